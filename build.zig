@@ -42,6 +42,8 @@ pub fn build(b: *std.Build) void {
         exe.linkSystemLibrary("gio-2.0");
         exe.linkSystemLibrary("curl");
         exe.linkSystemLibrary("z");
+        exe.linkSystemLibrary("zstd");
+        exe.linkSystemLibrary("lz4");
     }
 
     // C bindings are Linux-only
@@ -103,12 +105,38 @@ pub fn build(b: *std.Build) void {
         if (target.result.os.tag == .linux) {
             test_exe.linkSystemLibrary("curl");
             test_exe.linkSystemLibrary("z");
+            test_exe.linkSystemLibrary("zstd");
+            test_exe.linkSystemLibrary("lz4");
         }
 
         const run_test = b.addRunArtifact(test_exe);
         test_step.dependOn(&run_test.step);
     }
 
+    // Codec benchmark: none vs lz4 vs gzip vs zstd on a generated tree
+    const bench_module = b.createModule(.{
+        .root_source_file = b.path("tests/bench/codec_bench.zig"),
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+    const bench_exe = b.addExecutable(.{
+        .name = "codec-bench",
+        .root_module = bench_module,
+    });
+    bench_exe.linkLibC();
+    if (target.result.os.tag == .linux) {
+        bench_exe.linkSystemLibrary("curl");
+        bench_exe.linkSystemLibrary("z");
+        bench_exe.linkSystemLibrary("zstd");
+        bench_exe.linkSystemLibrary("lz4");
+    }
+    const run_bench = b.addRunArtifact(bench_exe);
+    if (b.args) |args| {
+        run_bench.addArgs(args);
+    }
+    const bench_step = b.step("bench", "Benchmark archive codecs");
+    bench_step.dependOn(&run_bench.step);
+
     // Simple completion message
     const print_info = b.addSystemCommand(&[_][]const u8{ "echo", "Krowno backup tool build complete!" });
     b.getInstallStep().dependOn(&print_info.step);
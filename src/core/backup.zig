@@ -29,6 +29,8 @@ const repo_crawler = @import("../utils/repo_crawler.zig");
 const khr_format = @import("khr_format.zig");
 
 const parallel_backup = @import("parallel_backup.zig");
+const khr_codec = @import("khr_codec.zig");
+const batch_reader = @import("batch_reader.zig");
 const keyring = @import("../security/keyring.zig");
 const streaming_crypto = @import("../security/streaming_crypto.zig");
 const deduplication = @import("deduplication.zig");
@@ -165,6 +167,9 @@ pub const BackupStrategy = enum {
     }
 };
 
+// Output/input path meaning stdout/stdin: the archive is streamed instead of written to a file.
+pub const PIPE_PATH = "-";
+
 pub const BackupError = error{
     FileNotFound,
     PermissionDenied,
@@ -310,6 +315,23 @@ pub const BackupEngine = struct {
     parallel_engine: ?*parallel_backup.ParallelBackupEngine,
     dedup_db: ?*deduplication.DeduplicationDatabase,
     network_available: bool,
+    // codec level for the archive payload; null = codec default
+    compression_level: ?i32 = null,
+    // v3 chunked archive; parent (a previous v3 backup) only stores what changed since
+    chunked: bool = false,
+    parent_archive: ?String = null,
+    // archive checksum algorithm
+    hash: khr_format.HashAlgo = .sha256,
+    // split the archive into volumes of this size, round-robin over volume_dirs;
+    // restores look for the other volumes of a set in volume_dirs too
+    volume_size: ?u64 = null,
+    volume_dirs: []const String = &[_]String{},
+    // more files to write each backup to, in the same pass as the main one
+    copies: []const String = &[_]String{},
+    // pick an interrupted backup to the same file up from its last checkpoint
+    resume_interrupted: bool = false,
+    // inodes scanPath has already counted, so a hard-linked file adds its size once
+    seen_inodes: std.AutoHashMapUnmanaged(batch_reader.Inode, void) = .{},
 
     const Self = @This();
 
@@ -396,6 +418,7 @@ pub const BackupEngine = struct {
             db.deinit();
             self.allocator.destroy(db);
         }
+        self.seen_inodes.deinit(self.allocator);
     }
 
     pub fn enableDeduplication(self: *Self, storage_path: String) !void {
@@ -485,7 +508,8 @@ pub const BackupEngine = struct {
             callback("Loading backup", 0, 100);
         }
 
-        if (!khr_format.isKhrFile(backup_path)) return BackupError.CorruptedBackup;
+        const piped = std.mem.eql(u8, backup_path, PIPE_PATH);
+        if (!piped and !khr_format.isKhrFile(backup_path)) return BackupError.CorruptedBackup;
 
         const restore_dir = try std.fmt.allocPrint(self.allocator, "krowno_restore_{d}", .{std.time.timestamp()});
         defer self.allocator.free(restore_dir);
@@ -494,7 +518,7 @@ pub const BackupEngine = struct {
             callback("Decrypting and extracting", 10, 100);
         }
 
-        try khr_format.extractKhrBackup(self.allocator, backup_path, password, restore_dir);
+        try self.extractArchive(backup_path, password, restore_dir);
 
         if (progress_callback) |callback| {
             callback("Restore complete", 100, 100);
@@ -512,13 +536,13 @@ pub const BackupEngine = struct {
             callback("Loading backup", 0, 100);
         }
 
-        if (!khr_format.isKhrFile(backup_path)) return BackupError.CorruptedBackup;
+        if (!std.mem.eql(u8, backup_path, PIPE_PATH) and !khr_format.isKhrFile(backup_path)) return BackupError.CorruptedBackup;
 
         if (progress_callback) |callback| {
             callback("Decrypting and extracting", 10, 100);
         }
 
-        try khr_format.extractKhrBackup(self.allocator, backup_path, password, extract_to);
+        try self.extractArchive(backup_path, password, extract_to);
 
         if (progress_callback) |callback| {
             callback("Restore complete", 100, 100);
@@ -826,6 +850,7 @@ pub const BackupEngine = struct {
         defer self.allocator.free(home_dir);
         var total_files: u32 = 0;
         var total_size: types.FileSize = 0;
+        self.seen_inodes.clearRetainingCapacity();
 
         for (paths, 0..) |rel_path, i| {
             if (progress_callback) |callback| {
@@ -880,13 +905,35 @@ pub const BackupEngine = struct {
 
             try entries.append(entry);
             file_count.* += 1;
+            // every name still goes in the list (the archive stores the extras as links), the bytes only once
+            if (try self.seenBefore(path)) return;
             total_size.* += stat.size;
         }
     }
 
+    // True when path is another name for an inode scanPath has already counted.
+    fn seenBefore(self: *Self, path: String) !bool {
+        const path_z = try self.allocator.dupeZ(u8, path);
+        defer self.allocator.free(path_z);
+        const links = batch_reader.pathLinks(path_z) orelse return false;
+        if (links.nlink < 2) return false;
+        const seen = try self.seen_inodes.getOrPut(self.allocator, links.inode);
+        return seen.found_existing;
+    }
+
+    // backup_path "-" is an archive coming in on stdin
+    fn extractArchive(self: *Self, backup_path: String, password: ?String, extract_to: String) !void {
+        if (std.mem.eql(u8, backup_path, PIPE_PATH)) {
+            return khr_format.extractKhrBackupPiped(self.allocator, std.io.getStdIn(), password, extract_to);
+        }
+        try khr_format.extractKhrBackupWithVolumeDirs(self.allocator, backup_path, self.volume_dirs, password, extract_to);
+    }
+
     fn saveBackup(self: *Self, output_path: String, metadata: *const BackupMetadata, entries: []const BackupEntry, package_manifest: ?PackageManifest, repo_snapshots: ?RepoSnapshots, user_password: ?String, progress_callback: ?ProgressCallback, requested_compression: khr_format.CompressionType) !void {
+        // "-" streams the archive to stdout (khr_format.createKhrBackupPiped)
+        const piped = std.mem.eql(u8, output_path, PIPE_PATH);
         var khr_path: []u8 = undefined;
-        if (endsWith(output_path, ".khr")) {
+        if (piped or endsWith(output_path, ".khr")) {
             khr_path = try self.allocator.dupe(u8, output_path);
         } else {
             khr_path = try std.fmt.allocPrint(self.allocator, "{s}.khr", .{output_path});
@@ -895,12 +942,14 @@ pub const BackupEngine = struct {
 
         print("Saving backup as KHR format: {s}\n", .{khr_path});
 
-        const dir = std.fs.path.dirname(khr_path) orelse ".";
-        const ten_percent: types.FileSize = metadata.total_size / 10;
-        const sixteen_mib: types.FileSize = 16 * 1024 * 1024;
-        const overhead: types.FileSize = if (sixteen_mib > ten_percent) sixteen_mib else ten_percent;
-        const ds = checkDiskSpace(dir, metadata.total_size + overhead);
-        if (ds.isError()) return BackupError.DiskSpaceInsufficient;
+        if (!piped) {
+            const dir = std.fs.path.dirname(khr_path) orelse ".";
+            const ten_percent: types.FileSize = metadata.total_size / 10;
+            const sixteen_mib: types.FileSize = 16 * 1024 * 1024;
+            const overhead: types.FileSize = if (sixteen_mib > ten_percent) sixteen_mib else ten_percent;
+            const ds = checkDiskSpace(dir, metadata.total_size + overhead);
+            if (ds.isError()) return BackupError.DiskSpaceInsufficient;
+        }
 
         var source_paths = ArrayList(String).init(self.allocator);
         defer source_paths.deinit();
@@ -920,9 +969,12 @@ pub const BackupEngine = struct {
             for (temp_paths.items) |p| self.allocator.free(p);
             temp_paths.deinit();
         }
+        // named after the archive rather than the time, so a resumed run finds the
+        // ones its checkpoint already has under the same names
+        const temp_id = try metadataTempId(self.allocator, khr_path);
 
         if (package_manifest) |manifest| {
-            const manifest_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_packages_{d}.txt", .{std.time.timestamp()});
+            const manifest_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_packages_{x:0>16}.txt", .{temp_id});
             defer self.allocator.free(manifest_path);
 
             const manifest_file = try fs.cwd().createFile(manifest_path, .{});
@@ -946,7 +998,7 @@ pub const BackupEngine = struct {
         }
 
         blk: {
-            const flatpak_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_flatpaks_{d}.txt", .{std.time.timestamp()});
+            const flatpak_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_flatpaks_{x:0>16}.txt", .{temp_id});
             defer self.allocator.free(flatpak_path);
 
             flatpak_support.saveFlatpakList(self.allocator, flatpak_path) catch break :blk;
@@ -961,7 +1013,7 @@ pub const BackupEngine = struct {
         }
 
         if (repo_snapshots) |snapshots| {
-            const snapshots_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_repos_{d}.txt", .{std.time.timestamp()});
+            const snapshots_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_repos_{x:0>16}.txt", .{temp_id});
             defer self.allocator.free(snapshots_path);
 
             const snapshots_file = try fs.cwd().createFile(snapshots_path, .{});
@@ -986,7 +1038,7 @@ pub const BackupEngine = struct {
         }
 
         {
-            const meta_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_meta_{d}.json", .{std.time.timestamp()});
+            const meta_path = try std.fmt.allocPrint(self.allocator, "/tmp/krowno_meta_{x:0>16}.json", .{temp_id});
             defer self.allocator.free(meta_path);
 
             const meta_file = try fs.cwd().createFile(meta_path, .{});
@@ -1010,26 +1062,19 @@ pub const BackupEngine = struct {
         }
 
         const compression = requested_compression;
-        var password: ?String = user_password;
-        const LARGE_FILE_COUNT: usize = 5000;
-        const LARGE_TOTAL_SIZE: u64 = 1_000_000_000; // 1 GiB
-        if (password != null and (source_paths.items.len > LARGE_FILE_COUNT or metadata.total_size > LARGE_TOTAL_SIZE)) {
-            print("{s}Warning:{s} encryption temporarily disabled for large backups (streaming encryption pending). Files: {d}, Size: {d} bytes\n", .{ ansi.Color.BOLD_YELLOW, ansi.Color.RESET, source_paths.items.len, metadata.total_size });
-            password = null;
-        }
+        const password: ?String = user_password;
 
         print("Creating archive with {d} files ({d} bytes total)...\n", .{ source_paths.items.len, metadata.total_size });
         print("Using streaming mode (files read on-demand, no memory bloat)\n", .{});
         if (progress_callback) |cb| cb("Saving files", 0, source_paths.items.len);
 
-        try khr_format.createKhrBackup(
-            self.allocator,
-            source_paths.items,
-            khr_path,
-            password,
-            compression,
-            if (progress_callback) |cb| @ptrCast(cb) else null,
-        );
+        const options = khr_format.CreateOptions{ .compression = compression, .level = self.compression_level, .chunked = self.chunked, .parent = self.parent_archive, .hash = self.hash, .volume_size = self.volume_size, .volume_dirs = self.volume_dirs, .copies = self.copies, .resume_interrupted = self.resume_interrupted };
+        const save_progress: ?khr_format.SaveProgressCallback = if (progress_callback) |cb| @ptrCast(cb) else null;
+        if (piped) {
+            try khr_format.createKhrBackupPiped(self.allocator, source_paths.items, std.io.getStdOut(), password, options, save_progress);
+        } else {
+            try khr_format.createKhrBackupWithOptions(self.allocator, source_paths.items, khr_path, password, options, save_progress);
+        }
 
         if (progress_callback) |cb| cb("Finalizing archive", source_paths.items.len, source_paths.items.len);
 
@@ -1310,6 +1355,22 @@ const BackupData = struct {
     repo_snapshots: ?RepoSnapshots,
 };
 
+// The metadata files share /tmp with every other run on the machine (a
+// restore looks for them under tmp/ in the archive), so their names come from
+// the output's real path and the uid: the same -o in two directories, or from
+// two users, never lands on the same names.
+fn metadataTempId(allocator: Allocator, khr_path: String) !u64 {
+    const real_dir = try fs.cwd().realpathAlloc(allocator, fs.path.dirname(khr_path) orelse ".");
+    defer allocator.free(real_dir);
+    var hasher = std.hash.Wyhash.init(0);
+    hasher.update(real_dir);
+    hasher.update("/");
+    hasher.update(fs.path.basename(khr_path));
+    const uid: u32 = if (builtin.os.tag == .linux) std.os.linux.getuid() else 0;
+    hasher.update(std.mem.asBytes(&uid));
+    return hasher.final();
+}
+
 fn shouldSkipFile(strategy: BackupStrategy, name: String) bool {
     const blacklist_patterns = [_]String{
         ".cache",      ".tmp", ".log",   ".lock", "node_modules", ".git",
@@ -1411,47 +1472,42 @@ pub fn getBackupInfo(allocator: Allocator, backup_path: String) !BackupInfo {
 }
 
 pub fn validateBackup(allocator: Allocator, backup_path: String, password: ?String) !bool {
-    _ = allocator;
     const file = fs.cwd().openFile(backup_path, .{}) catch return false;
     defer file.close();
     var magic: [8]u8 = undefined;
     _ = file.readAll(&magic) catch return false;
-    if (!std.mem.eql(u8, &magic, "KHRONO01")) return false;
+    if (!khr_format.isKhrMagic(&magic)) return false;
     try file.seekTo(0);
     const header = try khr_format.KhrHeader.read(file.reader());
     const data_start = try file.getPos();
+    const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
 
+    // a piped archive saved to a file keeps its size and checksum in a trailer
+    if (header.version == khr_format.PIPED_VERSION) {
+        if (is_encrypted and password == null) return true;
+        khr_format.verifyKhrBackup(allocator, backup_path, password) catch return false;
+        return true;
+    }
     if (header.tar_size == 0) return false;
 
-    const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
-
-    if (header.version == 2) {
+    if (header.version == 2 or header.version == 3) {
         try file.seekTo(data_start);
 
-        if (is_encrypted) {
-            const ENC_MAGIC = "KHROWNO_ENC_V1\n";
-            var enc_hdr: [ENC_MAGIC.len]u8 = undefined;
-            _ = file.readAll(&enc_hdr) catch return false;
-            if (!std.mem.eql(u8, &enc_hdr, ENC_MAGIC)) return false;
-            _ = password; // reserved for future deep validation
+        // without the password all we can check is that the sealed length adds up
+        if (is_encrypted and password == null) {
+            _ = streaming_crypto.plainLen(header.tar_size) catch return false;
             return true;
         }
-        const V2_MAGIC = "KHRV2\n";
-        if (header.compression == .none) {
-            var buf: [V2_MAGIC.len]u8 = undefined;
-            _ = file.readAll(&buf) catch return false;
-            return std.mem.eql(u8, &buf, V2_MAGIC);
-        } else if (header.compression == .gzip) {
-            var limited = std.io.limitedReader(file.reader(), header.tar_size);
-            var dec = std.compress.gzip.decompressor(limited.reader());
-            var r = dec.reader();
-            var buf: [V2_MAGIC.len]u8 = undefined;
-            const got = r.readAll(&buf) catch return false;
-            if (got != V2_MAGIC.len) return false;
-            return std.mem.eql(u8, &buf, V2_MAGIC);
-        } else {
-            return false;
-        }
+        var cipher = khr_format.archiveCipher(allocator, &header, password) catch return false;
+        defer if (cipher) |*c| c.wipe();
+        // v3 (chunked) shares the container, only the stream magic differs
+        const magic: *const [6]u8 = if (header.version == 3) "KHRV3\n" else "KHRV2\n";
+        const payload = khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, if (cipher) |*c| c else null) catch return false;
+        defer payload.close();
+        var buf: [magic.len]u8 = undefined;
+        const got = payload.any().readAll(&buf) catch return false;
+        if (got != magic.len) return false;
+        return std.mem.eql(u8, &buf, magic);
     }
     return false;
 }
@@ -1512,7 +1568,7 @@ pub fn quickValidate(allocator: Allocator, backup_path: String) !bool {
     defer file.close();
     var magic: [8]u8 = undefined;
     _ = try file.readAll(&magic);
-    if (std.mem.eql(u8, &magic, "KHRONO01")) {
+    if (khr_format.isKhrMagic(&magic)) {
         print("  ✅ KHR backup container\n", .{});
         return true;
     }
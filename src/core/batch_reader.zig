@@ -0,0 +1,236 @@
+//! Batched stat + read-ahead for archive creation. Trees like ~/.config are
+//! tens of thousands of tiny files, where readlink/open/fstat/read/close per
+//! file costs far more than the bytes themselves. On Linux the next BATCH
+//! entries are statted, opened, read and closed with one io_uring submission
+//! per step; small regular files come back with their contents, everything
+//! else with just its stat so the writer opens it the usual way. Without
+//! io_uring (other OSes, old kernels, seccomp'd sandboxes) or when a batch
+//! fails, entries come back unresolved and the writer does what it always did.
+
+const std = @import("std");
+const builtin = @import("builtin");
+const posix = std.posix;
+const linux = std.os.linux;
+const Allocator = std.mem.Allocator;
+const types = @import("../utils/types.zig");
+const String = types.String;
+
+const has_uring = builtin.os.tag == .linux;
+
+// Entries per batch; also the ring size, so one step always fits in the queue.
+pub const BATCH: usize = 64;
+// Regular files up to this size are read by the batch. Kept below the
+// zero-copy and store thresholds (khr_codec) so those paths never see one.
+pub const SMALL_FILE_MAX: usize = 64 * 1024;
+
+pub const Kind = enum {
+    unknown, // not resolved here: readlink/open/stat it yourself
+    file,
+    symlink,
+    other, // fifo, socket, device, directory
+};
+
+pub const Entry = struct {
+    kind: Kind = .unknown,
+    mode: u32 = 0,
+    size: u64 = 0,
+    mtime: i128 = 0, // ns, same as fs.File.Stat
+    data: ?[]const u8 = null, // the whole file, for regular files up to SMALL_FILE_MAX
+    links: Links = .{},
+};
+
+// What hard links are recognised by: names sharing an inode on one device.
+pub const Inode = struct {
+    dev: u64 = 0,
+    ino: u64 = 0,
+};
+
+pub const Links = struct {
+    nlink: u32 = 0, // 0 = not known
+    inode: Inode = .{},
+};
+
+fn linksOf(stx: *const linux.Statx) Links {
+    return .{
+        .nlink = stx.nlink,
+        .inode = .{ .dev = (@as(u64, stx.dev_major) << 32) | stx.dev_minor, .ino = stx.ino },
+    };
+}
+
+// Link count and inode, in the same terms as Entry.links, of an open file
+// or (following symlinks) of a path. Null where there's no statx to ask.
+pub fn fileLinks(fd: posix.fd_t) ?Links {
+    if (builtin.os.tag != .linux) return null;
+    return statLinks(fd, "", linux.AT.EMPTY_PATH);
+}
+
+pub fn pathLinks(path: [*:0]const u8) ?Links {
+    if (builtin.os.tag != .linux) return null;
+    return statLinks(linux.AT.FDCWD, path, 0);
+}
+
+fn statLinks(dirfd: posix.fd_t, path: [*:0]const u8, flags: u32) ?Links {
+    var stx: linux.Statx = undefined;
+    const rc = linux.statx(dirfd, path, flags, linux.STATX_NLINK | linux.STATX_INO, &stx);
+    if (linux.E.init(rc) != .SUCCESS) return null;
+    return linksOf(&stx);
+}
+
+pub const SmallFileReader = struct {
+    allocator: Allocator,
+    paths: []const String,
+    ring: if (has_uring) ?linux.IoUring else void,
+    arena: std.heap.ArenaAllocator, // NUL-terminated paths, reset every batch
+    buffers: []u8, // BATCH * SMALL_FILE_MAX, reused every batch
+    entries: [BATCH]Entry = [_]Entry{.{}} ** BATCH,
+    base: usize = 0,
+    count: usize = 0,
+
+    const Self = @This();
+
+    // Can't fail: without io_uring or the buffers the batching is just off.
+    pub fn init(allocator: Allocator, paths: []const String) Self {
+        var self = Self{
+            .allocator = allocator,
+            .paths = paths,
+            .ring = if (has_uring) null else {},
+            .arena = std.heap.ArenaAllocator.init(allocator),
+            .buffers = &[_]u8{},
+        };
+        if (has_uring) {
+            self.ring = linux.IoUring.init(BATCH, 0) catch null;
+            if (self.ring != null) {
+                self.buffers = allocator.alloc(u8, BATCH * SMALL_FILE_MAX) catch {
+                    self.ring.?.deinit();
+                    self.ring = null;
+                    return self;
+                };
+            }
+        }
+        return self;
+    }
+
+    pub fn deinit(self: *Self) void {
+        if (has_uring) {
+            if (self.ring) |*r| r.deinit();
+        }
+        self.allocator.free(self.buffers);
+        self.arena.deinit();
+    }
+
+    // What the batch learned about paths[i]. Valid until the next call that
+    // moves past the current batch, which is fine for a front-to-back walk.
+    pub fn get(self: *Self, i: usize) *const Entry {
+        if (i < self.base or i >= self.base + self.count) self.fill(i);
+        return &self.entries[i - self.base];
+    }
+
+    fn fill(self: *Self, base: usize) void {
+        self.base = base;
+        self.count = @min(BATCH, self.paths.len - base);
+        @memset(self.entries[0..self.count], .{});
+        if (!has_uring) return;
+        if (self.ring == null) return;
+        self.fillBatch() catch {
+            // a ring that failed once will probably fail again; stop paying for it
+            @memset(self.entries[0..self.count], .{});
+            self.ring.?.deinit();
+            self.ring = null;
+        };
+    }
+
+    fn fillBatch(self: *Self) !void {
+        const ring = &self.ring.?;
+        _ = self.arena.reset(.retain_capacity);
+        const arena = self.arena.allocator();
+        const n = self.count;
+
+        // step 1: statx without following links, which also replaces readlink as the symlink test
+        var stx: [BATCH]linux.Statx = undefined;
+        var paths_z: [BATCH][:0]const u8 = undefined;
+        for (0..n) |k| {
+            paths_z[k] = try arena.dupeZ(u8, self.paths[self.base + k]);
+            const mask = linux.STATX_TYPE | linux.STATX_MODE | linux.STATX_SIZE | linux.STATX_MTIME | linux.STATX_NLINK | linux.STATX_INO;
+            _ = try ring.statx(k, linux.AT.FDCWD, paths_z[k], linux.AT.SYMLINK_NOFOLLOW, mask, &stx[k]);
+        }
+        var cqes: [BATCH]linux.io_uring_cqe = undefined;
+        var wanted = [_]bool{false} ** BATCH;
+        for (try complete(ring, &cqes, n)) |cqe| {
+            if (cqe.res < 0) continue;
+            const k: usize = @intCast(cqe.user_data);
+            const st = &stx[k];
+            const e = &self.entries[k];
+            const mode: u32 = st.mode;
+            e.mode = mode;
+            e.size = st.size;
+            e.mtime = @as(i128, st.mtime.sec) * std.time.ns_per_s + st.mtime.nsec;
+            e.links = linksOf(st);
+            if (linux.S.ISREG(mode)) {
+                e.kind = .file;
+                if (st.size == 0) {
+                    e.data = &[_]u8{};
+                } else if (st.size <= SMALL_FILE_MAX) {
+                    wanted[k] = true;
+                }
+            } else if (linux.S.ISLNK(mode)) {
+                e.kind = .symlink;
+            } else {
+                e.kind = .other;
+            }
+        }
+
+        // step 2: open the small regular files
+        var opens: u32 = 0;
+        for (0..n) |k| {
+            if (!wanted[k]) continue;
+            // NOFOLLOW: if it turned into a symlink since the statx, leave it to the writer
+            _ = try ring.openat(k, linux.AT.FDCWD, paths_z[k], .{ .ACCMODE = .RDONLY, .CLOEXEC = true, .NOFOLLOW = true }, 0);
+            opens += 1;
+        }
+        var fds = [_]posix.fd_t{-1} ** BATCH;
+        defer for (fds) |fd| {
+            // only reached with fds still open when a later step failed
+            if (fd >= 0) posix.close(fd);
+        };
+        for (try complete(ring, &cqes, opens)) |cqe| {
+            if (cqe.res >= 0) fds[@intCast(cqe.user_data)] = cqe.res;
+        }
+
+        // step 3: read each one whole, straight into its slot
+        var reads: u32 = 0;
+        for (0..n) |k| {
+            if (fds[k] < 0) continue;
+            const slot = self.buffers[k * SMALL_FILE_MAX ..][0..@intCast(self.entries[k].size)];
+            _ = try ring.read(k, fds[k], .{ .buffer = slot }, 0);
+            reads += 1;
+        }
+        for (try complete(ring, &cqes, reads)) |cqe| {
+            const k: usize = @intCast(cqe.user_data);
+            // a short read means the file changed since the statx; the writer re-reads it
+            if (cqe.res >= 0 and cqe.res == self.entries[k].size) {
+                self.entries[k].data = self.buffers[k * SMALL_FILE_MAX ..][0..@intCast(cqe.res)];
+            }
+        }
+
+        // step 4: close them
+        var closes: u32 = 0;
+        for (0..n) |k| {
+            if (fds[k] < 0) continue;
+            _ = try ring.close(k, fds[k]);
+            fds[k] = -1;
+            closes += 1;
+        }
+        _ = try complete(ring, &cqes, closes);
+    }
+
+    // Submit what's queued and collect exactly want completions.
+    fn complete(ring: *linux.IoUring, cqes: *[BATCH]linux.io_uring_cqe, want: usize) ![]linux.io_uring_cqe {
+        if (want == 0) return cqes[0..0];
+        _ = try ring.submit_and_wait(@intCast(want));
+        var got: usize = 0;
+        while (got < want) {
+            got += try ring.copy_cqes(cqes[got..want], @intCast(want - got));
+        }
+        return cqes[0..want];
+    }
+};
@@ -0,0 +1,107 @@
+//! content-defined chunking (FastCDC-style gear hash) for v3 archives.
+//! Cut points depend on the bytes around them, not on their position, so an
+//! insert near the start of a file only changes the chunks it touches and
+//! everything after it lines up with the previous backup again.
+
+const std = @import("std");
+
+pub const MIN_CHUNK: usize = 16 * 1024;
+pub const AVG_CHUNK: usize = 64 * 1024;
+pub const MAX_CHUNK: usize = 256 * 1024;
+
+// "Normalized chunking": a stricter mask before the average size and a looser
+// one after it pulls chunk sizes towards AVG_CHUNK. The masks use the top bits
+// of the hash because those have seen the most bytes (the gear hash shifts left).
+const AVG_BITS = 16;
+const MASK_STRICT: u64 = topBits(AVG_BITS + 2);
+const MASK_LOOSE: u64 = topBits(AVG_BITS - 2);
+
+comptime {
+    std.debug.assert(AVG_CHUNK == 1 << AVG_BITS);
+}
+
+fn topBits(comptime n: comptime_int) u64 {
+    return ~@as(u64, 0) << (64 - n);
+}
+
+// 256 fixed pseudo-random words. They're part of the format in the sense that
+// changing them moves every cut point and kills dedup against older archives.
+const gear: [256]u64 = blk: {
+    @setEvalBranchQuota(10_000);
+    var table: [256]u64 = undefined;
+    var state: u64 = 0x6b68726f776e6f21; // splitmix64 seed
+    for (&table) |*g| {
+        state +%= 0x9e3779b97f4a7c15;
+        var z = state;
+        z = (z ^ (z >> 30)) *% 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) *% 0x94d049bb133111eb;
+        g.* = z ^ (z >> 31);
+    }
+    break :blk table;
+};
+
+// Length of the chunk at the start of data. When at_eof is false the caller
+// must hand in at least MAX_CHUNK bytes (or everything that's left), otherwise
+// the cut would land on the buffer edge instead of the content.
+pub fn cutPoint(data: []const u8, at_eof: bool) usize {
+    if (data.len <= MIN_CHUNK) return data.len;
+    std.debug.assert(at_eof or data.len >= MAX_CHUNK);
+
+    const end = @min(data.len, MAX_CHUNK);
+    const normal = @min(end, AVG_CHUNK);
+    var h: u64 = 0;
+    var i: usize = MIN_CHUNK;
+    while (i < normal) : (i += 1) {
+        h = (h << 1) +% gear[data[i]];
+        if (h & MASK_STRICT == 0) return i + 1;
+    }
+    while (i < end) : (i += 1) {
+        h = (h << 1) +% gear[data[i]];
+        if (h & MASK_LOOSE == 0) return i + 1;
+    }
+    return end;
+}
+
+// Pulls chunks out of a reader with one fixed buffer. Returned slices are only
+// valid until the next call.
+pub fn Chunker(comptime Reader: type) type {
+    return struct {
+        reader: Reader,
+        buf: []u8,
+        start: usize = 0,
+        end: usize = 0,
+        eof: bool = false,
+
+        const Self = @This();
+
+        // buf must hold at least MAX_CHUNK bytes; bigger means fewer reads.
+        pub fn init(reader: Reader, buf: []u8) Self {
+            std.debug.assert(buf.len >= MAX_CHUNK);
+            return .{ .reader = reader, .buf = buf };
+        }
+
+        pub fn next(self: *Self) !?[]const u8 {
+            if (!self.eof and self.end - self.start < MAX_CHUNK) try self.refill();
+            if (self.start == self.end) return null;
+            const n = cutPoint(self.buf[self.start..self.end], self.eof);
+            const chunk = self.buf[self.start..][0..n];
+            self.start += n;
+            return chunk;
+        }
+
+        fn refill(self: *Self) !void {
+            const left = self.end - self.start;
+            std.mem.copyForwards(u8, self.buf[0..left], self.buf[self.start..self.end]);
+            self.start = 0;
+            self.end = left;
+            while (self.end < self.buf.len) {
+                const n = try self.reader.read(self.buf[self.end..]);
+                if (n == 0) {
+                    self.eof = true;
+                    break;
+                }
+                self.end += n;
+            }
+        }
+    };
+}
@@ -0,0 +1,152 @@
+//! Open directory handles for restores. Restoring a file used to mean
+//! formatting its full path, a makePath over its parents and a createFile
+//! that walked the whole path again. DirCache keeps the directories files
+//! were last created in open, keyed by their path under the restore root. A
+//! miss opens (creating if need be) only the missing levels, each relative to
+//! its parent's handle, so every directory is made once and files are created
+//! with openat on their bare name. Archives are written directory by
+//! directory, so a few dozen handles catch nearly every lookup. Levels are
+//! opened without following symlinks: an archive that restores a link with a
+//! directory's name can't then have files written through it. Files are
+//! created the same way (createFile), by whichever thread writes them.
+
+const std = @import("std");
+const builtin = @import("builtin");
+const fs = std.fs;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+// Handles kept open; far below any fd limit, far above one restore's working set.
+pub const CAPACITY: usize = 64;
+
+pub const CacheError = error{
+    SymlinkInPath,
+};
+
+pub const DirCache = struct {
+    allocator: Allocator,
+    root: fs.Dir,
+    map: std.StringHashMapUnmanaged(Slot) = .{},
+    tick: u64 = 0, // bumped on every lookup; a slot's last use says how stale it is
+
+    const Slot = struct {
+        dir: fs.Dir,
+        used: u64,
+    };
+
+    const Self = @This();
+
+    // root_path is created if it isn't there yet.
+    pub fn init(allocator: Allocator, root_path: []const u8) !Self {
+        return .{
+            .allocator = allocator,
+            .root = try fs.cwd().makeOpenPath(root_path, .{}),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        var it = self.map.iterator();
+        while (it.next()) |kv| {
+            kv.value_ptr.dir.close();
+            self.allocator.free(kv.key_ptr.*);
+        }
+        self.map.deinit(self.allocator);
+        self.root.close();
+    }
+
+    // The directory at rel under the root ("" for the root itself), created
+    // along with any missing parents. rel must already be sanitized (no
+    // leading '/', no "." or ".." segments). The handle stays valid until
+    // the next call. A level that is a symlink is refused with SymlinkInPath.
+    pub fn open(self: *Self, rel: []const u8) !fs.Dir {
+        if (rel.len == 0) return self.root;
+        self.tick += 1;
+        if (self.map.getPtr(rel)) |slot| {
+            slot.used = self.tick;
+            return slot.dir;
+        }
+
+        // the parent is the most recently used slot now, so making room below never closes it
+        const parent = try self.open(fs.path.dirname(rel) orelse "");
+        var dir = try openLevel(parent, fs.path.basename(rel));
+        errdefer dir.close();
+        if (self.map.count() >= CAPACITY) self.evict();
+        const key = try self.allocator.dupe(u8, rel);
+        errdefer self.allocator.free(key);
+        try self.map.putNoClobber(self.allocator, key, .{ .dir = dir, .used = self.tick });
+        return dir;
+    }
+
+    // One directory under parent, made if missing.
+    fn openLevel(parent: fs.Dir, name: []const u8) !fs.Dir {
+        parent.makeDir(name) catch |err| switch (err) {
+            error.PathAlreadyExists => {},
+            else => return err,
+        };
+        return openNoFollow(parent, name);
+    }
+
+    fn evict(self: *Self) void {
+        var oldest: ?[]const u8 = null;
+        var oldest_used: u64 = std.math.maxInt(u64);
+        var it = self.map.iterator();
+        while (it.next()) |kv| {
+            if (kv.value_ptr.used < oldest_used) {
+                oldest = kv.key_ptr.*;
+                oldest_used = kv.value_ptr.used;
+            }
+        }
+        const kv = self.map.fetchRemove(oldest orelse return).?;
+        var dir = kv.value.dir;
+        dir.close();
+        self.allocator.free(kv.key);
+    }
+};
+
+// The existing directory at rel under root, opened a level at a time the
+// way DirCache.open does it, so no symlink on the way is followed. Nothing
+// is made or cached; the caller closes the result unless it is root.
+pub fn openBeneath(root: fs.Dir, rel: []const u8) !fs.Dir {
+    var dir = root;
+    errdefer if (dir.fd != root.fd) dir.close();
+    var it = std.mem.tokenizeScalar(u8, rel, '/');
+    while (it.next()) |name| {
+        const next = try openNoFollow(dir, name);
+        if (dir.fd != root.fd) dir.close();
+        dir = next;
+    }
+    return dir;
+}
+
+// Open name in dir for writing, created if missing. A symlink at the name
+// (an earlier record of the same archive, say) is unlinked and replaced,
+// never written through.
+pub fn createFile(dir: fs.Dir, name: []const u8, truncate: bool) !fs.File {
+    const flags: posix.O = .{ .ACCMODE = .WRONLY, .CREAT = true, .TRUNC = truncate, .NOFOLLOW = true, .CLOEXEC = true };
+    const fd = posix.openat(dir.fd, name, flags, fs.File.default_mode) catch |err| switch (err) {
+        error.SymLinkLoop => blk: {
+            try posix.unlinkat(dir.fd, name, 0);
+            break :blk try posix.openat(dir.fd, name, flags, fs.File.default_mode);
+        },
+        else => return err,
+    };
+    return .{ .handle = fd };
+}
+
+// The permission bits of mode on a restored file; failing is not an error.
+pub fn restoreMode(out: fs.File, mode: u64) void {
+    if (builtin.os.tag == .linux) {
+        const perm: u32 = @intCast(mode & 0o7777);
+        posix.fchmod(out.handle, perm) catch {};
+    }
+}
+
+// O_NOFOLLOW makes a symlink in name's place fail (ELOOP) instead of leading
+// somewhere else.
+fn openNoFollow(parent: fs.Dir, name: []const u8) !fs.Dir {
+    const fd = posix.openat(parent.fd, name, .{ .DIRECTORY = true, .NOFOLLOW = true, .CLOEXEC = true }, 0) catch |err| switch (err) {
+        error.SymLinkLoop => return CacheError.SymlinkInPath,
+        else => return err,
+    };
+    return .{ .fd = fd };
+}
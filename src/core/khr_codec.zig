@@ -0,0 +1,651 @@
+//! payload codecs for v2 archives - one writer/reader pair so the record
+//! code in khr_format doesn't care whether the bytes end up raw, gzip, lz4 or zstd.
+//! Compressed payloads are a run of independently decodable frames (one per
+//! parallel block); the writer reports where they start so the reader can seek.
+
+const std = @import("std");
+const builtin = @import("builtin");
+const fs = std.fs;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+const types = @import("../utils/types.zig");
+const FileSize = types.FileSize;
+const khr_format = @import("khr_format.zig");
+const CompressionType = khr_format.CompressionType;
+const parallel_blocks = @import("parallel_blocks.zig");
+const parallel_gzip = @import("parallel_gzip.zig");
+const lz4 = @import("../utils/lz4.zig");
+const zstd = @import("../utils/zstd.zig");
+const streaming_crypto = @import("../security/streaming_crypto.zig");
+
+const ParallelLz4Writer = parallel_blocks.BlockWriter(lz4.FrameCodec);
+const ParallelZstdWriter = parallel_blocks.BlockWriter(zstd.FrameCodec);
+pub const Frame = parallel_blocks.Frame;
+
+pub const CodecError = error{
+    CorruptFrameTable,
+    UnexpectedEndOfPayload,
+    NotSeekable,
+};
+
+pub const CodecOptions = struct {
+    compression: CompressionType = .none,
+    // codec level; null picks the codec default (gzip 6, lz4 0, zstd 3)
+    level: ?i32 = null,
+    // compression worker threads; 0 = one per cpu
+    threads: usize = 0,
+    // zstd only: compress every frame against it (see trainDictionary)
+    dictionary: ?*const zstd.Dictionary = null,
+};
+
+// Raw payloads get their own write buffer: the record code emits lots of
+// 1/4/8 byte fields and we don't want a syscall for each.
+const RAW_BUFFER_SIZE: usize = 256 * 1024;
+const READ_BUFFER_SIZE: usize = 64 * 1024;
+// Raw, unsealed payloads move file bodies at least this big file-to-file in
+// the kernel (PayloadWriter.flushRaw, PayloadReader.copyRaw); anything smaller
+// is cheaper through the buffer than as extra syscalls.
+pub const ZERO_COPY_MIN: u64 = 64 * 1024;
+
+// Raw, unsealed payloads are read through an mmap of the archive where the OS
+// has one: record headers become copies out of the mapping instead of buffered
+// read()s, and bodies can be written or hashed straight from it.
+const can_map = builtin.os.tag == .linux or builtin.os.tag.isDarwin() or builtin.os.tag.isBSD();
+const MappedFile = []align(std.heap.page_size_min) const u8;
+
+fn gzipOptions(level: ?i32) std.compress.flate.Options {
+    const l = level orelse return .{};
+    // std's deflate only implements levels 4-9
+    return switch (l) {
+        std.math.minInt(i32)...4 => .{ .level = .level_4 },
+        5 => .{ .level = .level_5 },
+        6 => .{ .level = .level_6 },
+        7 => .{ .level = .level_7 },
+        8 => .{ .level = .level_8 },
+        else => .{ .level = .level_9 },
+    };
+}
+
+fn threadCount(requested: usize) usize {
+    if (requested != 0) return requested;
+    return std.Thread.getCpuCount() catch 1;
+}
+
+pub const PayloadWriter = struct {
+    allocator: Allocator,
+    sink: std.io.AnyWriter,
+    encoder: Encoder,
+
+    const Encoder = union(enum) {
+        none: struct { buf: []u8, len: usize = 0 },
+        gzip: *parallel_gzip.ParallelGzipWriter,
+        lz4: *ParallelLz4Writer,
+        zstd: *ParallelZstdWriter,
+    };
+
+    const Self = @This();
+    pub const Writer = std.io.GenericWriter(*Self, anyerror, write);
+
+    pub fn init(allocator: Allocator, sink: std.io.AnyWriter, options: CodecOptions) !Self {
+        const encoder: Encoder = switch (options.compression) {
+            .none => .{ .none = .{ .buf = try allocator.alloc(u8, RAW_BUFFER_SIZE) } },
+            .gzip => .{ .gzip = try parallel_gzip.ParallelGzipWriter.init(allocator, sink, .{
+                .codec = gzipOptions(options.level),
+                .threads = threadCount(options.threads),
+            }) },
+            .lz4 => .{ .lz4 = try ParallelLz4Writer.init(allocator, sink, .{
+                .codec = .{ .level = options.level orelse lz4.DEFAULT_LEVEL },
+                .threads = threadCount(options.threads),
+            }) },
+            .zstd => .{ .zstd = try ParallelZstdWriter.init(allocator, sink, .{
+                .codec = .{ .level = options.level orelse zstd.DEFAULT_LEVEL, .dictionary = options.dictionary },
+                .threads = threadCount(options.threads),
+            }) },
+        };
+        return Self{
+            .allocator = allocator,
+            .sink = sink,
+            .encoder = encoder,
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        switch (self.encoder) {
+            .none => |*raw| self.allocator.free(raw.buf),
+            .gzip => |gz| gz.deinit(),
+            .lz4 => |l| l.deinit(),
+            .zstd => |z| z.deinit(),
+        }
+    }
+
+    pub fn write(self: *Self, bytes: []const u8) anyerror!usize {
+        switch (self.encoder) {
+            .none => |*raw| {
+                if (raw.len + bytes.len > raw.buf.len) {
+                    try self.sink.writeAll(raw.buf[0..raw.len]);
+                    raw.len = 0;
+                    // big file bodies skip the copy entirely
+                    if (bytes.len >= raw.buf.len) {
+                        try self.sink.writeAll(bytes);
+                        return bytes.len;
+                    }
+                }
+                @memcpy(raw.buf[raw.len..][0..bytes.len], bytes);
+                raw.len += bytes.len;
+                return bytes.len;
+            },
+            .gzip => |gz| return gz.write(bytes),
+            .lz4 => |l| return l.write(bytes),
+            .zstd => |z| return z.write(bytes),
+        }
+    }
+
+    pub fn writer(self: *Self) Writer {
+        return .{ .context = self };
+    }
+
+    // Store rather than compress what's written next (see shouldStore).
+    // Raw payloads store everything anyway.
+    pub fn setStored(self: *Self, stored: bool) !void {
+        switch (self.encoder) {
+            .none => {},
+            .gzip => |gz| try gz.setStored(stored),
+            .lz4 => |l| try l.setStored(stored),
+            .zstd => |z| try z.setStored(stored),
+        }
+    }
+
+    // zstd only, before anything is written: put the dictionary the frames are
+    // compressed against ahead of them, where PayloadReader.open looks for it.
+    // Appends reuse the one already at the start of the archive instead.
+    pub fn putDictionary(self: *Self, dictionary: *const zstd.Dictionary) !void {
+        const z = self.encoder.zstd;
+        const head = dictionary.frameHeader();
+        try z.prefix(&head);
+        try z.prefix(dictionary.bytes);
+    }
+
+    // Raw payloads only: push the buffer out so the caller can append to the
+    // sink's file directly (copy_file_range) and then carry on writing here.
+    pub fn flushRaw(self: *Self) !void {
+        const raw = &self.encoder.none;
+        try self.sink.writeAll(raw.buf[0..raw.len]);
+        raw.len = 0;
+    }
+
+    // Push everything still buffered or in flight to the sink. The sink
+    // position afterwards is the end of the payload.
+    pub fn finish(self: *Self) !void {
+        switch (self.encoder) {
+            .none => |*raw| {
+                try self.sink.writeAll(raw.buf[0..raw.len]);
+                raw.len = 0;
+            },
+            .gzip => |gz| try gz.finish(),
+            .lz4 => |l| try l.finish(),
+            .zstd => |z| try z.finish(),
+        }
+    }
+
+    // Frame starts, relative to the payload start. Complete after finish().
+    // Raw payloads have none: stored and decoded offsets are the same thing.
+    pub fn frames(self: *const Self) []const Frame {
+        return switch (self.encoder) {
+            .none => &[_]Frame{},
+            .gzip => |gz| gz.frames.items,
+            .lz4 => |l| l.frames.items,
+            .zstd => |z| z.frames.items,
+        };
+    }
+};
+
+// ---- store vs. compress ----
+//
+// Media and archives are already compressed; running them through gzip burns
+// CPU for nothing. The writer asks shouldStore about each file before writing
+// its body: a known-compressed extension is stored unless the sample says
+// otherwise, anything else only when the sample looks like noise. Byte
+// entropy alone is fooled by repeating patterns (a 0..255 ramp scores 8
+// bits), so unhinted files also get a quick lz4 pass over the sample.
+
+// Files smaller than this always go through the codec: storing them would cut
+// a short block for a few KB of savings.
+pub const STORE_MIN_SIZE: u64 = 256 * 1024;
+// How much of the first block the entropy estimate looks at.
+pub const SAMPLE_LEN: usize = 64 * 1024;
+
+// bits per byte; random data sits just under 8, text around 4-5
+const STORE_ENTROPY: f64 = 7.5;
+const HINTED_STORE_ENTROPY: f64 = 6.0;
+// lz4 has to save at least 1/32 of the sample for the file to be worth compressing
+const PROBE_MIN_SAVING_SHIFT: u6 = 5;
+
+const compressed_extensions = [_][]const u8{
+    // images
+    ".jpg", ".jpeg", ".png", ".gif", ".webp", ".heic", ".avif", ".jxl",
+    // audio / video
+    ".mp3", ".ogg", ".opus", ".flac", ".m4a", ".aac", ".mp4", ".m4v", ".mkv", ".webm", ".mov", ".avi",
+    // archives and packages
+    ".zip", ".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".7z", ".rar", ".jar", ".apk", ".deb", ".rpm", ".khr",
+    // zip containers
+    ".docx", ".xlsx", ".pptx", ".odt", ".ods", ".epub", ".woff2",
+};
+
+fn hasCompressedExtension(path: []const u8) bool {
+    const ext = std.fs.path.extension(path);
+    if (ext.len == 0) return false;
+    for (compressed_extensions) |known| {
+        if (std.ascii.eqlIgnoreCase(ext, known)) return true;
+    }
+    return false;
+}
+
+// Shannon entropy of the byte histogram, in bits per byte.
+fn sampleEntropy(sample: []const u8) f64 {
+    if (sample.len == 0) return 0;
+    var counts = [_]u32{0} ** 256;
+    for (sample) |b| counts[b] += 1;
+    const total: f64 = @floatFromInt(sample.len);
+    var bits: f64 = 0;
+    for (counts) |n| {
+        if (n == 0) continue;
+        const p = @as(f64, @floatFromInt(n)) / total;
+        bits -= p * @log2(p);
+    }
+    return bits;
+}
+
+fn probeIncompressible(allocator: Allocator, sample: []const u8) bool {
+    const packed_sample = lz4.compress(allocator, sample, lz4.DEFAULT_LEVEL) catch return false;
+    defer allocator.free(packed_sample);
+    return packed_sample.len + (sample.len >> PROBE_MIN_SAVING_SHIFT) >= sample.len;
+}
+
+// sample is the start of the file (up to SAMPLE_LEN bytes are looked at).
+pub fn shouldStore(allocator: Allocator, path: []const u8, size: u64, sample: []const u8) bool {
+    if (size < STORE_MIN_SIZE) return false;
+    const head = sample[0..@min(sample.len, SAMPLE_LEN)];
+    const entropy = sampleEntropy(head);
+    if (hasCompressedExtension(path)) return entropy >= HINTED_STORE_ENTROPY;
+    return entropy >= STORE_ENTROPY and probeIncompressible(allocator, head);
+}
+
+// ---- zstd dictionaries ----
+//
+// Config trees are thousands of small INI/JSON/TOML files. Solid blocks
+// already put them next to each other, but every frame starts with an empty
+// window, so the files at the front of each one compress as if alone, and a
+// selective restore decodes from there. A dictionary trained on a sample of
+// them fills the window before the first byte. It's stored once per archive,
+// so it's only trained when the small files span several frames.
+
+// Files up to this size are sampled (khr_format puts the same ones in solid blocks)...
+const DICT_FILE_MAX: u64 = 64 * 1024;
+// ...from their start, where the headers and common keys are
+const DICT_SAMPLE_LEN: usize = 4 * 1024;
+// what the trainer is given in total; more is slower for little gain
+const DICT_SAMPLE_BYTES: usize = 2 * 1024 * 1024;
+const DICT_MIN_SAMPLES: usize = 64;
+pub const DICT_CAPACITY: usize = 32 * 1024;
+// small files have to add up to this much before a dictionary pays for itself
+pub const DICT_MIN_INPUT: u64 = 4 * parallel_blocks.BLOCK_SIZE;
+
+// A dictionary for the small files among paths, or null when there aren't
+// enough of them (or zdict finds nothing worth keeping).
+pub fn trainDictionary(allocator: Allocator, paths: []const []const u8, level: i32) !?zstd.Dictionary {
+    var small = std.ArrayList(usize).init(allocator);
+    defer small.deinit();
+    var total: u64 = 0;
+    for (paths, 0..) |path, i| {
+        const st = posix.fstatat(posix.AT.FDCWD, path, posix.AT.SYMLINK_NOFOLLOW) catch continue;
+        if (!posix.S.ISREG(st.mode)) continue;
+        const size: u64 = @intCast(st.size);
+        if (size == 0 or size > DICT_FILE_MAX or hasCompressedExtension(path)) continue;
+        try small.append(i);
+        total += size;
+    }
+    if (total < DICT_MIN_INPUT or small.items.len < DICT_MIN_SAMPLES) return null;
+
+    // spread over the whole tree rather than the first directory's files
+    const stride = @max(1, small.items.len / (DICT_SAMPLE_BYTES / DICT_SAMPLE_LEN));
+    var samples = std.ArrayList(u8).init(allocator);
+    defer samples.deinit();
+    var sizes = std.ArrayList(usize).init(allocator);
+    defer sizes.deinit();
+    var i: usize = 0;
+    while (i < small.items.len and samples.items.len + DICT_SAMPLE_LEN <= DICT_SAMPLE_BYTES) : (i += stride) {
+        const f = std.fs.cwd().openFile(paths[small.items[i]], .{}) catch continue;
+        defer f.close();
+        const start = samples.items.len;
+        try samples.resize(start + DICT_SAMPLE_LEN);
+        const n = f.readAll(samples.items[start..]) catch 0;
+        samples.shrinkRetainingCapacity(start + n);
+        if (n > 0) try sizes.append(n);
+    }
+    if (sizes.items.len < DICT_MIN_SAMPLES) return null;
+    return zstd.Dictionary.train(allocator, samples.items, sizes.items, DICT_CAPACITY, level);
+}
+
+// Reads stored_len bytes starting at data_start and hands back the decoded
+// stream. Heap allocated because the decoders hold a reader pointing back at it.
+// With a cipher the stored bytes are a sealed stream and the codec sees the
+// decrypted bytes; frame offsets are in that decrypted space.
+pub const PayloadReader = struct {
+    allocator: Allocator,
+    file: fs.File,
+    data_start: u64,
+    payload_len: FileSize, // codec bytes, i.e. after decryption
+    remaining: FileSize, // undecoded payload bytes not yet pulled from the file
+    decoded_pos: u64 = 0, // position in the decoded stream
+    buf: []u8,
+    buf_pos: usize = 0,
+    buf_len: usize = 0,
+    sealed: ?streaming_crypto.DecryptingReader = null,
+    decoder: Decoder,
+    // the archive from offset 0 to the end of the payload; see can_map
+    mapped: ?MappedFile = null,
+    // openStream: stored bytes come from here instead of file, front to back only
+    stream: ?std.io.AnyReader = null,
+
+    const Decoder = union(enum) {
+        none,
+        gzip: parallel_gzip.MemberReader,
+        lz4: lz4.StreamDecompressor,
+        zstd: zstd.StreamDecompressor,
+    };
+
+    const Self = @This();
+
+    pub fn open(
+        allocator: Allocator,
+        file: fs.File,
+        data_start: u64,
+        stored_len: FileSize,
+        compression: CompressionType,
+        cipher: ?*const streaming_crypto.ChunkCipher,
+    ) !*Self {
+        try file.seekTo(data_start);
+
+        const self = try allocator.create(Self);
+        errdefer allocator.destroy(self);
+        const buf = try allocator.alloc(u8, READ_BUFFER_SIZE);
+        errdefer allocator.free(buf);
+
+        self.* = .{
+            .allocator = allocator,
+            .file = file,
+            .data_start = data_start,
+            .payload_len = stored_len,
+            .remaining = stored_len,
+            .buf = buf,
+            .decoder = .none,
+        };
+        if (cipher) |ci| {
+            self.sealed = try streaming_crypto.DecryptingReader.init(allocator, ci, .payload, file, data_start, stored_len);
+            self.payload_len = self.sealed.?.plain_len;
+            self.remaining = self.payload_len;
+        }
+        errdefer if (self.sealed) |*sr| sr.deinit();
+        switch (compression) {
+            .gzip => self.decoder = .{ .gzip = parallel_gzip.MemberReader.init(allocator, self.rawReader()) },
+            .lz4 => self.decoder = .{ .lz4 = try lz4.StreamDecompressor.init(allocator, self.rawReader()) },
+            .zstd => {
+                self.decoder = .{ .zstd = try zstd.StreamDecompressor.init(allocator, self.rawReader()) };
+                errdefer self.decoder.zstd.deinit();
+                try self.decoder.zstd.readDictionaryFrame();
+            },
+            .none => if (self.sealed == null) {
+                self.mapped = mapPayload(file, data_start + stored_len);
+            },
+        }
+        return self;
+    }
+
+    // Decoded stream over stored bytes read from source until it ends, for
+    // archives coming down a pipe (pipe_stream.zig). Any unsealing has
+    // happened already. There's no file behind it, so no seeking, mapping or
+    // zero-copy.
+    pub fn openStream(allocator: Allocator, source: std.io.AnyReader, compression: CompressionType) !*Self {
+        const self = try allocator.create(Self);
+        errdefer allocator.destroy(self);
+        const buf = try allocator.alloc(u8, READ_BUFFER_SIZE);
+        errdefer allocator.free(buf);
+
+        self.* = .{
+            .allocator = allocator,
+            .file = undefined,
+            .data_start = 0,
+            .payload_len = std.math.maxInt(FileSize),
+            .remaining = std.math.maxInt(FileSize),
+            .buf = buf,
+            .decoder = .none,
+            .stream = source,
+        };
+        switch (compression) {
+            .gzip => self.decoder = .{ .gzip = parallel_gzip.MemberReader.init(allocator, self.rawReader()) },
+            .lz4 => self.decoder = .{ .lz4 = try lz4.StreamDecompressor.init(allocator, self.rawReader()) },
+            .zstd => {
+                self.decoder = .{ .zstd = try zstd.StreamDecompressor.init(allocator, self.rawReader()) };
+                errdefer self.decoder.zstd.deinit();
+                try self.decoder.zstd.readDictionaryFrame();
+            },
+            .none => {},
+        }
+        return self;
+    }
+
+    // Best effort: without a mapping the buffered reads below do the same job.
+    fn mapPayload(file: fs.File, end: u64) ?MappedFile {
+        if (!can_map) return null;
+        const len = std.math.cast(usize, end) orelse return null;
+        if (len == 0) return null;
+        // touching a page past EOF is SIGBUS, so a truncated archive is read the old way and fails cleanly
+        const size = file.getEndPos() catch return null;
+        if (size < end) return null;
+        const mapped = posix.mmap(null, len, posix.PROT.READ, .{ .TYPE = .PRIVATE }, file.handle, 0) catch return null;
+        // most readers walk the payload front to back; selective restores add willNeed() per entry
+        posix.madvise(mapped.ptr, mapped.len, posix.MADV.SEQUENTIAL) catch {};
+        return mapped;
+    }
+
+    pub fn close(self: *Self) void {
+        switch (self.decoder) {
+            .none => {},
+            .gzip => |*g| g.deinit(),
+            .lz4 => |*l| l.deinit(),
+            .zstd => |*z| z.deinit(),
+        }
+        if (self.sealed) |*sr| sr.deinit();
+        if (self.mapped) |m| posix.munmap(m);
+        const allocator = self.allocator;
+        allocator.free(self.buf);
+        allocator.destroy(self);
+    }
+
+    // Decoded bytes; 0 means the payload is exhausted.
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        const n = switch (self.decoder) {
+            .none => try self.readRaw(dest),
+            .gzip => |*g| try g.read(dest),
+            .lz4 => |*l| try l.read(dest),
+            .zstd => |*z| try z.read(dest),
+        };
+        self.decoded_pos += n;
+        return n;
+    }
+
+    // Position the decoded stream at target. Compressed payloads restart at
+    // the frame holding target (unless we're already inside it, before target)
+    // and decode forward from there, so the cost is at most one frame.
+    pub fn seekDecoded(self: *Self, target: u64, frame_table: []const Frame) !void {
+        if (self.stream != null) return CodecError.NotSeekable;
+        if (self.decoder == .none) {
+            if (target > self.payload_len) return CodecError.UnexpectedEndOfPayload;
+            try self.repositionRaw(target);
+            self.decoded_pos = target;
+            return;
+        }
+        if (frame_table.len == 0 or frame_table[0].decoded_offset != 0) return CodecError.CorruptFrameTable;
+
+        const want = frameIndex(frame_table, target);
+        const stay = self.decoded_pos <= target and frameIndex(frame_table, self.decoded_pos) == want;
+        if (!stay) {
+            const frame = frame_table[want];
+            if (frame.offset > self.payload_len) return CodecError.CorruptFrameTable;
+            try self.repositionRaw(frame.offset);
+            switch (self.decoder) {
+                .none => {},
+                .gzip => |*g| g.reset(),
+                .lz4 => |*l| l.reset(),
+                .zstd => |*z| z.reset(),
+            }
+            self.decoded_pos = frame.decoded_offset;
+        }
+
+        var scratch: [16 * 1024]u8 = undefined;
+        while (self.decoded_pos < target) {
+            const chunk: usize = @intCast(@min(target - self.decoded_pos, scratch.len));
+            if (try self.read(scratch[0..chunk]) == 0) return CodecError.UnexpectedEndOfPayload;
+        }
+    }
+
+    // The dictionary a zstd payload starts with, if it has one (putDictionary).
+    pub fn dictionary(self: *const Self) ?[]const u8 {
+        return switch (self.decoder) {
+            .zstd => |*z| z.dictionary,
+            else => null,
+        };
+    }
+
+    // True when decoded bytes are file bytes: no codec and no sealing.
+    pub fn isRaw(self: *const Self) bool {
+        return self.decoder == .none and self.sealed == null and self.stream == null;
+    }
+
+    // isRaw payloads only: copy the next len bytes into out at out_offset
+    // without passing them through userspace (copy_file_range; std falls back
+    // to pread/pwrite where the kernel can't) and step past them. Returns the
+    // archive file offset they came from, for the caller's checksum pass.
+    pub fn copyRaw(self: *Self, out: fs.File, out_offset: u64, len: u64) !u64 {
+        std.debug.assert(self.isRaw());
+        if (len > self.payload_len - self.decoded_pos) return CodecError.UnexpectedEndOfPayload;
+        // buffered bytes are re-read from the file rather than written separately
+        const src_offset = self.data_start + self.decoded_pos;
+        const copied = try self.file.copyRangeAll(src_offset, out, out_offset, len);
+        if (copied != len) return CodecError.UnexpectedEndOfPayload;
+        try self.repositionRaw(self.decoded_pos + len);
+        self.decoded_pos += len;
+        return src_offset;
+    }
+
+    fn repositionRaw(self: *Self, payload_offset: u64) !void {
+        if (self.sealed) |*sr| {
+            try sr.seekTo(payload_offset);
+        } else if (self.mapped == null) {
+            try self.file.seekTo(self.data_start + payload_offset);
+        }
+        self.remaining = self.payload_len - payload_offset;
+        self.buf_pos = 0;
+        self.buf_len = 0;
+    }
+
+    // Last frame starting at or before target; frame_table is sorted by decoded_offset.
+    fn frameIndex(frame_table: []const Frame, target: u64) usize {
+        var lo: usize = 0;
+        var hi: usize = frame_table.len;
+        while (hi - lo > 1) {
+            const mid = lo + (hi - lo) / 2;
+            if (frame_table[mid].decoded_offset <= target) lo = mid else hi = mid;
+        }
+        return lo;
+    }
+
+    // Mapped payloads only: the next len decoded bytes (fewer at the end of
+    // the payload) as a slice of the mapping, stepping past them. null when
+    // the payload isn't mapped, and the caller reads as usual.
+    pub fn takeMapped(self: *Self, len: u64) ?[]const u8 {
+        const m = self.mapped orelse return null;
+        const n: usize = @intCast(@min(len, self.remaining));
+        const at: usize = @intCast(self.data_start + (self.payload_len - self.remaining));
+        self.remaining -= n;
+        self.decoded_pos += n;
+        return m[at..][0..n];
+    }
+
+    // Mapped payloads only: len bytes at an absolute archive offset, e.g. what
+    // copyRaw just copied, for the checksum pass.
+    pub fn mappedAt(self: *const Self, file_offset: u64, len: u64) ?[]const u8 {
+        const m = self.mapped orelse return null;
+        if (file_offset + len > m.len) return null;
+        return m[@intCast(file_offset)..][0..@intCast(len)];
+    }
+
+    // Hint that the decoded range [offset, offset+len) is about to be read.
+    // Seeking readers call this per entry, since the sequential hint set at
+    // open only helps front-to-back walks.
+    pub fn willNeed(self: *const Self, offset: u64, len: u64) void {
+        const m = self.mapped orelse return;
+        const start = self.data_start + offset;
+        if (start >= m.len) return;
+        const page = std.heap.pageSize();
+        const aligned = std.mem.alignBackward(u64, start, page);
+        const end = @min(start + len, m.len);
+        const ptr: [*]align(std.heap.page_size_min) u8 = @alignCast(@constCast(m.ptr + @as(usize, @intCast(aligned))));
+        posix.madvise(ptr, @intCast(end - aligned), posix.MADV.WILLNEED) catch {};
+    }
+
+    pub fn any(self: *Self) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
+
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+
+    // Buffered, length-limited bytes straight from the file (or through the
+    // decryptor, which keeps its own chunk buffer).
+    fn readRaw(self: *Self, dest: []u8) anyerror!usize {
+        if (self.stream) |source| return source.read(dest);
+        if (self.sealed) |*sr| {
+            const n = try sr.read(dest);
+            self.remaining -= n;
+            return n;
+        }
+        if (self.mapped) |m| {
+            const n: usize = @intCast(@min(dest.len, self.remaining));
+            const at: usize = @intCast(self.data_start + (self.payload_len - self.remaining));
+            @memcpy(dest[0..n], m[at..][0..n]);
+            self.remaining -= n;
+            return n;
+        }
+        if (self.buf_pos == self.buf_len) {
+            if (self.remaining == 0) return 0;
+            // large reads go straight into the caller's buffer
+            if (dest.len >= self.buf.len) {
+                const want: usize = @intCast(@min(self.remaining, dest.len));
+                const n = try self.file.read(dest[0..want]);
+                self.remaining -= n;
+                return n;
+            }
+            const want: usize = @intCast(@min(self.remaining, self.buf.len));
+            self.buf_len = try self.file.read(self.buf[0..want]);
+            self.buf_pos = 0;
+            self.remaining -= self.buf_len;
+            if (self.buf_len == 0) return 0;
+        }
+        const n = @min(dest.len, self.buf_len - self.buf_pos);
+        @memcpy(dest[0..n], self.buf[self.buf_pos..][0..n]);
+        self.buf_pos += n;
+        return n;
+    }
+
+    fn rawReader(self: *Self) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedReadRaw };
+    }
+
+    fn typeErasedReadRaw(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.readRaw(dest);
+    }
+};
@@ -13,353 +13,97 @@ const FileSize = types.FileSize;
 const Timestamp = types.Timestamp;
 const security = @import("../security/crypto.zig");
 const streaming_crypto = @import("../security/streaming_crypto.zig");
-const compress = @import("../utils/compress.zig");
+const khr_codec = @import("khr_codec.zig");
+const khr_index = @import("khr_index.zig");
+const chunker = @import("chunker.zig");
+const batch_reader = @import("batch_reader.zig");
+const parallel_extract = @import("parallel_extract.zig");
+const dir_cache = @import("dir_cache.zig");
+const tee_writer = @import("tee_writer.zig");
+const pipe_stream = @import("pipe_stream.zig");
+const merkle = @import("merkle.zig");
+const lz4 = @import("../utils/lz4.zig");
+const zstd = @import("../utils/zstd.zig");
 
 pub const SaveProgressCallback = *const fn (operation: String, current: usize, total: usize) void;
 
+// KHRONO02 is KHRONO01 plus a trailing checksum algorithm byte, and
+// KHRONO03 is KHRONO02 plus a byte saying what the checksum is a hash of
+// (ChecksumKind, with CHECKSUM_KEYED set when it's keyed, see
+// checksumFor). Every new archive gets KHRONO03. Older headers are still
+// read, and keep their size when an append rewrites them; what their
+// checksum covers has to be worked out from the TOC (see
+// V2Reader.checkAgainst).
+const MAGIC_V1 = "KHRONO01";
+const MAGIC_V2 = "KHRONO02";
+const MAGIC_V3 = "KHRONO03";
+
+// Header version of an archive written to a pipe (see pipe_stream.zig).
+pub const PIPED_VERSION: u32 = pipe_stream.VERSION;
+
+pub fn isKhrMagic(magic: []const u8) bool {
+    return std.mem.eql(u8, magic, MAGIC_V1) or std.mem.eql(u8, magic, MAGIC_V2) or std.mem.eql(u8, magic, MAGIC_V3);
+}
+
+// What header.checksum of a v2/v3 stream is over.
+pub const ChecksumKind = enum(u8) {
+    tree = 1, // Merkle root of the decoded stream (merkle.zig)
+    segments = 2, // root over the segment roots of an appended archive; the TOC says where they start
+};
+const CHECKSUM_KEYED: u8 = 0x80;
+
 pub const KhrHeader = struct {
-    magic: [8]u8 = "KHRONO01".*,
+    magic: [8]u8 = MAGIC_V1.*,
     version: u32 = 1,
     compression: CompressionType = .none,
     encryption: EncryptionInfo = undefined,
     tar_size: FileSize = 0,
     checksum: [32]u8 = undefined,
+    hash: HashAlgo = .sha256, // what checksum (and the TOC's Merkle leaves) are computed with
+    // null: a KHRONO01/02 header, which doesn't say
+    checksum_kind: ?ChecksumKind = null,
+    // sealed KHRONO03 archives: checksum is the root keyed with the archive key
+    checksum_keyed: bool = false,
 
     const Self = @This();
 
     pub fn write(self: *const Self, writer: anytype) !void {
-        try writer.writeAll(&self.magic);
+        const magic = if (self.checksum_kind != null) MAGIC_V3 else if (self.hash == .sha256) MAGIC_V1 else MAGIC_V2;
+        try writer.writeAll(magic);
         try writer.writeInt(u32, self.version, .little);
         try writer.writeInt(u8, @intFromEnum(self.compression), .little);
         try self.encryption.write(writer);
         try writer.writeInt(FileSize, self.tar_size, .little);
         try writer.writeAll(&self.checksum);
-    }
-
-    // Streaming extractor for V2 payloads.
-    // On-dsk layout (all little-endian):
-    //   "KHRV2\n" magic
-    //   Repeated entries:
-    //     tag: u8                 1=file, 2=symlink
-    //     path_len: u32           number of bytes in path
-    //     path: [path_len]u8      UTF-8 bytes (no NUL)
-    //     mode: u64               unix mode bit
-    //     mtime: i64              seconds since epoch
-    //     if tag==1 (file):
-    //         size: u64
-    //         data: [size]u8
-    //     if tag==2 (symlink):
-    //         target_len: u32
-    //         target: [target_len]u8
-    // Hashing note: we hash the uncompressed byte in the exact order written
-    // (including magic[constants or values that are used in algorithms that may appear arbitrary]
-    //  and metadata), then compare to header.checksum. The
-    // create() path updates the hasher with the same uncompressed stream, so
-    // the verifier must decompress first (as done here).
-    //
-    fn extractKhrBackupStreamingGzip(allocator: Allocator, file: fs.File, data_start: u64, payload_len: u64, extract_to: String, expected_checksum: [32]u8) !void {
-        const V2_MAGIC = "KHRV2\n";
-        try file.seekTo(data_start);
-
-        const base_reader = file.reader();
-        var limited = std.io.limitedReader(base_reader, payload_len);
-        var dec = std.compress.gzip.decompressor(limited.reader());
-        var reader = dec.reader();
-
-        var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-
-        var hdrbuf: [6]u8 = undefined;
-        const mread = reader.readAll(&hdrbuf) catch |err| switch (err) {
-            error.EndOfStream => 0,
-            else => return KhrError.ArchiveFormatFailed,
-        };
-        if (mread != V2_MAGIC.len or !std.mem.eql(u8, &hdrbuf, V2_MAGIC)) return KhrError.ArchiveFormatFailed;
-        hasher.update(V2_MAGIC);
-
-        var b4: [4]u8 = undefined;
-        var b8: [8]u8 = undefined;
-        var tagbuf: [1]u8 = undefined;
-        var tmp: [64 * 1024]u8 = undefined;
-
-        const sanitize = struct {
-            fn sanitizeRelativePath(alloc: Allocator, p: String) ![]u8 {
-                var start: usize = 0;
-                while (start < p.len and p[start] == '/') start += 1;
-                var out = std.ArrayList(u8).init(alloc);
-                errdefer out.deinit();
-                var it = std.mem.splitScalar(u8, p[start..], '/');
-                var first = true;
-                while (it.next()) |seg| {
-                    if (seg.len == 0 or std.mem.eql(u8, seg, ".") or std.mem.eql(u8, seg, "..")) {
-                        return KhrError.ArchiveFormatFailed;
-                    }
-                    if (!first) try out.append('/');
-                    first = false;
-                    try out.appendSlice(seg);
-                }
-                if (out.items.len == 0) return KhrError.ArchiveFormatFailed;
-                return out.toOwnedSlice();
-            }
-        };
-
-        // Main read loop: read a tag, then parse a record. We avoid buffering
-        // the entire archive; everything is streamed and written incrementally.
-        while (true) {
-            const tr = reader.readAll(&tagbuf) catch |err| {
-                if (err == error.EndOfStream) break;
-                return KhrError.ArchiveFormatFailed;
-            };
-            if (tr == 0) break;
-            if (tr != 1) return KhrError.ArchiveFormatFailed;
-            hasher.update(&tagbuf);
-            const tag = tagbuf[0];
-            // tag 1=file, 2=symlink
-
-            const pr = reader.readAll(&b4) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (pr != b4.len) return KhrError.ArchiveFormatFailed;
-            hasher.update(&b4);
-            const path_len = std.mem.readInt(u32, &b4, .little);
-
-            const path_slice = try allocator.alloc(u8, path_len); // allocate exact path bytes
-            defer allocator.free(path_slice);
-            const got = reader.readAll(path_slice) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (got != path_len) return KhrError.ArchiveFormatFailed;
-            hasher.update(path_slice);
-            // Prevent path traversal and absolute paths. If sanitize fails we bail.
-            const safe_rel = sanitize.sanitizeRelativePath(allocator, path_slice) catch return KhrError.ArchiveFormatFailed;
-            defer allocator.free(safe_rel);
-            print("Extracting: {s}\n", .{safe_rel});
-
-            const mr = reader.readAll(&b8) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (mr != b8.len) return KhrError.ArchiveFormatFailed;
-            hasher.update(&b8);
-            const mode_val_u64 = std.mem.readInt(u64, &b8, .little);
-
-            const mt = reader.readAll(&b8) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (mt != b8.len) return KhrError.ArchiveFormatFailed;
-            hasher.update(&b8);
-
-            if (tag == 1) {
-                const sr = reader.readAll(&b8) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (sr != b8.len) return KhrError.ArchiveFormatFailed;
-                hasher.update(&b8);
-                var size = std.mem.readInt(FileSize, &b8, .little);
-
-                const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, safe_rel }); // join without trusting input slashes
-                defer allocator.free(full_path);
-                if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-                const out = try std.fs.cwd().createFile(full_path, .{});
-                defer out.close();
-
-                while (size > 0) {
-                    const chunk: usize = @intCast(@min(size, tmp.len));
-                    const n = reader.read(tmp[0..chunk]) catch |err| switch (err) {
-                        error.EndOfStream => 0,
-                        else => return KhrError.ArchiveFormatFailed,
-                    };
-                    if (n == 0) return KhrError.ArchiveFormatFailed;
-                    try out.writeAll(tmp[0..n]);
-                    hasher.update(tmp[0..n]);
-                    size -= n;
-                }
-
-                if (builtin.os.tag == .linux) {
-                    const perm: u32 = @intCast(mode_val_u64 & 0o7777);
-                    posix.fchmod(out.handle, perm) catch {};
-                }
-            } else if (tag == 2) {
-                // symlink: read target len and target (allow absolute or relative targets)
-                const lr = reader.readAll(&b4) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (lr != b4.len) return KhrError.ArchiveFormatFailed;
-                hasher.update(&b4);
-                const target_len = std.mem.readInt(u32, &b4, .little);
-                const target = try allocator.alloc(u8, target_len);
-                defer allocator.free(target);
-                const got2 = reader.readAll(target) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (got2 != target_len) return KhrError.ArchiveFormatFailed;
-                hasher.update(target);
-
-                const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, safe_rel });
-                defer allocator.free(full_path);
-                if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-                const c_link = try allocator.allocSentinel(u8, full_path.len, 0);
-                defer allocator.free(c_link);
-                std.mem.copyForwards(u8, c_link, full_path);
-                const c_target = try allocator.allocSentinel(u8, target.len, 0);
-                defer allocator.free(c_target);
-                std.mem.copyForwards(u8, c_target, target);
-                posix.symlinkZ(c_target.ptr, c_link.ptr) catch {};
-            } else {
-                return KhrError.ArchiveFormatFailed;
-            }
+        if (self.checksum_kind != null or self.hash != .sha256) try writer.writeInt(u8, @intFromEnum(self.hash), .little);
+        if (self.checksum_kind) |kind| {
+            const keyed: u8 = if (self.checksum_keyed) CHECKSUM_KEYED else 0;
+            try writer.writeInt(u8, @intFromEnum(kind) | keyed, .little);
         }
-
-        var checksum: [32]u8 = undefined;
-        hasher.final(&checksum);
-        if (!std.mem.eql(u8, &checksum, &expected_checksum)) return KhrError.ChecksumMismatch;
     }
 
-    // Streaming creator for V2 payloads.
-    // Design choices:
-    // - We compress while we write to keep memory usage small.
-    // - The checksum is over the uncompressed logical stream (same order the
-    //   extractor reads), so verification doesn't depend on gzip chunking.
-    // - We skip non-regular files (fifos, sockets, devices) to avoid hangs.
-    // - Symlinks are encoded as tag=2 with a target string; we do not follow
-    //   symlinks to avoid duplicating unrelated data.
-    fn createKhrBackupStreamingGzip(allocator: Allocator, source_paths: []const String, output_path: String, progress_cb: ?SaveProgressCallback) !void {
-        const V2_MAGIC = "KHRV2\n";
-        const file = try fs.cwd().createFile(output_path, .{});
-        defer file.close();
-
-        var header = KhrHeader{
-            .compression = .gzip,
-            .encryption = EncryptionInfo{
-                .algorithm = .chacha20_poly1305,
-                .kdf = .argon2id,
-                .salt = [_]u8{0} ** 32,
-                .nonce = [_]u8{0} ** 12,
-                .opslimit = 0,
-                .memlimit = 0,
-            },
-            .tar_size = 0,
-            .checksum = [_]u8{0} ** 32,
-        };
-        header.version = 2;
-
-        try header.write(file.writer());
-        const data_start = try file.getPos();
-
-        var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-        try file.writer().writeAll(V2_MAGIC);
-        hasher.update(V2_MAGIC);
-
-        var gz = try std.compress.gzip.compressor(file.writer(), .{});
-
-        var b4: [4]u8 = undefined;
-        var b8: [8]u8 = undefined;
-        var tagbuf: [1]u8 = undefined;
-        const total_files_gzip_create = source_paths.len;
-        for (source_paths, 0..) |path, i| {
-            if (progress_cb) |cb| {
-                if (i % 100 == 0 or i == total_files_gzip_create - 1) {
-                    cb("Saving files", i + 1, total_files_gzip_create);
-                }
-            }
-            // Detect symlink via readlink
-            const c_path = allocator.allocSentinel(u8, path.len, 0) catch continue;
-            defer allocator.free(c_path);
-            std.mem.copyForwards(u8, c_path, path);
-            var linktmp: [4096]u8 = undefined;
-            const maybe_target: ?[]u8 = posix.readlinkZ(c_path.ptr, linktmp[0..]) catch null;
-            if (maybe_target) |target| {
-                // Tag: 2=symlink
-                tagbuf[0] = 2;
-                try gz.writer().writeAll(&tagbuf);
-                hasher.update(&tagbuf);
-
-                std.mem.writeInt(u32, &b4, @as(u32, @intCast(path.len)), .little);
-                try gz.writer().writeAll(&b4);
-                hasher.update(&b4);
-                try gz.writer().writeAll(path);
-                hasher.update(path);
-                std.mem.writeInt(u64, &b8, @as(u64, 0), .little);
-                try gz.writer().writeAll(&b8);
-                hasher.update(&b8);
-                std.mem.writeInt(i64, &b8, @as(i64, 0), .little);
-                try gz.writer().writeAll(&b8);
-                hasher.update(&b8);
-
-                std.mem.writeInt(u32, &b4, @as(u32, @intCast(target.len)), .little);
-                try gz.writer().writeAll(&b4);
-                hasher.update(&b4);
-                try gz.writer().writeAll(target);
-                hasher.update(target);
-                continue;
-            }
-
-            // Only archive regular files; skip fifos, sockets, block/char devices to avoid blocking
-            const f = fs.cwd().openFile(path, .{}) catch continue;
-            defer f.close();
-            const st = f.stat() catch continue;
-            if (st.kind != .file) continue;
-
-            tagbuf[0] = 1;
-            try gz.writer().writeAll(&tagbuf);
-            hasher.update(&tagbuf);
-
-            std.mem.writeInt(u32, &b4, @as(u32, @intCast(path.len)), .little);
-            try gz.writer().writeAll(&b4);
-            hasher.update(&b4);
-            try gz.writer().writeAll(path);
-            hasher.update(path);
-
-            std.mem.writeInt(u64, &b8, @as(u64, @intCast(st.mode)), .little);
-            try gz.writer().writeAll(&b8);
-            hasher.update(&b8);
-            std.mem.writeInt(i64, &b8, @as(i64, @intCast(st.mtime)), .little);
-            try gz.writer().writeAll(&b8);
-            hasher.update(&b8);
-            std.mem.writeInt(FileSize, &b8, @as(FileSize, @intCast(st.size)), .little);
-            try gz.writer().writeAll(&b8);
-            hasher.update(&b8);
-
-            var buf: [1024 * 1024]u8 = undefined;
-            var remaining: FileSize = st.size;
-            while (remaining > 0) {
-                const to_read: usize = @intCast(@min(remaining, buf.len));
-                const n = try f.read(buf[0..to_read]);
-                if (n == 0) break;
-                try gz.writer().writeAll(buf[0..n]);
-                hasher.update(buf[0..n]);
-                remaining -= n;
-            }
-        }
-
-        try gz.finish();
-        const data_end = try file.getPos();
-        const payload_len: u64 = @intCast(data_end - data_start);
-        var checksum: [32]u8 = undefined;
-        hasher.final(&checksum);
-        header.tar_size = payload_len;
-        header.checksum = checksum;
-
-        try file.seekTo(0);
-        try header.write(file.writer());
-    }
     pub fn read(reader: anytype) !Self {
         var header: Self = undefined;
 
         _ = try reader.readAll(&header.magic);
+        if (!isKhrMagic(&header.magic)) {
+            return error.InvalidKhrFile;
+        }
         header.version = try reader.readInt(u32, .little);
         header.compression = @enumFromInt(try reader.readInt(u8, .little));
         header.encryption = try EncryptionInfo.read(reader);
         header.tar_size = try reader.readInt(FileSize, .little);
         _ = try reader.readAll(&header.checksum);
-
-        if (!std.mem.eql(u8, &header.magic, "KHRONO01")) {
-            return error.InvalidKhrFile;
+        header.hash = .sha256;
+        header.checksum_kind = null;
+        header.checksum_keyed = false;
+        if (!std.mem.eql(u8, &header.magic, MAGIC_V1)) {
+            header.hash = std.meta.intToEnum(HashAlgo, try reader.readInt(u8, .little)) catch return error.InvalidKhrFile;
+        }
+        if (std.mem.eql(u8, &header.magic, MAGIC_V3)) {
+            const kind = try reader.readInt(u8, .little);
+            header.checksum_kind = std.meta.intToEnum(ChecksumKind, kind & ~CHECKSUM_KEYED) catch return error.InvalidKhrFile;
+            header.checksum_keyed = kind & CHECKSUM_KEYED != 0;
         }
 
         return header;
@@ -373,6 +117,9 @@ pub const CompressionType = enum(u8) {
     zstd = 3,
 };
 
+// Archive checksum hash; stored in KHRONO02/03 headers
+pub const HashAlgo = merkle.Algorithm;
+
 // This is some simple encryption metadata aligned with our crypto module
 pub const EncAlgo = enum(u8) { chacha20_poly1305 = 1 };
 pub const KdfAlgo = enum(u8) { argon2id = 1 };
@@ -426,412 +173,2502 @@ pub const KhrError = error{
     ArchiveFilterFailed,
     ArchiveOpenFailed,
     ArchiveCloseFailed,
+    ParentArchiveMissing,
+    ParentArchiveMismatch,
+    VolumeMissing,
+    VolumeMismatch,
 };
 
-fn createKhrBackupStreaming(allocator: Allocator, source_paths: []const String, output_path: String, progress_cb: ?SaveProgressCallback) !void {
-    const V2_MAGIC = "KHRV2\n";
-    const file = try fs.cwd().createFile(output_path, .{});
-    defer file.close();
+// ---- V2 streaming archives ----
+//
+// On-disk layout of the decoded payload (all little-endian):
+//   "KHRV2\n" magic
+//   Repeated entries (tag 5 is laid out differently, see below):
+//     tag: u8                 1=file, 2=symlink, 3=file with codec, 5=solid block, 6=sparse file,
+//                             7=hard link, 8=file part
+//     path_len: u32           number of bytes in path
+//     path: [path_len]u8      UTF-8 bytes (no NUL)
+//     mode: u64               unix mode bits
+//     mtime: i64              mtime as returned by stat
+//     if tag==3:
+//         codec: u8           CompressionType the body was stored with
+//     if tag==1 or tag==3 (file):
+//         size: u64
+//         data: [size]u8
+//     if tag==2 (symlink) or tag==7 (hard link):
+//         target_len: u32
+//         target: [target_len]u8      for tag 7, the path stored with the inode's body
+//     if tag==6 (sparse file) or tag==8 (file part):
+//         size: u64           logical length, holes included
+//         extent_count: u32
+//         extents: extent_count x (offset: u64, len: u64), ascending
+//         data: the extents' bytes back to back
+//   Solid block (tag 5): small files packed into one record
+//     tag: u8                 5
+//     count: u32
+//     count x (path_len: u32, path, mode: u64, mtime: i64, size: u64)
+//     data: the members' bodies back to back, in member order
+// The writer sorts its input by extension and directory and collects files
+// up to SOLID_FILE_MAX into solid blocks of about SOLID_BLOCK_SIZE, so
+// similar small files sit next to each other in the codec's window and a
+// restore parses one header for a whole batch of them. Every member still
+// gets its own TOC entry pointing at its body, so seeking to one works the
+// same as for a tag 1/3 file.
+// Files with holes (found with SEEK_DATA/SEEK_HOLE) are tag 6: only their
+// data extents are stored, and restore truncates to size and writes the
+// extents, so the holes stay holes. Their TOC entries point at the record,
+// like symlinks, since the body isn't the file's bytes.
+// A regular file whose inode was already stored under another name (same
+// dev and inode, found by the writer's statx) is a tag 7 record naming that
+// first path, and restore recreates it with linkat. The writer puts every
+// tag 7 record at the end of the stream, so its target has always been
+// restored by the time it's reached. v3 streams use tag 7 the same way.
+// A file too big for one volume of a multi-volume set (createVolumeSet) is
+// cut into tag 8 records, one per volume, each a single extent of it. They
+// restore like tag 6 except the file isn't truncated first, so the pieces
+// can land in any order, from volumes being restored at the same time.
+// header.compression says how that stream is stored (raw, gzip members, lz4
+// or zstd frames - see khr_codec.zig). A zstd payload may open with a
+// skippable frame holding a dictionary trained on the archive's small files,
+// which every frame after it is compressed against
+// (khr_codec.trainDictionary). Bodies of already-compressed files are
+// stored (codec 0) in uncompressed frames of the same codec instead, see
+// khr_codec.shouldStore; the frames are self-describing, so the per-entry
+// codec is informational for readers. Tag 1 (older writers) means the body
+// used header.compression. Hashing note: the checksum is over the
+// decoded stream in exactly the order above, magic included, so it
+// doesn't depend on how the codec chunked things and the verifier has to
+// decode first. It's SHA-256 or BLAKE3 (header.hash) and the Merkle root of
+// the stream's blocks (merkle.zig); KHRONO01 archives from before the tree
+// have a flat hash of the stream instead.
+// With a password the codec output is sealed in fixed-size ChaCha20-Poly1305
+// chunks on its way to disk (streaming_crypto.EncryptingWriter), so header.tar_size
+// is the sealed length and the codec, frame table and record offsets all
+// live in the decrypted space. The KDF salt, base nonce and cost go in
+// header.encryption, same as v1.
+// appendKhrBackup adds records after the last one (no second magic) without
+// touching the bytes before them. Each append is its own segment of the
+// Merkle tree, blocked from where it starts, so it verifies on its own and
+// header.checksum becomes the root over the segment roots (see merkle.zig).
+
+const V2_MAGIC = "KHRV2\n";
+const TAG_FILE: u8 = 1;
+const TAG_SYMLINK: u8 = 2;
+const TAG_FILE_CODED: u8 = 3; // only on disk; readers hand these out as TAG_FILE
+const TAG_SOLID: u8 = 5;
+// Files up to this size go into solid blocks (v2 only; v3 chunks everything)
+const SOLID_FILE_MAX: u64 = 64 * 1024;
+// A solid block is written once its bodies reach this size...
+const SOLID_BLOCK_SIZE: usize = 1024 * 1024;
+// ...or it has this many members; readers refuse more
+const MAX_SOLID_MEMBERS: u32 = 4096;
+const TAG_SPARSE: u8 = 6;
+const TAG_HARDLINK: u8 = 7;
+const TAG_PART: u8 = 8;
+// Smaller files aren't worth the extra lseeks to look for holes
+const SPARSE_MIN: u64 = 1024 * 1024;
+// A file fragmented worse than this is stored dense; readers refuse more
+const MAX_SPARSE_EXTENTS: u32 = 64 * 1024;
+// Longest path/link target we accept back from an archive; anything bigger is corruption.
+const MAX_RECORD_PATH: u32 = 64 * 1024;
+
+// appendKhrBackup's codec settings. The compression itself is always the archive's.
+pub const AppendOptions = struct {
+    // codec level; null is the level the archive was written at (see khr_index FLAG_LEVEL)
+    level: ?i32 = null,
+    // compression worker threads; 0 = one per cpu
+    threads: usize = 0,
+};
 
-    var header = KhrHeader{
-        .compression = .none,
-        .encryption = EncryptionInfo{
-            .algorithm = .chacha20_poly1305,
-            .kdf = .argon2id,
-            .salt = [_]u8{0} ** 32,
-            .nonce = [_]u8{0} ** 12,
-            .opslimit = 0,
-            .memlimit = 0,
-        },
-        .tar_size = 0,
-        .checksum = [_]u8{0} ** 32,
-    };
-    header.version = 2;
+pub const CreateOptions = struct {
+    compression: CompressionType = .gzip,
+    // codec level; null picks the codec default (gzip 6, lz4 0, zstd 3)
+    level: ?i32 = null,
+    // compression worker threads; 0 = one per cpu
+    threads: usize = 0,
+    // write a v3 archive: file bodies split into deduplicated chunks
+    chunked: bool = false,
+    // earlier v3 archive whose chunks become references instead of copies; implies chunked
+    parent: ?String = null,
+    // archive checksum hash, see KhrHeader
+    hash: HashAlgo = .sha256,
+    // zstd: train a dictionary on the small files when there are enough of them
+    dictionary: bool = true,
+    // split into volumes of at most this many bytes (v2 only, see createVolumeSet)
+    volume_size: ?u64 = null,
+    // directories the volumes go to, round-robin; empty = next to output_path
+    volume_dirs: []const String = &[_]String{},
+    // more files to write the same archive to, in the same pass (see tee_writer.zig)
+    copies: []const String = &[_]String{},
+    // decoded bytes between checkpoints (see Checkpoint); 0 = none
+    checkpoint_every: u64 = CHECKPOINT_INTERVAL,
+    // carry on from output_path's checkpoint, if it has one, instead of starting over
+    resume_interrupted: bool = false,
+};
 
-    try header.write(file.writer());
-    const data_start = try file.getPos();
+// Write side of the V2 stream: every byte goes through the codec and into the checksum.
+const V2Writer = struct {
+    out: khr_codec.PayloadWriter.Writer,
+    hash: merkle.StreamHash, // always a tree for new archives; its leaves go in the TOC
+    written: u64 = 0, // position in the decoded stream, what the TOC offsets refer to
 
-    var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-    try file.writer().writeAll(V2_MAGIC);
-    hasher.update(V2_MAGIC);
+    fn put(self: *V2Writer, bytes: []const u8) !void {
+        try self.out.writeAll(bytes);
+        try self.hash.update(bytes);
+        self.written += bytes.len;
+    }
 
-    var b4: [4]u8 = undefined;
-    var b8: [8]u8 = undefined;
-    var tagbuf: [1]u8 = undefined;
+    fn putInt(self: *V2Writer, comptime T: type, value: T) !void {
+        var buf: [@sizeOf(T)]u8 = undefined;
+        std.mem.writeInt(T, &buf, value, .little);
+        try self.put(&buf);
+    }
 
-    const total_files_plain_create = source_paths.len;
-    for (source_paths, 0..) |path, i| {
-        // Update progress every 100 files to reduce overhead
-        if (progress_cb) |cb| {
-            if (i % 100 == 0 or i == total_files_plain_create - 1) {
-                cb("Saving files", i + 1, total_files_plain_create);
-            }
-        }
-        // Detect symlink via readlink
-        const c_path = allocator.allocSentinel(u8, path.len, 0) catch continue;
-        defer allocator.free(c_path);
-        std.mem.copyForwards(u8, c_path, path);
-        var tbuf: [4096]u8 = undefined;
-        const maybe_target: ?[]u8 = posix.readlinkZ(c_path.ptr, tbuf[0..]) catch null;
-        if (maybe_target) |target| {
-            // Tag: 2=symlink
-            tagbuf[0] = 2;
-            try file.writer().writeAll(&tagbuf);
-            hasher.update(&tagbuf);
-
-            std.mem.writeInt(u32, &b4, @as(u32, @intCast(path.len)), .little);
-            try file.writer().writeAll(&b4);
-            hasher.update(&b4);
-            try file.writer().writeAll(path);
-            hasher.update(path);
+    fn recordHeader(self: *V2Writer, tag: u8, path: String, mode: u64, mtime: i64) !void {
+        try self.put(&[_]u8{tag});
+        try self.putInt(u32, @intCast(path.len));
+        try self.put(path);
+        try self.putInt(u64, mode);
+        try self.putInt(i64, mtime);
+    }
 
-            std.mem.writeInt(u64, &b8, @as(u64, 0), .little);
-            try file.writer().writeAll(&b8);
-            hasher.update(&b8);
-            std.mem.writeInt(i64, &b8, @as(i64, 0), .little);
-            try file.writer().writeAll(&b8);
-            hasher.update(&b8);
-
-            std.mem.writeInt(u32, &b4, @as(u32, @intCast(target.len)), .little);
-            try file.writer().writeAll(&b4);
-            hasher.update(&b4);
-            try file.writer().writeAll(target);
-            hasher.update(target);
-            continue;
-        }
+    fn symlink(self: *V2Writer, path: String, target: String) !void {
+        try self.recordHeader(TAG_SYMLINK, path, 0, 0);
+        try self.putInt(u32, @intCast(target.len));
+        try self.put(target);
+    }
 
-        const f = fs.cwd().openFile(path, .{}) catch continue;
-        defer f.close();
-        const st = f.stat() catch continue;
-        if (st.kind != .file) {
-            print("Skipping non-regular: {s}\n", .{path});
-            continue;
-        }
+    // target is the path the inode's body was stored under.
+    fn hardlink(self: *V2Writer, path: String, target: String, mode: u64, mtime: i64) !void {
+        try self.recordHeader(TAG_HARDLINK, path, mode, mtime);
+        try self.putInt(u32, @intCast(target.len));
+        try self.put(target);
+    }
 
-        tagbuf[0] = 1;
-        try file.writer().writeAll(&tagbuf);
-        hasher.update(&tagbuf);
-
-        std.mem.writeInt(u32, &b4, @as(u32, @intCast(path.len)), .little);
-        try file.writer().writeAll(&b4);
-        hasher.update(&b4);
-        try file.writer().writeAll(path);
-        hasher.update(path);
-
-        std.mem.writeInt(u64, &b8, @as(u64, @intCast(st.mode)), .little);
-        try file.writer().writeAll(&b8);
-        hasher.update(&b8);
-        std.mem.writeInt(i64, &b8, @as(i64, @intCast(st.mtime)), .little);
-        try file.writer().writeAll(&b8);
-        hasher.update(&b8);
-        std.mem.writeInt(FileSize, &b8, @as(FileSize, @intCast(st.size)), .little);
-        try file.writer().writeAll(&b8);
-        hasher.update(&b8);
-
-        var buf: [1024 * 1024]u8 = undefined;
-        var remaining: FileSize = st.size;
-        while (remaining > 0) {
-            const to_read: usize = @intCast(@min(remaining, buf.len));
-            const n = try f.read(buf[0..to_read]);
-            if (n == 0) break;
-            try file.writer().writeAll(buf[0..n]);
-            hasher.update(buf[0..n]);
-            remaining -= n;
+    // The caller follows this with exactly size bytes of body via put().
+    fn fileHeader(self: *V2Writer, path: String, mode: u64, mtime: i64, codec: CompressionType, size: FileSize) !void {
+        try self.recordHeader(TAG_FILE_CODED, path, mode, mtime);
+        try self.put(&[_]u8{@intFromEnum(codec)});
+        try self.putInt(FileSize, size);
+    }
+
+    // Sparse files and file parts (tag 6/8). The caller follows this with
+    // the extents' bytes, in order.
+    fn extentsHeader(self: *V2Writer, tag: u8, path: String, mode: u64, mtime: i64, size: FileSize, extents: []const Extent) !void {
+        try self.recordHeader(tag, path, mode, mtime);
+        try self.putInt(FileSize, size);
+        try self.putInt(u32, @intCast(extents.len));
+        for (extents) |e| {
+            try self.putInt(u64, e.offset);
+            try self.putInt(u64, e.len);
         }
     }
 
-    // Finalize header
-    const data_end = try file.getPos();
-    const payload_len: u64 = @intCast(data_end - data_start);
-    var checksum: [32]u8 = undefined;
-    hasher.final(&checksum);
-    header.tar_size = payload_len;
-    header.checksum = checksum;
+    // v3: the caller follows this with the chunk list, see ChunkWriter.writeFile.
+    fn chunkedFileHeader(self: *V2Writer, path: String, mode: u64, mtime: i64, size: FileSize) !void {
+        try self.recordHeader(TAG_CHUNKED_FILE, path, mode, mtime);
+        try self.putInt(FileSize, size);
+    }
+};
 
-    // Rewrite header at start
-    try file.seekTo(0);
-    try header.write(file.writer());
+// A run of data in a sparse file; everything between runs is a hole.
+const Extent = struct {
+    offset: u64,
+    len: u64,
+};
+
+// lseek whence values for hole detection (Linux 3.1+; std doesn't name them)
+const SEEK_DATA: usize = 3;
+const SEEK_HOLE: usize = 4;
+
+// Where the next data (or hole) starts at or after offset; null past the
+// last data. Errors mean the filesystem can't tell us.
+fn seekExtent(f: fs.File, offset: u64, whence: usize) !?u64 {
+    const linux = std.os.linux;
+    const rc = linux.lseek(f.handle, @intCast(offset), whence);
+    return switch (linux.E.init(rc)) {
+        .SUCCESS => rc,
+        .NXIO => null,
+        else => error.Unsupported,
+    };
+}
+
+// Data extents of f, or null when it has no holes (or we can't find them):
+// then it's stored like any other file.
+fn dataExtents(allocator: Allocator, f: fs.File, size: u64) !?[]Extent {
+    if (builtin.os.tag != .linux) return null;
+    if (size < SPARSE_MIN) return null;
+    var list = std.ArrayList(Extent).init(allocator);
+    defer list.deinit();
+    var pos: u64 = 0;
+    while (pos < size) {
+        const data = (seekExtent(f, pos, SEEK_DATA) catch return null) orelse break;
+        if (data >= size) break;
+        const hole = (seekExtent(f, data, SEEK_HOLE) catch return null) orelse size;
+        const end = @min(hole, size);
+        if (end <= data) return null;
+        if (list.items.len == MAX_SPARSE_EXTENTS) return null;
+        try list.append(.{ .offset = data, .len = end - data });
+        pos = end;
+    }
+    if (list.items.len == 1 and list.items[0].offset == 0 and list.items[0].len == size) return null;
+    return try list.toOwnedSlice();
+}
+
+// Stored bytes of a sparse file: each extent pread into buf and written out.
+fn writeExtents(out: *V2Writer, src: fs.File, extents: []const Extent, buf: []u8) !u32 {
+    var crc = std.hash.Crc32.init();
+    for (extents) |e| {
+        var done: u64 = 0;
+        while (done < e.len) {
+            const chunk: usize = @intCast(@min(e.len - done, buf.len));
+            const n = try src.pread(buf[0..chunk], e.offset + done);
+            // the header already promised these bytes; a file that shrank can't be patched up here
+            if (n == 0) return KhrError.ArchiveCreationFailed;
+            try out.put(buf[0..n]);
+            crc.update(buf[0..n]);
+            done += n;
+        }
+    }
+    return crc.final();
 }
 
-fn extractKhrBackupStreaming(allocator: Allocator, file: fs.File, data_start: u64, payload_len: u64, extract_to: String, expected_checksum: [32]u8) !void {
-    const V2_MAGIC = "KHRV2\n";
-    try file.seekTo(data_start);
+const SolidMember = struct {
+    path: []const u8, // borrowed from the source list when writing, owned by the record when reading
+    mode: u64,
+    mtime: i64,
+    size: FileSize,
+};
 
-    var remaining = payload_len;
-    if (remaining < V2_MAGIC.len) return KhrError.ArchiveFormatFailed;
+// Small files waiting to go out together as one tag 5 record.
+const SolidBlock = struct {
+    members: std.ArrayList(SolidMember),
+    data: std.ArrayList(u8),
 
-    var hdrbuf: [6]u8 = undefined;
-    _ = try file.readAll(&hdrbuf);
-    if (!std.mem.eql(u8, &hdrbuf, V2_MAGIC)) return KhrError.ArchiveFormatFailed;
-    remaining -= V2_MAGIC.len;
+    fn init(allocator: Allocator) SolidBlock {
+        return .{
+            .members = std.ArrayList(SolidMember).init(allocator),
+            .data = std.ArrayList(u8).init(allocator),
+        };
+    }
 
-    var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-    hasher.update(V2_MAGIC);
-
-    var b4: [4]u8 = undefined;
-    var b8: [8]u8 = undefined;
-    var tagbuf: [1]u8 = undefined;
-    var tmp: [64 * 1024]u8 = undefined;
-
-    while (remaining > 0) {
-        if (remaining < 1) break;
-        _ = try file.readAll(&tagbuf);
-        hasher.update(&tagbuf);
-        remaining -= 1;
-        const tag = tagbuf[0];
+    fn deinit(self: *SolidBlock) void {
+        self.members.deinit();
+        self.data.deinit();
+    }
 
-        _ = try file.readAll(&b4);
-        hasher.update(&b4);
-        remaining -= b4.len;
-        const path_len = std.mem.readInt(u32, &b4, .little);
-
-        if (remaining < path_len) return KhrError.ArchiveFormatFailed;
-        const path_slice = try allocator.alloc(u8, path_len);
-        defer allocator.free(path_slice);
-        _ = try file.readAll(path_slice);
-        hasher.update(path_slice);
-        remaining -= path_len;
-
-        _ = try file.readAll(&b8);
-        hasher.update(&b8);
-        remaining -= b8.len;
-        const mode_val_u64 = std.mem.readInt(u64, &b8, .little);
-
-        _ = try file.readAll(&b8);
-        hasher.update(&b8);
-        remaining -= b8.len;
-        const _mtime = std.mem.readInt(i64, &b8, .little);
-        _ = _mtime; // Read for format compliance but not used during extraction
-
-        if (tag == 1) {
-            _ = try file.readAll(&b8);
-            hasher.update(&b8);
-            remaining -= b8.len;
-            var size = std.mem.readInt(FileSize, &b8, .little);
-
-            const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, path_slice });
-            defer allocator.free(full_path);
-            if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-            const out = try std.fs.cwd().createFile(full_path, .{});
-            defer out.close();
-
-            while (size > 0) {
-                const chunk: usize = @intCast(@min(size, tmp.len));
-                const n = try file.read(tmp[0..chunk]);
-                if (n == 0) return KhrError.ArchiveFormatFailed;
-                try out.writeAll(tmp[0..n]);
-                hasher.update(tmp[0..n]);
-                size -= n;
-                remaining -= n;
-            }
-            if (builtin.os.tag == .linux) {
-                const perm: u32 = @intCast(mode_val_u64 & 0o7777);
-                posix.fchmod(out.handle, perm) catch {};
-            }
-        } else if (tag == 2) {
-            // symlink: read target len and target (allow absolute or relative targets)
-            _ = try file.readAll(&b4);
-            hasher.update(&b4);
-            remaining -= b4.len;
-            const target_len = std.mem.readInt(u32, &b4, .little);
-            if (remaining < target_len) return KhrError.ArchiveFormatFailed;
-            const target = try allocator.alloc(u8, target_len);
-            defer allocator.free(target);
-            _ = try file.readAll(target);
-            hasher.update(target);
-            remaining -= target_len;
-
-            // create symlink(remember this means symbolic link)
-            const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, path_slice });
-            defer allocator.free(full_path);
-            if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-            const c_link = allocator.allocSentinel(u8, full_path.len, 0) catch continue;
-            defer allocator.free(c_link);
-            std.mem.copyForwards(u8, c_link, full_path);
-            const c_target = allocator.allocSentinel(u8, target.len, 0) catch continue;
-            defer allocator.free(c_target);
-            std.mem.copyForwards(u8, c_target, target);
-            posix.symlinkZ(c_target.ptr, c_link.ptr) catch {};
-        } else {
-            return KhrError.ArchiveFormatFailed;
+    fn full(self: *const SolidBlock) bool {
+        return self.data.items.len >= SOLID_BLOCK_SIZE or self.members.items.len >= MAX_SOLID_MEMBERS;
+    }
+
+    fn add(self: *SolidBlock, path: String, meta: FileMeta, src: BodySource.Reader) !void {
+        const start = self.data.items.len;
+        try self.data.resize(start + @as(usize, @intCast(meta.size)));
+        // a file that shrank since the stat goes in at the size it actually had
+        const n = try src.readAll(self.data.items[start..]);
+        self.data.shrinkRetainingCapacity(start + n);
+        try self.members.append(.{ .path = path, .mode = @intCast(meta.mode), .mtime = @intCast(meta.mtime), .size = n });
+    }
+
+    fn flush(self: *SolidBlock, out: *V2Writer, index: *khr_index.IndexBuilder) !void {
+        if (self.members.items.len == 0) return;
+        try out.put(&[_]u8{TAG_SOLID});
+        try out.putInt(u32, @intCast(self.members.items.len));
+        for (self.members.items) |m| {
+            try out.putInt(u32, @intCast(m.path.len));
+            try out.put(m.path);
+            try out.putInt(u64, m.mode);
+            try out.putInt(i64, m.mtime);
+            try out.putInt(FileSize, m.size);
+        }
+        var at: usize = 0;
+        for (self.members.items) |m| {
+            const body = self.data.items[at..][0..@intCast(m.size)];
+            try index.add(.{
+                .tag = TAG_FILE,
+                .path = m.path,
+                .mode = m.mode,
+                .mtime = m.mtime,
+                .size = m.size,
+                .offset = out.written,
+                .crc32 = std.hash.Crc32.hash(body),
+            });
+            try out.put(body);
+            at += body.len;
         }
+        self.members.clearRetainingCapacity();
+        self.data.clearRetainingCapacity();
     }
+};
 
-    var checksum: [32]u8 = undefined;
-    hasher.final(&checksum);
-    if (!std.mem.eql(u8, &checksum, &expected_checksum)) return KhrError.ChecksumMismatch;
+// Input order for a v2 archive: by extension, then directory, then name, so
+// files with similar contents end up next to each other in the stream.
+fn solidOrderLessThan(_: void, a: String, b: String) bool {
+    switch (std.mem.order(u8, fs.path.extension(a), fs.path.extension(b))) {
+        .lt => return true,
+        .gt => return false,
+        .eq => {},
+    }
+    switch (std.mem.order(u8, fs.path.dirname(a) orelse "", fs.path.dirname(b) orelse "")) {
+        .lt => return true,
+        .gt => return false,
+        .eq => {},
+    }
+    return std.mem.lessThan(u8, fs.path.basename(a), fs.path.basename(b));
 }
 
-pub fn createKhrBackup(
-    allocator: Allocator,
-    source_paths: []const String,
-    output_path: String,
-    password: ?String,
-    compression: CompressionType,
-    progress_cb: ?SaveProgressCallback,
-) !void {
-    // Fast path: streaming archive with no compression/encryption (version 2)
-    if (password == null and compression == .none) {
-        try createKhrBackupStreaming(allocator, source_paths, output_path, progress_cb);
-        return;
-    }
-    // Streaming gzip path (version 2, no encryption)
-    if (password == null and compression == .gzip) {
-        try KhrHeader.createKhrBackupStreamingGzip(allocator, source_paths, output_path, progress_cb);
-        return;
+const V2Record = struct {
+    tag: u8,
+    path: []u8,
+    mode: u64,
+    mtime: i64,
+    start: u64, // position of the tag byte in the decoded stream
+    size: FileSize = 0, // files: body length, the body follows in the stream
+    codec: ?CompressionType = null, // files: per-entry codec, null = header.compression
+    target: ?[]u8 = null, // symlinks and hard links
+    // solid blocks: path is empty, size covers every member's body
+    members: ?[]SolidMember = null,
+    // sparse files: size is the logical length, the body is just these
+    extents: ?[]Extent = null,
+
+    // Bytes of body that follow the record header in the stream.
+    fn bodyLen(self: V2Record) FileSize {
+        const list = self.extents orelse return self.size;
+        var n: FileSize = 0;
+        for (list) |e| n += e.len;
+        return n;
     }
-    print("Creating .khr backup: {s}\n", .{output_path});
 
-    // Step 1: Create simple archive blob (length-prefixed file data)
-    const tar_data = try createTarArchive(allocator, source_paths);
-    defer allocator.free(tar_data);
+    fn deinit(self: V2Record, allocator: Allocator) void {
+        allocator.free(self.path);
+        if (self.target) |t| allocator.free(t);
+        if (self.extents) |list| allocator.free(list);
+        if (self.members) |list| {
+            for (list) |m| allocator.free(m.path);
+            allocator.free(list);
+        }
+    }
+};
 
-    print("Created archive blob: {d} bytes\n", .{tar_data.len});
+// Read side of the V2 stream: keeps the checksum in step with every byte consumed.
+const V2Reader = struct {
+    source: std.io.AnyReader,
+    // set when the payload is plain file bytes, so big bodies can skip userspace
+    raw: ?*khr_codec.PayloadReader,
+    // flat unless set up by checkAgainst
+    algorithm: HashAlgo,
+    hash: merkle.StreamHash,
+    // KHRONO01 streams without leaves to go by: a flat SHA-256 alongside the tree, see checkAgainst
+    legacy_flat: ?merkle.Hasher = null,
+    // set when the checksum is keyed (checksumFor)
+    checksum_key: ?*const streaming_crypto.ChunkCipher = null,
+    consumed: u64 = 0, // position in the decoded stream
+    // crc32 of the last body read; only kept when something will check it against the TOC
+    check_crc: bool = false,
+    body_crc: std.hash.Crc32 = std.hash.Crc32.init(),
+    // v3 stream: files are tag 4 and their bodies are chunk lists (readChunkedBody)
+    chunked: bool = false,
+
+    fn init(payload: *khr_codec.PayloadReader, algorithm: HashAlgo) V2Reader {
+        return .{
+            .source = payload.any(),
+            .raw = if (payload.isRaw()) payload else null,
+            .algorithm = algorithm,
+            .hash = merkle.StreamHash.initFlat(algorithm),
+        };
+    }
 
-    // Step 2: Compress if requested
-    var compressed_data: ?[]u8 = null;
-    var final_data = tar_data;
-    var final_size = tar_data.len;
-    var effective_compression = compression;
+    fn deinit(self: *V2Reader) void {
+        self.hash.deinit();
+    }
 
-    if (compression != .none) {
-        compressed_data = try compressData(allocator, tar_data, compression);
-        defer allocator.free(compressed_data.?);
-        final_data = compressed_data.?;
-        final_size = compressed_data.?.len;
-        print("Compressed to: {d} bytes\n", .{final_size});
-        // If unsupported algos fell back to gzip in compressData, reflect that in header
-        if (compression == .lz4 or compression == .zstd) {
-            effective_compression = .gzip;
+    // Set up hashing for header.checksum, before the first read. tree is
+    // the TOC's leaves (trustedTree), checked block by block as they
+    // complete. Without one it's down to the header: a KHRONO03 header says
+    // what its checksum is; a KHRONO01 one may hold a Merkle root or, from
+    // before the tree, a flat SHA-256, so both are kept and either will do.
+    // An appended archive's segments are only listed in the TOC, so without
+    // it there's no checking it. cipher is the archive's, for keyed checksums.
+    fn checkAgainst(self: *V2Reader, allocator: Allocator, header: *const KhrHeader, cipher: ?*const streaming_crypto.ChunkCipher, tree: ?merkle.Tree) !void {
+        if (header.checksum_keyed) self.checksum_key = cipher orelse return KhrError.DecryptionFailed;
+        if (tree) |t| return self.expectTree(allocator, t);
+        const kind = header.checksum_kind orelse {
+            self.hashAsTree(allocator);
+            if (header.hash == .sha256) self.legacy_flat = merkle.Hasher.init(.sha256);
+            return;
+        };
+        switch (kind) {
+            .tree => self.hashAsTree(allocator),
+            .segments => {
+                print("Appended archive without a readable TOC: its checksum can't be checked\n", .{});
+                return KhrError.ArchiveFormatFailed;
+            },
         }
     }
 
-    // Step 3: Encrypt if password provided
-    var encryption_info: ?EncryptionInfo = null;
-    if (password != null) {
-        const enc_res = try encryptData(allocator, final_data, password.?);
-        defer allocator.free(enc_res.data);
-        encryption_info = enc_res.info;
-        final_data = enc_res.data;
-        final_size = enc_res.data.len;
-        print("Encrypted to: {d} bytes\n", .{final_size});
+    // Hash as a Merkle tree and check each block against its leaf as it
+    // completes. Only before the first read; the tree must outlive the reader.
+    fn expectTree(self: *V2Reader, allocator: Allocator, tree: merkle.Tree) void {
+        std.debug.assert(self.consumed == 0);
+        self.hash = merkle.StreamHash.initTree(allocator, self.algorithm, tree);
     }
 
-    // Step 4: Create header
-    var checksum: [32]u8 = undefined;
-    var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-    hasher.update(final_data);
-    hasher.final(&checksum);
-
-    var header = KhrHeader{
-        .compression = effective_compression,
-        .tar_size = @intCast(final_size), // total payload size actually stored after comp/encrypt
-        .checksum = checksum,
-        .encryption = EncryptionInfo{
-            .algorithm = .chacha20_poly1305,
-            .kdf = .argon2id,
-            .salt = [_]u8{0} ** 32,
-            .nonce = [_]u8{0} ** 12,
-            .opslimit = 0,
-            .memlimit = 0,
-        },
-    };
+    // Hash as a Merkle tree with no leaves to check against, for streams
+    // whose root only turns up after the payload (pipe_stream.Trailer).
+    fn hashAsTree(self: *V2Reader, allocator: Allocator) void {
+        std.debug.assert(self.consumed == 0);
+        self.hash = merkle.StreamHash.initTree(allocator, self.algorithm, null);
+    }
 
-    if (encryption_info) |info| {
-        header.encryption = info;
+    // A block that doesn't match its leaf fails here, not at the end of the stream.
+    fn absorb(self: *V2Reader, bytes: []const u8) !void {
+        self.hash.update(bytes) catch |err| {
+            return if (err == merkle.MerkleError.BlockHashMismatch) KhrError.ChecksumMismatch else err;
+        };
+        if (self.legacy_flat) |*h| h.update(bytes);
     }
 
-    // Step 5: Write file
-    const file = try fs.cwd().createFile(output_path, .{});
-    defer file.close();
+    fn readExact(self: *V2Reader, buf: []u8) !void {
+        const n = self.source.readAll(buf) catch return KhrError.ArchiveFormatFailed;
+        if (n != buf.len) return KhrError.ArchiveFormatFailed;
+        try self.absorb(buf);
+        self.consumed += n;
+    }
 
-    try header.write(file.writer());
-    try file.writeAll(final_data);
+    fn readInt(self: *V2Reader, comptime T: type) !T {
+        var buf: [@sizeOf(T)]u8 = undefined;
+        try self.readExact(&buf);
+        return std.mem.readInt(T, &buf, .little);
+    }
 
-    print("KHR backup created successfully: {s}\n", .{output_path});
-}
+    fn readMagic(self: *V2Reader, comptime magic: []const u8) !void {
+        var buf: [magic.len]u8 = undefined;
+        try self.readExact(&buf);
+        if (!std.mem.eql(u8, &buf, magic)) return KhrError.ArchiveFormatFailed;
+    }
 
-pub fn extractKhrBackup(
-    allocator: Allocator,
-    khr_path: String,
-    password: ?String,
-    extract_to: String,
-) !void {
-    print("Extracting .khr backup: {s}\n", .{khr_path});
+    // Next record header, or null at a clean end of stream. For files the
+    // caller has to consume the body (readBody) before asking for the next one.
+    fn next(self: *V2Reader, allocator: Allocator) !?V2Record {
+        const start = self.consumed;
+        var tagbuf: [1]u8 = undefined;
+        const got = self.source.readAll(&tagbuf) catch return KhrError.ArchiveFormatFailed;
+        if (got == 0) return null;
+        try self.absorb(&tagbuf);
+        self.consumed += 1;
+        const tag = tagbuf[0];
+        const known = if (self.chunked)
+            tag == TAG_CHUNKED_FILE or tag == TAG_SYMLINK or tag == TAG_HARDLINK
+        else
+            tag == TAG_FILE or tag == TAG_SYMLINK or tag == TAG_FILE_CODED or tag == TAG_SOLID or tag == TAG_SPARSE or tag == TAG_HARDLINK or tag == TAG_PART;
+        if (!known) return KhrError.ArchiveFormatFailed;
+        if (tag == TAG_SOLID) return try self.readSolid(allocator, start);
+
+        const path_len = try self.readInt(u32);
+        if (path_len > MAX_RECORD_PATH) return KhrError.ArchiveFormatFailed;
+        const path = try allocator.alloc(u8, path_len);
+        errdefer allocator.free(path);
+        try self.readExact(path);
+        const mode = try self.readInt(u64);
+        const mtime = try self.readInt(i64);
+
+        var record = V2Record{ .tag = tag, .path = path, .mode = mode, .mtime = mtime, .start = start };
+        if (tag == TAG_FILE_CODED) {
+            const codec = try self.readInt(u8);
+            record.codec = std.meta.intToEnum(CompressionType, codec) catch return KhrError.ArchiveFormatFailed;
+            record.tag = TAG_FILE;
+        }
+        if (record.tag == TAG_FILE or record.tag == TAG_CHUNKED_FILE) {
+            record.size = try self.readInt(FileSize);
+        } else if (record.tag == TAG_SPARSE or record.tag == TAG_PART) {
+            record.size = try self.readInt(FileSize);
+            record.extents = try self.readExtents(allocator, record.size);
+        } else {
+            const target_len = try self.readInt(u32);
+            if (target_len > MAX_RECORD_PATH) return KhrError.ArchiveFormatFailed;
+            const target = try allocator.alloc(u8, target_len);
+            errdefer allocator.free(target);
+            try self.readExact(target);
+            record.target = target;
+        }
+        return record;
+    }
 
-    const file = try fs.cwd().openFile(khr_path, .{});
-    defer file.close();
+    // Extent list of a sparse file: ascending, non-overlapping and inside size.
+    fn readExtents(self: *V2Reader, allocator: Allocator, size: FileSize) ![]Extent {
+        const count = try self.readInt(u32);
+        if (count > MAX_SPARSE_EXTENTS) return KhrError.ArchiveFormatFailed;
+        const extents = try allocator.alloc(Extent, count);
+        errdefer allocator.free(extents);
+        var end: u64 = 0;
+        for (extents) |*e| {
+            e.offset = try self.readInt(u64);
+            e.len = try self.readInt(u64);
+            if (e.offset < end or e.len > size or e.offset > size - e.len) return KhrError.ArchiveFormatFailed;
+            end = e.offset + e.len;
+        }
+        return extents;
+    }
 
-    // Step 1: Read header
-    const header = try KhrHeader.read(file.reader());
-    print("KHR version: {d}, compression: {s}, tar size: {d}\n", .{ header.version, @tagName(header.compression), header.tar_size });
+    // Member list of a solid block; the bodies follow, to be read with readBody one by one.
+    fn readSolid(self: *V2Reader, allocator: Allocator, start: u64) !V2Record {
+        const count = try self.readInt(u32);
+        if (count > MAX_SOLID_MEMBERS) return KhrError.ArchiveFormatFailed;
+        const members = try allocator.alloc(SolidMember, count);
+        var filled: usize = 0;
+        errdefer {
+            for (members[0..filled]) |m| allocator.free(m.path);
+            allocator.free(members);
+        }
+        var total: FileSize = 0;
+        for (members) |*m| {
+            const path_len = try self.readInt(u32);
+            if (path_len > MAX_RECORD_PATH) return KhrError.ArchiveFormatFailed;
+            const path = try allocator.alloc(u8, path_len);
+            errdefer allocator.free(path);
+            try self.readExact(path);
+            const mode = try self.readInt(u64);
+            const mtime = try self.readInt(i64);
+            const size = try self.readInt(FileSize);
+            if (size > SOLID_FILE_MAX) return KhrError.ArchiveFormatFailed;
+            m.* = .{ .path = path, .mode = mode, .mtime = mtime, .size = size };
+            filled += 1;
+            total += size;
+        }
+        return V2Record{
+            .tag = TAG_SOLID,
+            .path = try allocator.alloc(u8, 0),
+            .mode = 0,
+            .mtime = 0,
+            .start = start,
+            .size = total,
+            .members = members,
+        };
+    }
 
-    // Streaming extract for v2 (no compression/encryption)
-    const data_start_pos = try file.getPos();
-    if (header.version == 2) {
-        const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
-        if (header.compression == .none and !is_encrypted) {
-            try extractKhrBackupStreaming(allocator, file, data_start_pos, header.tar_size, extract_to, header.checksum);
-            print("KHR backup extracted successfully to: {s}\n", .{extract_to});
-            return;
+    // Consume a file body, copying it to out when given.
+    fn readBody(self: *V2Reader, size: FileSize, out: ?fs.File) !void {
+        if (self.check_crc) self.body_crc = std.hash.Crc32.init();
+        if (out) |f| {
+            if (self.raw) |payload| {
+                if (size >= khr_codec.ZERO_COPY_MIN) return self.copyBody(payload, size, f);
+            }
         }
-        if (header.compression == .gzip and !is_encrypted) {
-            try KhrHeader.extractKhrBackupStreamingGzip(allocator, file, data_start_pos, header.tar_size, extract_to, header.checksum);
-            print("KHR backup extracted successfully to: {s}\n", .{extract_to});
-            return;
+        if (self.raw) |payload| {
+            // mapped archive: write and hash the body in place
+            if (payload.takeMapped(size)) |bytes| {
+                if (bytes.len != size) return KhrError.ArchiveFormatFailed;
+                if (out) |f| try f.writeAll(bytes);
+                try self.absorb(bytes);
+                if (self.check_crc) self.body_crc.update(bytes);
+                self.consumed += size;
+                return;
+            }
+        }
+        var tmp: [64 * 1024]u8 = undefined;
+        var left = size;
+        while (left > 0) {
+            const chunk: usize = @intCast(@min(left, tmp.len));
+            const n = self.source.read(tmp[0..chunk]) catch return KhrError.ArchiveFormatFailed;
+            if (n == 0) return KhrError.ArchiveFormatFailed;
+            if (out) |f| try f.writeAll(tmp[0..n]);
+            try self.absorb(tmp[0..n]);
+            if (self.check_crc) self.body_crc.update(tmp[0..n]);
+            self.consumed += n;
+            left -= n;
         }
     }
 
-    // Step 2: Read encrypted/compressed data (v1 or non-streamable)
-    const encrypted_data = try allocator.alloc(u8, header.tar_size);
-    defer allocator.free(encrypted_data);
-    _ = try file.readAll(encrypted_data);
+    // Raw payloads: the body goes archive-to-file in the kernel and the
+    // checksum pass reads the archive range back, which the copy has just
+    // pulled into the page cache.
+    fn copyBody(self: *V2Reader, payload: *khr_codec.PayloadReader, size: FileSize, out: fs.File) !void {
+        const at = try out.getPos();
+        const src_offset = payload.copyRaw(out, at, size) catch |err| {
+            return if (err == error.UnexpectedEndOfPayload) KhrError.ArchiveFormatFailed else err;
+        };
+        try out.seekTo(at + size);
 
-    // Step 3: Verify checksum
-    var checksum: [32]u8 = undefined;
-    var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-    hasher.update(encrypted_data);
-    hasher.final(&checksum);
+        if (payload.mappedAt(src_offset, size)) |bytes| {
+            try self.absorb(bytes);
+            if (self.check_crc) self.body_crc.update(bytes);
+            self.consumed += size;
+            return;
+        }
+        var tmp: [64 * 1024]u8 = undefined;
+        var done: u64 = 0;
+        while (done < size) {
+            const chunk: usize = @intCast(@min(size - done, tmp.len));
+            const n = try payload.file.pread(tmp[0..chunk], src_offset + done);
+            if (n == 0) return KhrError.ArchiveFormatFailed;
+            try self.absorb(tmp[0..n]);
+            if (self.check_crc) self.body_crc.update(tmp[0..n]);
+            done += n;
+        }
+        self.consumed += size;
+    }
 
-    if (!std.mem.eql(u8, &checksum, &header.checksum)) {
+    fn verify(self: *V2Reader, expected: [32]u8) !void {
+        const root = self.hash.final() catch |err| {
+            return if (err == merkle.MerkleError.BlockHashMismatch) KhrError.ChecksumMismatch else err;
+        };
+        const checksum = if (self.checksum_key) |c| c.keyedDigest(root) else root;
+        if (std.mem.eql(u8, &checksum, &expected)) return;
+        if (self.legacy_flat) |*h| {
+            if (std.mem.eql(u8, &h.final(), &expected)) return;
+        }
         return KhrError.ChecksumMismatch;
     }
+};
 
-    // Step 4: Decrypt if needed
-    var decrypted_data = encrypted_data;
-    var needs_free = false;
-
-    const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
-    if (is_encrypted) {
-        if (password == null) return KhrError.DecryptionFailed;
-        decrypted_data = try decryptData(allocator, encrypted_data, &header.encryption, password.?);
-        needs_free = true;
-        defer if (needs_free) allocator.free(decrypted_data);
-        print("Decrypted: {d} bytes\n", .{decrypted_data.len});
+// Strip leading '/' and refuse empty, "." and ".." segments so nothing can
+// land outside extract_to. What's left is a slice of p.
+fn relativePath(p: String) !String {
+    var start: usize = 0;
+    while (start < p.len and p[start] == '/') start += 1;
+    const rel = p[start..];
+    if (rel.len == 0) return KhrError.ArchiveFormatFailed;
+    var it = std.mem.splitScalar(u8, rel, '/');
+    while (it.next()) |seg| {
+        if (seg.len == 0 or std.mem.eql(u8, seg, ".") or std.mem.eql(u8, seg, "..")) {
+            return KhrError.ArchiveFormatFailed;
+        }
     }
+    return rel;
+}
 
-    // Step 5: Decompress if needed
-    var decompressed_data = decrypted_data;
-    var needs_free_decomp = false;
+// Where a restore writes: extract_to, with the directories under it kept
+// open (dir_cache) so entries are created relative to their parent.
+const Destination = struct {
+    path: String, // extract_to
+    dirs: dir_cache.DirCache,
 
-    if (header.compression != .none) {
-        decompressed_data = try decompressData(allocator, decrypted_data, header.compression);
-        needs_free_decomp = true;
-        defer if (needs_free_decomp) allocator.free(decompressed_data);
-        print("Decompressed: {d} bytes\n", .{decompressed_data.len});
+    fn init(allocator: Allocator, extract_to: String) !Destination {
+        return .{ .path = extract_to, .dirs = try dir_cache.DirCache.init(allocator, extract_to) };
     }
 
-    // Step 6: Extract archive
-    try extractTarArchive(allocator, decompressed_data, extract_to);
+    fn deinit(self: *Destination) void {
+        self.dirs.deinit();
+    }
+};
 
-    print("KHR backup extracted successfully to: {s}\n", .{extract_to});
+// An archive path's place under the destination: the directory it goes in
+// (created if need be) and its name there. dir is only good until the next
+// lookup.
+const Target = struct {
+    dir: fs.Dir,
+    name: String,
+};
+
+fn restoreTarget(dest: *Destination, path: String) !Target {
+    const rel = try relativePath(path);
+    print("Extracting: {s}\n", .{rel});
+    return .{ .dir = try dest.dirs.open(fs.path.dirname(rel) orelse ""), .name = fs.path.basename(rel) };
 }
 
-pub const EntryMeta = struct {
-    path: []u8,
+// Recreate one record under dest, consuming its body from the stream.
+fn restoreRecord(v2: *V2Reader, record: V2Record, dest: *Destination) !void {
+    if (record.tag == TAG_SOLID) return restoreSolid(v2, record, dest, null);
+    const t = try restoreTarget(dest, record.path);
+
+    if (record.tag == TAG_FILE) {
+        const out = try dir_cache.createFile(t.dir, t.name, true);
+        defer out.close();
+        try v2.readBody(record.size, out);
+        dir_cache.restoreMode(out, record.mode);
+    } else if (record.tag == TAG_SPARSE or record.tag == TAG_PART) {
+        // the length first, so everything the extents don't cover is a hole;
+        // a part leaves the rest of the file to the other volumes
+        const out = try dir_cache.createFile(t.dir, t.name, record.tag == TAG_SPARSE);
+        defer out.close();
+        try out.setEndPos(record.size);
+        for (record.extents.?) |e| {
+            try out.seekTo(e.offset);
+            try v2.readBody(e.len, out);
+        }
+        dir_cache.restoreMode(out, record.mode);
+    } else if (record.tag == TAG_HARDLINK) {
+        if (!try restoreHardlink(dest, t, record.target.?)) {
+            print("Skipping {s}: {s}, which it links to, wasn't restored\n", .{ record.path, record.target.? });
+        }
+    } else {
+        // symlink targets may be absolute or relative, we recreate them as-is
+        posix.symlinkat(record.target.?, t.dir.fd, t.name) catch {};
+    }
+}
+
+// Make t another name for target, an archive path restored under dest.
+// False when target isn't there; a filesystem that can't link gets a copy
+// instead. target is found from the root rather than through the cache, so
+// t.dir stays open, and without following symlinks: one the archive restored
+// earlier must not take the link (or the copy) outside dest.
+fn restoreHardlink(dest: *Destination, t: Target, target: String) !bool {
+    const target_rel = try relativePath(target);
+    const root = dest.dirs.root;
+    var parent = dir_cache.openBeneath(root, fs.path.dirname(target_rel) orelse "") catch |err| switch (err) {
+        error.FileNotFound => return false,
+        else => return err,
+    };
+    defer if (parent.fd != root.fd) parent.close();
+    const name = fs.path.basename(target_rel);
+    _ = posix.fstatat(parent.fd, name, posix.AT.SYMLINK_NOFOLLOW) catch |err| switch (err) {
+        error.FileNotFound => return false,
+        else => return err,
+    };
+    // linkat won't replace a name that's taken, so whatever is there goes
+    // first; that's only done once the target is known to exist
+    t.dir.deleteFile(t.name) catch {};
+    // flags 0: a symlink as target is linked itself, never what it points at
+    posix.linkat(parent.fd, name, t.dir.fd, t.name, 0) catch |err| {
+        if (err == error.FileNotFound) return false;
+        copyNoFollow(parent, name, t) catch return err;
+    };
+    return true;
+}
+
+fn copyNoFollow(parent: fs.Dir, name: String, t: Target) !void {
+    const fd = try posix.openat(parent.fd, name, .{ .NOFOLLOW = true, .CLOEXEC = true }, 0);
+    const src = fs.File{ .handle = fd };
+    defer src.close();
+    const st = try src.stat();
+    if (st.kind != .file) return KhrError.ArchiveFormatFailed;
+    const out = try dir_cache.createFile(t.dir, t.name, true);
+    defer out.close();
+    try out.writeFileAll(src, .{});
+    dir_cache.restoreMode(out, st.mode);
+}
+
+// The members of a solid block, in order; with selected, the others are read past.
+fn restoreSolid(v2: *V2Reader, record: V2Record, dest: *Destination, selected: ?[]const String) !void {
+    for (record.members.?) |m| {
+        if (selected) |list| {
+            if (!isSelected(m.path, list)) {
+                try v2.readBody(m.size, null);
+                continue;
+            }
+        }
+        const t = try restoreTarget(dest, m.path);
+        const out = try dir_cache.createFile(t.dir, t.name, true);
+        defer out.close();
+        try v2.readBody(m.size, out);
+        dir_cache.restoreMode(out, m.mode);
+    }
+}
+
+// ---- V3 chunked archives ----
+//
+// Same container as v2 (header, codec, optional sealing, TOC footer), but file
+// bodies are cut into content-defined chunks (chunker.zig) and each distinct
+// chunk is stored once. A chunk seen before - earlier in this archive or in an
+// archive this one builds on - becomes a reference. Decoded payload:
+//   "KHRV3\n" magic
+//   ancestor_count: u32       archives references may point into, nearest first
+//     id: [32]u8              that archive's header checksum
+//     path_len: u32, path     where it was when this archive was written
+//   Repeated entries:
+//     tag 2 (symlink), tag 7 (hard link): as in v2
+//     tag 4 (chunked file): path_len, path, mode, mtime as in v2, then
+//         size: u64
+//         chunks until their lengths add up to size:
+//           kind: u8          0 = stored here, 1 = reference
+//           digest: [32]u8    SHA-256 of the chunk bytes
+//           len: u32
+//           data: [len]u8     kind 0 only
+// Every archive's TOC lists the chunks it stores (khr_index FLAG_CHUNKS), so
+// resolving references only costs reading the ancestors' footers. Restoring
+// needs the whole chain: a missing or replaced ancestor is an error, never a
+// partial restore. Ancestor paths are tried as recorded and then next to the
+// archive naming them, so a chain can be moved as one directory.
+
+const V3_MAGIC = "KHRV3\n";
+const TAG_CHUNKED_FILE: u8 = 4;
+const CHUNK_STORED: u8 = 0;
+const CHUNK_REF: u8 = 1;
+// a corrupt ancestor count shouldn't turn into thousands of open() calls
+const MAX_ANCESTORS: u32 = 4096;
+
+const Ancestor = struct {
+    id: [32]u8,
+    path: []u8,
+};
+
+fn freeAncestors(allocator: Allocator, list: []Ancestor) void {
+    for (list) |a| allocator.free(a.path);
+    allocator.free(list);
+}
+
+fn writeAncestors(out: *V2Writer, list: []const Ancestor) !void {
+    try out.putInt(u32, @intCast(list.len));
+    for (list) |a| {
+        try out.put(&a.id);
+        try out.putInt(u32, @intCast(a.path.len));
+        try out.put(a.path);
+    }
+}
+
+fn readAncestors(allocator: Allocator, v2: *V2Reader) ![]Ancestor {
+    const count = try v2.readInt(u32);
+    if (count > MAX_ANCESTORS) return KhrError.ArchiveFormatFailed;
+    var list = try std.ArrayList(Ancestor).initCapacity(allocator, count);
+    errdefer {
+        for (list.items) |a| allocator.free(a.path);
+        list.deinit();
+    }
+    for (0..count) |_| {
+        var id: [32]u8 = undefined;
+        try v2.readExact(&id);
+        const path_len = try v2.readInt(u32);
+        if (path_len > MAX_RECORD_PATH) return KhrError.ArchiveFormatFailed;
+        const path = try allocator.alloc(u8, path_len);
+        errdefer allocator.free(path);
+        try v2.readExact(path);
+        list.appendAssumeCapacity(.{ .id = id, .path = path });
+    }
+    return list.toOwnedSlice();
+}
+
+// One v3 archive that chunk references can point into.
+const ChunkSource = struct {
+    allocator: Allocator,
+    file: fs.File,
+    header: KhrHeader,
+    data_start: u64,
+    cipher: ?streaming_crypto.ChunkCipher,
+    index: khr_index.Index,
+    payload: ?*khr_codec.PayloadReader = null, // opened on first use, most of a long chain is never read
+
+    fn open(allocator: Allocator, path: String, password: ?String) !*ChunkSource {
+        const file = try fs.cwd().openFile(path, .{});
+        errdefer file.close();
+        const header = try KhrHeader.read(file.reader());
+        if (header.version != 3) return KhrError.UnsupportedVersion;
+        const data_start = try file.getPos();
+
+        const self = try allocator.create(ChunkSource);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .file = file,
+            .header = header,
+            .data_start = data_start,
+            .cipher = try archiveCipher(allocator, &header, password),
+            .index = undefined,
+        };
+        errdefer if (self.cipher) |*c| c.wipe();
+        // v3 writers always leave a TOC; without its chunk table there's nothing to resolve against
+        self.index = (try khr_index.readIndex(allocator, file, data_start + header.tar_size, self.cipherRef())) orelse return KhrError.ArchiveFormatFailed;
+        return self;
+    }
+
+    fn close(self: *ChunkSource) void {
+        if (self.payload) |p| p.close();
+        self.index.deinit();
+        if (self.cipher) |*c| c.wipe();
+        self.file.close();
+        self.allocator.destroy(self);
+    }
+
+    fn cipherRef(self: *const ChunkSource) ?*const streaming_crypto.ChunkCipher {
+        return if (self.cipher) |*c| c else null;
+    }
+
+    fn reader(self: *ChunkSource) !*khr_codec.PayloadReader {
+        if (self.payload == null) {
+            self.payload = try khr_codec.PayloadReader.open(self.allocator, self.file, self.data_start, self.header.tar_size, self.header.compression, self.cipherRef());
+        }
+        return self.payload.?;
+    }
+
+    fn readAncestorList(self: *ChunkSource, allocator: Allocator) ![]Ancestor {
+        const payload = try self.reader();
+        try payload.seekDecoded(0, self.index.frames);
+        var v2 = V2Reader.init(payload, self.header.hash);
+        defer v2.deinit();
+        try v2.readMagic(V3_MAGIC);
+        return readAncestors(allocator, &v2);
+    }
+};
+
+const ChunkLoc = struct {
+    source: u32, // index into ChunkResolver.sources
+    offset: u64,
+    len: u32,
+};
+
+// Digest -> where the chunk's bytes can be read back, over a set of opened archives.
+const ChunkResolver = struct {
+    allocator: Allocator,
+    sources: std.ArrayList(*ChunkSource),
+    map: std.AutoHashMap([32]u8, ChunkLoc),
+    scratch: []u8,
+
+    fn init(allocator: Allocator) !ChunkResolver {
+        return .{
+            .allocator = allocator,
+            .sources = std.ArrayList(*ChunkSource).init(allocator),
+            .map = std.AutoHashMap([32]u8, ChunkLoc).init(allocator),
+            .scratch = try allocator.alloc(u8, chunker.MAX_CHUNK),
+        };
+    }
+
+    fn deinit(self: *ChunkResolver) void {
+        for (self.sources.items) |s| s.close();
+        self.sources.deinit();
+        self.map.deinit();
+        self.allocator.free(self.scratch);
+    }
+
+    // Open path and take in its chunk table. expected_id catches a different
+    // archive sitting where an ancestor used to be. The first archive to list
+    // a digest is the one it's read from.
+    fn addArchive(self: *ChunkResolver, path: String, expected_id: ?[32]u8, password: ?String) !*ChunkSource {
+        const src = ChunkSource.open(self.allocator, path, password) catch |err| switch (err) {
+            error.FileNotFound => return if (expected_id != null) KhrError.ParentArchiveMissing else err,
+            else => return err,
+        };
+        errdefer src.close();
+        if (expected_id) |id| {
+            if (!std.mem.eql(u8, &id, &src.header.checksum)) return KhrError.ParentArchiveMismatch;
+        }
+
+        const source: u32 = @intCast(self.sources.items.len);
+        try self.map.ensureUnusedCapacity(@intCast(src.index.chunks.len));
+        for (src.index.chunks) |c| {
+            const gop = self.map.getOrPutAssumeCapacity(c.digest);
+            if (!gop.found_existing) gop.value_ptr.* = .{ .source = source, .offset = c.offset, .len = c.len };
+        }
+        try self.sources.append(src);
+        return src;
+    }
+
+    // Open every recorded ancestor, resolving paths against base_dir when they
+    // moved. Returns the list with the paths that actually worked.
+    fn addAncestors(self: *ChunkResolver, base_dir: String, recorded: []const Ancestor, password: ?String) ![]Ancestor {
+        var list = std.ArrayList(Ancestor).init(self.allocator);
+        errdefer {
+            for (list.items) |a| self.allocator.free(a.path);
+            list.deinit();
+        }
+        for (recorded) |a| {
+            const path = try resolveAncestorPath(self.allocator, base_dir, a.path);
+            defer self.allocator.free(path);
+            _ = try self.addArchive(path, a.id, password);
+            const abs = try fs.cwd().realpathAlloc(self.allocator, path);
+            errdefer self.allocator.free(abs);
+            try list.append(.{ .id = a.id, .path = abs });
+        }
+        return list.toOwnedSlice();
+    }
+
+    fn contains(self: *const ChunkResolver, digest: [32]u8) bool {
+        return self.map.contains(digest);
+    }
+
+    // Write a referenced chunk to out, after checking it still hashes to digest.
+    fn copyChunk(self: *ChunkResolver, digest: [32]u8, len: u32, out: fs.File) !void {
+        const loc = self.map.get(digest) orelse return KhrError.ArchiveFormatFailed;
+        if (loc.len != len or len > self.scratch.len) return KhrError.ArchiveFormatFailed;
+        const src = self.sources.items[loc.source];
+        const payload = try src.reader();
+        try payload.seekDecoded(loc.offset, src.index.frames);
+        const data = self.scratch[0..len];
+        payload.any().readNoEof(data) catch return KhrError.ArchiveFormatFailed;
+
+        var got: [32]u8 = undefined;
+        std.crypto.hash.sha2.Sha256.hash(data, &got, .{});
+        if (!std.mem.eql(u8, &got, &digest)) return KhrError.ChecksumMismatch;
+        try out.writeAll(data);
+    }
+};
+
+fn resolveAncestorPath(allocator: Allocator, base_dir: String, recorded: String) ![]u8 {
+    if (fs.cwd().access(recorded, .{})) |_| {
+        return allocator.dupe(u8, recorded);
+    } else |_| {
+        return fs.path.join(allocator, &.{ base_dir, fs.path.basename(recorded) });
+    }
+}
+
+// Write side of v3: knows every chunk the parent chain already holds plus the
+// ones stored so far in this archive.
+const ChunkWriter = struct {
+    allocator: Allocator,
+    resolver: ChunkResolver,
+    own: std.AutoHashMap([32]u8, void),
+    ancestors: []Ancestor,
+    stored_bytes: u64 = 0,
+    referenced_bytes: u64 = 0,
+
+    fn init(allocator: Allocator, parent: ?String, password: ?String) !ChunkWriter {
+        var resolver = try ChunkResolver.init(allocator);
+        errdefer resolver.deinit();
+        var ancestors: []Ancestor = &[_]Ancestor{};
+        if (parent) |p| {
+            const parent_abs = fs.cwd().realpathAlloc(allocator, p) catch return KhrError.ParentArchiveMissing;
+            defer allocator.free(parent_abs);
+            const parent_src = try resolver.addArchive(parent_abs, null, password);
+
+            // our chain is the parent followed by the parent's own chain
+            const inherited = try parent_src.readAncestorList(allocator);
+            defer freeAncestors(allocator, inherited);
+            const rest = try resolver.addAncestors(fs.path.dirname(parent_abs) orelse ".", inherited, password);
+            defer allocator.free(rest);
+            errdefer for (rest) |a| allocator.free(a.path);
+
+            ancestors = try allocator.alloc(Ancestor, rest.len + 1);
+            errdefer allocator.free(ancestors);
+            ancestors[0] = .{ .id = parent_src.header.checksum, .path = try allocator.dupe(u8, parent_abs) };
+            @memcpy(ancestors[1..], rest);
+        }
+        return .{
+            .allocator = allocator,
+            .resolver = resolver,
+            .own = std.AutoHashMap([32]u8, void).init(allocator),
+            .ancestors = ancestors,
+        };
+    }
+
+    fn deinit(self: *ChunkWriter) void {
+        freeAncestors(self.allocator, self.ancestors);
+        self.own.deinit();
+        self.resolver.deinit();
+    }
+
+    // Body of one tag 4 record (the header is already out). Returns the
+    // crc32 of the file data for the TOC.
+    fn writeFile(
+        self: *ChunkWriter,
+        out: *V2Writer,
+        payload: *khr_codec.PayloadWriter,
+        index: *khr_index.IndexBuilder,
+        src: BodySource.Reader,
+        path: String,
+        size: FileSize,
+        buf: []u8,
+        compression: CompressionType,
+    ) !u32 {
+        var chunks = chunker.Chunker(BodySource.Reader).init(src, buf);
+        var crc = std.hash.Crc32.init();
+        var left = size;
+        var first = true;
+        while (left > 0) {
+            // running out early means the file shrank under us; the record already promised size bytes
+            const chunk = (try chunks.next()) orelse return KhrError.ArchiveCreationFailed;
+            const data = chunk[0..@intCast(@min(chunk.len, left))];
+            if (first) {
+                // same store-or-compress call as v2, sampled from the first chunk
+                try payload.setStored(compression != .none and khr_codec.shouldStore(self.allocator, path, size, data));
+                first = false;
+            }
+
+            var digest: [32]u8 = undefined;
+            std.crypto.hash.sha2.Sha256.hash(data, &digest, .{});
+            crc.update(data);
+            const known = self.own.contains(digest) or self.resolver.contains(digest);
+            try out.put(&[_]u8{if (known) CHUNK_REF else CHUNK_STORED});
+            try out.put(&digest);
+            try out.putInt(u32, @intCast(data.len));
+            if (known) {
+                self.referenced_bytes += data.len;
+            } else {
+                try index.addChunk(.{ .digest = digest, .offset = out.written, .len = @intCast(data.len) });
+                try out.put(data);
+                try self.own.put(digest, {});
+                self.stored_bytes += data.len;
+            }
+            left -= data.len;
+        }
+        try payload.setStored(false);
+        return crc.final();
+    }
+};
+
+// Consume the chunk list of a tag 4 record, writing the file to out when given.
+fn readChunkedBody(v2: *V2Reader, resolver: *ChunkResolver, size: FileSize, out: ?fs.File) !void {
+    var left = size;
+    while (left > 0) {
+        const kind = try v2.readInt(u8);
+        var digest: [32]u8 = undefined;
+        try v2.readExact(&digest);
+        const len = try v2.readInt(u32);
+        if (len == 0 or len > chunker.MAX_CHUNK or len > left) return KhrError.ArchiveFormatFailed;
+        switch (kind) {
+            CHUNK_STORED => try v2.readBody(len, out),
+            CHUNK_REF => if (out) |f| try resolver.copyChunk(digest, len, f),
+            else => return KhrError.ArchiveFormatFailed,
+        }
+        left -= len;
+    }
+}
+
+// Restore a v3 archive; selected limits which entries get written (null = all).
+// The whole stream is still walked so the checksum covers everything.
+fn extractKhrBackupChunked(
+    allocator: Allocator,
+    khr_path: String,
+    file: fs.File,
+    data_start: u64,
+    header: *const KhrHeader,
+    password: ?String,
+    extract_to: String,
+    selected: ?[]const String,
+) !void {
+    var resolver = try ChunkResolver.init(allocator);
+    defer resolver.deinit();
+    // the archive itself comes first, on its own handle, for references back into its earlier chunks
+    const self_src = try resolver.addArchive(khr_path, null, password);
+
+    const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, self_src.cipherRef());
+    defer payload.close();
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    v2.chunked = true;
+    try v2.checkAgainst(allocator, header, self_src.cipherRef(), try trustedTree(allocator, header, self_src.cipherRef(), &self_src.index));
+    try v2.readMagic(V3_MAGIC);
+
+    const recorded = try readAncestors(allocator, &v2);
+    defer freeAncestors(allocator, recorded);
+    const self_abs = try fs.cwd().realpathAlloc(allocator, khr_path);
+    defer allocator.free(self_abs);
+    const chain = try resolver.addAncestors(fs.path.dirname(self_abs) orelse ".", recorded, password);
+    defer freeAncestors(allocator, chain);
+
+    var dest = try Destination.init(allocator, extract_to);
+    defer dest.deinit();
+    while (try v2.next(allocator)) |record| {
+        defer record.deinit(allocator);
+        const wanted = if (selected) |list| isSelected(record.path, list) else true;
+        if (record.tag != TAG_CHUNKED_FILE) {
+            if (wanted) try restoreRecord(&v2, record, &dest);
+            continue;
+        }
+        if (!wanted) {
+            try readChunkedBody(&v2, &resolver, record.size, null);
+            continue;
+        }
+        const t = try restoreTarget(&dest, record.path);
+        const out = try dir_cache.createFile(t.dir, t.name, true);
+        defer out.close();
+        try readChunkedBody(&v2, &resolver, record.size, out);
+        dir_cache.restoreMode(out, record.mode);
+    }
+    try v2.verify(header.checksum);
+}
+
+// Streaming creator for V2 payloads.
+// Design choices:
+// - We compress while we write to keep memory usage small. gzip, lz4 and
+//   zstd compress on worker threads (see khr_codec.zig); this loop only reads
+//   files, hashes and hands bytes over.
+// - The checksum is over the uncompressed logical stream (same order the
+//   extractor reads), so verification doesn't depend on codec chunking.
+// - We skip non-regular files (fifos, sockets, devices) to avoid hangs.
+// - Symlinks are encoded as tag=2 with a target string; we do not follow
+//   symlinks to avoid duplicating unrelated data.
+// - A table of contents goes after the payload (see khr_index.zig) so listing
+//   doesn't have to decode everything.
+// - options.chunked/parent switch the body encoding to v3 chunk lists; the
+//   rest (codec, sealing, TOC) is shared.
+// - volume, for one volume of a set: its place in the set (into the TOC) and
+//   the pieces of files too big for a volume, written after source_paths.
+// - options.copies get the same bytes as output_path: the payload is teed to
+//   all of them, the TOC is written once and copied, then every header is
+//   rewritten.
+// - archives that can be resumed get checkpoints along the way (see Checkpoint).
+fn createKhrBackupStreaming(allocator: Allocator, source_paths: []const String, output_path: String, password: ?String, options: CreateOptions, progress_cb: ?SaveProgressCallback, volume: ?*const VolumeShare) !void {
+    // the parent chain is opened before the output is created, so a missing
+    // parent fails before anything is truncated
+    const chunked = options.chunked or options.parent != null;
+    var chunk_writer: ?ChunkWriter = null;
+    if (chunked) chunk_writer = try ChunkWriter.init(allocator, options.parent, password);
+    defer if (chunk_writer) |*cw| cw.deinit();
+    if (chunk_writer) |*cw| {
+        // truncating an ancestor would destroy the chunks we're about to reference
+        for ([_][]const String{ &[_]String{output_path}, options.copies }) |group| {
+            for (group) |path| {
+                const out_abs = fs.cwd().realpathAlloc(allocator, path) catch continue;
+                defer allocator.free(out_abs);
+                for (cw.ancestors) |a| {
+                    if (std.mem.eql(u8, a.path, out_abs)) return KhrError.ArchiveCreationFailed;
+                }
+            }
+        }
+    }
+
+    // a checkpoint of an earlier run would point into the file about to be truncated
+    if (volume == null) try removeCheckpoint(allocator, output_path);
+    // readable too: zero-copy bodies are checksummed by reading them back
+    const file = try fs.cwd().createFile(output_path, .{ .read = true });
+    defer file.close();
+    // output_path first, then the copies
+    var outputs = try std.ArrayList(fs.File).initCapacity(allocator, 1 + options.copies.len);
+    defer {
+        for (outputs.items[1..]) |f| f.close();
+        outputs.deinit();
+    }
+    outputs.appendAssumeCapacity(file);
+    for (options.copies) |path| outputs.appendAssumeCapacity(try fs.cwd().createFile(path, .{}));
+
+    var header = newHeader(options);
+    header.version = if (chunked) 3 else 2;
+
+    var cipher: ?streaming_crypto.ChunkCipher = null;
+    defer if (cipher) |*c| c.wipe();
+    if (password) |pw| {
+        header.encryption = deriveEncryptionInfo();
+        header.checksum_keyed = true;
+        cipher = try archiveCipher(allocator, &header, pw);
+    }
+
+    for (outputs.items) |f| try header.write(f.writer());
+    const data_start = try file.getPos();
+
+    var checkpoint: ?Checkpoint = null;
+    defer if (checkpoint) |*cp| cp.deinit();
+    if (volume == null and options.checkpoint_every > 0 and resumable(options, password)) {
+        checkpoint = try Checkpoint.init(allocator, file, output_path, header, data_start, options.checkpoint_every, CheckpointKey.of(source_paths, options.level));
+    }
+
+    const file_writer = file.writer();
+    var tee: ?*tee_writer.TeeWriter = null;
+    if (outputs.items.len > 1) tee = try tee_writer.TeeWriter.init(allocator, outputs.items);
+    defer if (tee) |t| t.deinit();
+    const sink = if (tee) |t| t.any() else file_writer.any();
+    var sealer: ?streaming_crypto.EncryptingWriter = null;
+    if (cipher) |*c| sealer = try streaming_crypto.EncryptingWriter.init(allocator, c, .payload, sink);
+    defer if (sealer) |*s| s.deinit();
+
+    var dictionary = try trainedDictionary(allocator, source_paths, options);
+    defer if (dictionary) |*d| d.deinit();
+
+    var payload = try khr_codec.PayloadWriter.init(allocator, if (sealer) |*s| s.any() else sink, .{
+        .compression = options.compression,
+        .level = options.level,
+        .threads = options.threads,
+        .dictionary = if (dictionary) |*d| d else null,
+    });
+    defer payload.deinit();
+    if (dictionary) |*d| try payload.putDictionary(d);
+
+    var out = V2Writer{ .out = payload.writer(), .hash = merkle.StreamHash.initTree(allocator, options.hash, null) };
+    defer out.hash.deinit();
+    if (chunk_writer) |*cw| {
+        try out.put(V3_MAGIC);
+        try writeAncestors(&out, cw.ancestors);
+    } else {
+        try out.put(V2_MAGIC);
+    }
+
+    var index = khr_index.IndexBuilder.init(allocator);
+    defer index.deinit();
+    if (volume) |v| index.volume = v.info;
+    index.level = options.level;
+
+    // raw, unsealed and a single output: file bodies can go straight from file to archive
+    const zero_copy = options.compression == .none and cipher == null and tee == null;
+    const parts: []const FilePart = if (volume) |v| v.parts.items else &[_]FilePart{};
+    try writeEntries(allocator, &out, &payload, &index, file, source_paths, parts, if (chunk_writer) |*cw| cw else null, options.compression, zero_copy, if (checkpoint) |*cp| cp else null, progress_cb);
+    if (chunk_writer) |cw| {
+        print("Chunks: {d} bytes stored, {d} bytes referenced\n", .{ cw.stored_bytes, cw.referenced_bytes });
+    }
+
+    // Finalize header
+    try payload.finish();
+    if (sealer) |*s| try s.finish();
+    if (tee) |t| try t.finish();
+    const data_end = try file.getPos();
+    header.tar_size = data_end - data_start;
+    // the Merkle root; the leaves under it go in the TOC
+    header.checksum = try checksumFor(&header, if (cipher) |*c| c else null, try out.hash.final());
+    try index.writeFooter(file, data_end, payload.frames(), .{ .leaves = out.hash.leaves() }, if (cipher) |*c| c else null);
+    // a sealed TOC gets fresh nonces each time it's written, so copy it rather than write it again
+    const footer_len = try file.getPos() - data_end;
+    for (outputs.items[1..]) |f| {
+        if (try file.copyRangeAll(data_end, f, data_end, footer_len) != footer_len) return KhrError.ArchiveCreationFailed;
+    }
+
+    // Rewrite header at start
+    for (outputs.items) |f| {
+        try f.seekTo(0);
+        try header.write(f.writer());
+    }
+    if (checkpoint != null) {
+        // the finished archive has to be on disk before the way back to the last checkpoint goes
+        try file.sync();
+        try removeCheckpoint(allocator, output_path);
+    }
+}
+
+// A new archive's header, unsealed, before anything is written; size and
+// checksum are only known at the end.
+fn newHeader(options: CreateOptions) KhrHeader {
+    return .{
+        .compression = options.compression,
+        .encryption = EncryptionInfo{
+            .algorithm = .chacha20_poly1305,
+            .kdf = .argon2id,
+            .salt = [_]u8{0} ** 32,
+            .nonce = [_]u8{0} ** 12,
+            .opslimit = 0,
+            .memlimit = 0,
+        },
+        .tar_size = 0,
+        .checksum = [_]u8{0} ** 32,
+        .hash = options.hash,
+        .checksum_kind = .tree,
+    };
+}
+
+// zstd: a dictionary from the small files among source_paths, when there are enough of them.
+fn trainedDictionary(allocator: Allocator, source_paths: []const String, options: CreateOptions) !?zstd.Dictionary {
+    if (options.compression != .zstd or !options.dictionary) return null;
+    const dictionary = try khr_codec.trainDictionary(allocator, source_paths, options.level orelse zstd.DEFAULT_LEVEL);
+    if (dictionary) |d| print("Trained a {d} byte dictionary on the small files\n", .{d.bytes.len});
+    return dictionary;
+}
+
+// The records for source_paths (then parts), written through out with their
+// TOC entries in index; shared by createKhrBackupStreaming and
+// appendKhrBackup. archive is the file payload ends up in, for zero_copy bodies.
+// With checkpoint, one is saved between files whenever it's due.
+fn writeEntries(
+    allocator: Allocator,
+    out: *V2Writer,
+    payload: *khr_codec.PayloadWriter,
+    index: *khr_index.IndexBuilder,
+    archive: fs.File,
+    source_paths: []const String,
+    parts: []const FilePart,
+    chunk_writer: ?*ChunkWriter,
+    compression: CompressionType,
+    zero_copy: bool,
+    checkpoint: ?*Checkpoint,
+    progress_cb: ?SaveProgressCallback,
+) !void {
+    // v2: similar files next to each other, small ones packed into solid blocks
+    var ordered: ?[]String = null;
+    defer if (ordered) |o| allocator.free(o);
+    var solid: ?SolidBlock = null;
+    defer if (solid) |*sb| sb.deinit();
+    if (chunk_writer == null) {
+        const o = try allocator.dupe(String, source_paths);
+        std.mem.sort(String, o, {}, solidOrderLessThan);
+        ordered = o;
+        solid = SolidBlock.init(allocator);
+    }
+    const paths: []const String = ordered orelse source_paths;
+
+    // stats (and reads, when small) files a batch ahead of this loop
+    var prefetch = batch_reader.SmallFileReader.init(allocator, paths);
+    defer prefetch.deinit();
+
+    // inodes with more than one name: the path their body went under, and the
+    // other names, which are written as links once every body is out
+    var first_names = std.AutoHashMap(batch_reader.Inode, String).init(allocator);
+    defer first_names.deinit();
+    var hardlinks = std.ArrayList(Hardlink).init(allocator);
+    defer hardlinks.deinit();
+    var linked: usize = 0;
+
+    var buf: [1024 * 1024]u8 = undefined;
+    const total_files = paths.len;
+    for (paths, 0..) |path, i| {
+        // Update progress every 100 files to reduce overhead
+        if (progress_cb) |cb| {
+            if (i % 100 == 0 or i == total_files - 1) {
+                cb("Saving files", i + 1, total_files);
+            }
+        }
+        if (checkpoint) |cp| {
+            if (out.written >= cp.next_at) {
+                // everything before path has to be in the payload, not held back in a block or a list
+                if (solid) |*sb| try sb.flush(out, index);
+                try writeHardlinks(out, index, hardlinks.items);
+                linked += hardlinks.items.len;
+                hardlinks.clearRetainingCapacity();
+                try cp.save(out, payload, index);
+            }
+        }
+        const pre = prefetch.get(i);
+        if (pre.kind == .other) {
+            print("Skipping non-regular: {s}\n", .{path});
+            continue;
+        }
+
+        // Detect symlink via readlink, unless the batch already knows it's a regular file
+        if (pre.kind != .file) {
+            const c_path = allocator.allocSentinel(u8, path.len, 0) catch continue;
+            defer allocator.free(c_path);
+            std.mem.copyForwards(u8, c_path, path);
+            var tbuf: [4096]u8 = undefined;
+            const maybe_target: ?[]u8 = posix.readlinkZ(c_path.ptr, tbuf[0..]) catch null;
+            if (maybe_target) |target| {
+                try index.add(.{ .tag = TAG_SYMLINK, .path = path, .mode = 0, .mtime = 0, .size = 0, .offset = out.written, .crc32 = 0 });
+                try out.symlink(path, target);
+                continue;
+            }
+        }
+
+        var body: BodySource = undefined;
+        var st: FileMeta = undefined;
+        var opened: ?fs.File = null;
+        defer if (opened) |f| f.close();
+        if (pre.data) |data| {
+            body = .{ .memory = std.io.fixedBufferStream(data) };
+            st = .{ .mode = @intCast(pre.mode), .mtime = pre.mtime, .size = data.len };
+        } else {
+            const f = fs.cwd().openFile(path, .{}) catch continue;
+            opened = f;
+            const fst = f.stat() catch continue;
+            if (fst.kind != .file) {
+                print("Skipping non-regular: {s}\n", .{path});
+                continue;
+            }
+            body = .{ .file = f };
+            st = .{ .mode = fst.mode, .mtime = fst.mtime, .size = fst.size };
+        }
+
+        var links = pre.links;
+        if (pre.kind != .file) {
+            if (opened) |f| links = batch_reader.fileLinks(f.handle) orelse .{};
+        }
+        if (links.nlink > 1) {
+            const first = try first_names.getOrPut(links.inode);
+            if (first.found_existing) {
+                try hardlinks.append(.{ .path = path, .target = first.value_ptr.*, .meta = st });
+                continue;
+            }
+            first.value_ptr.* = path;
+        }
+
+        if (solid) |*sb| {
+            if (st.size <= SOLID_FILE_MAX) {
+                try sb.add(path, st, body.reader());
+                if (sb.full()) try sb.flush(out, index);
+                continue;
+            }
+        }
+
+        if (chunk_writer) |cw| {
+            const record_start = out.written;
+            try out.chunkedFileHeader(path, @intCast(st.mode), @intCast(st.mtime), st.size);
+            const crc = try cw.writeFile(out, payload, index, body.reader(), path, st.size, &buf, compression);
+            // v3 TOC entries point at the record: the body isn't one contiguous run of bytes
+            try index.add(.{
+                .tag = TAG_FILE,
+                .path = path,
+                .mode = @intCast(st.mode),
+                .mtime = @intCast(st.mtime),
+                .size = st.size,
+                .offset = record_start,
+                .crc32 = crc,
+            });
+            continue;
+        }
+
+        if (body == .file) {
+            if (try dataExtents(allocator, body.file, st.size)) |extents| {
+                defer allocator.free(extents);
+                const record_start = out.written;
+                try out.extentsHeader(TAG_SPARSE, path, @intCast(st.mode), @intCast(st.mtime), st.size, extents);
+                const crc = try writeExtents(out, body.file, extents, &buf);
+                try index.add(.{
+                    .tag = TAG_SPARSE,
+                    .path = path,
+                    .mode = @intCast(st.mode),
+                    .mtime = @intCast(st.mtime),
+                    .size = st.size,
+                    .offset = record_start,
+                    .crc32 = crc,
+                });
+                continue;
+            }
+        }
+
+        var data_offset: u64 = undefined;
+        var body_crc: u32 = undefined;
+        if (zero_copy and body == .file and st.size >= khr_codec.ZERO_COPY_MIN) {
+            try out.fileHeader(path, @intCast(st.mode), @intCast(st.mtime), .none, st.size);
+            data_offset = out.written;
+            body_crc = try copyFileBody(out, payload, archive, body.file, st.size, &buf);
+        } else {
+            const src = body.reader();
+            // the first block doubles as the compressibility sample, so it's read before the header goes out
+            const first_len: usize = @intCast(@min(st.size, buf.len));
+            const first = buf[0..try src.readAll(buf[0..first_len])];
+            const stored = compression != .none and khr_codec.shouldStore(allocator, path, st.size, first);
+            const codec: CompressionType = if (stored) .none else compression;
+
+            try out.fileHeader(path, @intCast(st.mode), @intCast(st.mtime), codec, st.size);
+            data_offset = out.written;
+            try payload.setStored(stored);
+            var crc = std.hash.Crc32.init();
+            try out.put(first);
+            crc.update(first);
+            var remaining: FileSize = st.size - first.len;
+            while (remaining > 0) {
+                const to_read: usize = @intCast(@min(remaining, buf.len));
+                const n = try src.read(buf[0..to_read]);
+                if (n == 0) break;
+                try out.put(buf[0..n]);
+                crc.update(buf[0..n]);
+                remaining -= n;
+            }
+            try payload.setStored(false);
+            body_crc = crc.final();
+        }
+        try index.add(.{
+            .tag = TAG_FILE,
+            .path = path,
+            .mode = @intCast(st.mode),
+            .mtime = @intCast(st.mtime),
+            .size = st.size,
+            .offset = data_offset,
+            .crc32 = body_crc,
+        });
+    }
+
+    if (solid) |*sb| try sb.flush(out, index);
+    for (parts) |part| {
+        const f = fs.cwd().openFile(part.path, .{}) catch continue;
+        defer f.close();
+        const fst = f.stat() catch continue;
+        const extents = [_]Extent{.{ .offset = part.offset, .len = part.len }};
+        const record_start = out.written;
+        try out.extentsHeader(TAG_PART, part.path, @intCast(fst.mode), @intCast(fst.mtime), part.size, &extents);
+        const crc = try writeExtents(out, f, &extents, &buf);
+        try index.add(.{
+            .tag = TAG_PART,
+            .path = part.path,
+            .mode = @intCast(fst.mode),
+            .mtime = @intCast(fst.mtime),
+            .size = part.size,
+            .offset = record_start,
+            .crc32 = crc,
+        });
+    }
+    try writeHardlinks(out, index, hardlinks.items);
+    linked += hardlinks.items.len;
+    if (linked > 0) print("Hard links: {d} names stored once\n", .{linked});
+}
+
+fn writeHardlinks(out: *V2Writer, index: *khr_index.IndexBuilder, links: []const Hardlink) !void {
+    for (links) |l| {
+        try index.add(.{
+            .tag = TAG_HARDLINK,
+            .path = l.path,
+            .mode = @intCast(l.meta.mode),
+            .mtime = @intCast(l.meta.mtime),
+            .size = l.meta.size,
+            .offset = out.written,
+            .crc32 = 0,
+        });
+        try out.hardlink(l.path, l.target, @intCast(l.meta.mode), @intCast(l.meta.mtime));
+    }
+}
+
+// Where a file body is read from: the batch reader's buffer for small files,
+// the open file for everything else.
+const BodySource = union(enum) {
+    memory: std.io.FixedBufferStream([]const u8),
+    file: fs.File,
+
+    const Reader = std.io.GenericReader(*BodySource, anyerror, read);
+
+    fn read(self: *BodySource, dest: []u8) anyerror!usize {
+        return switch (self.*) {
+            .memory => |*m| m.read(dest),
+            .file => |f| f.read(dest),
+        };
+    }
+
+    fn reader(self: *BodySource) Reader {
+        return .{ .context = self };
+    }
+};
+
+const FileMeta = struct {
+    mode: fs.File.Mode,
+    mtime: i128,
+    size: FileSize,
+};
+
+// A second name for an inode the archive already has under target.
+const Hardlink = struct {
+    path: String,
+    target: String,
+    meta: FileMeta,
+};
+
+// Body of one file on a raw, unsealed payload: copy_file_range from the source
+// straight into the archive (a reflink where the filesystem shares extents),
+// then one read pass over what landed in the archive for the checksum and crc.
+// Hashing the archive side rather than the source means a file changing under
+// us can't leave a checksum that disagrees with the stored bytes.
+fn copyFileBody(out: *V2Writer, payload: *khr_codec.PayloadWriter, archive: fs.File, src: fs.File, size: FileSize, buf: []u8) !u32 {
+    try payload.flushRaw();
+    const at = try archive.getPos();
+    const copied = try src.copyRangeAll(0, archive, at, size);
+    // the header already promised size bytes; a file that shrank can't be patched up here
+    if (copied != size) return KhrError.ArchiveCreationFailed;
+    try archive.seekTo(at + size);
+
+    var crc = std.hash.Crc32.init();
+    var done: u64 = 0;
+    while (done < size) {
+        const chunk: usize = @intCast(@min(size - done, buf.len));
+        const n = try archive.pread(buf[0..chunk], at + done);
+        if (n == 0) return KhrError.ArchiveCreationFailed;
+        try out.hash.update(buf[0..n]);
+        crc.update(buf[0..n]);
+        done += n;
+    }
+    out.written += size;
+    return crc.final();
+}
+
+// tree: the TOC's Merkle leaves (trustedTree), or null to go by the header (V2Reader.checkAgainst).
+fn extractKhrBackupStreaming(allocator: Allocator, file: fs.File, data_start: u64, header: *const KhrHeader, cipher: ?*const streaming_crypto.ChunkCipher, tree: ?merkle.Tree, extract_to: String) !void {
+    const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, cipher);
+    defer payload.close();
+
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    try v2.checkAgainst(allocator, header, cipher, tree);
+    try restoreStream(allocator, &v2, extract_to);
+    try v2.verify(header.checksum);
+}
+
+// Main read loop: read a record, then restore it. Decoding and the
+// checksum stay on this thread; file bodies up to MAX_JOB_SIZE are read
+// into memory and written by the pool, bigger ones (and, on raw payloads,
+// anything copy_file_range can take) are streamed here as before. Both
+// kinds are created the same way, by name under the directory handle the
+// cache gives restoreTarget (dir_cache.createFile), so what may be written
+// where doesn't depend on which thread writes it. Nothing ever holds the
+// whole archive. Checking the checksum is the caller's.
+fn restoreStream(allocator: Allocator, v2: *V2Reader, extract_to: String) !void {
+    var dest = try Destination.init(allocator, extract_to);
+    defer dest.deinit();
+    const pool = try parallel_extract.WriterPool.init(allocator, 0);
+    defer pool.deinit();
+    var pending = PendingPaths.init(allocator, pool);
+    defer pending.deinit();
+
+    try v2.readMagic(V2_MAGIC);
+    while (try v2.next(allocator)) |record| {
+        defer record.deinit(allocator);
+        if (record.tag == TAG_SOLID) {
+            // the whole block comes off the stream here, its members go to the pool
+            for (record.members.?) |m| {
+                try pending.settle(m.path);
+                try restoreToPool(pool, v2, m.path, m.size, m.mode, &dest);
+                try pending.add(m.path);
+            }
+            continue;
+        }
+        if (record.tag == TAG_HARDLINK) {
+            // the name it links to may still be waiting in the pool
+            try pending.drain();
+            try restoreRecord(v2, record, &dest);
+            continue;
+        }
+        try pending.settle(record.path);
+        const zero_copy = v2.raw != null and record.size >= khr_codec.ZERO_COPY_MIN;
+        if (record.tag != TAG_FILE or record.size > parallel_extract.MAX_JOB_SIZE or zero_copy) {
+            try restoreRecord(v2, record, &dest);
+            continue;
+        }
+        try restoreToPool(pool, v2, record.path, record.size, record.mode, &dest);
+        try pending.add(record.path);
+    }
+    try pending.drain();
+}
+
+// Paths with a body still in the pool. After an append the same name comes
+// round again, and the pool could otherwise land the older body last, so a
+// repeat waits for everything queued before it.
+const PendingPaths = struct {
+    allocator: Allocator,
+    pool: *parallel_extract.WriterPool,
+    paths: std.StringHashMap(void),
+
+    fn init(allocator: Allocator, pool: *parallel_extract.WriterPool) PendingPaths {
+        return .{ .allocator = allocator, .pool = pool, .paths = std.StringHashMap(void).init(allocator) };
+    }
+
+    fn deinit(self: *PendingPaths) void {
+        self.clear();
+        self.paths.deinit();
+    }
+
+    fn add(self: *PendingPaths, path: String) !void {
+        if (self.paths.contains(path)) return;
+        const key = try self.allocator.dupe(u8, path);
+        errdefer self.allocator.free(key);
+        try self.paths.put(key, {});
+    }
+
+    fn settle(self: *PendingPaths, path: String) !void {
+        if (self.paths.contains(path)) try self.drain();
+    }
+
+    fn drain(self: *PendingPaths) !void {
+        try self.pool.finish();
+        self.clear();
+    }
+
+    fn clear(self: *PendingPaths) void {
+        var it = self.paths.keyIterator();
+        while (it.next()) |key| self.allocator.free(key.*);
+        self.paths.clearRetainingCapacity();
+    }
+};
+
+// Read one file body into memory and hand it to the pool to write, along
+// with the directory the cache found for it: the pool creates the file there
+// by name, exactly as restoreRecord would.
+fn restoreToPool(pool: *parallel_extract.WriterPool, v2: *V2Reader, path: String, size: FileSize, mode: u64, dest: *Destination) !void {
+    const t = try restoreTarget(dest, path);
+    const body_len: usize = @intCast(size);
+    const buf = try pool.acquire(body_len + t.name.len);
+    v2.readExact(buf[0..body_len]) catch |err| {
+        pool.cancel(buf);
+        return err;
+    };
+    @memcpy(buf[body_len..], t.name);
+    try pool.submit(t.dir, buf, t.name.len, mode);
+}
+
+pub fn createKhrBackup(
+    allocator: Allocator,
+    source_paths: []const String,
+    output_path: String,
+    password: ?String,
+    compression: CompressionType,
+    progress_cb: ?SaveProgressCallback,
+) !void {
+    try createKhrBackupWithOptions(allocator, source_paths, output_path, password, .{ .compression = compression }, progress_cb);
+}
+
+pub fn createKhrBackupWithOptions(
+    allocator: Allocator,
+    source_paths: []const String,
+    output_path: String,
+    password: ?String,
+    options: CreateOptions,
+    progress_cb: ?SaveProgressCallback,
+) !void {
+    // Every new archive is version 2 (3 when chunked); passwords seal the stream in chunks
+    // instead of encrypting one in-memory blob, so size no longer matters.
+    if (options.volume_size != null) return createVolumeSet(allocator, source_paths, output_path, password, options, progress_cb);
+    if (options.resume_interrupted and resumable(options, password)) {
+        if (try resumeKhrBackup(allocator, source_paths, output_path, options, progress_cb)) return;
+    }
+    try createKhrBackupStreaming(allocator, source_paths, output_path, password, options, progress_cb, null);
+}
+
+// Write a v2 archive to out strictly front to back, e.g. stdout into a pipe:
+// size and checksum go in a trailer instead of back into the header, and
+// there's no TOC (see pipe_stream.zig). Bodies are the same as in a regular
+// archive, zero-copy aside.
+pub fn createKhrBackupPiped(
+    allocator: Allocator,
+    source_paths: []const String,
+    out: fs.File,
+    password: ?String,
+    options: CreateOptions,
+    progress_cb: ?SaveProgressCallback,
+) !void {
+    // v3 reads its own chunks back and the others are more than one file
+    if (options.chunked or options.parent != null or options.volume_size != null or options.copies.len > 0) return KhrError.ArchiveCreationFailed;
+
+    var header = newHeader(options);
+    header.version = pipe_stream.VERSION;
+    var cipher: ?streaming_crypto.ChunkCipher = null;
+    defer if (cipher) |*c| c.wipe();
+    if (password) |pw| {
+        header.encryption = deriveEncryptionInfo();
+        header.checksum_keyed = true;
+        cipher = try archiveCipher(allocator, &header, pw);
+    }
+    const out_writer = out.writer();
+    try header.write(out_writer);
+
+    var frames = try pipe_stream.FrameWriter.init(allocator, out_writer.any());
+    defer frames.deinit();
+    var sealer: ?streaming_crypto.EncryptingWriter = null;
+    if (cipher) |*c| sealer = try streaming_crypto.EncryptingWriter.init(allocator, c, .payload, frames.any());
+    defer if (sealer) |*s| s.deinit();
+
+    var dictionary = try trainedDictionary(allocator, source_paths, options);
+    defer if (dictionary) |*d| d.deinit();
+
+    var payload = try khr_codec.PayloadWriter.init(allocator, if (sealer) |*s| s.any() else frames.any(), .{
+        .compression = options.compression,
+        .level = options.level,
+        .threads = options.threads,
+        .dictionary = if (dictionary) |*d| d else null,
+    });
+    defer payload.deinit();
+    if (dictionary) |*d| try payload.putDictionary(d);
+
+    var v2 = V2Writer{ .out = payload.writer(), .hash = merkle.StreamHash.initTree(allocator, options.hash, null) };
+    defer v2.hash.deinit();
+    try v2.put(V2_MAGIC);
+    // the entries have nowhere to go, but writeEntries keeps them as it goes
+    var index = khr_index.IndexBuilder.init(allocator);
+    defer index.deinit();
+    try writeEntries(allocator, &v2, &payload, &index, out, source_paths, &[_]FilePart{}, null, options.compression, false, null, progress_cb);
+
+    try payload.finish();
+    if (sealer) |*s| try s.finish();
+    try frames.finish();
+    const trailer = pipe_stream.Trailer{ .stored_len = frames.total, .checksum = try checksumFor(&header, if (cipher) |*c| c else null, try v2.hash.final()) };
+    try trailer.write(out_writer);
+}
+
+// Add source_paths to an existing archive without recompressing what's
+// already in it: the new records go where the TOC was, as a segment of their
+// own in the Merkle tree (merkle.Segment), and then the TOC and header are
+// rewritten. Of the old payload only the last codec frame is decoded, to find
+// where the stream ends. Only unsealed v2 archives with leaves in their TOC:
+// sealed chunks are numbered from the payload start, so carrying on after the
+// last one would need the cipher state at the end, and v3 chunk references
+// into the archive would have to be resolved again.
+//
+// The new segment and footer are written in place, over the old footer,
+// once the old header and footer are saved to an undo record next to the
+// archive. The header rewrite is the commit point, and everything before it
+// is synced first: an append that fails part way is rolled back from the
+// record straight away, one cut off by a crash the next time the archive is
+// appended to (recoverAppend). Either way the cost is the new data's, not
+// the archive's.
+pub fn appendKhrBackup(allocator: Allocator, khr_path: String, source_paths: []const String, options: AppendOptions, progress_cb: ?SaveProgressCallback) !void {
+    try appendInPlace(allocator, khr_path, source_paths, options, null, progress_cb);
+}
+
+// Checkpoints for an append that carries on an interrupted backup: how often,
+// and the key of the backup as a whole, not of what's left of it.
+const CheckpointPlan = struct {
+    every: u64,
+    key: CheckpointKey,
+};
+
+fn appendInPlace(allocator: Allocator, khr_path: String, source_paths: []const String, options: AppendOptions, plan: ?CheckpointPlan, progress_cb: ?SaveProgressCallback) !void {
+    try recoverAppend(allocator, khr_path);
+    const undo_path = try appendUndoPath(allocator, khr_path);
+    defer allocator.free(undo_path);
+    try saveAppendUndo(allocator, khr_path, undo_path);
+    const appended = appendSegment(allocator, khr_path, source_paths, options, plan, progress_cb) catch |err| {
+        // if this fails too the record stays for the next append
+        recoverAppend(allocator, khr_path) catch {};
+        return err;
+    };
+    if (!appended) {
+        // nothing reached the archive; putting the footer back is a no-op
+        try recoverAppend(allocator, khr_path);
+        print("Nothing to append to {s}\n", .{khr_path});
+        return;
+    }
+    try fs.cwd().deleteFile(undo_path);
+}
+
+// Undo record of an append in progress, <archive>.append:
+//   APPEND_UNDO_MAGIC
+//   payload_end: u64   where the old payload stops
+//   header             the old header, as it was on disk
+//   footer             the old TOC and trailer, to the end of the record
+// a checkpoint's layout without the key, and an append that saves
+// checkpoints moves its record up to each one (Checkpoint.save). It is written to a temporary
+// name, synced and renamed into place before the archive is touched, so a
+// record that exists is whole.
+const APPEND_UNDO_MAGIC = "KHRUNDO1";
+
+fn appendUndoPath(allocator: Allocator, khr_path: String) ![]u8 {
+    return std.fmt.allocPrint(allocator, "{s}.append", .{khr_path});
+}
+
+fn saveAppendUndo(allocator: Allocator, khr_path: String, undo_path: String) !void {
+    const file = try fs.cwd().openFile(khr_path, .{});
+    defer file.close();
+    const header = try KhrHeader.read(file.reader());
+    const header_len = try file.getPos();
+    const payload_end = header_len + header.tar_size;
+    const end = try file.getEndPos();
+    if (end < payload_end) return KhrError.ArchiveFormatFailed;
+
+    const tmp_path = try std.fmt.allocPrint(allocator, "{s}.tmp", .{undo_path});
+    defer allocator.free(tmp_path);
+    errdefer fs.cwd().deleteFile(tmp_path) catch {};
+    {
+        const undo = try fs.cwd().createFile(tmp_path, .{});
+        defer undo.close();
+        const undo_writer = undo.writer();
+        try undo_writer.writeAll(APPEND_UNDO_MAGIC);
+        try undo_writer.writeInt(u64, payload_end, .little);
+        const at = try undo.getPos();
+        if (try file.copyRangeAll(0, undo, at, header_len) != header_len) return KhrError.ArchiveFormatFailed;
+        if (try file.copyRangeAll(payload_end, undo, at + header_len, end - payload_end) != end - payload_end) return KhrError.ArchiveFormatFailed;
+        try undo.sync();
+    }
+    try fs.cwd().rename(tmp_path, undo_path);
+}
+
+// Put khr_path back the way it was before an append that never got to its
+// header, from the undo record; after one that did, only the record goes.
+// Nothing to do without a record.
+pub fn recoverAppend(allocator: Allocator, khr_path: String) !void {
+    const undo_path = try appendUndoPath(allocator, khr_path);
+    defer allocator.free(undo_path);
+    const undo = fs.cwd().openFile(undo_path, .{}) catch |err| switch (err) {
+        error.FileNotFound => return,
+        else => return err,
+    };
+    defer undo.close();
+
+    const undo_reader = undo.reader();
+    var magic: [APPEND_UNDO_MAGIC.len]u8 = undefined;
+    try undo_reader.readNoEof(&magic);
+    if (!std.mem.eql(u8, &magic, APPEND_UNDO_MAGIC)) return KhrError.ArchiveFormatFailed;
+    const payload_end = try undo_reader.readInt(u64, .little);
+    const header_start = try undo.getPos();
+    _ = try KhrHeader.read(undo_reader);
+    const footer_start = try undo.getPos();
+    const old_header = try allocator.alloc(u8, footer_start - header_start);
+    defer allocator.free(old_header);
+    if (try undo.preadAll(old_header, header_start) != old_header.len) return KhrError.ArchiveFormatFailed;
+    const footer_len = try undo.getEndPos() - footer_start;
+
+    const file = try fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+    defer file.close();
+    if (!try appendCommitted(allocator, file, old_header)) {
+        try file.setEndPos(payload_end);
+        if (try undo.copyRangeAll(footer_start, file, payload_end, footer_len) != footer_len) return KhrError.ArchiveFormatFailed;
+        try file.pwriteAll(old_header, 0);
+        try file.sync();
+    }
+    try fs.cwd().deleteFile(undo_path);
+}
+
+// Whether an append got as far as rewriting the header: one that isn't the
+// old header and has a TOC where it says the payload ends. The footer is
+// synced before the header is written, so a torn header finds none.
+fn appendCommitted(allocator: Allocator, file: fs.File, old_header: []const u8) !bool {
+    const current = try allocator.alloc(u8, old_header.len);
+    defer allocator.free(current);
+    if (try file.preadAll(current, 0) != current.len or std.mem.eql(u8, current, old_header)) return false;
+    try file.seekTo(0);
+    const header = KhrHeader.read(file.reader()) catch return false;
+    const payload_end = try file.getPos() + header.tar_size;
+    var toc = (khr_index.readIndex(allocator, file, payload_end, null) catch return false) orelse return false;
+    toc.deinit();
+    return true;
+}
+
+// The append itself, in place on khr_path; false if nothing was added.
+fn appendSegment(allocator: Allocator, khr_path: String, source_paths: []const String, options: AppendOptions, plan: ?CheckpointPlan, progress_cb: ?SaveProgressCallback) !bool {
+    const file = try fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+    defer file.close();
+
+    var header = try KhrHeader.read(file.reader());
+    const data_start = try file.getPos();
+    if (header.version != 2) return KhrError.UnsupportedVersion;
+    if (header.encryption.opslimit != 0 or header.encryption.memlimit != 0) return KhrError.ArchiveFormatFailed;
+    const payload_end = data_start + header.tar_size;
+    var toc = (try khr_index.readIndex(allocator, file, payload_end, null)) orelse return KhrError.ArchiveFormatFailed;
+    defer toc.deinit();
+    const old_tree = (try trustedTree(allocator, &header, null, &toc)) orelse return KhrError.ArchiveFormatFailed;
+    const level = options.level orelse toc.level;
+
+    // decoded length so far, which is where the new records' TOC offsets start
+    var decoded_end: u64 = header.tar_size;
+    // frames after a zstd dictionary are decoded with it, so new ones have to be compressed with it too
+    var dictionary: ?zstd.Dictionary = null;
+    defer if (dictionary) |*d| d.deinit();
+    if (header.compression != .none) {
+        const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, null);
+        defer payload.close();
+        if (payload.dictionary()) |bytes| dictionary = try zstd.Dictionary.init(allocator, bytes, level orelse zstd.DEFAULT_LEVEL);
+        decoded_end = 0;
+        if (toc.frames.len > 0) {
+            decoded_end = toc.frames[toc.frames.len - 1].decoded_offset;
+            try payload.seekDecoded(decoded_end, toc.frames);
+        }
+        var buf: [64 * 1024]u8 = undefined;
+        while (true) {
+            const n = try payload.read(&buf);
+            if (n == 0) break;
+            decoded_end += n;
+        }
+    }
+
+    // an archive that was never appended to is one segment
+    const whole = [1]merkle.Segment{.{ .decoded_start = 0, .leaf_count = old_tree.leaves.len, .root = header.checksum }};
+    const base = SegmentBase{
+        .tar_size = header.tar_size,
+        .decoded_end = decoded_end,
+        .frames = toc.frames,
+        .leaves = old_tree.leaves,
+        .segments = if (old_tree.segments.len > 0) old_tree.segments else &whole,
+    };
+
+    var checkpoint: ?Checkpoint = null;
+    defer if (checkpoint) |*cp| cp.deinit();
+    if (plan) |p| {
+        checkpoint = try Checkpoint.init(allocator, file, khr_path, header, data_start, p.every, p.key);
+        checkpoint.?.base = &base;
+        checkpoint.?.next_at = decoded_end + p.every;
+    }
+
+    try file.seekTo(payload_end);
+    const file_writer = file.writer();
+    var payload = try khr_codec.PayloadWriter.init(allocator, file_writer.any(), .{
+        .compression = header.compression,
+        .level = level,
+        .threads = options.threads,
+        .dictionary = if (dictionary) |*d| d else null,
+    });
+    defer payload.deinit();
+
+    // no magic: the segment carries on with records where the last one stopped
+    var out = V2Writer{ .out = payload.writer(), .hash = merkle.StreamHash.initTree(allocator, header.hash, null), .written = decoded_end };
+    defer out.hash.deinit();
+
+    var index = khr_index.IndexBuilder.init(allocator);
+    defer index.deinit();
+    for (toc.entries) |e| try index.add(e);
+    index.level = level;
+    const old_entries = index.entries.items.len;
+    try writeEntries(allocator, &out, &payload, &index, file, source_paths, &[_]FilePart{}, null, header.compression, header.compression == .none, if (checkpoint) |*cp| cp else null, progress_cb);
+    if (out.written == decoded_end) return false;
+
+    try payload.finish();
+    const data_end = try file.getPos();
+    // final first: it hashes the last, partial block into a leaf
+    const new_root = try out.hash.final();
+    var extended = try base.extend(allocator, payload.frames(), out.hash.leaves(), new_root);
+    defer extended.deinit();
+    try index.writeFooter(file, data_end, extended.frames.items, extended.tree(), null);
+    try file.setEndPos(try file.getPos());
+
+    header.tar_size = data_end - data_start;
+    header.checksum = try merkle.segmentsRoot(allocator, header.hash, extended.segments.items);
+    // a KHRONO01/02 header has no room to say so; the TOC lists the segments either way
+    if (header.checksum_kind != null) header.checksum_kind = .segments;
+    // the header is the commit point: what it points at has to be on disk first
+    try file.sync();
+    try file.seekTo(0);
+    try header.write(file.writer());
+    try file.sync();
+    print("Appended {d} entries ({d} segments)\n", .{ index.entries.items.len - old_entries, extended.segments.items.len });
+    return true;
+}
+
+// What an append carries on from: the payload so far, stored and decoded,
+// with its codec frames and Merkle tree.
+const SegmentBase = struct {
+    tar_size: u64,
+    decoded_end: u64, // where the new segment starts
+    frames: []const khr_codec.Frame,
+    leaves: []const merkle.Digest,
+    segments: []const merkle.Segment,
+
+    // The whole payload's frames and tree once a segment with these frames,
+    // leaves and root follows it.
+    fn extend(self: *const SegmentBase, allocator: Allocator, frames: []const khr_codec.Frame, leaves: []const merkle.Digest, root: merkle.Digest) !ExtendedTree {
+        var extended = ExtendedTree{
+            .frames = std.ArrayList(khr_codec.Frame).init(allocator),
+            .leaves = std.ArrayList(merkle.Digest).init(allocator),
+            .segments = std.ArrayList(merkle.Segment).init(allocator),
+        };
+        errdefer extended.deinit();
+        // the new codec frames, moved to where they landed in the whole payload
+        try extended.frames.appendSlice(self.frames);
+        if (self.frames.len > 0) {
+            for (frames) |f| {
+                try extended.frames.append(.{ .offset = self.tar_size + f.offset, .decoded_offset = self.decoded_end + f.decoded_offset });
+            }
+        }
+        try extended.leaves.appendSlice(self.leaves);
+        try extended.leaves.appendSlice(leaves);
+        try extended.segments.appendSlice(self.segments);
+        try extended.segments.append(.{ .decoded_start = self.decoded_end, .leaf_count = leaves.len, .root = root });
+        return extended;
+    }
+};
+
+const ExtendedTree = struct {
+    frames: std.ArrayList(khr_codec.Frame),
+    leaves: std.ArrayList(merkle.Digest),
+    segments: std.ArrayList(merkle.Segment),
+
+    fn tree(self: *const ExtendedTree) merkle.Tree {
+        return .{ .leaves = self.leaves.items, .segments = self.segments.items };
+    }
+
+    fn deinit(self: *ExtendedTree) void {
+        self.frames.deinit();
+        self.leaves.deinit();
+        self.segments.deinit();
+    }
+};
+
+// ---- checkpoints ----
+//
+// A long backup saves a checkpoint every checkpoint_every decoded bytes,
+// between two files: the payload is flushed and synced, and what a finished
+// archive ending right there would have around its payload goes into a
+// sidecar next to the output, <output>.ckpt:
+//   CHECKPOINT_MAGIC
+//   key               which backup it is of (CheckpointKey)
+//   data_end: u64     where the payload stops in the archive
+//   header            tar_size and checksum (Merkle root) as of data_end
+//   TOC               entries, frames and leaves (and segments, when
+//                     appending) so far, as khr_index writes it
+// The TOC says which entries are done, its leaves are the hasher state and
+// data_end the output offset. resumeKhrBackup cuts the archive back to
+// data_end, puts the TOC and header in place, which makes it a complete
+// archive of everything up to the checkpoint, and appends the rest with
+// appendKhrBackup, which saves checkpoints of its own as it goes. Nothing
+// before data_end is ever rewritten, so a resume that gets interrupted can
+// itself be resumed. Only archives appendKhrBackup can carry on are
+// checkpointed: unsealed, v2, a single file.
+
+const CHECKPOINT_MAGIC = "KHRCKPT2";
+// decoded bytes between checkpoints unless CreateOptions says otherwise
+pub const CHECKPOINT_INTERVAL: u64 = 1024 * 1024 * 1024;
+
+fn resumable(options: CreateOptions, password: ?String) bool {
+    return password == null and !options.chunked and options.parent == null and options.volume_size == null and options.copies.len == 0;
+}
+
+fn checkpointPath(allocator: Allocator, output_path: String) ![]u8 {
+    return std.fmt.allocPrint(allocator, "{s}.ckpt", .{output_path});
+}
+
+fn removeCheckpoint(allocator: Allocator, output_path: String) !void {
+    const path = try checkpointPath(allocator, output_path);
+    defer allocator.free(path);
+    fs.cwd().deleteFile(path) catch |err| switch (err) {
+        error.FileNotFound => {},
+        else => return err,
+    };
+}
+
+// What a checkpoint is of besides the archive's own header: the source list
+// (hashed) and the level. A resume with anything else starts over.
+const CheckpointKey = struct {
+    sources: u64,
+    level: ?i32,
+
+    fn of(source_paths: []const String, level: ?i32) CheckpointKey {
+        var hasher = std.hash.Wyhash.init(0);
+        for (source_paths) |path| {
+            hasher.update(path);
+            hasher.update(&[_]u8{0});
+        }
+        return .{ .sources = hasher.final(), .level = level };
+    }
+
+    fn write(self: CheckpointKey, writer: anytype) !void {
+        try writer.writeInt(u64, self.sources, .little);
+        try writer.writeByte(@intFromBool(self.level != null));
+        try writer.writeInt(i32, self.level orelse 0, .little);
+    }
+
+    fn read(reader: anytype) !CheckpointKey {
+        const sources = try reader.readInt(u64, .little);
+        const has_level = try reader.readByte();
+        const level = try reader.readInt(i32, .little);
+        return .{ .sources = sources, .level = if (has_level != 0) level else null };
+    }
+
+    fn eql(self: CheckpointKey, other: CheckpointKey) bool {
+        return self.sources == other.sources and std.meta.eql(self.level, other.level);
+    }
+};
+
+const Checkpoint = struct {
+    allocator: Allocator,
+    archive: fs.File,
+    output_path: String,
+    path: []u8, // the sidecar
+    header: KhrHeader, // as written at the start, before size and checksum are known
+    data_start: u64,
+    key: CheckpointKey,
+    every: u64,
+    next_at: u64, // decoded offset the next checkpoint is due at
+    // set when appending: the payload is a new segment after this
+    base: ?*const SegmentBase = null,
+
+    fn init(allocator: Allocator, archive: fs.File, output_path: String, header: KhrHeader, data_start: u64, every: u64, key: CheckpointKey) !Checkpoint {
+        return .{
+            .allocator = allocator,
+            .archive = archive,
+            .output_path = output_path,
+            .path = try checkpointPath(allocator, output_path),
+            .header = header,
+            .data_start = data_start,
+            .key = key,
+            .every = every,
+            .next_at = every,
+        };
+    }
+
+    fn deinit(self: *Checkpoint) void {
+        self.allocator.free(self.path);
+    }
+
+    // Called between records, with nothing held back outside payload.
+    fn save(self: *Checkpoint, out: *V2Writer, payload: *khr_codec.PayloadWriter, index: *const khr_index.IndexBuilder) !void {
+        try payload.finish();
+        const data_end = try self.archive.getPos();
+        try self.archive.sync();
+
+        const leaves = try out.hash.tree.snapshot();
+        defer self.allocator.free(leaves);
+        var header = self.header;
+        header.tar_size = data_end - self.data_start;
+        const root = try merkle.root(self.allocator, header.hash, leaves);
+
+        var extended: ?ExtendedTree = null;
+        defer if (extended) |*e| e.deinit();
+        var frames: []const khr_codec.Frame = payload.frames();
+        var tree = merkle.Tree{ .leaves = leaves };
+        header.checksum = root;
+        if (self.base) |base| {
+            extended = try base.extend(self.allocator, frames, leaves, root);
+            frames = extended.?.frames.items;
+            tree = extended.?.tree();
+            header.checksum = try merkle.segmentsRoot(self.allocator, header.hash, tree.segments);
+            if (header.checksum_kind != null) header.checksum_kind = .segments;
+        }
+
+        try self.writeSidecar(self.path, CHECKPOINT_MAGIC, self.key, data_end, header, index, frames, tree);
+        if (self.base != null) {
+            // an append that fails from here on goes back to this checkpoint,
+            // not to where it started
+            const undo_path = try appendUndoPath(self.allocator, self.output_path);
+            defer self.allocator.free(undo_path);
+            try self.writeSidecar(undo_path, APPEND_UNDO_MAGIC, null, data_end, header, index, frames, tree);
+        }
+        self.next_at = out.written + self.every;
+        print("Checkpoint: {d} entries, {d} bytes\n", .{ index.entries.items.len, out.written });
+    }
+
+    // magic, then key if there is one, data_end, header and footer into
+    // path; a crash halfway through leaves what was there before in place.
+    fn writeSidecar(self: *Checkpoint, path: String, magic: []const u8, key: ?CheckpointKey, data_end: u64, header: KhrHeader, index: *const khr_index.IndexBuilder, frames: []const khr_codec.Frame, tree: merkle.Tree) !void {
+        const tmp_path = try std.fmt.allocPrint(self.allocator, "{s}.tmp", .{path});
+        defer self.allocator.free(tmp_path);
+        {
+            const f = try fs.cwd().createFile(tmp_path, .{});
+            defer f.close();
+            const f_writer = f.writer();
+            try f_writer.writeAll(magic);
+            if (key) |k| try k.write(f_writer);
+            try f_writer.writeInt(u64, data_end, .little);
+            try header.write(f_writer);
+            try index.writeFooter(f, data_end, frames, tree, null);
+            try f.sync();
+        }
+        try fs.cwd().rename(tmp_path, path);
+    }
+};
+
+// Carry on with an interrupted backup of source_paths to output_path from
+// its last checkpoint. false when there's nothing to carry on from, and the
+// caller should start over.
+fn resumeKhrBackup(allocator: Allocator, source_paths: []const String, output_path: String, options: CreateOptions, progress_cb: ?SaveProgressCallback) !bool {
+    const ckpt_path = try checkpointPath(allocator, output_path);
+    defer allocator.free(ckpt_path);
+    const ckpt = fs.cwd().openFile(ckpt_path, .{}) catch |err| switch (err) {
+        error.FileNotFound => return false,
+        else => return err,
+    };
+    defer ckpt.close();
+
+    const ckpt_reader = ckpt.reader();
+    var magic: [CHECKPOINT_MAGIC.len]u8 = undefined;
+    try ckpt_reader.readNoEof(&magic);
+    if (!std.mem.eql(u8, &magic, CHECKPOINT_MAGIC)) return KhrError.ArchiveFormatFailed;
+    const key = CheckpointKey.of(source_paths, options.level);
+    const saved_key = try CheckpointKey.read(ckpt_reader);
+    const data_end = try ckpt_reader.readInt(u64, .little);
+    const header = try KhrHeader.read(ckpt_reader);
+    if (!saved_key.eql(key) or header.version != 2 or header.compression != options.compression or header.hash != options.hash) {
+        print("Checkpoint of {s} doesn't match these options, starting over\n", .{output_path});
+        return false;
+    }
+    const toc_start = try ckpt.getPos();
+    const toc_len = try ckpt.getEndPos() - toc_start;
+
+    {
+        const archive = fs.cwd().openFile(output_path, .{ .mode = .read_write }) catch |err| switch (err) {
+            error.FileNotFound => return false,
+            else => return err,
+        };
+        defer archive.close();
+        if (try archive.getEndPos() < data_end) {
+            print("{s} is shorter than its checkpoint, starting over\n", .{output_path});
+            return false;
+        }
+        // the archive as it stood at the checkpoint, finished
+        try archive.setEndPos(data_end);
+        if (try ckpt.copyRangeAll(toc_start, archive, data_end, toc_len) != toc_len) return KhrError.ArchiveFormatFailed;
+        try archive.seekTo(0);
+        try header.write(archive.writer());
+        try archive.sync();
+    }
+
+    // whatever the TOC lists is done; the rest goes in as an appended segment
+    var remaining = std.ArrayList(String).init(allocator);
+    defer remaining.deinit();
+    {
+        const archive = try fs.cwd().openFile(output_path, .{});
+        defer archive.close();
+        var toc = (try khr_index.readIndex(allocator, archive, data_end, null)) orelse return KhrError.ArchiveFormatFailed;
+        defer toc.deinit();
+        var done = std.StringHashMap(void).init(allocator);
+        defer done.deinit();
+        for (toc.entries) |e| try done.put(e.path, {});
+        for (source_paths) |path| {
+            if (!done.contains(path)) try remaining.append(path);
+        }
+    }
+    print("Resuming {s}: {d} of {d} entries left\n", .{ output_path, remaining.items.len, source_paths.len });
+    const plan = if (options.checkpoint_every > 0) CheckpointPlan{ .every = options.checkpoint_every, .key = key } else null;
+    try appendInPlace(allocator, output_path, remaining.items, .{ .level = options.level, .threads = options.threads }, plan, progress_cb);
+    try fs.cwd().deleteFile(ckpt_path);
+    return true;
+}
+
+pub fn extractKhrBackup(
+    allocator: Allocator,
+    khr_path: String,
+    password: ?String,
+    extract_to: String,
+) !void {
+    try extractKhrBackupFile(allocator, khr_path, password, extract_to, .{ .whole_set = &[_]String{} });
+}
+
+// Same, but the other volumes of a multi-volume set may also be in volume_dirs.
+pub fn extractKhrBackupWithVolumeDirs(allocator: Allocator, khr_path: String, volume_dirs: []const String, password: ?String, extract_to: String) !void {
+    try extractKhrBackupFile(allocator, khr_path, password, extract_to, .{ .whole_set = volume_dirs });
+}
+
+// Restore an archive written by createKhrBackupPiped from in, e.g. stdin,
+// reading it once front to back. Files are restored as they come, so a
+// damaged stream can leave some behind before the trailer's checksum fails.
+pub fn extractKhrBackupPiped(allocator: Allocator, in: fs.File, password: ?String, extract_to: String) !void {
+    var buffered = std.io.bufferedReader(in.reader());
+    const buffered_reader = buffered.reader();
+    const source = buffered_reader.any();
+    const header = try KhrHeader.read(source);
+    if (header.version != pipe_stream.VERSION) return KhrError.UnsupportedVersion;
+    try extractPipedStream(allocator, source, &header, password, extract_to);
+}
+
+fn extractPipedStream(allocator: Allocator, source: std.io.AnyReader, header: *const KhrHeader, password: ?String, extract_to: String) !void {
+    try readPipedStream(allocator, source, header, password, extract_to, restoreStream);
+}
+
+// What follows a piped archive's header: frames, then the trailer. consume
+// gets the V2 stream (consume(allocator, v2, context)) and has to read it to
+// the end; the trailer's checksum is checked after it.
+fn readPipedStream(allocator: Allocator, source: std.io.AnyReader, header: *const KhrHeader, password: ?String, context: anytype, comptime consume: anytype) !void {
+    var cipher = try archiveCipher(allocator, header, password);
+    defer if (cipher) |*c| c.wipe();
+
+    var frames = pipe_stream.FrameReader{ .source = source };
+    var opener: ?streaming_crypto.SequentialDecryptor = null;
+    if (cipher) |*c| opener = try streaming_crypto.SequentialDecryptor.init(allocator, c, .payload, frames.any());
+    defer if (opener) |*o| o.deinit();
+    const payload = try khr_codec.PayloadReader.openStream(allocator, if (opener) |*o| o.any() else frames.any(), header.compression);
+    defer payload.close();
+
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    try v2.checkAgainst(allocator, header, if (cipher) |*c| c else null, null);
+    try consume(allocator, &v2, context);
+
+    // the codec has to have used up the payload exactly
+    var rest: [1]u8 = undefined;
+    if (try frames.read(&rest) != 0) return KhrError.ArchiveFormatFailed;
+    const trailer = pipe_stream.Trailer.read(source) catch return KhrError.ArchiveFormatFailed;
+    if (trailer.stored_len != frames.total) return KhrError.ArchiveFormatFailed;
+    try v2.verify(trailer.checksum);
+}
+
+fn extractKhrBackupFile(allocator: Allocator, khr_path: String, password: ?String, extract_to: String, mode: VolumeMode) !void {
+    print("Extracting .khr backup: {s}\n", .{khr_path});
+
+    const file = fs.cwd().openFile(khr_path, .{}) catch |err| {
+        // a set is found by the path it was created with
+        if (err == error.FileNotFound and mode == .whole_set) {
+            if (try volumeAt(allocator, khr_path, mode.whole_set, 1)) |first| {
+                allocator.free(first);
+                return extractKhrVolumeSet(allocator, khr_path, mode.whole_set, password, extract_to);
+            }
+        }
+        return err;
+    };
+    defer file.close();
+
+    // Step 1: Read header
+    const header = try KhrHeader.read(file.reader());
+    print("KHR version: {d}, compression: {s}, tar size: {d}\n", .{ header.version, @tagName(header.compression), header.tar_size });
+
+    // Streaming extract for v2 (any codec, encrypted or not)
+    const data_start_pos = try file.getPos();
+    if (header.version == 2) {
+        var cipher = try archiveCipher(allocator, &header, password);
+        defer if (cipher) |*c| c.wipe();
+        const cipher_ref: ?*const streaming_crypto.ChunkCipher = if (cipher) |*c| c else null;
+        // a damaged TOC shouldn't stop a full restore; the checksum still gets the last word
+        var toc = khr_index.readIndex(allocator, file, data_start_pos + header.tar_size, cipher_ref) catch null;
+        defer if (toc) |*t| t.deinit();
+        if (toc) |*t| {
+            if (t.volume) |v| switch (mode) {
+                .whole_set => |dirs| if (v.count > 1) {
+                    return extractKhrVolumeSet(allocator, khr_path, dirs, password, extract_to);
+                },
+                .only => |want| if (!v.eql(want)) return KhrError.VolumeMismatch,
+            };
+        }
+        const tree = if (toc) |*t| try trustedTree(allocator, &header, cipher_ref, t) else null;
+        try extractKhrBackupStreaming(allocator, file, data_start_pos, &header, cipher_ref, tree, extract_to);
+        print("KHR backup extracted successfully to: {s}\n", .{extract_to});
+        return;
+    }
+    if (header.version == 3) {
+        try extractKhrBackupChunked(allocator, khr_path, file, data_start_pos, &header, password, extract_to, null);
+        print("KHR backup extracted successfully to: {s}\n", .{extract_to});
+        return;
+    }
+    // a piped archive that was saved to a file
+    if (header.version == pipe_stream.VERSION) {
+        var buffered = std.io.bufferedReader(file.reader());
+        const buffered_reader = buffered.reader();
+        try extractPipedStream(allocator, buffered_reader.any(), &header, password, extract_to);
+        print("KHR backup extracted successfully to: {s}\n", .{extract_to});
+        return;
+    }
+
+    if (header.version != 1) return KhrError.UnsupportedVersion;
+    try extractKhrBackupV1(allocator, file, data_start_pos, &header, password, extract_to);
+    print("KHR backup extracted successfully to: {s}\n", .{extract_to});
+}
+
+pub const EntryMeta = struct {
+    path: []u8,
     size: FileSize,
     mtime: Timestamp,
     is_symlink: bool,
+    mode: u64 = 0,
+    offset: u64 = 0, // data position in the decoded payload stream
+    crc32: u32 = 0, // only known when the archive has a TOC footer
 
     pub fn deinit(self: *EntryMeta, allocator: Allocator) void {
         allocator.free(self.path);
@@ -839,6 +2676,11 @@ pub const EntryMeta = struct {
 };
 
 pub fn indexKhrBackup(allocator: Allocator, khr_path: String) !std.ArrayList(EntryMeta) {
+    return indexKhrBackupWithPassword(allocator, khr_path, null);
+}
+
+// Encrypted archives need the password even for listing: the index is sealed too.
+pub fn indexKhrBackupWithPassword(allocator: Allocator, khr_path: String, password: ?String) !std.ArrayList(EntryMeta) {
     const file = try fs.cwd().openFile(khr_path, .{});
     defer file.close();
 
@@ -850,644 +2692,995 @@ pub fn indexKhrBackup(allocator: Allocator, khr_path: String) !std.ArrayList(Ent
         entries.deinit();
     }
 
-    if (header.version != 2) return KhrError.UnsupportedVersion;
-    const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
-    if (is_encrypted) return KhrError.EncryptionFailed;
-
-    const V2_MAGIC = "KHRV2\n";
-
-    if (header.compression == .none) {
-        try file.seekTo(data_start);
-        var remaining = header.tar_size;
-        if (remaining < V2_MAGIC.len) return KhrError.ArchiveFormatFailed;
+    // a piped archive saved to a file has no TOC: read it front to back
+    if (header.version == pipe_stream.VERSION) {
+        var buffered = std.io.bufferedReader(file.reader());
+        const buffered_reader = buffered.reader();
+        try readPipedStream(allocator, buffered_reader.any(), &header, password, &entries, walkEntries);
+        return entries;
+    }
+    if (header.version != 2 and header.version != 3) return KhrError.UnsupportedVersion;
+    var cipher = try archiveCipher(allocator, &header, password);
+    defer if (cipher) |*c| c.wipe();
+    const cipher_ref: ?*const streaming_crypto.ChunkCipher = if (cipher) |*c| c else null;
+
+    // Fast path: the TOC footer, no payload decoding at all
+    if (try khr_index.readIndex(allocator, file, data_start + header.tar_size, cipher_ref)) |toc| {
+        var index = toc;
+        defer index.deinit();
+        try entries.ensureTotalCapacity(index.entries.len);
+        for (index.entries) |e| {
+            entries.appendAssumeCapacity(.{
+                .path = try allocator.dupe(u8, e.path),
+                .size = e.size,
+                .mtime = e.mtime,
+                .is_symlink = e.tag == TAG_SYMLINK,
+                .mode = e.mode,
+                .offset = e.offset,
+                .crc32 = e.crc32,
+            });
+        }
+        return entries;
+    }
+    // every v3 writer leaves a TOC, and walking chunk lists would mean opening the ancestors too
+    if (header.version == 3) return KhrError.ArchiveFormatFailed;
+
+    // Archives from before the footer existed: decode and walk the whole payload
+    const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, cipher_ref);
+    defer payload.close();
+
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    try v2.checkAgainst(allocator, &header, cipher_ref, null);
+    try walkEntries(allocator, &v2, &entries);
+    try v2.verify(header.checksum);
+    return entries;
+}
 
-        var hdrbuf: [6]u8 = undefined;
-        _ = try file.readAll(&hdrbuf);
-        if (!std.mem.eql(u8, &hdrbuf, V2_MAGIC)) return KhrError.ArchiveFormatFailed;
-        remaining -= V2_MAGIC.len;
+// Every record of a v2 stream into entries, bodies read past; the stream
+// is left at its end for the caller's checksum.
+fn walkEntries(allocator: Allocator, v2: *V2Reader, entries: *std.ArrayList(EntryMeta)) !void {
+    try v2.readMagic(V2_MAGIC);
+    while (try v2.next(allocator)) |record| {
+        if (record.tag == TAG_SOLID) {
+            defer record.deinit(allocator);
+            for (record.members.?) |m| {
+                const path = try allocator.dupe(u8, m.path);
+                entries.append(.{
+                    .path = path,
+                    .size = m.size,
+                    .mtime = m.mtime,
+                    .is_symlink = false,
+                    .mode = m.mode,
+                    .offset = v2.consumed,
+                }) catch |err| {
+                    allocator.free(path);
+                    return err;
+                };
+                try v2.readBody(m.size, null);
+            }
+            continue;
+        }
+        // the path moves into the entry, the rest of the record is freed here
+        const body_len = record.bodyLen();
+        if (record.target) |t| allocator.free(t);
+        if (record.extents) |list| allocator.free(list);
+        entries.append(.{
+            .path = record.path,
+            .size = record.size,
+            .mtime = record.mtime,
+            .is_symlink = record.tag == TAG_SYMLINK,
+            .mode = record.mode,
+            .offset = if (record.tag == TAG_FILE) v2.consumed else record.start,
+        }) catch |err| {
+            allocator.free(record.path);
+            return err;
+        };
+        if (record.tag == TAG_FILE or record.tag == TAG_SPARSE or record.tag == TAG_PART) try v2.readBody(body_len, null);
+    }
+}
 
-        var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-        hasher.update(V2_MAGIC);
+pub fn extractSelectedKhrBackup(allocator: Allocator, khr_path: String, password: ?String, extract_to: String, selected_paths: []const String) !void {
+    const file = try fs.cwd().openFile(khr_path, .{});
+    defer file.close();
 
-        var b4: [4]u8 = undefined;
-        var b8: [8]u8 = undefined;
-        var tagbuf: [1]u8 = undefined;
-        var tmp: [64 * 1024]u8 = undefined;
+    const header = try KhrHeader.read(file.reader());
+    const data_start = try file.getPos();
+    if (header.version == 3) {
+        // chunk references can point anywhere in the chain, so there's no cheap seek to one file
+        return extractKhrBackupChunked(allocator, khr_path, file, data_start, &header, password, extract_to, selected_paths);
+    }
+    if (header.version != 2) return KhrError.UnsupportedVersion;
+    var cipher = try archiveCipher(allocator, &header, password);
+    defer if (cipher) |*c| c.wipe();
+    const cipher_ref: ?*const streaming_crypto.ChunkCipher = if (cipher) |*c| c else null;
+
+    var toc = try khr_index.readIndex(allocator, file, data_start + header.tar_size, cipher_ref);
+    defer if (toc) |*t| t.deinit();
+    const tree = if (toc) |*t| try trustedTree(allocator, &header, cipher_ref, t) else null;
+    if (toc) |*index| {
+        // raw payloads seek by offset alone; compressed ones need the frame table
+        if (header.compression == .none or index.frames.len > 0) {
+            const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, cipher_ref);
+            defer payload.close();
+            try extractSelectedSeeking(allocator, payload, &header, index, tree, extract_to, selected_paths);
+            return;
+        }
+    }
 
-        while (remaining > 0) {
-            if (remaining < 1) break;
-            _ = try file.readAll(&tagbuf);
-            hasher.update(&tagbuf);
-            remaining -= 1;
-            const tag = tagbuf[0];
-
-            _ = try file.readAll(&b4);
-            hasher.update(&b4);
-            remaining -= b4.len;
-            const path_len = std.mem.readInt(u32, &b4, .little);
-
-            if (remaining < path_len) return KhrError.ArchiveFormatFailed;
-            const path_slice = try allocator.alloc(u8, path_len);
-            errdefer allocator.free(path_slice);
-            _ = try file.readAll(path_slice);
-            hasher.update(path_slice);
-            remaining -= path_len;
-
-            _ = try file.readAll(&b8);
-            hasher.update(&b8);
-            remaining -= b8.len;
-
-            _ = try file.readAll(&b8);
-            hasher.update(&b8);
-            remaining -= b8.len;
-            const mtime = std.mem.readInt(i64, &b8, .little);
-
-            if (tag == 1) {
-                _ = try file.readAll(&b8);
-                hasher.update(&b8);
-                remaining -= b8.len;
-                var size = std.mem.readInt(u64, &b8, .little);
-
-                try entries.append(.{ .path = path_slice, .size = size, .mtime = mtime, .is_symlink = false });
-
-                while (size > 0) {
-                    const chunk: usize = @intCast(@min(size, tmp.len));
-                    const n = try file.read(tmp[0..chunk]);
-                    if (n == 0) return KhrError.ArchiveFormatFailed;
-                    hasher.update(tmp[0..n]);
-                    size -= n;
-                    remaining -= n;
-                }
-            } else if (tag == 2) {
-                _ = try file.readAll(&b4);
-                hasher.update(&b4);
-                remaining -= b4.len;
-                const target_len = std.mem.readInt(u32, &b4, .little);
-                if (remaining < target_len) return KhrError.ArchiveFormatFailed;
-                const target = try allocator.alloc(u8, target_len);
-                errdefer allocator.free(target);
-                _ = try file.readAll(target);
-                hasher.update(target);
-                remaining -= target_len;
-                allocator.free(target);
-
-                try entries.append(.{ .path = path_slice, .size = 0, .mtime = mtime, .is_symlink = true });
-            } else {
-                allocator.free(path_slice);
-                return KhrError.ArchiveFormatFailed;
-            }
+    const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, cipher_ref);
+    defer payload.close();
+
+    // No usable TOC: unselected bodies have to be decoded to get past them (and to keep the checksum honest)
+    var dest = try Destination.init(allocator, extract_to);
+    defer dest.deinit();
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    try v2.checkAgainst(allocator, &header, cipher_ref, tree);
+    try v2.readMagic(V2_MAGIC);
+    while (try v2.next(allocator)) |record| {
+        defer record.deinit(allocator);
+        if (record.tag == TAG_SOLID) {
+            try restoreSolid(&v2, record, &dest, selected_paths);
+        } else if (isSelected(record.path, selected_paths)) {
+            try restoreRecord(&v2, record, &dest);
+        } else if (record.tag == TAG_FILE or record.tag == TAG_SPARSE or record.tag == TAG_PART) {
+            try v2.readBody(record.bodyLen(), null);
         }
+    }
+    try v2.verify(header.checksum);
+}
 
-        var checksum: [32]u8 = undefined;
-        hasher.final(&checksum);
-        if (!std.mem.eql(u8, &checksum, &header.checksum)) return KhrError.ChecksumMismatch;
-        return entries;
-    } else if (header.compression == .gzip) {
-        try file.seekTo(data_start);
-        var hasher = std.crypto.hash.sha2.Sha256.init(.{});
-        var limited = std.io.limitedReader(file.reader(), header.tar_size);
-        var dec = std.compress.gzip.decompressor(limited.reader());
-        var reader = dec.reader();
-
-        const magic = "KHRV2\n";
-        var hdrbuf: [6]u8 = undefined;
-        const mread = reader.readAll(&hdrbuf) catch |err| switch (err) {
-            error.EndOfStream => 0,
-            else => return KhrError.ArchiveFormatFailed,
+fn isSelected(path: String, list: []const String) bool {
+    for (list) |p| {
+        if (std.mem.eql(u8, path, p)) return true;
+    }
+    return false;
+}
+
+// Reads the decoded stream from any offset a whole Merkle block at a time, and
+// won't hand out a byte whose block doesn't hash to its leaf.
+const VerifiedBlocks = struct {
+    payload: *khr_codec.PayloadReader,
+    frames: []const khr_codec.Frame,
+    algorithm: HashAlgo,
+    tree: merkle.Tree,
+    block: []u8,
+    loaded: ?usize = null, // which block `data` holds
+    data: []const u8 = &[_]u8{}, // `block`, or the block in place on mapped payloads
+    pos: u64 = 0, // decoded offset of the next byte handed out
+
+    fn init(allocator: Allocator, payload: *khr_codec.PayloadReader, frames: []const khr_codec.Frame, algorithm: HashAlgo, tree: merkle.Tree) !VerifiedBlocks {
+        return .{
+            .payload = payload,
+            .frames = frames,
+            .algorithm = algorithm,
+            .tree = tree,
+            .block = try allocator.alloc(u8, merkle.BLOCK_SIZE),
         };
-        if (mread != magic.len or !std.mem.eql(u8, &hdrbuf, magic)) return KhrError.ArchiveFormatFailed;
-        hasher.update(magic);
+    }
 
-        var b4: [4]u8 = undefined;
-        var b8: [8]u8 = undefined;
-        var tagbuf: [1]u8 = undefined;
-        var tmp: [64 * 1024]u8 = undefined;
+    fn deinit(self: *VerifiedBlocks, allocator: Allocator) void {
+        allocator.free(self.block);
+    }
 
-        while (true) {
-            const tr = reader.readAll(&tagbuf) catch |err| {
-                if (err == error.EndOfStream) break;
-                return KhrError.ArchiveFormatFailed;
-            };
-            if (tr == 0) break;
-            if (tr != 1) return KhrError.ArchiveFormatFailed;
-            hasher.update(&tagbuf);
-            const tag = tagbuf[0];
-
-            const pr = reader.readAll(&b4) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (pr != b4.len) return KhrError.ArchiveFormatFailed;
-            hasher.update(&b4);
-            const path_len = std.mem.readInt(u32, &b4, .little);
-
-            const path_slice = try allocator.alloc(u8, path_len);
-            errdefer allocator.free(path_slice);
-            const got = reader.readAll(path_slice) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (got != path_len) return KhrError.ArchiveFormatFailed;
-            hasher.update(path_slice);
+    fn read(self: *VerifiedBlocks, dest: []u8) !usize {
+        const bi = self.tree.blockAt(self.pos);
+        if (self.loaded == null or self.loaded.? != bi) try self.load(bi);
+        const in_block: usize = @intCast(self.pos - self.tree.block(bi).start);
+        if (in_block >= self.data.len) return 0;
+        const n = @min(dest.len, self.data.len - in_block);
+        @memcpy(dest[0..n], self.data[in_block..][0..n]);
+        self.pos += n;
+        return n;
+    }
 
-            const mr = reader.readAll(&b8) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (mr != b8.len) return KhrError.ArchiveFormatFailed;
-            hasher.update(&b8);
+    fn load(self: *VerifiedBlocks, bi: usize) !void {
+        if (bi >= self.tree.leaves.len) return KhrError.ArchiveFormatFailed;
+        const b = self.tree.block(bi);
+        // the next block along is already where the payload is
+        const next_along = if (self.loaded) |l| l + 1 == bi else false;
+        if (!next_along) try self.payload.seekDecoded(b.start, self.frames);
+        self.loaded = null;
+        const data = self.payload.takeMapped(b.len) orelse
+            self.block[0..try self.payload.any().readAll(self.block[0..b.len])];
+        const leaf = merkle.leafHash(self.algorithm, data);
+        if (!std.mem.eql(u8, &leaf, &self.tree.leaves[bi])) return KhrError.ChecksumMismatch;
+        self.loaded = bi;
+        self.data = data;
+    }
 
-            const mt = reader.readAll(&b8) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (mt != b8.len) return KhrError.ArchiveFormatFailed;
-            hasher.update(&b8);
-            const mtime = std.mem.readInt(i64, &b8, .little);
-
-            if (tag == 1) {
-                const sr = reader.readAll(&b8) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (sr != b8.len) return KhrError.ArchiveFormatFailed;
-                hasher.update(&b8);
-                var size = std.mem.readInt(u64, &b8, .little);
-
-                try entries.append(.{ .path = path_slice, .size = size, .mtime = mtime, .is_symlink = false });
-
-                while (size > 0) {
-                    const chunk: usize = @intCast(@min(size, tmp.len));
-                    const n = reader.read(tmp[0..chunk]) catch |err| switch (err) {
-                        error.EndOfStream => 0,
-                        else => return KhrError.ArchiveFormatFailed,
-                    };
-                    if (n == 0) return KhrError.ArchiveFormatFailed;
-                    hasher.update(tmp[0..n]);
-                    size -= n;
-                }
-            } else if (tag == 2) {
-                const lr = reader.readAll(&b4) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (lr != b4.len) return KhrError.ArchiveFormatFailed;
-                hasher.update(&b4);
-                const target_len = std.mem.readInt(u32, &b4, .little);
-                const target = try allocator.alloc(u8, target_len);
-                errdefer allocator.free(target);
-                const got2 = reader.readAll(target) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (got2 != target_len) return KhrError.ArchiveFormatFailed;
-                hasher.update(target);
-                allocator.free(target);
+    fn any(self: *VerifiedBlocks) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
 
-                try entries.append(.{ .path = path_slice, .size = 0, .mtime = mtime, .is_symlink = true });
-            } else {
-                allocator.free(path_slice);
-                return KhrError.ArchiveFormatFailed;
-            }
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *VerifiedBlocks = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+};
+
+// Selective restore driven by the TOC: jump to each wanted entry instead of
+// decoding the payload in front of it. With Merkle leaves only the blocks an
+// entry overlaps are hashed and checked; older archives have no checksum that
+// covers part of the stream, so their file bodies are checked against the
+// crc32 from the index instead.
+fn extractSelectedSeeking(allocator: Allocator, payload: *khr_codec.PayloadReader, header: *const KhrHeader, index: *const khr_index.Index, tree: ?merkle.Tree, extract_to: String, selected_paths: []const String) !void {
+    var blocks: ?VerifiedBlocks = if (tree) |t| try VerifiedBlocks.init(allocator, payload, index.frames, header.hash, t) else null;
+    defer if (blocks) |*b| b.deinit(allocator);
+
+    var dest = try Destination.init(allocator, extract_to);
+    defer dest.deinit();
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    if (blocks) |*b| {
+        // everything goes through the block check, so no zero-copy bypass either
+        v2.source = b.any();
+        v2.raw = null;
+    } else {
+        v2.check_crc = true;
+    }
+    for (index.entries) |*e| {
+        if (!isSelected(e.path, selected_paths)) continue;
+        if (e.tag != TAG_HARDLINK) {
+            try restoreIndexed(allocator, &v2, payload, if (blocks) |*b| b else null, index.frames, e, e.path, &dest);
+            continue;
         }
+        try seekIndexed(payload, if (blocks) |*b| b else null, index.frames, e);
+        const record = (try v2.next(allocator)) orelse return KhrError.ArchiveFormatFailed;
+        defer record.deinit(allocator);
+        if (record.tag != TAG_HARDLINK) return KhrError.ArchiveFormatFailed;
+        if (try restoreHardlink(&dest, try restoreTarget(&dest, record.path), record.target.?)) continue;
+        // the name it links to wasn't selected: restore that entry's contents under this one
+        const target = for (index.entries) |*t| {
+            if (t.tag != TAG_HARDLINK and std.mem.eql(u8, t.path, record.target.?)) break t;
+        } else return KhrError.ArchiveFormatFailed;
+        try restoreIndexed(allocator, &v2, payload, if (blocks) |*b| b else null, index.frames, target, record.path, &dest);
+    }
+}
 
-        var checksum: [32]u8 = undefined;
-        hasher.final(&checksum);
-        if (!std.mem.eql(u8, &checksum, &header.checksum)) return KhrError.ChecksumMismatch;
-        return entries;
+fn seekIndexed(payload: *khr_codec.PayloadReader, blocks: ?*VerifiedBlocks, frames: []const khr_codec.Frame, e: *const khr_index.IndexEntry) !void {
+    payload.willNeed(e.offset, e.size);
+    if (blocks) |b| {
+        b.pos = e.offset;
     } else {
-        return KhrError.CompressionFailed;
+        try payload.seekDecoded(e.offset, frames);
     }
 }
 
-pub fn extractSelectedKhrBackup(allocator: Allocator, khr_path: String, password: ?String, extract_to: String, selected_paths: []const String) !void {
-    _ = password; // streaming selection currently unsupported for encrypted payloads
-    const file = try fs.cwd().openFile(khr_path, .{});
-    defer file.close();
+// Restore TOC entry e under path, which is e.path or a hard link standing in for it.
+fn restoreIndexed(allocator: Allocator, v2: *V2Reader, payload: *khr_codec.PayloadReader, blocks: ?*VerifiedBlocks, frames: []const khr_codec.Frame, e: *const khr_index.IndexEntry, path: String, dest: *Destination) !void {
+    try seekIndexed(payload, blocks, frames, e);
+    if (e.tag == TAG_SYMLINK or e.tag == TAG_SPARSE or e.tag == TAG_PART) {
+        // these offsets point at the record itself: the link target or extent list isn't in the index
+        var record = (try v2.next(allocator)) orelse return KhrError.ArchiveFormatFailed;
+        defer record.deinit(allocator);
+        if (record.tag != e.tag) return KhrError.ArchiveFormatFailed;
+        const renamed = try allocator.dupe(u8, path);
+        allocator.free(record.path);
+        record.path = renamed;
+        try restoreRecord(v2, record, dest);
+    } else {
+        const record = V2Record{
+            .tag = TAG_FILE,
+            .path = try allocator.dupe(u8, path),
+            .mode = e.mode,
+            .mtime = e.mtime,
+            .start = e.offset,
+            .size = e.size,
+        };
+        defer record.deinit(allocator);
+        try restoreRecord(v2, record, dest);
+        if (v2.check_crc and v2.body_crc.final() != e.crc32) return KhrError.ChecksumMismatch;
+    }
+}
 
-    const header = try KhrHeader.read(file.reader());
-    const data_start = try file.getPos();
-    if (header.version != 2) return KhrError.UnsupportedVersion;
-    const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
-    if (is_encrypted) return KhrError.EncryptionFailed;
+// ---- v1 archives ----
+//
+// Nothing writes these any more, but old backups still have to restore.
+// Stored payload: the stream below compressed as a single gzip, lz4 or zstd
+// stream, then with a password sealed as one ChaCha20-Poly1305 message
+// (streaming_crypto.LegacyReader); header.checksum is a SHA-256 of the stored
+// bytes. Decoded stream:
+//   "KROWNO_BACKUP_V1\n"
+//   Repeated entries:
+//     "FILE: " path "\n"
+//     "LEN: " decimal size "\n"
+//     "MTIME: " decimal mtime "\n"
+//     data: [size]u8
+// Reading is streamed like v2: the checksum and the tag each take one pass
+// over the file, then decrypting, decoding and writing go through fixed
+// buffers, so memory doesn't grow with the archive.
+
+const V1_MAGIC = "KROWNO_BACKUP_V1\n";
+
+// Decodes the whole stored stream; v1 has no frames, so there is nothing to seek by.
+const V1Decoder = union(enum) {
+    none: std.io.AnyReader,
+    gzip: std.compress.gzip.Decompressor(std.io.AnyReader),
+    lz4: lz4.StreamDecompressor,
+    zstd: zstd.StreamDecompressor,
+
+    fn init(allocator: Allocator, source: std.io.AnyReader, compression: CompressionType) !V1Decoder {
+        return switch (compression) {
+            .none => .{ .none = source },
+            .gzip => .{ .gzip = std.compress.gzip.decompressor(source) },
+            .lz4 => .{ .lz4 = try lz4.StreamDecompressor.init(allocator, source) },
+            .zstd => .{ .zstd = try zstd.StreamDecompressor.init(allocator, source) },
+        };
+    }
 
-    const V2_MAGIC = "KHRV2\n";
-    const shouldExtract = struct {
-        fn check(path: String, list: []const String) bool {
-            for (list) |p| {
-                if (std.mem.eql(u8, path, p)) return true;
-            }
-            return false;
+    fn deinit(self: *V1Decoder) void {
+        switch (self.*) {
+            .none, .gzip => {},
+            .lz4 => |*l| l.deinit(),
+            .zstd => |*z| z.deinit(),
         }
-    }.check;
+    }
 
-    if (header.compression == .none) {
-        try file.seekTo(data_start);
-        var remaining = header.tar_size;
-        if (remaining < V2_MAGIC.len) return KhrError.ArchiveFormatFailed;
-        var hdrbuf: [6]u8 = undefined;
-        _ = try file.readAll(&hdrbuf);
-        if (!std.mem.eql(u8, &hdrbuf, V2_MAGIC)) return KhrError.ArchiveFormatFailed;
-        remaining -= V2_MAGIC.len;
+    fn read(self: *V1Decoder, dest: []u8) anyerror!usize {
+        return switch (self.*) {
+            .none => |r| r.read(dest),
+            .gzip => |*g| g.read(dest) catch return KhrError.DecompressionFailed,
+            .lz4 => |*l| l.read(dest),
+            .zstd => |*z| z.read(dest),
+        };
+    }
 
-        var b4: [4]u8 = undefined;
-        var b8: [8]u8 = undefined;
-        var tagbuf: [1]u8 = undefined;
-        var tmp: [64 * 1024]u8 = undefined;
+    fn any(self: *V1Decoder) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
 
-        while (remaining > 0) {
-            if (remaining < 1) break;
-            _ = try file.readAll(&tagbuf);
-            remaining -= 1;
-            const tag = tagbuf[0];
-
-            _ = try file.readAll(&b4);
-            remaining -= b4.len;
-            const path_len = std.mem.readInt(u32, &b4, .little);
-            if (remaining < path_len) return KhrError.ArchiveFormatFailed;
-            const path_slice = try allocator.alloc(u8, path_len);
-            defer allocator.free(path_slice);
-            _ = try file.readAll(path_slice);
-            remaining -= path_len;
-
-            _ = try file.readAll(&b8);
-            remaining -= b8.len;
-
-            _ = try file.readAll(&b8);
-            remaining -= b8.len;
-
-            if (tag == 1) {
-                _ = try file.readAll(&b8);
-                remaining -= b8.len;
-                var size = std.mem.readInt(u64, &b8, .little);
-
-                const do_extract = shouldExtract(path_slice, selected_paths);
-                var out: ?fs.File = null;
-                if (do_extract) {
-                    const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, path_slice });
-                    defer allocator.free(full_path);
-                    if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-                    out = try std.fs.cwd().createFile(full_path, .{});
-                }
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *V1Decoder = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+};
 
-                while (size > 0) {
-                    const chunk: usize = @intCast(@min(size, tmp.len));
-                    const n = try file.read(tmp[0..chunk]);
-                    if (n == 0) return KhrError.ArchiveFormatFailed;
-                    if (do_extract) try out.?.writeAll(tmp[0..n]);
-                    size -= n;
-                    remaining -= n;
-                }
-                if (out) |f| f.close();
-            } else if (tag == 2) {
-                _ = try file.readAll(&b4);
-                remaining -= b4.len;
-                const target_len = std.mem.readInt(u32, &b4, .little);
-                if (remaining < target_len) return KhrError.ArchiveFormatFailed;
-                const target = try allocator.alloc(u8, target_len);
-                defer allocator.free(target);
-                _ = try file.readAll(target);
-                remaining -= target_len;
-
-                if (shouldExtract(path_slice, selected_paths)) {
-                    const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, path_slice });
-                    defer allocator.free(full_path);
-                    if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-                    const c_link = try allocator.allocSentinel(u8, full_path.len, 0);
-                    defer allocator.free(c_link);
-                    std.mem.copyForwards(u8, c_link, full_path);
-                    const c_target = try allocator.allocSentinel(u8, target.len, 0);
-                    defer allocator.free(c_target);
-                    std.mem.copyForwards(u8, c_target, target);
-                    posix.symlinkZ(c_target.ptr, c_link.ptr) catch {};
-                }
-            } else {
-                return KhrError.ArchiveFormatFailed;
-            }
+fn extractKhrBackupV1(allocator: Allocator, file: fs.File, data_start: u64, header: *const KhrHeader, password: ?String, extract_to: String) !void {
+    // the checksum covers the stored bytes, so it's settled before anything is decoded
+    try checkStoredSha256(file, data_start, header.tar_size, header.checksum);
+
+    const raw = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, .none, null);
+    defer raw.close();
+    var source = raw.any();
+    var sealed: ?streaming_crypto.LegacyReader = null;
+    defer if (sealed) |*l| l.deinit();
+    const is_encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0);
+    if (is_encrypted) {
+        const pw = password orelse return KhrError.DecryptionFailed;
+        sealed = try streaming_crypto.LegacyReader.init(allocator, pw, file, data_start, header.tar_size);
+        try sealed.?.verify();
+        source = sealed.?.any();
+    }
+
+    var decoder = try V1Decoder.init(allocator, source, header.compression);
+    defer decoder.deinit();
+    var buffered = std.io.bufferedReader(decoder.any());
+    const reader = buffered.reader();
+
+    var magic: [V1_MAGIC.len]u8 = undefined;
+    if (try reader.readAll(&magic) != magic.len or !std.mem.eql(u8, &magic, V1_MAGIC)) return KhrError.ArchiveFormatFailed;
+
+    var line = std.ArrayList(u8).init(allocator);
+    defer line.deinit();
+    var body: [64 * 1024]u8 = undefined;
+    var dest = try Destination.init(allocator, extract_to);
+    defer dest.deinit();
+    // anything that isn't another entry ends the archive, as it always has
+    while (try readV1Field(reader, &line, "FILE: ")) |path| {
+        const t = try restoreTarget(&dest, path);
+        const len_str = (try readV1Field(reader, &line, "LEN: ")) orelse return KhrError.ArchiveFormatFailed;
+        const file_len = std.fmt.parseInt(u64, len_str, 10) catch return KhrError.ArchiveFormatFailed;
+        // v1 recorded mtimes but never restored them
+        _ = (try readV1Field(reader, &line, "MTIME: ")) orelse return KhrError.ArchiveFormatFailed;
+
+        const out = try dir_cache.createFile(t.dir, t.name, true);
+        defer out.close();
+        var left = file_len;
+        while (left > 0) {
+            const n = try reader.read(body[0..@intCast(@min(left, body.len))]);
+            if (n == 0) return KhrError.ArchiveFormatFailed;
+            try out.writeAll(body[0..n]);
+            left -= n;
         }
-        return;
-    } else if (header.compression == .gzip) {
-        try file.seekTo(data_start);
-        var limited = std.io.limitedReader(file.reader(), header.tar_size);
-        var dec = std.compress.gzip.decompressor(limited.reader());
-        var reader = dec.reader();
-
-        const magic = "KHRV2\n";
-        var hdrbuf: [6]u8 = undefined;
-        const mread = reader.readAll(&hdrbuf) catch |err| switch (err) {
-            error.EndOfStream => 0,
-            else => return KhrError.ArchiveFormatFailed,
-        };
-        if (mread != magic.len or !std.mem.eql(u8, &hdrbuf, magic)) return KhrError.ArchiveFormatFailed;
+    }
+}
 
-        var b4: [4]u8 = undefined;
-        var b8: [8]u8 = undefined;
-        var tagbuf: [1]u8 = undefined;
-        var tmp: [64 * 1024]u8 = undefined;
+// The value of one "TAG: value\n" line, valid until the next call; null at
+// the end of the stream or when the line is something else.
+fn readV1Field(reader: anytype, line: *std.ArrayList(u8), comptime tag: []const u8) !?[]const u8 {
+    line.clearRetainingCapacity();
+    reader.streamUntilDelimiter(line.writer(), '\n', tag.len + MAX_RECORD_PATH) catch |err| switch (err) {
+        error.EndOfStream => return null,
+        error.StreamTooLong => return KhrError.ArchiveFormatFailed,
+        else => return err,
+    };
+    if (!std.mem.startsWith(u8, line.items, tag)) return null;
+    return line.items[tag.len..];
+}
 
-        while (true) {
-            const tr = reader.readAll(&tagbuf) catch |err| {
-                if (err == error.EndOfStream) break;
-                return KhrError.ArchiveFormatFailed;
-            };
-            if (tr == 0) break;
-            if (tr != 1) return KhrError.ArchiveFormatFailed;
-            const tag = tagbuf[0];
+fn checkStoredSha256(file: fs.File, start: u64, len: u64, expected: [32]u8) !void {
+    var hasher = std.crypto.hash.sha2.Sha256.init(.{});
+    var buf: [256 * 1024]u8 = undefined;
+    var done: u64 = 0;
+    while (done < len) {
+        const want: usize = @intCast(@min(len - done, buf.len));
+        if (try file.preadAll(buf[0..want], start + done) != want) return KhrError.ChecksumMismatch;
+        hasher.update(buf[0..want]);
+        done += want;
+    }
+    var checksum: [32]u8 = undefined;
+    hasher.final(&checksum);
+    if (!std.mem.eql(u8, &checksum, &expected)) return KhrError.ChecksumMismatch;
+}
 
-            const pr = reader.readAll(&b4) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (pr != b4.len) return KhrError.ArchiveFormatFailed;
-            const path_len = std.mem.readInt(u32, &b4, .little);
-
-            const path_slice = try allocator.alloc(u8, path_len);
-            defer allocator.free(path_slice);
-            const got = reader.readAll(path_slice) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (got != path_len) return KhrError.ArchiveFormatFailed;
+// Fresh salt and base nonce for a new v2 archive, with the KDF cost recorded
+// so the archive still opens if the defaults change later.
+fn deriveEncryptionInfo() EncryptionInfo {
+    var salt: [32]u8 = undefined;
+    var nonce: [12]u8 = undefined;
+    std.crypto.random.bytes(&salt);
+    std.crypto.random.bytes(&nonce);
 
-            const mr = reader.readAll(&b8) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (mr != b8.len) return KhrError.ArchiveFormatFailed;
+    return EncryptionInfo{
+        .salt = salt,
+        .nonce = nonce,
+        .opslimit = security.KDF_ITERATIONS,
+        .memlimit = security.KDF_MEMORY_KIB * 1024,
+    };
+}
 
-            const mt = reader.readAll(&b8) catch |err| switch (err) {
-                error.EndOfStream => 0,
-                else => return KhrError.ArchiveFormatFailed,
-            };
-            if (mt != b8.len) return KhrError.ArchiveFormatFailed;
+// a hostile header shouldn't be able to ask argon2 for all the ram in the machine
+const MAX_KDF_MEMORY: u32 = 1024 * 1024 * 1024;
+
+// Key for a v2 archive's sealed payload and index; null when the archive isn't
+// encrypted. Callers wipe() it when done.
+pub fn archiveCipher(allocator: Allocator, header: *const KhrHeader, password: ?String) !?streaming_crypto.ChunkCipher {
+    const info = &header.encryption;
+    if (info.opslimit == 0 and info.memlimit == 0) return null;
+    const pw = password orelse return KhrError.DecryptionFailed;
+    if (info.algorithm != .chacha20_poly1305 or info.kdf != .argon2id) return KhrError.DecryptionFailed;
+    if (info.opslimit == 0 or info.memlimit > MAX_KDF_MEMORY) return KhrError.InvalidKhrFile;
+    return try streaming_crypto.ChunkCipher.derive(allocator, pw, info.salt, info.nonce, info.opslimit, info.memlimit / 1024);
+}
 
-            if (tag == 1) {
-                const sr = reader.readAll(&b8) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (sr != b8.len) return KhrError.ArchiveFormatFailed;
-                var size = std.mem.readInt(u64, &b8, .little);
-
-                const do_extract = shouldExtract(path_slice, selected_paths);
-                var out: ?fs.File = null;
-                if (do_extract) {
-                    const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, path_slice });
-                    defer allocator.free(full_path);
-                    if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-                    out = try std.fs.cwd().createFile(full_path, .{});
-                }
+// The TOC's Merkle leaves (and segments, on appended archives), once they've
+// been checked against the root in the header; null when the archive predates
+// the tree and header.checksum is a flat SHA-256 of the stream. The slices
+// belong to index.
+fn trustedTree(allocator: Allocator, header: *const KhrHeader, cipher: ?*const streaming_crypto.ChunkCipher, index: *const khr_index.Index) !?merkle.Tree {
+    if (index.leaves.len == 0) return null;
+    const tree = merkle.Tree{ .leaves = index.leaves, .segments = index.segments };
+    if (tree.segments.len == 0) {
+        const root = try merkle.root(allocator, header.hash, tree.leaves);
+        if (!std.mem.eql(u8, &(try checksumFor(header, cipher, root)), &header.checksum)) return KhrError.ChecksumMismatch;
+        return tree;
+    }
 
-                while (size > 0) {
-                    const chunk: usize = @intCast(@min(size, tmp.len));
-                    const n = reader.read(tmp[0..chunk]) catch |err| switch (err) {
-                        error.EndOfStream => 0,
-                        else => return KhrError.ArchiveFormatFailed,
-                    };
-                    if (n == 0) return KhrError.ArchiveFormatFailed;
-                    if (do_extract) try out.?.writeAll(tmp[0..n]);
-                    size -= n;
-                }
-                if (out) |f| f.close();
-            } else if (tag == 2) {
-                const lr = reader.readAll(&b4) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (lr != b4.len) return KhrError.ArchiveFormatFailed;
-                const target_len = std.mem.readInt(u32, &b4, .little);
-                const target = try allocator.alloc(u8, target_len);
-                defer allocator.free(target);
-                const got2 = reader.readAll(target) catch |err| switch (err) {
-                    error.EndOfStream => 0,
-                    else => return KhrError.ArchiveFormatFailed,
-                };
-                if (got2 != target_len) return KhrError.ArchiveFormatFailed;
-
-                if (shouldExtract(path_slice, selected_paths)) {
-                    const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, path_slice });
-                    defer allocator.free(full_path);
-                    if (std.fs.path.dirname(full_path)) |d| std.fs.cwd().makePath(d) catch {};
-                    const c_link = try allocator.allocSentinel(u8, full_path.len, 0);
-                    defer allocator.free(c_link);
-                    std.mem.copyForwards(u8, c_link, full_path);
-                    const c_target = try allocator.allocSentinel(u8, target.len, 0);
-                    defer allocator.free(c_target);
-                    std.mem.copyForwards(u8, c_target, target);
-                    posix.symlinkZ(c_target.ptr, c_link.ptr) catch {};
-                }
-            } else {
-                return KhrError.ArchiveFormatFailed;
-            }
-        }
-        return;
-    } else {
-        return KhrError.CompressionFailed;
+    if (tree.segments[0].decoded_start != 0) return KhrError.ArchiveFormatFailed;
+    var first: u64 = 0;
+    for (tree.segments, 0..) |seg, i| {
+        if (seg.leaf_count == 0 or seg.leaf_count > tree.leaves.len - first) return KhrError.ArchiveFormatFailed;
+        if (i > 0 and seg.decoded_start <= tree.segments[i - 1].decoded_start) return KhrError.ArchiveFormatFailed;
+        const count: usize = @intCast(seg.leaf_count);
+        const start: usize = @intCast(first);
+        const root = try merkle.root(allocator, header.hash, tree.leaves[start..][0..count]);
+        if (!std.mem.eql(u8, &root, &seg.root)) return KhrError.ChecksumMismatch;
+        first += seg.leaf_count;
     }
+    if (first != tree.leaves.len) return KhrError.ArchiveFormatFailed;
+    const root = try merkle.segmentsRoot(allocator, header.hash, tree.segments);
+    if (!std.mem.eql(u8, &(try checksumFor(header, cipher, root)), &header.checksum)) return KhrError.ChecksumMismatch;
+    return tree;
 }
 
-fn createTarArchive(allocator: Allocator, source_paths: []const String) ![]u8 {
-    // Create a simple length-prefixed archive format:
-    // Header: "KROWNO_BACKUP_V1\n"
-    // For each file:
-    //   "FILE: {path}\n"
-    //   "LEN: {size}\n"
-    //   "MTIME: {mtime}\n"
-    //   raw {size} bytes of file content
-    var out = std.ArrayList(u8).init(allocator);
-    defer out.deinit();
+// What header.checksum holds for a stream with this root. A sealed
+// archive's header is in the clear, so its checksum is keyed with the
+// archive key (ChunkCipher.keyedDigest): a bare root would let anyone
+// without the password confirm a guess at the contents. Sealed archives
+// with older headers have the bare root.
+fn checksumFor(header: *const KhrHeader, cipher: ?*const streaming_crypto.ChunkCipher, root: merkle.Digest) !merkle.Digest {
+    if (!header.checksum_keyed) return root;
+    const c = cipher orelse return KhrError.DecryptionFailed;
+    return c.keyedDigest(root);
+}
+
+// Check an archive's payload against header.checksum without restoring
+// anything. With Merkle leaves in the TOC the blocks are hashed on every core;
+// archives from before the tree, and compressed ones without a frame table,
+// are hashed front to back. v3 chunk references aren't followed: this checks
+// the archive's own bytes, not its ancestors.
+pub fn verifyKhrBackup(allocator: Allocator, khr_path: String, password: ?String) !void {
+    const file = try fs.cwd().openFile(khr_path, .{});
+    defer file.close();
+
+    const header = try KhrHeader.read(file.reader());
+    const data_start = try file.getPos();
+    // a piped archive saved to a file: the whole stream, against its trailer
+    if (header.version == pipe_stream.VERSION) {
+        var entries = std.ArrayList(EntryMeta).init(allocator);
+        defer {
+            for (entries.items) |*e| e.deinit(allocator);
+            entries.deinit();
+        }
+        var buffered = std.io.bufferedReader(file.reader());
+        const buffered_reader = buffered.reader();
+        return readPipedStream(allocator, buffered_reader.any(), &header, password, &entries, walkEntries);
+    }
+    if (header.version != 2 and header.version != 3) return KhrError.UnsupportedVersion;
+    var cipher = try archiveCipher(allocator, &header, password);
+    defer if (cipher) |*c| c.wipe();
+    const cipher_ref: ?*const streaming_crypto.ChunkCipher = if (cipher) |*c| c else null;
+
+    var toc = try khr_index.readIndex(allocator, file, data_start + header.tar_size, cipher_ref);
+    defer if (toc) |*t| t.deinit();
+    const tree = if (toc) |*t| try trustedTree(allocator, &header, cipher_ref, t) else null;
+    if (tree) |t| {
+        const frames = toc.?.frames;
+        if (header.compression == .none or frames.len > 0) {
+            return verifyBlocksParallel(allocator, khr_path, data_start, &header, cipher_ref, frames, t);
+        }
+    }
+
+    const payload = try khr_codec.PayloadReader.open(allocator, file, data_start, header.tar_size, header.compression, cipher_ref);
+    defer payload.close();
+    var v2 = V2Reader.init(payload, header.hash);
+    defer v2.deinit();
+    try v2.checkAgainst(allocator, &header, cipher_ref, tree);
+    const buf = try allocator.alloc(u8, 256 * 1024);
+    defer allocator.free(buf);
+    while (true) {
+        const n = try payload.read(buf);
+        if (n == 0) break;
+        try v2.absorb(buf[0..n]);
+    }
+    try v2.verify(header.checksum);
+}
 
-    try out.appendSlice("KROWNO_BACKUP_V1\n");
+// One worker's share of verifyBlocksParallel: a contiguous run of blocks, read
+// through its own file handle and decoder so nothing is shared but the key.
+const BlockRange = struct {
+    allocator: Allocator,
+    khr_path: String,
+    data_start: u64,
+    header: *const KhrHeader,
+    cipher: ?*const streaming_crypto.ChunkCipher,
+    frames: []const khr_codec.Frame,
+    tree: merkle.Tree,
+    first: usize,
+    end: usize,
+    err: ?anyerror = null,
+
+    fn run(self: *BlockRange) void {
+        self.check() catch |err| {
+            self.err = err;
+        };
+    }
 
-    for (source_paths) |path| {
-        const file = fs.cwd().openFile(path, .{}) catch continue;
+    fn check(self: *BlockRange) !void {
+        const file = try fs.cwd().openFile(self.khr_path, .{});
         defer file.close();
+        const payload = try khr_codec.PayloadReader.open(self.allocator, file, self.data_start, self.header.tar_size, self.header.compression, self.cipher);
+        defer payload.close();
+        const block = try self.allocator.alloc(u8, merkle.BLOCK_SIZE);
+        defer self.allocator.free(block);
+
+        // blocks run on back to back, across segment boundaries too
+        try payload.seekDecoded(self.tree.block(self.first).start, self.frames);
+        for (self.first..self.end) |bi| {
+            const len = self.tree.block(bi).len;
+            const data = payload.takeMapped(len) orelse block[0..try payload.any().readAll(block[0..len])];
+            const leaf = merkle.leafHash(self.header.hash, data);
+            if (!std.mem.eql(u8, &leaf, &self.tree.leaves[bi])) return KhrError.ChecksumMismatch;
+        }
+        // bytes past the last leaf aren't covered by anything
+        if (self.end == self.tree.leaves.len and try payload.read(block[0..1]) != 0) return KhrError.ChecksumMismatch;
+    }
+};
+
+fn verifyBlocksParallel(
+    allocator: Allocator,
+    khr_path: String,
+    data_start: u64,
+    header: *const KhrHeader,
+    cipher: ?*const streaming_crypto.ChunkCipher,
+    frames: []const khr_codec.Frame,
+    tree: merkle.Tree,
+) !void {
+    const leaves = tree.leaves;
+    const cpus = std.Thread.getCpuCount() catch 1;
+    const workers = @max(1, @min(cpus, leaves.len));
+    const ranges = try allocator.alloc(BlockRange, workers);
+    defer allocator.free(ranges);
+    const threads = try allocator.alloc(std.Thread, workers);
+    defer allocator.free(threads);
+
+    const per = leaves.len / workers;
+    const extra = leaves.len % workers;
+    var first: usize = 0;
+    for (ranges, 0..) |*r, i| {
+        const count = per + @intFromBool(i < extra);
+        r.* = .{
+            .allocator = allocator,
+            .khr_path = khr_path,
+            .data_start = data_start,
+            .header = header,
+            .cipher = cipher,
+            .frames = frames,
+            .tree = tree,
+            .first = first,
+            .end = first + count,
+        };
+        first += count;
+    }
+
+    // the first range runs here; if spawning fails the rest just run here too
+    var spawned: usize = 0;
+    for (ranges[1..], threads[1..]) |*r, *t| {
+        t.* = std.Thread.spawn(.{}, BlockRange.run, .{r}) catch break;
+        spawned += 1;
+    }
+    ranges[0].run();
+    for (ranges[1 + spawned ..]) |*r| r.run();
+    for (threads[1 .. 1 + spawned]) |t| t.join();
 
-        const stat = file.stat() catch continue;
-        const contents = file.readToEndAlloc(allocator, std.math.maxInt(usize)) catch continue;
-        defer allocator.free(contents);
+    for (ranges) |r| {
+        if (r.err) |err| return err;
+    }
+}
 
-        const file_line = try std.fmt.allocPrint(allocator, "FILE: {s}\n", .{path});
-        defer allocator.free(file_line);
-        try out.appendSlice(file_line);
+// ---- multi-volume sets ----
+//
+// With options.volume_size the archive is written as a set of volumes named
+// <output_path>.001, .002, ... (in options.volume_dirs, round-robin, when
+// given). Each volume is a whole v2 archive holding its share of the files,
+// with its own header, TOC and Merkle root, so one can be copied, verified
+// or sent again on its own; its TOC says which set it's in and where
+// (khr_index.Volume). Volumes are filled by uncompressed size with room left
+// for headers, TOC and codec framing, so compression can only make them
+// smaller than volume_size. A file that doesn't fit in what's left of a
+// volume starts the next one, and one bigger than a whole volume is cut into
+// tag 8 parts across as many as it takes. There's one writer thread per
+// target directory, so every disk is busy at once, and a restore takes the
+// volumes on as many threads as there are cpus.
+
+// Smaller volumes would be mostly overhead
+pub const MIN_VOLUME_SIZE: u64 = 1024 * 1024;
+// Kept free in every volume for the header, magic, TOC and trailer
+const VOLUME_RESERVE: u64 = 64 * 1024;
+// Volume names have three digits
+const MAX_VOLUMES: usize = 999;
+
+// A byte range of a file too big for one volume.
+const FilePart = struct {
+    path: String,
+    offset: u64,
+    len: u64,
+    size: FileSize, // the whole file's
+};
 
-        const len_line = try std.fmt.allocPrint(allocator, "LEN: {d}\n", .{contents.len});
-        defer allocator.free(len_line);
-        try out.appendSlice(len_line);
+// What goes into one volume.
+const VolumeShare = struct {
+    info: khr_index.Volume,
+    paths: std.ArrayList(String),
+    parts: std.ArrayList(FilePart),
+};
 
-        const mtime_line = try std.fmt.allocPrint(allocator, "MTIME: {d}\n", .{stat.mtime});
-        defer allocator.free(mtime_line);
-        try out.appendSlice(mtime_line);
+// How extractKhrBackupFile treats an archive that is one volume of a set.
+const VolumeMode = union(enum) {
+    whole_set: []const String, // restore every volume, looking in these directories too
+    only: khr_index.Volume, // restore just this one, which has to be this volume
+};
 
-        // Raw bytes
-        try out.appendSlice(contents);
+fn freeVolumes(allocator: Allocator, shares: []VolumeShare) void {
+    for (shares) |*sh| {
+        sh.paths.deinit();
+        sh.parts.deinit();
     }
+    allocator.free(shares);
+}
 
-    return out.toOwnedSlice();
+// Record header and TOC entry of a path, roughly; plenty for solid members too.
+fn entryOverhead(path: String) u64 {
+    return 2 * @as(u64, path.len) + 96;
 }
 
-fn extractTarArchive(allocator: Allocator, data: String, extract_to: String) !void {
-    // Sanitize and ensure extracted paths remain inside extract_to
-    const sanitize = struct {
-        fn sanitizeRelativePath(alloc: Allocator, p: String) ![]u8 {
-            // Strip leading '/'
-            var start: usize = 0;
-            while (start < p.len and p[start] == '/') start += 1;
-            var out = std.ArrayList(u8).init(alloc);
-            errdefer out.deinit();
-            var it = std.mem.splitScalar(u8, p[start..], '/');
-            var first = true;
-            while (it.next()) |seg| {
-                if (seg.len == 0 or std.mem.eql(u8, seg, ".") or std.mem.eql(u8, seg, "..")) {
-                    return KhrError.ArchiveFormatFailed;
-                }
-                if (!first) try out.append('/');
-                first = false;
-                try out.appendSlice(seg);
+const PlannedEntry = struct {
+    size: u64 = 0,
+    inode: ?batch_reader.Inode = null, // files with more than one name
+};
+
+// Body size a path will have in the archive: nothing for symlinks and for
+// what can't be statted (the writer skips or rechecks those).
+fn plannedEntry(path: String) PlannedEntry {
+    const st = posix.fstatat(posix.AT.FDCWD, path, posix.AT.SYMLINK_NOFOLLOW) catch return .{};
+    if (!posix.S.ISREG(st.mode)) return .{};
+    return .{
+        .size = @intCast(st.size),
+        .inode = if (st.nlink > 1) .{ .dev = @intCast(st.dev), .ino = @intCast(st.ino) } else null,
+    };
+}
+
+// Share source_paths out over as few volumes of volume_size as they fit in.
+// Every name of a hard-linked file goes in the volume its body went to, where
+// the writer stores the others as links; a file too big for one volume is
+// split, and its other names become copies.
+fn planVolumes(allocator: Allocator, source_paths: []const String, volume_size: u64) ![]VolumeShare {
+    var shares = std.ArrayList(VolumeShare).init(allocator);
+    errdefer {
+        for (shares.items) |*sh| {
+            sh.paths.deinit();
+            sh.parts.deinit();
+        }
+        shares.deinit();
+    }
+    // the 1/64 covers stored bodies' codec framing and the Merkle leaves
+    const budget = volume_size - volume_size / 64 - VOLUME_RESERVE;
+
+    // in the writer's order, so what sits together in a volume still does
+    const ordered = try allocator.dupe(String, source_paths);
+    defer allocator.free(ordered);
+    std.mem.sort(String, ordered, {}, solidOrderLessThan);
+
+    var left: u64 = 0; // room in the last volume
+    // the volume each hard-linked body went to
+    var linked = std.AutoHashMap(batch_reader.Inode, usize).init(allocator);
+    defer linked.deinit();
+    for (ordered) |path| {
+        const planned = plannedEntry(path);
+        const size = planned.size;
+        const overhead = entryOverhead(path);
+        if (planned.inode) |inode| {
+            // a link record only; the 1/64 taken off the budget covers it in an earlier volume
+            if (linked.get(inode)) |v| {
+                try shares.items[v].paths.append(path);
+                if (v == shares.items.len - 1) left -|= overhead;
+                continue;
             }
-            if (out.items.len == 0) return KhrError.ArchiveFormatFailed;
-            return out.toOwnedSlice();
         }
-    };
-    var i: usize = 0;
-    // Expect header
-    const magic = "KROWNO_BACKUP_V1\n";
-    if (data.len < magic.len or !std.mem.eql(u8, data[0..magic.len], magic)) {
-        return KhrError.ArchiveFormatFailed;
-    }
-    i = magic.len;
-
-    while (i < data.len) {
-        // Read a line ending with '\n'
-        const file_tag = "FILE: ";
-        if (i + file_tag.len > data.len) break;
-        if (!std.mem.eql(u8, data[i .. i + file_tag.len], file_tag)) break;
-        i += file_tag.len;
-
-        const path_start = i;
-        const nl1 = std.mem.indexOfScalarPos(u8, data, i, '\n') orelse break;
-        const path = data[path_start..nl1];
-        const safe_rel = sanitize.sanitizeRelativePath(allocator, path) catch return KhrError.ArchiveFormatFailed;
-        defer allocator.free(safe_rel);
-        i = nl1 + 1;
-
-        const len_tag = "LEN: ";
-        if (i + len_tag.len > data.len or !std.mem.eql(u8, data[i .. i + len_tag.len], len_tag)) return KhrError.ArchiveFormatFailed;
-        i += len_tag.len;
-        const len_start = i;
-        const nl2 = std.mem.indexOfScalarPos(u8, data, i, '\n') orelse return KhrError.ArchiveFormatFailed;
-        const len_str = data[len_start..nl2];
-        const file_len = std.fmt.parseInt(usize, len_str, 10) catch return KhrError.ArchiveFormatFailed;
-        i = nl2 + 1;
-
-        const mtime_tag = "MTIME: ";
-        if (i + mtime_tag.len > data.len or !std.mem.eql(u8, data[i .. i + mtime_tag.len], mtime_tag)) return KhrError.ArchiveFormatFailed;
-        i += mtime_tag.len;
-        const mt_start = i;
-        const nl3 = std.mem.indexOfScalarPos(u8, data, i, '\n') orelse return KhrError.ArchiveFormatFailed;
-        _ = std.fmt.parseInt(i64, data[mt_start..nl3], 10) catch 0; // unused
-        i = nl3 + 1;
-
-        if (i + file_len > data.len) return KhrError.ArchiveFormatFailed;
-        const content = data[i .. i + file_len];
-        i += file_len;
-
-        // Write file
-        const full_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ extract_to, safe_rel });
-        defer allocator.free(full_path);
-        const dir = std.fs.path.dirname(full_path);
-        if (dir) |d| std.fs.cwd().makePath(d) catch {};
-        try std.fs.cwd().writeFile(.{ .sub_path = full_path, .data = content });
-    }
-}
-
-fn compressData(allocator: Allocator, data: String, compression: CompressionType) ![]u8 {
-    switch (compression) {
-        .none => return try allocator.dupe(u8, data),
-        .gzip => {
-            var engine = compress.Compressor.init(allocator);
-            defer engine.deinit();
-            var result = try engine.compress(data);
-            defer result.deinit(allocator);
-            return try allocator.dupe(u8, result.compressed_data);
-        },
-        .lz4, .zstd => {
-            // LZ4 and ZSTD would be nice to have, but they're not implemented yet.
-            // For now, we just fall back to good old gzip. It works fine.
-            var engine = compress.Compressor.init(allocator);
-            defer engine.deinit();
-            var result = try engine.compress(data);
-            defer result.deinit(allocator);
-            return try allocator.dupe(u8, result.compressed_data);
-        },
+        if (size + overhead <= budget) {
+            if (size + overhead > left) {
+                try shares.append(.{ .info = undefined, .paths = std.ArrayList(String).init(allocator), .parts = std.ArrayList(FilePart).init(allocator) });
+                left = budget;
+            }
+            try shares.items[shares.items.len - 1].paths.append(path);
+            left -= size + overhead;
+            if (planned.inode) |inode| try linked.put(inode, shares.items.len - 1);
+            continue;
+        }
+        var offset: u64 = 0;
+        while (offset < size) {
+            if (left <= overhead) {
+                try shares.append(.{ .info = undefined, .paths = std.ArrayList(String).init(allocator), .parts = std.ArrayList(FilePart).init(allocator) });
+                left = budget;
+            }
+            const len = @min(size - offset, left - overhead);
+            try shares.items[shares.items.len - 1].parts.append(.{ .path = path, .offset = offset, .len = len, .size = size });
+            left -= len + overhead;
+            offset += len;
+        }
+    }
+    if (shares.items.len == 0) {
+        try shares.append(.{ .info = undefined, .paths = std.ArrayList(String).init(allocator), .parts = std.ArrayList(FilePart).init(allocator) });
     }
+    if (shares.items.len > MAX_VOLUMES) return KhrError.ArchiveCreationFailed;
+
+    var set_id: [16]u8 = undefined;
+    std.crypto.random.bytes(&set_id);
+    for (shares.items, 1..) |*sh, n| {
+        sh.info = .{ .set_id = set_id, .number = @intCast(n), .count = @intCast(shares.items.len) };
+    }
+    return shares.toOwnedSlice();
 }
 
-fn decompressData(allocator: Allocator, data: String, compression: CompressionType) ![]u8 {
-    switch (compression) {
-        .none => return try allocator.dupe(u8, data),
-        .gzip => {
-            var engine = compress.Compressor.init(allocator);
-            defer engine.deinit();
-            return engine.decompress(data);
-        },
-        .lz4, .zstd => {
-            // Same deal here - LZ4 and ZSTD aren't ready yet.
-            // Gzip to the rescue again.
-            var engine = compress.Compressor.init(allocator);
-            defer engine.deinit();
-            return engine.decompress(data);
-        },
+// Where volume i (0-based) of the set named output_path goes.
+fn volumePath(allocator: Allocator, output_path: String, dirs: []const String, i: usize) ![]u8 {
+    if (dirs.len == 0) return std.fmt.allocPrint(allocator, "{s}.{d:0>3}", .{ output_path, i + 1 });
+    return std.fmt.allocPrint(allocator, "{s}/{s}.{d:0>3}", .{ dirs[i % dirs.len], fs.path.basename(output_path), i + 1 });
+}
+
+fn createVolumeSet(allocator: Allocator, source_paths: []const String, output_path: String, password: ?String, options: CreateOptions, progress_cb: ?SaveProgressCallback) !void {
+    const volume_size = options.volume_size.?;
+    if (volume_size < MIN_VOLUME_SIZE) return KhrError.ArchiveCreationFailed;
+    // v3 chunk references are resolved against a single archive file
+    if (options.chunked or options.parent != null) return KhrError.ArchiveCreationFailed;
+    // a copy of a set would be a second set; write it with --volume-dir instead
+    if (options.copies.len > 0) return KhrError.ArchiveCreationFailed;
+
+    const shares = try planVolumes(allocator, source_paths, volume_size);
+    defer freeVolumes(allocator, shares);
+
+    // with round-robin directories, writer w gets every volume on directory w
+    const writers = @max(1, @min(options.volume_dirs.len, shares.len));
+    var per_volume = options;
+    per_volume.volume_size = null;
+    // the codec threads are shared out between the writers
+    const cpus = if (options.threads != 0) options.threads else (std.Thread.getCpuCount() catch 1);
+    per_volume.threads = @max(1, cpus / writers);
+    print("Writing {d} volumes of up to {d} bytes with {d} writers\n", .{ shares.len, volume_size, writers });
+    if (progress_cb) |cb| cb("Saving volumes", 0, shares.len);
+
+    const jobs = try allocator.alloc(VolumeWriter, writers);
+    defer allocator.free(jobs);
+    const threads = try allocator.alloc(std.Thread, writers);
+    defer allocator.free(threads);
+    for (jobs, 0..) |*j, w| {
+        j.* = .{
+            .allocator = allocator,
+            .shares = shares,
+            .first = w,
+            .stride = writers,
+            .output_path = output_path,
+            .password = password,
+            .options = per_volume,
+        };
+    }
+
+    // the first writer runs here; if spawning fails the rest just run here too
+    var spawned: usize = 0;
+    for (jobs[1..], threads[1..]) |*j, *t| {
+        t.* = std.Thread.spawn(.{}, VolumeWriter.run, .{j}) catch break;
+        spawned += 1;
+    }
+    jobs[0].run();
+    for (jobs[1 + spawned ..]) |*j| j.run();
+    for (threads[1 .. 1 + spawned]) |t| t.join();
+
+    for (jobs) |j| {
+        if (j.err) |err| return err;
     }
+    if (progress_cb) |cb| cb("Saving volumes", shares.len, shares.len);
 }
 
-fn encryptData(allocator: Allocator, data: String, password: String) !struct { data: []u8, info: EncryptionInfo } {
-    var ctx = security.CryptoContext.init(allocator);
-    defer ctx.deinit();
+// One writer's volumes: first, first + stride, ...
+const VolumeWriter = struct {
+    allocator: Allocator,
+    shares: []const VolumeShare,
+    first: usize,
+    stride: usize,
+    output_path: String,
+    password: ?String,
+    options: CreateOptions,
+    err: ?anyerror = null,
 
-    var enc = try ctx.encrypt(data, password);
-    defer enc.deinit(allocator);
+    fn run(self: *VolumeWriter) void {
+        self.write() catch |err| {
+            self.err = err;
+        };
+    }
 
-    const info = EncryptionInfo{
-        .algorithm = .chacha20_poly1305,
-        .kdf = .argon2id,
-        .salt = enc.salt,
-        .nonce = enc.nonce,
-        .opslimit = 3,
-        .memlimit = 67108864,
-    };
+    fn write(self: *VolumeWriter) !void {
+        var i = self.first;
+        while (i < self.shares.len) : (i += self.stride) {
+            const path = try volumePath(self.allocator, self.output_path, self.options.volume_dirs, i);
+            defer self.allocator.free(path);
+            const share = &self.shares[i];
+            try createKhrBackupStreaming(self.allocator, share.paths.items, path, self.password, self.options, null, share);
+        }
+    }
+};
 
-    const serialized = try ctx.serializeEncrypted(enc);
-    return .{ .data = serialized, .info = info };
+// The path a set was created with, given it or one of its volumes.
+fn volumeBase(path: String) String {
+    if (path.len < 4 or path[path.len - 4] != '.') return path;
+    for (path[path.len - 3 ..]) |ch| {
+        if (!std.ascii.isDigit(ch)) return path;
+    }
+    return path[0 .. path.len - 4];
 }
 
-fn decryptData(allocator: Allocator, data: String, encryption_info: *const EncryptionInfo, password: String) ![]u8 {
-    _ = encryption_info;
-    var ctx = security.CryptoContext.init(allocator);
-    defer ctx.deinit();
+// Volume number n of the set named base, next to base or in one of dirs.
+fn volumeAt(allocator: Allocator, base: String, dirs: []const String, number: u32) !?[]u8 {
+    const here = try std.fmt.allocPrint(allocator, "{s}.{d:0>3}", .{ base, number });
+    if (fileExists(here)) return here;
+    allocator.free(here);
+    for (dirs) |dir| {
+        const there = try std.fmt.allocPrint(allocator, "{s}/{s}.{d:0>3}", .{ dir, fs.path.basename(base), number });
+        if (fileExists(there)) return there;
+        allocator.free(there);
+    }
+    return null;
+}
 
-    var parsed = try ctx.deserializeEncrypted(data);
-    defer parsed.deinit(allocator);
-    return try ctx.decrypt(parsed, password);
+fn fileExists(path: String) bool {
+    fs.cwd().access(path, .{}) catch return false;
+    return true;
 }
 
-fn deriveEncryptionInfo(allocator: Allocator, password: String) !EncryptionInfo {
-    _ = allocator;
-    _ = password;
+// The set a volume says it belongs to; null for an archive that isn't a volume.
+fn readVolumeInfo(allocator: Allocator, path: String, password: ?String) !?khr_index.Volume {
+    const file = try fs.cwd().openFile(path, .{});
+    defer file.close();
+    const header = try KhrHeader.read(file.reader());
+    const data_start = try file.getPos();
+    var cipher = try archiveCipher(allocator, &header, password);
+    defer if (cipher) |*c| c.wipe();
+    var toc = (try khr_index.readIndex(allocator, file, data_start + header.tar_size, if (cipher) |*c| c else null)) orelse return null;
+    defer toc.deinit();
+    return toc.volume;
+}
 
-    var salt: [32]u8 = undefined;
-    var nonce: [12]u8 = undefined;
-    std.crypto.random.bytes(&salt);
-    std.crypto.random.bytes(&nonce);
+// Restore every volume of the set khr_path belongs to. khr_path is the path
+// the set was created with, or any one of its volumes; the others are looked
+// for next to it and in dirs. Each volume is checked to be the one its name
+// says before anything in it is restored.
+fn extractKhrVolumeSet(allocator: Allocator, khr_path: String, dirs: []const String, password: ?String, extract_to: String) !void {
+    const base = volumeBase(khr_path);
+    var paths = std.ArrayList([]u8).init(allocator);
+    defer {
+        for (paths.items) |p| allocator.free(p);
+        paths.deinit();
+    }
+    const first = (try volumeAt(allocator, base, dirs, 1)) orelse return KhrError.VolumeMissing;
+    try paths.append(first);
+    const info = (try readVolumeInfo(allocator, first, password)) orelse return KhrError.VolumeMismatch;
+    if (info.number != 1) return KhrError.VolumeMismatch;
+    var n: u32 = 2;
+    while (n <= info.count) : (n += 1) {
+        const p = (try volumeAt(allocator, base, dirs, n)) orelse {
+            print("Volume {d} of {d} of {s} not found\n", .{ n, info.count, base });
+            return KhrError.VolumeMissing;
+        };
+        try paths.append(p);
+    }
+    print("Restoring {d} volumes of {s}\n", .{ paths.items.len, base });
+
+    const cpus = std.Thread.getCpuCount() catch 1;
+    const workers = @max(1, @min(cpus, paths.items.len));
+    const jobs = try allocator.alloc(VolumeReader, workers);
+    defer allocator.free(jobs);
+    const threads = try allocator.alloc(std.Thread, workers);
+    defer allocator.free(threads);
+    var next = std.atomic.Value(usize).init(0);
+    for (jobs) |*j| {
+        j.* = .{
+            .allocator = allocator,
+            .paths = paths.items,
+            .info = info,
+            .next = &next,
+            .password = password,
+            .extract_to = extract_to,
+        };
+    }
 
-    return EncryptionInfo{
-        .salt = salt,
-        .nonce = nonce,
-        .opslimit = 3,
-        .memlimit = 67108864,
-    };
+    var spawned: usize = 0;
+    for (jobs[1..], threads[1..]) |*j, *t| {
+        t.* = std.Thread.spawn(.{}, VolumeReader.run, .{j}) catch break;
+        spawned += 1;
+    }
+    jobs[0].run();
+    for (jobs[1 + spawned ..]) |*j| j.run();
+    for (threads[1 .. 1 + spawned]) |t| t.join();
+
+    for (jobs) |j| {
+        if (j.err) |err| return err;
+    }
 }
 
+// Takes the next volume nobody has started on until there are none left.
+const VolumeReader = struct {
+    allocator: Allocator,
+    paths: []const []u8,
+    info: khr_index.Volume,
+    next: *std.atomic.Value(usize),
+    password: ?String,
+    extract_to: String,
+    err: ?anyerror = null,
+
+    fn run(self: *VolumeReader) void {
+        while (self.err == null) {
+            const i = self.next.fetchAdd(1, .monotonic);
+            if (i >= self.paths.len) return;
+            var want = self.info;
+            want.number = @intCast(i + 1);
+            extractKhrBackupFile(self.allocator, self.paths[i], self.password, self.extract_to, .{ .only = want }) catch |err| {
+                self.err = err;
+            };
+        }
+    }
+};
+
 pub fn isKhrFile(path: String) bool {
     const file = fs.cwd().openFile(path, .{}) catch return false;
     defer file.close();
@@ -1495,7 +3688,7 @@ pub fn isKhrFile(path: String) bool {
     var magic: [8]u8 = undefined;
     _ = file.readAll(&magic) catch return false;
 
-    return std.mem.eql(u8, &magic, "KHRONO01");
+    return isKhrMagic(&magic);
 }
 
 pub fn getKhrInfo(allocator: Allocator, khr_path: String) !struct {
@@ -1504,6 +3697,7 @@ pub fn getKhrInfo(allocator: Allocator, khr_path: String) !struct {
     encrypted: bool,
     tar_size: u64,
     file_size: u64,
+    hash: HashAlgo,
 } {
     _ = allocator;
     const file = try fs.cwd().openFile(khr_path, .{});
@@ -1519,5 +3713,6 @@ pub fn getKhrInfo(allocator: Allocator, khr_path: String) !struct {
         .encrypted = (header.encryption.opslimit != 0 or header.encryption.memlimit != 0),
         .tar_size = header.tar_size,
         .file_size = file_size,
+        .hash = header.hash,
     };
 }
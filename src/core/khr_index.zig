@@ -0,0 +1,452 @@
+//! Trailing table of contents for v2 archives. It's written after the payload
+//! so listing an archive costs one seek to the end and one read of the index
+//! instead of decoding the whole payload.
+//!
+//! Layout after the payload (all little-endian):
+//!   index:
+//!     entry_count: u64
+//!     entries: tag u8, path_len u32, path, mode u64, mtime i64,
+//!              size u64, offset u64, crc32 u32
+//!     if flags & FLAG_FRAMES:
+//!       frame_count: u64
+//!       frames: offset u64, decoded_offset u64
+//!     if flags & FLAG_CHUNKS:
+//!       chunk_count: u64
+//!       chunks: digest [32]u8, offset u64, len u32
+//!     if flags & FLAG_MERKLE:
+//!       leaf_count: u64
+//!       leaves: [32]u8 each
+//!     if flags & FLAG_SEGMENTS:
+//!       segment_count: u64
+//!       segments: decoded_start u64, leaf_count u64, root [32]u8
+//!     if flags & FLAG_VOLUME:
+//!       set_id: [16]u8, number: u32, count: u32
+//!     if flags & FLAG_LEVEL:
+//!       level: i32
+//!   trailer (TRAILER_LEN bytes, always the last thing in the file):
+//!     index_offset: u64      absolute file offset of the index
+//!     index_len: u64
+//!     index_crc32: u32
+//!     flags: u32
+//!     magic: "KHRTOC1\n"
+//! offset is where the entry's data starts in the decoded payload stream (for
+//! symlinks: where the record starts). crc32 covers the file data and is 0
+//! for symlinks. The frame table lists where each independently decodable
+//! frame of a compressed payload starts (offset relative to the payload
+//! start), which is what lets selective restore seek instead of decoding
+//! everything in front of the file it wants. The chunk table (v3 archives)
+//! lists every chunk stored in this archive by SHA-256 and decoded offset;
+//! it's how a later archive finds what it can reference instead of storing.
+//! The Merkle leaves (merkle.zig) are the per-block hashes of the decoded
+//! stream; with FLAG_MERKLE set, header.checksum is their root rather than a
+//! flat SHA-256 of the stream. An archive that has been appended to lists
+//! its segments (merkle.Segment): the leaves are then each segment's in turn
+//! and header.checksum is the root over the segment roots.
+//! Each volume of a multi-volume set is a whole archive of its own; its
+//! Volume says which set it belongs to and where it sits in it, which is how
+//! a restore starting from any one volume knows how many others to find.
+//! The codec level the payload was written at is kept when one was asked
+//! for, so an append compresses its segment the same way.
+//! header.tar_size still only covers the payload, so archives
+//! without a trailer (older builds) just fall back to a full scan.
+//! In encrypted archives (FLAG_ENCRYPTED) the index is a sealed stream of its
+//! own (see streaming_crypto.EncryptingWriter); index_len is the stored length
+//! and index_crc32 covers the stored, sealed bytes (FLAG_STORED_CRC). A crc of
+//! the decrypted bytes, which older builds wrote, would let anyone without
+//! the password check a guess at what the index holds.
+
+const std = @import("std");
+const fs = std.fs;
+const Allocator = std.mem.Allocator;
+const types = @import("../utils/types.zig");
+const FileSize = types.FileSize;
+const parallel_blocks = @import("parallel_blocks.zig");
+const Frame = parallel_blocks.Frame;
+const streaming_crypto = @import("../security/streaming_crypto.zig");
+const ChunkCipher = streaming_crypto.ChunkCipher;
+const merkle = @import("merkle.zig");
+const Digest = merkle.Digest;
+const Segment = merkle.Segment;
+
+pub const TRAILER_MAGIC = "KHRTOC1\n";
+pub const TRAILER_LEN: usize = 32;
+
+pub const FLAG_FRAMES: u32 = 1 << 0;
+pub const FLAG_ENCRYPTED: u32 = 1 << 1;
+pub const FLAG_CHUNKS: u32 = 1 << 2;
+pub const FLAG_MERKLE: u32 = 1 << 3;
+pub const FLAG_SEGMENTS: u32 = 1 << 4;
+pub const FLAG_VOLUME: u32 = 1 << 5;
+pub const FLAG_STORED_CRC: u32 = 1 << 6;
+pub const FLAG_LEVEL: u32 = 1 << 7;
+
+// a corrupt trailer shouldn't be able to make us allocate the whole disk
+const MAX_INDEX_LEN: u64 = 1 << 32;
+const FLUSH_THRESHOLD: usize = 64 * 1024;
+
+pub const IndexError = error{
+    CorruptIndex,
+};
+
+pub const IndexEntry = struct {
+    tag: u8,
+    path: []const u8,
+    mode: u64,
+    mtime: i64,
+    size: FileSize,
+    offset: u64,
+    crc32: u32,
+};
+
+// Where an archive sits in a multi-volume set (khr_format.createVolumeSet).
+pub const Volume = struct {
+    set_id: [16]u8, // random per set, so volumes of two runs can't be mixed up
+    number: u32, // 1-based
+    count: u32,
+
+    pub fn eql(a: Volume, b: Volume) bool {
+        return std.mem.eql(u8, &a.set_id, &b.set_id) and a.number == b.number and a.count == b.count;
+    }
+};
+
+pub const ChunkEntry = struct {
+    digest: [32]u8,
+    offset: u64, // where the chunk's bytes start in the decoded payload stream
+    len: u32,
+};
+
+// Collects entries while the payload is being written. Paths are copied into
+// an arena so callers can hand in temporaries.
+pub const IndexBuilder = struct {
+    arena: std.heap.ArenaAllocator,
+    entries: std.ArrayList(IndexEntry),
+    chunks: std.ArrayList(ChunkEntry),
+    volume: ?Volume = null,
+    level: ?i32 = null, // codec level the payload was written at, if one was asked for
+
+    const Self = @This();
+
+    pub fn init(allocator: Allocator) Self {
+        return Self{
+            .arena = std.heap.ArenaAllocator.init(allocator),
+            .entries = std.ArrayList(IndexEntry).init(allocator),
+            .chunks = std.ArrayList(ChunkEntry).init(allocator),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        self.entries.deinit();
+        self.chunks.deinit();
+        self.arena.deinit();
+    }
+
+    pub fn addChunk(self: *Self, chunk: ChunkEntry) !void {
+        try self.chunks.append(chunk);
+    }
+
+    pub fn add(self: *Self, entry: IndexEntry) !void {
+        var owned = entry;
+        owned.path = try self.arena.allocator().dupe(u8, entry.path);
+        try self.entries.append(owned);
+    }
+
+    // Append index + trailer to file. index_offset must be the current end of
+    // the payload, which is where the index starts. With a cipher the index is
+    // sealed like the payload so file names don't leak from encrypted archives.
+    pub fn writeFooter(self: *const Self, file: fs.File, index_offset: u64, frames: []const Frame, tree: merkle.Tree, cipher: ?*const ChunkCipher) !void {
+        const allocator = self.entries.allocator;
+        var file_writer = file.writer();
+        var stored = CrcWriter{ .sink = file_writer.any() };
+        var sealer: ?streaming_crypto.EncryptingWriter = null;
+        if (cipher) |c| sealer = try streaming_crypto.EncryptingWriter.init(allocator, c, .index, stored.any());
+        defer if (sealer) |*s| s.deinit();
+
+        var out = FooterWriter{
+            .sink = if (sealer) |*s| s.any() else file_writer.any(),
+            .buf = std.ArrayList(u8).init(allocator),
+        };
+        defer out.buf.deinit();
+
+        try out.putInt(u64, self.entries.items.len);
+        for (self.entries.items) |e| {
+            try out.put(&[_]u8{e.tag});
+            try out.putInt(u32, @intCast(e.path.len));
+            try out.put(e.path);
+            try out.putInt(u64, e.mode);
+            try out.putInt(i64, e.mtime);
+            try out.putInt(FileSize, e.size);
+            try out.putInt(u64, e.offset);
+            try out.putInt(u32, e.crc32);
+        }
+        try out.putInt(u64, frames.len);
+        for (frames) |f| {
+            try out.putInt(u64, f.offset);
+            try out.putInt(u64, f.decoded_offset);
+        }
+        var flags = FLAG_FRAMES;
+        if (self.chunks.items.len > 0) {
+            flags |= FLAG_CHUNKS;
+            try out.putInt(u64, self.chunks.items.len);
+            for (self.chunks.items) |c| {
+                try out.put(&c.digest);
+                try out.putInt(u64, c.offset);
+                try out.putInt(u32, c.len);
+            }
+        }
+        if (tree.leaves.len > 0) {
+            flags |= FLAG_MERKLE;
+            try out.putInt(u64, tree.leaves.len);
+            for (tree.leaves) |*leaf| try out.put(leaf);
+        }
+        if (tree.segments.len > 0) {
+            flags |= FLAG_SEGMENTS;
+            try out.putInt(u64, tree.segments.len);
+            for (tree.segments) |seg| {
+                try out.putInt(u64, seg.decoded_start);
+                try out.putInt(u64, seg.leaf_count);
+                try out.put(&seg.root);
+            }
+        }
+        if (self.volume) |v| {
+            flags |= FLAG_VOLUME;
+            try out.put(&v.set_id);
+            try out.putInt(u32, v.number);
+            try out.putInt(u32, v.count);
+        }
+        if (self.level) |level| {
+            flags |= FLAG_LEVEL;
+            try out.putInt(i32, level);
+        }
+        try out.flush();
+
+        var stored_len = out.len;
+        var crc = out.crc.final();
+        if (sealer) |*s| {
+            try s.finish();
+            flags |= FLAG_ENCRYPTED | FLAG_STORED_CRC;
+            stored_len = streaming_crypto.sealedLen(out.len);
+            crc = stored.crc.final();
+        }
+
+        var trailer: [TRAILER_LEN]u8 = undefined;
+        std.mem.writeInt(u64, trailer[0..8], index_offset, .little);
+        std.mem.writeInt(u64, trailer[8..16], stored_len, .little);
+        std.mem.writeInt(u32, trailer[16..20], crc, .little);
+        std.mem.writeInt(u32, trailer[20..24], flags, .little);
+        @memcpy(trailer[24..32], TRAILER_MAGIC);
+        try file.writeAll(&trailer);
+    }
+};
+
+// Buffers the serialized index and keeps the crc/length that go in the trailer.
+const FooterWriter = struct {
+    sink: std.io.AnyWriter,
+    buf: std.ArrayList(u8),
+    crc: std.hash.Crc32 = std.hash.Crc32.init(),
+    len: u64 = 0,
+
+    fn put(self: *FooterWriter, bytes: []const u8) !void {
+        try self.buf.appendSlice(bytes);
+        if (self.buf.items.len >= FLUSH_THRESHOLD) try self.flush();
+    }
+
+    fn putInt(self: *FooterWriter, comptime T: type, value: T) !void {
+        var b: [@sizeOf(T)]u8 = undefined;
+        std.mem.writeInt(T, &b, value, .little);
+        try self.put(&b);
+    }
+
+    fn flush(self: *FooterWriter) !void {
+        try self.sink.writeAll(self.buf.items);
+        self.crc.update(self.buf.items);
+        self.len += self.buf.items.len;
+        self.buf.clearRetainingCapacity();
+    }
+};
+
+// Passes the sealed index on to the file, keeping the crc that goes in the trailer.
+const CrcWriter = struct {
+    sink: std.io.AnyWriter,
+    crc: std.hash.Crc32 = std.hash.Crc32.init(),
+
+    fn write(self: *CrcWriter, bytes: []const u8) anyerror!usize {
+        const n = try self.sink.write(bytes);
+        self.crc.update(bytes[0..n]);
+        return n;
+    }
+
+    fn any(self: *CrcWriter) std.io.AnyWriter {
+        return .{ .context = self, .writeFn = typeErasedWrite };
+    }
+
+    fn typeErasedWrite(context: *const anyopaque, bytes: []const u8) anyerror!usize {
+        const self: *CrcWriter = @ptrCast(@alignCast(@constCast(context)));
+        return self.write(bytes);
+    }
+};
+
+pub const Index = struct {
+    arena: std.heap.ArenaAllocator,
+    entries: []const IndexEntry,
+    frames: []const Frame,
+    chunks: []const ChunkEntry = &[_]ChunkEntry{},
+    leaves: []const Digest = &[_]Digest{}, // empty: header.checksum is a flat stream hash
+    segments: []const Segment = &[_]Segment{}, // empty: never appended to
+    volume: ?Volume = null, // null: not part of a multi-volume set
+    level: ?i32 = null, // null: the codec default
+
+    pub fn deinit(self: *Index) void {
+        self.arena.deinit();
+    }
+};
+
+// Load the index of an archive whose payload ends at payload_end. Returns null
+// when there's no trailer so the caller can fall back to scanning the payload.
+// cipher must be given exactly when the archive is encrypted.
+pub fn readIndex(allocator: Allocator, file: fs.File, payload_end: u64, cipher: ?*const ChunkCipher) !?Index {
+    const file_size = try file.getEndPos();
+    if (file_size < payload_end + TRAILER_LEN) return null;
+
+    var trailer: [TRAILER_LEN]u8 = undefined;
+    try file.seekTo(file_size - TRAILER_LEN);
+    if (try file.readAll(&trailer) != TRAILER_LEN) return null;
+    if (!std.mem.eql(u8, trailer[24..32], TRAILER_MAGIC)) return null;
+
+    const index_offset = std.mem.readInt(u64, trailer[0..8], .little);
+    const index_len = std.mem.readInt(u64, trailer[8..16], .little);
+    const index_crc = std.mem.readInt(u32, trailer[16..20], .little);
+    const flags = std.mem.readInt(u32, trailer[20..24], .little);
+    if (index_offset != payload_end) return IndexError.CorruptIndex;
+    if (index_len > MAX_INDEX_LEN or index_offset + index_len + TRAILER_LEN != file_size) return IndexError.CorruptIndex;
+    // a plaintext index in an encrypted archive means someone swapped it
+    if ((flags & FLAG_ENCRYPTED != 0) != (cipher != null)) return IndexError.CorruptIndex;
+
+    var index = Index{ .arena = std.heap.ArenaAllocator.init(allocator), .entries = &[_]IndexEntry{}, .frames = &[_]Frame{} };
+    errdefer index.arena.deinit();
+    const arena = index.arena.allocator();
+
+    // sealed indexes from older builds have the crc of the decrypted bytes
+    const stored_crc = flags & FLAG_STORED_CRC != 0;
+    if (stored_crc) try checkStoredCrc(file, index_offset, index_len, index_crc);
+    const data = if (cipher) |c|
+        try readSealedIndex(arena, file, index_offset, index_len, c)
+    else blk: {
+        const plain = try arena.alloc(u8, @intCast(index_len));
+        try file.seekTo(index_offset);
+        if (try file.readAll(plain) != plain.len) return IndexError.CorruptIndex;
+        break :blk plain;
+    };
+    if (!stored_crc and std.hash.Crc32.hash(data) != index_crc) return IndexError.CorruptIndex;
+
+    parseIndex(arena, data, flags, &index) catch |err| switch (err) {
+        error.EndOfStream => return IndexError.CorruptIndex,
+        else => return err,
+    };
+    return index;
+}
+
+fn checkStoredCrc(file: fs.File, offset: u64, len: u64, expected: u32) !void {
+    var crc = std.hash.Crc32.init();
+    var buf: [64 * 1024]u8 = undefined;
+    var done: u64 = 0;
+    while (done < len) {
+        const want: usize = @intCast(@min(len - done, buf.len));
+        if (try file.preadAll(buf[0..want], offset + done) != want) return IndexError.CorruptIndex;
+        crc.update(buf[0..want]);
+        done += want;
+    }
+    if (crc.final() != expected) return IndexError.CorruptIndex;
+}
+
+fn readSealedIndex(arena: Allocator, file: fs.File, index_offset: u64, index_len: u64, cipher: *const ChunkCipher) ![]u8 {
+    var sealed = streaming_crypto.DecryptingReader.init(arena, cipher, .index, file, index_offset, index_len) catch |err| switch (err) {
+        error.TruncatedStream => return IndexError.CorruptIndex,
+        else => return err,
+    };
+    defer sealed.deinit();
+
+    const data = try arena.alloc(u8, @intCast(sealed.plain_len));
+    if (try sealed.any().readAll(data) != data.len) return IndexError.CorruptIndex;
+    // one more read so the final chunk gets authenticated even when it's empty
+    var probe: [1]u8 = undefined;
+    if (try sealed.read(&probe) != 0) return IndexError.CorruptIndex;
+    return data;
+}
+
+// Paths point into data, which lives in the same arena as the entries.
+fn parseIndex(arena: Allocator, data: []const u8, flags: u32, index: *Index) !void {
+    var stream = std.io.fixedBufferStream(data);
+    const r = stream.reader();
+
+    const count = try r.readInt(u64, .little);
+    // every record takes well over one byte, so this bounds the allocations by the index size
+    if (count > data.len) return IndexError.CorruptIndex;
+    const entries = try arena.alloc(IndexEntry, @intCast(count));
+    for (entries) |*e| {
+        e.tag = try r.readByte();
+        const path_len = try r.readInt(u32, .little);
+        if (path_len > data.len - stream.pos) return IndexError.CorruptIndex;
+        e.path = data[stream.pos..][0..path_len];
+        stream.pos += path_len;
+        e.mode = try r.readInt(u64, .little);
+        e.mtime = try r.readInt(i64, .little);
+        e.size = try r.readInt(FileSize, .little);
+        e.offset = try r.readInt(u64, .little);
+        e.crc32 = try r.readInt(u32, .little);
+    }
+    index.entries = entries;
+
+    if (flags & FLAG_FRAMES != 0) {
+        const frame_count = try r.readInt(u64, .little);
+        if (frame_count > data.len) return IndexError.CorruptIndex;
+        const frames = try arena.alloc(Frame, @intCast(frame_count));
+        for (frames) |*f| {
+            f.offset = try r.readInt(u64, .little);
+            f.decoded_offset = try r.readInt(u64, .little);
+        }
+        index.frames = frames;
+    }
+
+    if (flags & FLAG_CHUNKS != 0) {
+        const chunk_count = try r.readInt(u64, .little);
+        if (chunk_count > data.len) return IndexError.CorruptIndex;
+        const chunks = try arena.alloc(ChunkEntry, @intCast(chunk_count));
+        for (chunks) |*c| {
+            try r.readNoEof(&c.digest);
+            c.offset = try r.readInt(u64, .little);
+            c.len = try r.readInt(u32, .little);
+        }
+        index.chunks = chunks;
+    }
+
+    if (flags & FLAG_MERKLE != 0) {
+        const leaf_count = try r.readInt(u64, .little);
+        if (leaf_count > data.len) return IndexError.CorruptIndex;
+        const leaves = try arena.alloc(Digest, @intCast(leaf_count));
+        for (leaves) |*leaf| try r.readNoEof(leaf);
+        index.leaves = leaves;
+    }
+
+    if (flags & FLAG_SEGMENTS != 0) {
+        const segment_count = try r.readInt(u64, .little);
+        if (segment_count > data.len) return IndexError.CorruptIndex;
+        const segments = try arena.alloc(Segment, @intCast(segment_count));
+        for (segments) |*seg| {
+            seg.decoded_start = try r.readInt(u64, .little);
+            seg.leaf_count = try r.readInt(u64, .little);
+            try r.readNoEof(&seg.root);
+        }
+        index.segments = segments;
+    }
+
+    if (flags & FLAG_VOLUME != 0) {
+        var v: Volume = undefined;
+        try r.readNoEof(&v.set_id);
+        v.number = try r.readInt(u32, .little);
+        v.count = try r.readInt(u32, .little);
+        if (v.number == 0 or v.number > v.count) return IndexError.CorruptIndex;
+        index.volume = v;
+    }
+    if (flags & FLAG_LEVEL != 0) index.level = try r.readInt(i32, .little);
+    if (stream.pos != data.len) return IndexError.CorruptIndex;
+}
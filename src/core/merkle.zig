@@ -0,0 +1,300 @@
+//! Merkle tree over the decoded payload stream of v2/v3 archives. The stream
+//! is cut into fixed BLOCK_SIZE blocks (by decoded offset, independent of the
+//! codec's frames); each block's hash is a leaf, and header.checksum holds
+//! the root. The hash is SHA-256 or BLAKE3 (header.hash); std's BLAKE3 is
+//! written on @Vector, so it compiles down to SSE4.1/AVX2/AVX-512 for
+//! whatever -Dcpu the build targets. The leaves themselves go in the TOC
+//! (khr_index FLAG_MERKLE), so a verifier can check the leaves against the
+//! root and then hash blocks on as many threads as it likes, and a selective
+//! restore only has to hash the blocks its entries overlap.
+//! Hashes are domain-separated (0x00 for leaves, 0x01 for inner nodes) so a
+//! leaf can never be passed off as an inner node. An odd node at the end of a
+//! level is carried up unchanged.
+//! An archive that has been appended to holds several streams back to back
+//! (segments). Each is cut into blocks from its own start and is a tree of
+//! its own, so a segment can be checked without the others; header.checksum
+//! is then the tree over the segment roots. One segment is its own root, so
+//! archives that were never appended to don't change.
+
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const Sha256 = std.crypto.hash.sha2.Sha256;
+const Blake3 = std.crypto.hash.Blake3;
+
+pub const BLOCK_SIZE: usize = 1024 * 1024;
+pub const Digest = [32]u8;
+
+pub const MerkleError = error{
+    BlockHashMismatch,
+};
+
+// On disk in the archive header, so values are fixed.
+pub const Algorithm = enum(u8) {
+    sha256 = 0,
+    blake3 = 1,
+};
+
+// A running hash of either algorithm; both have 32-byte digests.
+pub const Hasher = union(Algorithm) {
+    sha256: Sha256,
+    blake3: Blake3,
+
+    pub fn init(algorithm: Algorithm) Hasher {
+        return switch (algorithm) {
+            .sha256 => .{ .sha256 = Sha256.init(.{}) },
+            .blake3 => .{ .blake3 = Blake3.init(.{}) },
+        };
+    }
+
+    pub fn update(self: *Hasher, bytes: []const u8) void {
+        switch (self.*) {
+            inline else => |*h| h.update(bytes),
+        }
+    }
+
+    pub fn final(self: *Hasher) Digest {
+        var out: Digest = undefined;
+        switch (self.*) {
+            inline else => |*h| h.final(&out),
+        }
+        return out;
+    }
+};
+
+pub fn leafHash(algorithm: Algorithm, block: []const u8) Digest {
+    var h = Hasher.init(algorithm);
+    h.update(&[_]u8{0x00});
+    h.update(block);
+    return h.final();
+}
+
+fn nodeHash(algorithm: Algorithm, left: *const Digest, right: *const Digest) Digest {
+    var h = Hasher.init(algorithm);
+    h.update(&[_]u8{0x01});
+    h.update(left);
+    h.update(right);
+    return h.final();
+}
+
+// Root over leaves. An empty stream can't happen (the magic is always there),
+// but gets the hash of an empty leaf rather than a special case.
+pub fn root(allocator: Allocator, algorithm: Algorithm, leaves: []const Digest) !Digest {
+    if (leaves.len == 0) return leafHash(algorithm, &[_]u8{});
+    const level = try allocator.dupe(Digest, leaves);
+    defer allocator.free(level);
+    var n = level.len;
+    while (n > 1) {
+        var out: usize = 0;
+        var i: usize = 0;
+        while (i < n) : (i += 2) {
+            level[out] = if (i + 1 < n) nodeHash(algorithm, &level[i], &level[i + 1]) else level[i];
+            out += 1;
+        }
+        n = out;
+    }
+    return level[0];
+}
+
+// One stream of an appended archive, as listed in the TOC (khr_index FLAG_SEGMENTS).
+pub const Segment = struct {
+    decoded_start: u64, // where it begins in the decoded payload
+    leaf_count: u64,
+    root: Digest,
+};
+
+// Root over each segment's own root, which is how an appended archive's
+// header.checksum is made.
+pub fn segmentsRoot(allocator: Allocator, algorithm: Algorithm, segments: []const Segment) !Digest {
+    const roots = try allocator.alloc(Digest, segments.len);
+    defer allocator.free(roots);
+    for (roots, segments) |*r, seg| r.* = seg.root;
+    return root(allocator, algorithm, roots);
+}
+
+// The leaves of a payload and where their blocks sit in the decoded stream.
+pub const Tree = struct {
+    leaves: []const Digest,
+    segments: []const Segment = &[_]Segment{}, // empty: a single stream
+
+    // Index of the block holding decoded offset pos.
+    pub fn blockAt(self: Tree, pos: u64) usize {
+        if (self.segments.len == 0) return @intCast(pos / BLOCK_SIZE);
+        var first_leaf: u64 = 0;
+        var i: usize = 0;
+        while (i + 1 < self.segments.len and self.segments[i + 1].decoded_start <= pos) : (i += 1) {
+            first_leaf += self.segments[i].leaf_count;
+        }
+        return @intCast(first_leaf + (pos - self.segments[i].decoded_start) / BLOCK_SIZE);
+    }
+
+    // Decoded offset of block i and the most bytes it can hold; only the
+    // stream's last block can hold fewer.
+    pub fn block(self: Tree, i: usize) struct { start: u64, len: usize } {
+        if (self.segments.len == 0) return .{ .start = @as(u64, i) * BLOCK_SIZE, .len = BLOCK_SIZE };
+        var first_leaf: u64 = 0;
+        for (self.segments, 0..) |seg, s| {
+            if (i < first_leaf + seg.leaf_count or s + 1 == self.segments.len) {
+                const start = seg.decoded_start + (i - first_leaf) * BLOCK_SIZE;
+                var len: u64 = BLOCK_SIZE;
+                if (s + 1 < self.segments.len) len = @min(len, self.segments[s + 1].decoded_start -| start);
+                return .{ .start = start, .len = @intCast(len) };
+            }
+            first_leaf += seg.leaf_count;
+        }
+        unreachable;
+    }
+};
+
+// Leaves of a stream fed front to back in arbitrary pieces. With expected set
+// each block is checked as soon as it's complete, so corruption shows up at
+// the first bad block rather than at the end.
+pub const LeafHasher = struct {
+    allocator: Allocator,
+    algorithm: Algorithm,
+    leaves: std.ArrayList(Digest),
+    current: Hasher,
+    filled: usize = 0,
+    expected: ?[]const Digest = null,
+    // decoded offsets where a segment after the first starts; a block never spans one
+    segments: []const Segment = &[_]Segment{},
+    next_segment: usize = 1,
+    pos: u64 = 0,
+
+    const Self = @This();
+
+    pub fn init(allocator: Allocator, algorithm: Algorithm) Self {
+        return .{
+            .allocator = allocator,
+            .algorithm = algorithm,
+            .leaves = std.ArrayList(Digest).init(allocator),
+            .current = leafStart(algorithm),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        self.leaves.deinit();
+    }
+
+    fn leafStart(algorithm: Algorithm) Hasher {
+        var h = Hasher.init(algorithm);
+        h.update(&[_]u8{0x00});
+        return h;
+    }
+
+    pub fn update(self: *Self, bytes: []const u8) !void {
+        var rest = bytes;
+        while (rest.len > 0) {
+            while (self.next_segment < self.segments.len and self.pos == self.segments[self.next_segment].decoded_start) {
+                if (self.filled > 0) try self.closeBlock();
+                self.next_segment += 1;
+            }
+            var n = @min(rest.len, BLOCK_SIZE - self.filled);
+            if (self.next_segment < self.segments.len) {
+                n = @intCast(@min(n, self.segments[self.next_segment].decoded_start - self.pos));
+            }
+            self.current.update(rest[0..n]);
+            self.filled += n;
+            self.pos += n;
+            rest = rest[n..];
+            if (self.filled == BLOCK_SIZE) try self.closeBlock();
+        }
+    }
+
+    fn closeBlock(self: *Self) !void {
+        const leaf = self.current.final();
+        if (self.expected) |want| {
+            const i = self.leaves.items.len;
+            if (i >= want.len or !std.mem.eql(u8, &leaf, &want[i])) return MerkleError.BlockHashMismatch;
+        }
+        try self.leaves.append(leaf);
+        self.current = leafStart(self.algorithm);
+        self.filled = 0;
+    }
+
+    // The leaves finish() would see if the stream ended here, the partial
+    // block's included, leaving the hasher as it was so more can follow.
+    // Single streams only. Caller owns the slice.
+    pub fn snapshot(self: *const Self) ![]Digest {
+        std.debug.assert(self.segments.len == 0);
+        var list = try std.ArrayList(Digest).initCapacity(self.allocator, self.leaves.items.len + 1);
+        errdefer list.deinit();
+        list.appendSliceAssumeCapacity(self.leaves.items);
+        if (self.filled > 0 or list.items.len == 0) {
+            var partial = self.current;
+            list.appendAssumeCapacity(partial.final());
+        }
+        return list.toOwnedSlice();
+    }
+
+    // Close the last, partial block and return the root.
+    pub fn finish(self: *Self) !Digest {
+        if (self.filled > 0 or self.leaves.items.len == 0) try self.closeBlock();
+        if (self.expected) |want| {
+            if (want.len != self.leaves.items.len) return MerkleError.BlockHashMismatch;
+        }
+        if (self.segments.len == 0) return root(self.allocator, self.algorithm, self.leaves.items);
+        if (self.next_segment != self.segments.len) return MerkleError.BlockHashMismatch;
+
+        const roots = try self.allocator.alloc(Digest, self.segments.len);
+        defer self.allocator.free(roots);
+        var first: usize = 0;
+        for (roots, self.segments) |*r, seg| {
+            const count: usize = @intCast(seg.leaf_count);
+            if (count > self.leaves.items.len - first) return MerkleError.BlockHashMismatch;
+            r.* = try root(self.allocator, self.algorithm, self.leaves.items[first..][0..count]);
+            first += count;
+        }
+        if (first != self.leaves.items.len) return MerkleError.BlockHashMismatch;
+        return root(self.allocator, self.algorithm, roots);
+    }
+};
+
+// What a payload stream's header.checksum is computed with: archives written
+// before the tree existed have a single SHA-256 over the stream.
+pub const StreamHash = union(enum) {
+    flat: Hasher,
+    tree: LeafHasher,
+
+    pub fn initFlat(algorithm: Algorithm) StreamHash {
+        return .{ .flat = Hasher.init(algorithm) };
+    }
+
+    // With expected, each block is checked against its leaf as it completes.
+    pub fn initTree(allocator: Allocator, algorithm: Algorithm, expected: ?Tree) StreamHash {
+        var tree = LeafHasher.init(allocator, algorithm);
+        if (expected) |t| {
+            tree.expected = t.leaves;
+            tree.segments = t.segments;
+        }
+        return .{ .tree = tree };
+    }
+
+    pub fn deinit(self: *StreamHash) void {
+        switch (self.*) {
+            .flat => {},
+            .tree => |*t| t.deinit(),
+        }
+    }
+
+    pub fn update(self: *StreamHash, bytes: []const u8) !void {
+        switch (self.*) {
+            .flat => |*h| h.update(bytes),
+            .tree => |*t| try t.update(bytes),
+        }
+    }
+
+    pub fn final(self: *StreamHash) !Digest {
+        return switch (self.*) {
+            .flat => |*h| h.final(),
+            .tree => |*t| try t.finish(),
+        };
+    }
+
+    // Leaves so far; all of them once final() has run. Empty for flat hashes.
+    pub fn leaves(self: *const StreamHash) []const Digest {
+        return switch (self.*) {
+            .flat => &[_]Digest{},
+            .tree => |*t| t.leaves.items,
+        };
+    }
+};
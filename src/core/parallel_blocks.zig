@@ -0,0 +1,220 @@
+//! pigz-style block compression shared by the gzip and lz4 payload codecs:
+//! split the stream into fixed blocks, encode them on the work queue and write
+//! them back out in order. Each block becomes a self-contained unit (gzip
+//! member, lz4 frame) so the output is still a plain concatenated stream.
+//!
+//! A codec is any type with
+//!   pub const Options: type (default-initialisable)
+//!   pub fn encode(out: *ArrayList(u8), data: []const u8, options: Options) !void
+//!   pub fn store(out: *ArrayList(u8), data: []const u8) !void
+//! where encode replaces out's contents with the encoded block and store does
+//! the same without compressing (a valid unit for the codec's own decoder,
+//! used for data that won't shrink). Codecs that want reusable per-block
+//! state (zstd contexts) also declare
+//!   pub const Context: type with init() !Context and deinit(*Context)
+//! and take it as encode's first argument.
+//!
+//! Because every block is independently decodable, the writer also records
+//! where each one starts (frames) so readers can seek into the stream.
+
+const std = @import("std");
+const ArrayList = std.ArrayList;
+const Allocator = std.mem.Allocator;
+const work_queue = @import("work_queue.zig");
+
+// 1MB blocks - big enough that the per-block header and the lost window
+// at each boundary cost well under 1% ratio, small enough to keep 16 cores fed
+pub const BLOCK_SIZE: usize = 1024 * 1024;
+
+// Where one encoded block starts: offset in the encoded output and offset in the input stream.
+pub const Frame = struct {
+    offset: u64,
+    decoded_offset: u64,
+};
+
+pub fn BlockWriter(comptime Codec: type) type {
+    return struct {
+        allocator: Allocator,
+        sink: std.io.AnyWriter,
+        queue: work_queue.WorkQueue,
+        // ring of blocks; two per worker so the pool stays busy while we wait on the oldest
+        blocks: []Block,
+        fill: usize, // block currently being filled by write()
+        oldest: usize, // next block to hand to the sink
+        in_flight: usize,
+        next_id: u64,
+        bytes_out: u64,
+        decoded_out: u64,
+        frames: ArrayList(Frame),
+        stored: bool = false, // mode for the block being filled, see setStored
+
+        const Self = @This();
+        const has_context = @hasDecl(Codec, "Context");
+        const Context = if (has_context) Codec.Context else void;
+        pub const Writer = std.io.GenericWriter(*Self, anyerror, write);
+
+        pub const Options = struct {
+            codec: Codec.Options = .{},
+            block_size: usize = BLOCK_SIZE,
+            threads: usize = 0, // 0 = one per cpu
+        };
+
+        const Block = struct {
+            input: []u8,
+            len: usize = 0,
+            output: ArrayList(u8),
+            options: Codec.Options,
+            context: Context,
+            stored: bool = false,
+            done: std.Thread.ResetEvent = .{},
+            err: ?anyerror = null,
+
+            fn run(ctx: *anyopaque) anyerror!void {
+                const block: *Block = @ptrCast(@alignCast(ctx));
+                defer block.done.set();
+                const data = block.input[0..block.len];
+                const result = if (block.stored)
+                    Codec.store(&block.output, data)
+                else if (has_context)
+                    Codec.encode(&block.context, &block.output, data, block.options)
+                else
+                    Codec.encode(&block.output, data, block.options);
+                result catch |err| {
+                    block.err = err;
+                };
+            }
+
+            fn deinit(block: *Block, allocator: Allocator) void {
+                allocator.free(block.input);
+                block.output.deinit();
+                if (has_context) block.context.deinit();
+            }
+        };
+
+        // Heap allocated because the workers hold pointers into the queue and the blocks.
+        pub fn init(allocator: Allocator, sink: std.io.AnyWriter, options: Options) !*Self {
+            const threads = if (options.threads != 0) options.threads else (std.Thread.getCpuCount() catch 1);
+
+            const self = try allocator.create(Self);
+            errdefer allocator.destroy(self);
+
+            const blocks = try allocator.alloc(Block, threads * 2);
+            errdefer allocator.free(blocks);
+            var made: usize = 0;
+            errdefer {
+                for (blocks[0..made]) |*b| b.deinit(allocator);
+            }
+            for (blocks) |*b| {
+                const input = try allocator.alloc(u8, options.block_size);
+                errdefer allocator.free(input);
+                b.* = .{
+                    .input = input,
+                    .output = ArrayList(u8).init(allocator),
+                    .options = options.codec,
+                    .context = if (has_context) try Codec.Context.init() else {},
+                };
+                made += 1;
+            }
+
+            self.* = .{
+                .allocator = allocator,
+                .sink = sink,
+                .queue = work_queue.WorkQueue.init(allocator, threads),
+                .blocks = blocks,
+                .fill = 0,
+                .oldest = 0,
+                .in_flight = 0,
+                .next_id = 0,
+                .bytes_out = 0,
+                .decoded_out = 0,
+                .frames = ArrayList(Frame).init(allocator),
+            };
+            errdefer self.queue.deinit();
+            errdefer self.frames.deinit();
+            try self.queue.start();
+            return self;
+        }
+
+        pub fn deinit(self: *Self) void {
+            // after an error blocks may still be queued; let the workers finish with them before freeing
+            while (self.in_flight > 0) {
+                self.blocks[self.oldest].done.wait();
+                self.in_flight -= 1;
+                self.oldest = (self.oldest + 1) % self.blocks.len;
+            }
+            self.queue.deinit();
+
+            const allocator = self.allocator;
+            for (self.blocks) |*b| b.deinit(allocator);
+            allocator.free(self.blocks);
+            self.frames.deinit();
+            allocator.destroy(self);
+        }
+
+        pub fn write(self: *Self, bytes: []const u8) anyerror!usize {
+            const block = &self.blocks[self.fill];
+            const n = @min(bytes.len, block.input.len - block.len);
+            @memcpy(block.input[block.len..][0..n], bytes[0..n]);
+            block.len += n;
+            if (block.len == block.input.len) try self.submit();
+            return n;
+        }
+
+        pub fn writer(self: *Self) Writer {
+            return .{ .context = self };
+        }
+
+        // Already-encoded bytes for the sink ahead of the first block (a zstd
+        // dictionary frame). Frame offsets count them; decoded offsets don't.
+        pub fn prefix(self: *Self, bytes: []const u8) !void {
+            std.debug.assert(self.next_id == 0);
+            try self.sink.writeAll(bytes);
+            self.bytes_out += bytes.len;
+        }
+
+        // Switch between compressing and storing what's written next. A
+        // switch closes the partial block so a block is never half and half;
+        // the cost is one short block per switch.
+        pub fn setStored(self: *Self, stored: bool) !void {
+            if (stored == self.stored) return;
+            if (self.blocks[self.fill].len > 0) try self.submit();
+            self.stored = stored;
+            self.blocks[self.fill].stored = stored;
+        }
+
+        // Flush the partial block and wait for everything to reach the sink, in order.
+        pub fn finish(self: *Self) !void {
+            if (self.blocks[self.fill].len > 0) try self.submit();
+            while (self.in_flight > 0) try self.drainOldest();
+        }
+
+        fn submit(self: *Self) !void {
+            const block = &self.blocks[self.fill];
+            block.done.reset();
+            block.err = null;
+            try self.queue.enqueue(work_queue.WorkItem.initWithContext(self.allocator, self.next_id, block, &Block.run));
+            self.in_flight += 1;
+            self.next_id += 1;
+            self.fill = (self.fill + 1) % self.blocks.len;
+
+            // wrapped onto a block that hasn't been written out yet
+            if (self.in_flight == self.blocks.len) try self.drainOldest();
+            self.blocks[self.fill].stored = self.stored;
+        }
+
+        fn drainOldest(self: *Self) !void {
+            const block = &self.blocks[self.oldest];
+            block.done.wait();
+            const decoded_len = block.len;
+            block.len = 0;
+            self.in_flight -= 1;
+            self.oldest = (self.oldest + 1) % self.blocks.len;
+
+            if (block.err) |err| return err;
+            try self.frames.append(.{ .offset = self.bytes_out, .decoded_offset = self.decoded_out });
+            try self.sink.writeAll(block.output.items);
+            self.bytes_out += block.output.items.len;
+            self.decoded_out += decoded_len;
+        }
+    };
+}
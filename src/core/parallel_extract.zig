@@ -0,0 +1,151 @@
+//! Parallel restore: the reader still decodes the payload on one thread (it
+//! owns the whole-stream checksum), but whole file bodies are handed to the
+//! work queue, where create/write/fchmod/close happen on several cores at
+//! once. Bodies in flight are capped in bytes and in count, so a tree of huge
+//! files can't pile up in memory while the disk catches up. A job gets its
+//! own handle on the directory the reader found through the DirCache and
+//! creates the file there by name, with the same dir_cache.createFile the
+//! reader's thread uses, so neither walks a path or follows a symlink.
+
+const std = @import("std");
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+const Mutex = std.Thread.Mutex;
+const Condition = std.Thread.Condition;
+const work_queue = @import("work_queue.zig");
+const dir_cache = @import("dir_cache.zig");
+
+// decoded bytes the reader may have handed out but not yet seen written
+pub const MAX_IN_FLIGHT_BYTES: usize = 64 * 1024 * 1024;
+// empty and tiny files cost a job each; this bounds the queue for those
+pub const MAX_IN_FLIGHT_JOBS: usize = 1024;
+// bodies above this are streamed to disk by the reader itself instead
+pub const MAX_JOB_SIZE: u64 = 8 * 1024 * 1024;
+
+pub const WriterPool = struct {
+    allocator: Allocator,
+    queue: work_queue.WorkQueue,
+    mutex: Mutex = .{},
+    changed: Condition = .{}, // a job finished
+    bytes: usize = 0,
+    jobs: usize = 0,
+    next_id: u64 = 0,
+    err: ?anyerror = null, // first failure; everything after it is refused
+
+    const Self = @This();
+
+    const Job = struct {
+        pool: *WriterPool,
+        dir: std.fs.Dir, // the pool's own handle, closed with the job
+        buf: []u8, // the body, then the file name
+        name_len: usize,
+        mode: u64,
+
+        fn run(ctx: *anyopaque) anyerror!void {
+            const job: *Job = @ptrCast(@alignCast(ctx));
+            const pool = job.pool;
+            const result = job.write();
+
+            pool.mutex.lock();
+            defer pool.mutex.unlock();
+            result catch |err| {
+                if (pool.err == null) pool.err = err;
+            };
+            pool.bytes -= job.buf.len;
+            pool.jobs -= 1;
+            job.dir.close();
+            pool.allocator.free(job.buf);
+            pool.allocator.destroy(job);
+            pool.changed.broadcast();
+        }
+
+        fn write(job: *const Job) !void {
+            const split = job.buf.len - job.name_len;
+            const out = try dir_cache.createFile(job.dir, job.buf[split..], true);
+            defer out.close();
+            try out.writeAll(job.buf[0..split]);
+            dir_cache.restoreMode(out, job.mode);
+        }
+    };
+
+    // Heap allocated because the workers hold pointers back to it.
+    // threads = 0 means one per cpu.
+    pub fn init(allocator: Allocator, threads: usize) !*Self {
+        const count = if (threads != 0) threads else (std.Thread.getCpuCount() catch 1);
+        const self = try allocator.create(Self);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .queue = work_queue.WorkQueue.init(allocator, count),
+        };
+        errdefer self.queue.deinit();
+        try self.queue.start();
+        return self;
+    }
+
+    // Lets queued jobs finish first; call finish() before this to see their errors.
+    pub fn deinit(self: *Self) void {
+        self.queue.deinit();
+        self.allocator.destroy(self);
+    }
+
+    // A buffer for the next body and, after it, its file name (so a job is
+    // one allocation), once there's room for it under the caps. Either
+    // submit() it or cancel() it.
+    pub fn acquire(self: *Self, size: usize) ![]u8 {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        // a body bigger than the whole budget still gets through, alone
+        while (self.err == null and self.jobs > 0 and
+            (self.bytes + size > MAX_IN_FLIGHT_BYTES or self.jobs >= MAX_IN_FLIGHT_JOBS))
+        {
+            self.changed.wait(&self.mutex);
+        }
+        if (self.err) |err| return err;
+        const data = try self.allocator.alloc(u8, size);
+        self.bytes += size;
+        self.jobs += 1;
+        return data;
+    }
+
+    // Write the body in buf (from acquire, its last name_len bytes the file
+    // name) to that name in dir, and chmod it. dir is only borrowed: the job
+    // writes through a dup of it. The pool owns buf from here on.
+    pub fn submit(self: *Self, dir: std.fs.Dir, buf: []u8, name_len: usize, mode: u64) !void {
+        const fd = posix.dup(dir.fd) catch |err| {
+            self.cancel(buf);
+            return err;
+        };
+        const job = self.allocator.create(Job) catch |err| {
+            posix.close(fd);
+            self.cancel(buf);
+            return err;
+        };
+        job.* = .{ .pool = self, .dir = .{ .fd = fd }, .buf = buf, .name_len = name_len, .mode = mode };
+        self.queue.enqueue(work_queue.WorkItem.initWithContext(self.allocator, self.next_id, job, &Job.run)) catch |err| {
+            job.dir.close();
+            self.allocator.destroy(job);
+            self.cancel(buf);
+            return err;
+        };
+        self.next_id += 1;
+    }
+
+    // Give back a buffer from acquire() that won't be submitted.
+    pub fn cancel(self: *Self, buf: []u8) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        self.bytes -= buf.len;
+        self.jobs -= 1;
+        self.allocator.free(buf);
+        self.changed.broadcast();
+    }
+
+    // Wait for every submitted body to be on disk; the first write error, if any.
+    pub fn finish(self: *Self) !void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        while (self.jobs > 0) self.changed.wait(&self.mutex);
+        if (self.err) |err| return err;
+    }
+};
@@ -0,0 +1,183 @@
+//! pigz-style gzip: each parallel_blocks block is deflated into its own gzip
+//! member. Concatenated members are still one valid .gz for gzip/zcat. Each
+//! member also carries its own total size in a FEXTRA subfield ('K','M') so our
+//! reader can walk member by member (std's inflater reads ahead and can't stop
+//! cleanly at a member boundary on its own).
+
+const std = @import("std");
+const ArrayList = std.ArrayList;
+const Allocator = std.mem.Allocator;
+const parallel_blocks = @import("parallel_blocks.zig");
+
+pub const BLOCK_SIZE = parallel_blocks.BLOCK_SIZE;
+
+// gzip header (10) + XLEN (2) + one 'KM' subfield (2 id + 2 len + 4 size)
+pub const MEMBER_HEADER_LEN: usize = 20;
+pub const MEMBER_TRAILER_LEN: usize = 8; // crc32 + isize
+
+// reader refuses anything bigger so a corrupt size field can't make us allocate gigabytes
+pub const MAX_MEMBER_SIZE: usize = 64 * 1024 * 1024;
+
+pub const GzipError = error{
+    BadMemberHeader,
+    MemberTooLarge,
+    CorruptMember,
+};
+
+// Deflate one block into a complete, self-describing gzip member.
+pub fn writeMember(out: *ArrayList(u8), data: []const u8, options: std.compress.flate.Options) !void {
+    try beginMember(out);
+    var deflater = try std.compress.flate.compressor(out.writer(), options);
+    try deflater.writer().writeAll(data);
+    try deflater.finish();
+    try endMember(out, data);
+}
+
+// Same member layout but with deflate "stored" blocks: costs a crc32 and a
+// copy, for data that wouldn't shrink anyway. Any inflater reads it.
+pub fn writeStoredMember(out: *ArrayList(u8), data: []const u8) !void {
+    try beginMember(out);
+    const MAX_STORED: usize = 65535;
+    var rest = data;
+    while (true) {
+        const n = @min(rest.len, MAX_STORED);
+        const final = n == rest.len;
+        var hdr: [5]u8 = undefined;
+        hdr[0] = if (final) 1 else 0; // BFINAL, BTYPE=00; the rest of the byte is padding
+        std.mem.writeInt(u16, hdr[1..3], @intCast(n), .little);
+        std.mem.writeInt(u16, hdr[3..5], ~@as(u16, @intCast(n)), .little);
+        try out.appendSlice(&hdr);
+        try out.appendSlice(rest[0..n]);
+        rest = rest[n..];
+        if (final) break;
+    }
+    try endMember(out, data);
+}
+
+fn beginMember(out: *ArrayList(u8)) !void {
+    out.clearRetainingCapacity();
+    try out.appendSlice(&[_]u8{
+        0x1f, 0x8b, 8, 0x04, // magic, CM=deflate, FLG=FEXTRA
+        0, 0, 0, 0, // mtime (unset, keeps output reproducible)
+        0, 3, // XFL, OS=unix
+        8, 0, // XLEN
+        'K', 'M', 4, 0, // subfield id + length
+        0, 0, 0, 0, // member size, patched once we know it
+    });
+}
+
+fn endMember(out: *ArrayList(u8), data: []const u8) !void {
+    var tail: [MEMBER_TRAILER_LEN]u8 = undefined;
+    std.mem.writeInt(u32, tail[0..4], std.hash.Crc32.hash(data), .little);
+    std.mem.writeInt(u32, tail[4..8], @as(u32, @truncate(data.len)), .little);
+    try out.appendSlice(&tail);
+
+    std.mem.writeInt(u32, out.items[16..20], @as(u32, @intCast(out.items.len)), .little);
+}
+
+// Returns the total member size (header + deflate data + trailer) recorded by writeMember.
+pub fn parseMemberHeader(hdr: *const [MEMBER_HEADER_LEN]u8) !usize {
+    if (hdr[0] != 0x1f or hdr[1] != 0x8b or hdr[2] != 8) return GzipError.BadMemberHeader;
+    // we only ever write FEXTRA; a member without our size field came from some other tool
+    if (hdr[3] != 0x04) return GzipError.BadMemberHeader;
+    if (std.mem.readInt(u16, hdr[10..12], .little) != 8) return GzipError.BadMemberHeader;
+    if (hdr[12] != 'K' or hdr[13] != 'M' or std.mem.readInt(u16, hdr[14..16], .little) != 4) return GzipError.BadMemberHeader;
+
+    const size: usize = std.mem.readInt(u32, hdr[16..20], .little);
+    if (size < MEMBER_HEADER_LEN + MEMBER_TRAILER_LEN) return GzipError.BadMemberHeader;
+    if (size > MAX_MEMBER_SIZE) return GzipError.MemberTooLarge;
+    return size;
+}
+
+// Inflate a complete member (as produced by writeMember) into out, checking crc and length.
+pub fn inflateMember(member: []const u8, out: *ArrayList(u8)) !void {
+    if (member.len < MEMBER_HEADER_LEN + MEMBER_TRAILER_LEN) return GzipError.CorruptMember;
+    const tail = member[member.len - MEMBER_TRAILER_LEN ..];
+    const expected_crc = std.mem.readInt(u32, tail[0..4], .little);
+    const expected_len = std.mem.readInt(u32, tail[4..8], .little);
+
+    out.clearRetainingCapacity();
+    var stream = std.io.fixedBufferStream(member[MEMBER_HEADER_LEN .. member.len - MEMBER_TRAILER_LEN]);
+    var inflater = std.compress.flate.decompressor(stream.reader());
+    inflater.reader().readAllArrayList(out, MAX_MEMBER_SIZE) catch return GzipError.CorruptMember;
+
+    if (@as(u32, @truncate(out.items.len)) != expected_len) return GzipError.CorruptMember;
+    if (std.hash.Crc32.hash(out.items) != expected_crc) return GzipError.CorruptMember;
+}
+
+const GzipCodec = struct {
+    pub const Options = std.compress.flate.Options;
+    pub const encode = writeMember;
+    pub const store = writeStoredMember;
+};
+
+pub const ParallelGzipWriter = parallel_blocks.BlockWriter(GzipCodec);
+pub const Options = ParallelGzipWriter.Options;
+
+// Reads a stream of writeMember members back as one continuous byte stream.
+// Memory stays bounded to one compressed + one decompressed member.
+pub const MemberReader = struct {
+    source: std.io.AnyReader,
+    member: ArrayList(u8),
+    block: ArrayList(u8),
+    pos: usize = 0,
+    done: bool = false,
+
+    const Self = @This();
+    pub const Reader = std.io.GenericReader(*Self, anyerror, read);
+
+    pub fn init(allocator: Allocator, source: std.io.AnyReader) Self {
+        return Self{
+            .source = source,
+            .member = ArrayList(u8).init(allocator),
+            .block = ArrayList(u8).init(allocator),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        self.member.deinit();
+        self.block.deinit();
+    }
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        // loop because an empty member is legal and decodes to nothing
+        while (self.pos == self.block.items.len) {
+            if (self.done) return 0;
+            try self.nextMember();
+        }
+        const n = @min(dest.len, self.block.items.len - self.pos);
+        @memcpy(dest[0..n], self.block.items[self.pos..][0..n]);
+        self.pos += n;
+        return n;
+    }
+
+    pub fn reader(self: *Self) Reader {
+        return .{ .context = self };
+    }
+
+    // Drop the current member; the source has been repositioned at a member boundary.
+    pub fn reset(self: *Self) void {
+        self.block.clearRetainingCapacity();
+        self.pos = 0;
+        self.done = false;
+    }
+
+    fn nextMember(self: *Self) !void {
+        self.block.clearRetainingCapacity();
+        self.pos = 0;
+
+        var hdr: [MEMBER_HEADER_LEN]u8 = undefined;
+        const got = try self.source.readAll(&hdr);
+        if (got == 0) {
+            self.done = true;
+            return;
+        }
+        if (got != hdr.len) return GzipError.BadMemberHeader;
+
+        const size = try parseMemberHeader(&hdr);
+        try self.member.resize(size);
+        @memcpy(self.member.items[0..MEMBER_HEADER_LEN], &hdr);
+        try self.source.readNoEof(self.member.items[MEMBER_HEADER_LEN..]);
+        try inflateMember(self.member.items, &self.block);
+    }
+};
@@ -0,0 +1,135 @@
+//! Framing for archives written to and read from pipes. A regular archive
+//! gets its header rewritten once the payload is out (size, checksum) and its
+//! TOC found by seeking, neither of which a pipe allows. A piped archive is
+//!   header            tar_size and checksum zero, version VERSION
+//!   payload frames    u32 length + that many stored bytes, repeated
+//!   u32 0             end of the payload
+//!   trailer           TRAILER_MAGIC, u64 stored payload bytes, checksum
+//! The stored bytes are the same sealed/compressed V2 stream a regular
+//! archive holds; the frames only say where it ends, so a reader can hand the
+//! codec exactly the payload and then find the trailer. There's no TOC: a
+//! pipe is read front to back anyway.
+
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+// Header version of a piped archive; readers that only seek refuse it up front.
+pub const VERSION: u32 = 4;
+pub const TRAILER_MAGIC = "KHRTAIL1";
+// Largest frame written; bigger lengths on read mean a corrupt stream.
+pub const FRAME_SIZE: usize = 1024 * 1024;
+
+pub const PipeError = error{
+    CorruptFrame,
+    TruncatedStream,
+};
+
+// What the header of a regular archive would have held.
+pub const Trailer = struct {
+    stored_len: u64,
+    checksum: [32]u8,
+
+    pub fn write(self: *const Trailer, writer: anytype) !void {
+        try writer.writeAll(TRAILER_MAGIC);
+        try writer.writeInt(u64, self.stored_len, .little);
+        try writer.writeAll(&self.checksum);
+    }
+
+    pub fn read(reader: anytype) !Trailer {
+        var magic: [TRAILER_MAGIC.len]u8 = undefined;
+        reader.readNoEof(&magic) catch return PipeError.TruncatedStream;
+        if (!std.mem.eql(u8, &magic, TRAILER_MAGIC)) return PipeError.CorruptFrame;
+        var trailer: Trailer = undefined;
+        trailer.stored_len = reader.readInt(u64, .little) catch return PipeError.TruncatedStream;
+        reader.readNoEof(&trailer.checksum) catch return PipeError.TruncatedStream;
+        return trailer;
+    }
+};
+
+// Cuts what's written to it into frames on sink; finish() writes the end marker.
+pub const FrameWriter = struct {
+    allocator: Allocator,
+    sink: std.io.AnyWriter,
+    buf: []u8,
+    len: usize = 0,
+    total: u64 = 0, // stored bytes so far, for the trailer
+
+    const Self = @This();
+
+    pub fn init(allocator: Allocator, sink: std.io.AnyWriter) !Self {
+        return .{
+            .allocator = allocator,
+            .sink = sink,
+            .buf = try allocator.alloc(u8, FRAME_SIZE),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        self.allocator.free(self.buf);
+    }
+
+    pub fn write(self: *Self, bytes: []const u8) anyerror!usize {
+        const n = @min(bytes.len, self.buf.len - self.len);
+        @memcpy(self.buf[self.len..][0..n], bytes[0..n]);
+        self.len += n;
+        if (self.len == self.buf.len) try self.flush();
+        return n;
+    }
+
+    pub fn any(self: *Self) std.io.AnyWriter {
+        return .{ .context = self, .writeFn = typeErasedWrite };
+    }
+
+    fn typeErasedWrite(context: *const anyopaque, bytes: []const u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.write(bytes);
+    }
+
+    pub fn finish(self: *Self) !void {
+        if (self.len > 0) try self.flush();
+        try self.sink.writeInt(u32, 0, .little);
+    }
+
+    fn flush(self: *Self) !void {
+        try self.sink.writeInt(u32, @intCast(self.len), .little);
+        try self.sink.writeAll(self.buf[0..self.len]);
+        self.total += self.len;
+        self.len = 0;
+    }
+};
+
+// The stored bytes back out of the frames; reads 0 once the end marker has
+// gone by, leaving source at the trailer.
+pub const FrameReader = struct {
+    source: std.io.AnyReader,
+    left: usize = 0, // bytes still to come in the current frame
+    done: bool = false,
+    total: u64 = 0,
+
+    const Self = @This();
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        if (dest.len == 0) return 0;
+        while (self.left == 0) {
+            if (self.done) return 0;
+            const len = self.source.readInt(u32, .little) catch return PipeError.TruncatedStream;
+            if (len > FRAME_SIZE) return PipeError.CorruptFrame;
+            if (len == 0) self.done = true;
+            self.left = len;
+        }
+        const n = try self.source.read(dest[0..@min(dest.len, self.left)]);
+        if (n == 0) return PipeError.TruncatedStream;
+        self.left -= n;
+        self.total += n;
+        return n;
+    }
+
+    pub fn any(self: *Self) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
+
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+};
@@ -0,0 +1,186 @@
+//! One archive stream written to several files in a single pass, e.g. a
+//! local disk and a NAS. What's written is cut into CHUNK_SIZE pieces and
+//! each piece is queued for every file; each file has its own thread
+//! draining its own queue, so a slow destination only holds up the others
+//! once it has MAX_QUEUED_BYTES waiting. A piece is freed when the last
+//! file has written it.
+
+const std = @import("std");
+const fs = std.fs;
+const Allocator = std.mem.Allocator;
+const Mutex = std.Thread.Mutex;
+const Condition = std.Thread.Condition;
+
+pub const CHUNK_SIZE: usize = 1024 * 1024;
+// per destination: how far it may fall behind before the writer waits for it
+pub const MAX_QUEUED_BYTES: usize = 64 * 1024 * 1024;
+
+pub const TeeWriter = struct {
+    allocator: Allocator,
+    outputs: []Output,
+    buf: []u8, // piece being filled by write()
+    len: usize = 0,
+    mutex: Mutex = .{},
+    changed: Condition = .{}, // something was queued, written or closed
+    closing: bool = false,
+    err: ?anyerror = null, // first write error on any destination
+
+    const Self = @This();
+    pub const Writer = std.io.GenericWriter(*Self, anyerror, write);
+
+    const Chunk = struct {
+        data: []u8,
+        refs: usize, // destinations that haven't written it yet
+    };
+
+    const Output = struct {
+        file: fs.File,
+        queue: std.fifo.LinearFifo(*Chunk, .Dynamic),
+        queued: usize = 0, // bytes in queue
+        thread: ?std.Thread = null,
+    };
+
+    // Heap allocated because the threads hold a pointer to it. The files
+    // are written from their current position on and stay the caller's.
+    pub fn init(allocator: Allocator, files: []const fs.File) !*Self {
+        const self = try allocator.create(Self);
+        errdefer allocator.destroy(self);
+        const outputs = try allocator.alloc(Output, files.len);
+        errdefer allocator.free(outputs);
+        const buf = try allocator.alloc(u8, CHUNK_SIZE);
+        errdefer allocator.free(buf);
+        for (outputs, files) |*o, f| o.* = .{ .file = f, .queue = std.fifo.LinearFifo(*Chunk, .Dynamic).init(allocator) };
+        self.* = .{
+            .allocator = allocator,
+            .outputs = outputs,
+            .buf = buf,
+        };
+        errdefer self.stop();
+        for (outputs) |*o| o.thread = try std.Thread.spawn(.{}, run, .{ self, o });
+        return self;
+    }
+
+    // Stops the threads; what hasn't been written by then is dropped, so
+    // call finish() first.
+    pub fn deinit(self: *Self) void {
+        self.stop();
+        for (self.outputs) |*o| {
+            while (o.queue.readItem()) |chunk| self.release(chunk);
+            o.queue.deinit();
+        }
+        const allocator = self.allocator;
+        allocator.free(self.outputs);
+        allocator.free(self.buf);
+        allocator.destroy(self);
+    }
+
+    fn stop(self: *Self) void {
+        self.mutex.lock();
+        self.closing = true;
+        self.changed.broadcast();
+        self.mutex.unlock();
+        for (self.outputs) |*o| {
+            if (o.thread) |t| t.join();
+            o.thread = null;
+        }
+    }
+
+    pub fn write(self: *Self, bytes: []const u8) anyerror!usize {
+        const n = @min(bytes.len, self.buf.len - self.len);
+        @memcpy(self.buf[self.len..][0..n], bytes[0..n]);
+        self.len += n;
+        if (self.len == self.buf.len) try self.submit();
+        return n;
+    }
+
+    pub fn writer(self: *Self) Writer {
+        return .{ .context = self };
+    }
+
+    pub fn any(self: *Self) std.io.AnyWriter {
+        return .{ .context = self, .writeFn = typeErasedWrite };
+    }
+
+    fn typeErasedWrite(context: *const anyopaque, bytes: []const u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.write(bytes);
+    }
+
+    // Wait until every file has everything written so far; the first write
+    // error on any of them, if there was one.
+    pub fn finish(self: *Self) !void {
+        if (self.len > 0) try self.submit();
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        while (self.err == null and self.pending()) self.changed.wait(&self.mutex);
+        if (self.err) |err| return err;
+    }
+
+    fn pending(self: *const Self) bool {
+        for (self.outputs) |*o| {
+            if (o.queued > 0) return true;
+        }
+        return false;
+    }
+
+    // Hand the filled piece to every queue once each has room for it.
+    fn submit(self: *Self) !void {
+        const next = try self.allocator.alloc(u8, CHUNK_SIZE);
+        errdefer self.allocator.free(next);
+        const chunk = try self.allocator.create(Chunk);
+        errdefer self.allocator.destroy(chunk);
+        chunk.* = .{ .data = self.buf[0..self.len], .refs = self.outputs.len };
+
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        // a queue with nothing in it always takes the piece
+        while (self.err == null and self.full(chunk.data.len)) self.changed.wait(&self.mutex);
+        if (self.err) |err| return err;
+        for (self.outputs) |*o| try o.queue.ensureUnusedCapacity(1);
+        for (self.outputs) |*o| {
+            o.queue.writeItemAssumeCapacity(chunk);
+            o.queued += chunk.data.len;
+        }
+        self.changed.broadcast();
+        // the queued piece owns the old buffer now
+        self.buf = next;
+        self.len = 0;
+    }
+
+    fn full(self: *const Self, len: usize) bool {
+        for (self.outputs) |*o| {
+            if (o.queued > 0 and o.queued + len > MAX_QUEUED_BYTES) return true;
+        }
+        return false;
+    }
+
+    fn release(self: *Self, chunk: *Chunk) void {
+        chunk.refs -= 1;
+        if (chunk.refs > 0) return;
+        self.allocator.free(chunk.data.ptr[0..CHUNK_SIZE]);
+        self.allocator.destroy(chunk);
+    }
+
+    fn run(self: *Self, o: *Output) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        while (true) {
+            while (o.queue.count == 0 and !self.closing) self.changed.wait(&self.mutex);
+            if (self.closing) return;
+            const chunk = o.queue.readItem().?;
+
+            // after a failure anywhere the rest is only drained, not written
+            const skip = self.err != null;
+            self.mutex.unlock();
+            const result = if (skip) {} else o.file.writeAll(chunk.data);
+            self.mutex.lock();
+
+            result catch |err| {
+                if (self.err == null) self.err = err;
+            };
+            o.queued -= chunk.data.len;
+            self.release(chunk);
+            self.changed.broadcast();
+        }
+    }
+};
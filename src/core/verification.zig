@@ -7,6 +7,7 @@ const types = @import("../utils/types.zig");
 const String = types.String;
 const FileSize = types.FileSize;
 const ansi = @import("../utils/ansi.zig");
+const khr_format = @import("khr_format.zig");
 
 pub const ChecksumType = enum {
     md5, // fast but broken for security
@@ -281,7 +282,18 @@ pub const BackupVerifier = struct {
         return hex_hash;
     }
     fn calculateBlake3(self: *BackupVerifier, file: fs.File, buffer: []u8) !String {
-        return self.calculateSHA256(file, buffer);
+        var hasher = std.crypto.hash.Blake3.init(.{});
+        try file.seekTo(0);
+
+        while (true) {
+            const bytes_read = try file.read(buffer);
+            if (bytes_read == 0) break;
+            hasher.update(buffer[0..bytes_read]);
+        }
+
+        var hash: [32]u8 = undefined;
+        hasher.final(&hash);
+        return std.fmt.allocPrint(self.allocator, "{}", .{std.fmt.fmtSliceHexLower(&hash)});
     }
 
     fn calculateCRC32(self: *BackupVerifier, file: fs.File, buffer: []u8) !String {
@@ -341,9 +353,9 @@ pub const BackupVerifier = struct {
         } else if (std.mem.startsWith(u8, &header, "KROWNO_BACKUP_V1")) {
             print("{s}Plain backup detected{s}\n", .{ ansi.Color.CYAN, ansi.Color.RESET });
             return self.verifyPlainBackup(file);
-        } else if (std.mem.startsWith(u8, &header, "KHRONO01")) {
+        } else if (khr_format.isKhrMagic(header[0..8])) {
             print("{s}KHR format backup detected{s}\n", .{ ansi.Color.CYAN, ansi.Color.RESET });
-            return self.verifyKhrBackup(file);
+            return self.verifyKhrBackup(file, backup_path);
         } else {
             print("{s}Error: Unknown backup format{s}\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
             return false;
@@ -397,7 +409,7 @@ pub const BackupVerifier = struct {
         return true;
     }
 
-    fn verifyKhrBackup(self: *BackupVerifier, file: fs.File) !bool {
+    fn verifyKhrBackup(self: *BackupVerifier, file: fs.File, backup_path: String) !bool {
         print("{s}Verifying KHR format backup integrity...{s}\n", .{ ansi.Color.BOLD_BLUE, ansi.Color.RESET });
 
         // Check KHR header
@@ -405,17 +417,29 @@ pub const BackupVerifier = struct {
         var header: [8]u8 = undefined;
         const bytes_read = try file.read(&header);
 
-        if (bytes_read < 8 or !std.mem.eql(u8, &header, "KHRONO01")) {
+        if (bytes_read < 8 or !khr_format.isKhrMagic(&header)) {
             print("{s}Error: Invalid KHR header{s}\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
             return false;
         }
 
-        // Calculate checksum for verification
-        var buffer: [4096]u8 = undefined;
-        const sha256_hash = try self.calculateSHA256(file, &buffer);
-        defer self.allocator.free(sha256_hash);
-
-        print("{s}KHR backup SHA256: {s}{s}\n", .{ ansi.Color.DIM_WHITE, sha256_hash, ansi.Color.RESET });
+        // v2/v3: check the payload against the header checksum (block by block, in parallel, on newer archives)
+        khr_format.verifyKhrBackup(self.allocator, backup_path, null) catch |err| switch (err) {
+            error.DecryptionFailed => {
+                print("{s}Encrypted KHR backup: header is valid, contents need the password to check{s}\n", .{ ansi.Color.YELLOW, ansi.Color.RESET });
+                return true;
+            },
+            error.UnsupportedVersion => {
+                // v1 keeps its checksum inside the encrypted blob; all we can do is fingerprint the file
+                var buffer: [4096]u8 = undefined;
+                const sha256_hash = try self.calculateSHA256(file, &buffer);
+                defer self.allocator.free(sha256_hash);
+                print("{s}KHR backup SHA256: {s}{s}\n", .{ ansi.Color.DIM_WHITE, sha256_hash, ansi.Color.RESET });
+            },
+            else => {
+                print("{s}Error: KHR backup failed verification: {any}{s}\n", .{ ansi.Color.BOLD_RED, err, ansi.Color.RESET });
+                return false;
+            },
+        };
         print("{s}✓ KHR backup integrity verified{s}\n", .{ ansi.Color.GREEN, ansi.Color.RESET });
         return true;
     }
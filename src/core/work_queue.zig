@@ -14,6 +14,9 @@ pub const WorkItem = struct {
     id: u64,
     data: String,
     callback: *const fn (data: String) anyerror!void,
+    // set by initWithContext: the worker gets a borrowed pointer instead of a copied string
+    context: ?*anyopaque = null,
+    context_callback: ?*const fn (context: *anyopaque) anyerror!void = null,
 
     allocator: Allocator,
 
@@ -26,11 +29,30 @@ pub const WorkItem = struct {
         };
     }
 
+    // caller owns context and must keep it alive until the callback has run
+    pub fn initWithContext(allocator: Allocator, id: u64, context: *anyopaque, callback: *const fn (context: *anyopaque) anyerror!void) WorkItem {
+        return WorkItem{
+            .id = id,
+            .data = &[_]u8{},
+            .callback = &noopCallback,
+            .context = context,
+            .context_callback = callback,
+            .allocator = allocator,
+        };
+    }
+
+    fn noopCallback(_: String) anyerror!void {}
+
     pub fn deinit(self: *WorkItem) void {
+        if (self.context != null) return; // nothing was duped
         self.allocator.free(self.data);
     }
 
     pub fn execute(self: *const WorkItem) !void {
+        if (self.context_callback) |cb| {
+            try cb(self.context.?);
+            return;
+        }
         try self.callback(self.data);
     }
 };
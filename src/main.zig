@@ -61,6 +61,16 @@ const CommandLineOptions = struct {
     force_terminal: bool = false,
     setup: bool = false,
     install_flatpaks: bool = false,
+    compression: khr_format.CompressionType = .gzip,
+    compression_level: ?i32 = null,
+    chunked: bool = false,
+    parent: ?String = null,
+    hash: khr_format.HashAlgo = .sha256,
+    volume_size: ?u64 = null,
+    volume_dirs: []const String = &[_]String{},
+    copies: []const String = &[_]String{},
+    resume_interrupted: bool = false,
+    operands: []const String = &[_]String{}, // bare arguments after the command
 };
 
 pub fn main() !void {
@@ -101,6 +111,9 @@ pub fn main() !void {
     }
 
     const options = try parseCommandLine(allocator, args);
+    defer allocator.free(options.operands);
+    defer allocator.free(options.volume_dirs);
+    defer allocator.free(options.copies);
 
     if (options.help) {
         try printHelp();
@@ -141,6 +154,12 @@ fn parseCommandLine(allocator: Allocator, args: []String) !CommandLineOptions {
     if (args.len < 2) {
         return options;
     }
+    var operands = std.ArrayList(String).init(allocator);
+    defer operands.deinit();
+    var volume_dirs = std.ArrayList(String).init(allocator);
+    defer volume_dirs.deinit();
+    var copies = std.ArrayList(String).init(allocator);
+    defer copies.deinit();
     var i: usize = 1;
     while (i < args.len) {
         const arg = args[i];
@@ -196,15 +215,62 @@ fn parseCommandLine(allocator: Allocator, args: []String) !CommandLineOptions {
             if (i < args.len) {
                 options.input_file = args[i];
             }
+        } else if (std.mem.eql(u8, arg, "-c") or std.mem.eql(u8, arg, "--compression")) {
+            i += 1;
+            if (i < args.len) {
+                options.compression = parseCompression(args[i]);
+            }
+        } else if (std.mem.eql(u8, arg, "-l") or std.mem.eql(u8, arg, "--level")) {
+            i += 1;
+            if (i < args.len) {
+                options.compression_level = std.fmt.parseInt(i32, args[i], 10) catch blk: {
+                    print("{s}Warning:{s} Invalid compression level '{s}', using codec default\n", .{ ansi.Color.BOLD_YELLOW, ansi.Color.RESET, args[i] });
+                    break :blk null;
+                };
+            }
+        } else if (std.mem.eql(u8, arg, "--chunked")) {
+            options.chunked = true;
+        } else if (std.mem.eql(u8, arg, "--parent")) {
+            i += 1;
+            if (i < args.len) {
+                options.parent = args[i];
+            }
+        } else if (std.mem.eql(u8, arg, "--volume-size")) {
+            i += 1;
+            if (i < args.len) {
+                options.volume_size = parseSize(args[i]);
+            }
+        } else if (std.mem.eql(u8, arg, "--volume-dir")) {
+            i += 1;
+            if (i < args.len) {
+                try volume_dirs.append(args[i]);
+            }
+        } else if (std.mem.eql(u8, arg, "--copy")) {
+            i += 1;
+            if (i < args.len) {
+                try copies.append(args[i]);
+            }
+        } else if (std.mem.eql(u8, arg, "--resume")) {
+            options.resume_interrupted = true;
+        } else if (std.mem.eql(u8, arg, "--hash")) {
+            i += 1;
+            if (i < args.len) {
+                options.hash = parseHash(args[i]);
+            }
         } else if (std.mem.eql(u8, arg, "-t") or std.mem.eql(u8, arg, "--term")) {
             options.force_terminal = true;
         } else if (options.command == null and !std.mem.startsWith(u8, arg, "-")) {
             options.command = arg;
+        } else if (!std.mem.startsWith(u8, arg, "-")) {
+            try operands.append(arg);
         }
 
         i += 1;
     }
 
+    options.operands = try operands.toOwnedSlice();
+    options.volume_dirs = try volume_dirs.toOwnedSlice();
+    options.copies = try copies.toOwnedSlice();
     return options;
 }
 
@@ -218,6 +284,41 @@ fn parseBackupStrategy(strategy_str: String) !backup.BackupStrategy {
     return .standard;
 }
 
+fn parseCompression(name: String) khr_format.CompressionType {
+    if (std.mem.eql(u8, name, "none")) return .none;
+    if (std.mem.eql(u8, name, "gzip")) return .gzip;
+    if (std.mem.eql(u8, name, "lz4")) return .lz4;
+    if (std.mem.eql(u8, name, "zstd")) return .zstd;
+
+    print("{s}Warning:{s} Unknown compression '{s}', using 'gzip'\n", .{ ansi.Color.BOLD_YELLOW, ansi.Color.RESET, name });
+    return .gzip;
+}
+
+// Byte count with an optional K/M/G suffix (powers of 1024), e.g. "700M".
+fn parseSize(text: String) ?u64 {
+    if (text.len == 0) return null;
+    const unit: u64 = switch (std.ascii.toUpper(text[text.len - 1])) {
+        'K' => 1024,
+        'M' => 1024 * 1024,
+        'G' => 1024 * 1024 * 1024,
+        else => 1,
+    };
+    const digits = if (unit == 1) text else text[0 .. text.len - 1];
+    const n = std.fmt.parseInt(u64, digits, 10) catch {
+        print("{s}Warning:{s} Invalid size '{s}', not splitting into volumes\n", .{ ansi.Color.BOLD_YELLOW, ansi.Color.RESET, text });
+        return null;
+    };
+    return std.math.mul(u64, n, unit) catch null;
+}
+
+fn parseHash(name: String) khr_format.HashAlgo {
+    if (std.mem.eql(u8, name, "sha256")) return .sha256;
+    if (std.mem.eql(u8, name, "blake3")) return .blake3;
+
+    print("{s}Warning:{s} Unknown hash '{s}', using 'sha256'\n", .{ ansi.Color.BOLD_YELLOW, ansi.Color.RESET, name });
+    return .sha256;
+}
+
 // classic stty -echo trick for password input
 // unix-only and not elegant but it works
 // proper terminal library would be nicer someday
@@ -229,13 +330,21 @@ fn promptForPassword(allocator: Allocator) !String {
         defer _ = c.system("stty echo");
     }
 
-    const stdin = std.io.getStdIn().reader();
-    const password = try stdin.readUntilDelimiterAlloc(allocator, '\n', 256);
+    const input = promptInput();
+    defer if (input.handle != std.io.getStdIn().handle) input.close();
+    const password = try input.reader().readUntilDelimiterAlloc(allocator, '\n', 256);
 
     print("\n", .{});
     return password;
 }
 
+// stdin may be carrying the archive (restore -i -), so ask on the terminal when there is one
+fn promptInput() std.fs.File {
+    const stdin = std.io.getStdIn();
+    if (stdin.isTty()) return stdin;
+    return std.fs.openFileAbsolute("/dev/tty", .{}) catch stdin;
+}
+
 fn promptForPasswordConfirm(allocator: Allocator) !String {
     // First entry
     const pwd1 = try promptForPassword(allocator);
@@ -247,8 +356,9 @@ fn promptForPasswordConfirm(allocator: Allocator) !String {
         _ = c.system("stty -echo");
         defer _ = c.system("stty echo");
     }
-    const stdin = std.io.getStdIn().reader();
-    const pwd2 = try stdin.readUntilDelimiterAlloc(allocator, '\n', 256);
+    const input = promptInput();
+    defer if (input.handle != std.io.getStdIn().handle) input.close();
+    const pwd2 = try input.reader().readUntilDelimiterAlloc(allocator, '\n', 256);
     defer allocator.free(pwd2);
     print("\n", .{});
 
@@ -266,6 +376,8 @@ fn executeCommand(allocator: Allocator, options: CommandLineOptions) !void {
 
     if (std.mem.eql(u8, command, "backup")) {
         try executeBackup(allocator, options);
+    } else if (std.mem.eql(u8, command, "append")) {
+        try executeAppend(allocator, options);
     } else if (std.mem.eql(u8, command, "restore")) {
         try executeRestore(allocator, options);
     } else if (std.mem.eql(u8, command, "info")) {
@@ -302,25 +414,75 @@ fn executeBackup(allocator: Allocator, options: CommandLineOptions) !void {
         return;
     };
 
+    if (std.mem.eql(u8, output_file, backup.PIPE_PATH) and std.io.getStdOut().isTty()) {
+        print("{s}Error:{s} Refusing to write a backup to a terminal\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
+        print("Use: {s}krowno backup -o - | ssh host 'cat > backup.khr'{s}\n", .{ ansi.Color.CYAN, ansi.Color.RESET });
+        return;
+    }
+
     print("{s}Creating {s} backup...{s}\n", .{ ansi.Color.BOLD_BLUE, options.strategy.getDescription(), ansi.Color.RESET });
 
     if (options.verbose) {
         print("Strategy: {s}\n", .{options.strategy.getDescription()});
         print("Output: {s}\n", .{output_file});
         print("Encryption: {s}\n", .{if (options.encrypt) "enabled" else "disabled"});
+        print("Compression: {s}\n", .{@tagName(options.compression)});
     }
 
     var engine = try backup.BackupEngine.init(allocator);
     defer engine.deinit();
+    engine.compression_level = options.compression_level;
+    engine.chunked = options.chunked;
+    engine.parent_archive = options.parent;
+    engine.hash = options.hash;
+    engine.volume_size = options.volume_size;
+    engine.volume_dirs = options.volume_dirs;
+    engine.copies = options.copies;
+    engine.resume_interrupted = options.resume_interrupted;
 
     const progress_callback = if (options.show_progress) &backup.defaultProgressCallback else null;
     const password = if (options.encrypt) options.password else null;
 
-    try engine.createBackup(options.strategy, output_file, password, progress_callback, khr_format.CompressionType.gzip);
+    try engine.createBackup(options.strategy, output_file, password, progress_callback, options.compression);
 
     print("\n{s}Backup completed successfully!{s}\n", .{ ansi.Color.BOLD_GREEN, ansi.Color.RESET });
 }
 
+fn executeAppend(allocator: Allocator, options: CommandLineOptions) !void {
+    const input_file = options.input_file orelse {
+        print("{s}Error:{s} Input file required for append command\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
+        print("Use: {s}krowno append -i /path/to/backup.khr FILE...{s}\n", .{ ansi.Color.CYAN, ansi.Color.RESET });
+        return;
+    };
+    if (options.operands.len == 0) {
+        print("{s}Error:{s} Nothing to append\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
+        return;
+    }
+
+    // directories are added file by file, like a backup strategy's paths
+    var arena = std.heap.ArenaAllocator.init(allocator);
+    defer arena.deinit();
+    var paths = std.ArrayList(String).init(allocator);
+    defer paths.deinit();
+    for (options.operands) |operand| {
+        var dir = std.fs.cwd().openDir(operand, .{ .iterate = true }) catch {
+            try paths.append(operand);
+            continue;
+        };
+        defer dir.close();
+        var walker = try dir.walk(allocator);
+        defer walker.deinit();
+        while (try walker.next()) |entry| {
+            if (entry.kind == .directory) continue;
+            try paths.append(try std.fs.path.join(arena.allocator(), &[_]String{ operand, entry.path }));
+        }
+    }
+
+    const progress_callback = if (options.show_progress) &backup.defaultProgressCallback else null;
+    try khr_format.appendKhrBackup(allocator, input_file, paths.items, .{ .level = options.compression_level }, progress_callback);
+    print("\n{s}Append completed successfully!{s}\n", .{ ansi.Color.BOLD_GREEN, ansi.Color.RESET });
+}
+
 fn executeRestore(allocator: Allocator, options: CommandLineOptions) !void {
     const input_file = options.input_file orelse {
         print("{s}Error:{s} Input file required for restore command\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
@@ -328,6 +490,12 @@ fn executeRestore(allocator: Allocator, options: CommandLineOptions) !void {
         return;
     };
 
+    if (std.mem.eql(u8, input_file, backup.PIPE_PATH) and std.io.getStdIn().isTty()) {
+        print("{s}Error:{s} Expected a backup on stdin, not a terminal\n", .{ ansi.Color.BOLD_RED, ansi.Color.RESET });
+        print("Use: {s}ssh host 'cat backup.khr' | krowno restore -i -{s}\n", .{ ansi.Color.CYAN, ansi.Color.RESET });
+        return;
+    }
+
     print("{s}Restoring from backup:{s} {s}\n", .{ ansi.Color.BOLD_BLUE, ansi.Color.RESET, input_file });
     print("\n{s}Restore will automatically:{s}\n", .{ ansi.Color.BOLD_WHITE, ansi.Color.RESET });
     print("  • Extract files to proper locations\n", .{});
@@ -352,6 +520,7 @@ fn executeRestore(allocator: Allocator, options: CommandLineOptions) !void {
     // Create backup engine and run restore
     var engine = try backup.BackupEngine.init(allocator);
     defer engine.deinit();
+    engine.volume_dirs = options.volume_dirs;
 
     const progress_callback = if (options.show_progress) &backup.defaultProgressCallback else null;
 
@@ -459,6 +628,7 @@ fn printHelp() !void {
 
     print("COMMANDS:\n", .{});
     print("    backup      Create a new backup\n", .{});
+    print("    append      Add files to an existing backup\n", .{});
     print("    restore     Restore from a backup file\n", .{});
     print("    info        Show backup information\n", .{});
     print("    validate    Verify backup integrity\n", .{});
@@ -478,11 +648,20 @@ fn printHelp() !void {
     print("        --install <FILE>        Install Flatpaks from backup file\n", .{});
     print("    -t, --term                  Force terminal mode (no GUI)\n", .{});
     print("    -s, --strategy <STRATEGY>   Backup strategy [minimal|standard|comprehensive|paranoid]\n", .{});
-    print("    -o, --output <FILE>         Output backup file path\n", .{});
-    print("    -i, --input <FILE>          Input backup file path\n", .{});
+    print("    -o, --output <FILE>         Output backup file path ('-' streams to stdout)\n", .{});
+    print("    -i, --input <FILE>          Input backup file path ('-' reads from stdin)\n", .{});
     print("    -u, --username <USER>       Target username for migration\n", .{});
     print("    -p, --password              Prompt for encryption password\n", .{});
     print("        --no-encrypt            Disable encryption\n", .{});
+    print("    -c, --compression <CODEC>   Archive compression [none|lz4|gzip|zstd] (default: gzip)\n", .{});
+    print("    -l, --level <N>             Compression level (gzip 4-9, lz4 0-12, zstd 1-19)\n", .{});
+    print("        --chunked               Deduplicating chunked archive (KHR v3)\n", .{});
+    print("        --parent <FILE>         Chunked backup that only stores changes since FILE\n", .{});
+    print("        --hash <ALGO>           Archive checksum [sha256|blake3] (default: sha256)\n", .{});
+    print("        --volume-size <SIZE>    Split the archive into volumes of SIZE (e.g. 700M)\n", .{});
+    print("        --volume-dir <DIR>      Write/find volumes in DIR (repeatable)\n", .{});
+    print("        --copy <FILE>           Also write the backup to FILE, same pass (repeatable)\n", .{});
+    print("        --resume                Continue an interrupted backup from its last checkpoint\n", .{});
     print("    -v, --verbose               Enable verbose output\n", .{});
     print("    -q, --quiet                 Suppress progress indicators\n\n", .{});
 
@@ -496,6 +675,15 @@ fn printHelp() !void {
     print("    # Create a standard backup with encryption\n", .{});
     print("    krowno backup -s standard -o ~/mybackup.krowno -p\n\n", .{});
 
+    print("    # Create a zstd-compressed backup\n", .{});
+    print("    krowno backup -c zstd -l 6 -o ~/mybackup.khr\n\n", .{});
+
+    print("    # Incremental backup on top of an earlier chunked one\n", .{});
+    print("    krowno backup --chunked --parent ~/monday.khr -o ~/tuesday.khr\n\n", .{});
+
+    print("    # Stream a backup to another machine without a local copy\n", .{});
+    print("    krowno backup -o - | ssh host 'krowno restore -i - -o ~/restored'\n\n", .{});
+
     print("    # Restore with username migration\n", .{});
     print("    krowno restore -i ~/mybackup.krowno -u newuser -p\n\n", .{});
 
@@ -22,6 +22,16 @@ const Argon2 = crypto.pwhash.argon2;
 // 1. faster on CPUs without AES-NI (most users likely wont have it)
 // 2. constant-time implementation easier, less side-channel risk
 
+// argon2 params tuned for ~300ms delay on ryzen 9 5600HX
+// want it slow enough attackers cant bruteforce but fast enough users dont complain
+pub const KDF_ITERATIONS: u32 = 3;
+pub const KDF_MEMORY_KIB: u32 = 65536; // 64MB memory - makes parallelization expensive for attackers
+const KDF_THREADS: u24 = 4;
+
+pub const KEY_LEN: usize = ChaCha20Poly1305.key_length;
+pub const NONCE_LEN: usize = ChaCha20Poly1305.nonce_length;
+pub const TAG_LEN: usize = ChaCha20Poly1305.tag_length;
+
 pub const EncryptedData = struct {
     salt: [32]u8, // need unique salt per password for argon2
     nonce: [12]u8, // NEVER reuse nonce with same key
@@ -49,22 +59,7 @@ pub const CryptoContext = struct {
     }
 
     fn deriveKey(self: *Self, password: String, salt: String, key_out: []u8) !void {
-        // argon2 params tuned for ~300ms delay on ryzen 9 5600HX
-        // want it slow enough attackers cant bruteforce but fast enough users dont complain
-        const params = Argon2.Params{
-            .t = 3, // iterations
-            .m = 65536, // 64MB memory - makes parallelization expensive for attackers
-            .p = 4, // threads
-        };
-
-        try Argon2.kdf(
-            self.allocator,
-            key_out,
-            password,
-            salt,
-            params,
-            .argon2id, // hybrid of argon2i and argon2d - best of both
-        );
+        try deriveKeyInto(self.allocator, password, salt, key_out, KDF_ITERATIONS, KDF_MEMORY_KIB);
     }
 
     pub fn encrypt(self: *Self, plaintext: String, password: String) !EncryptedData {
@@ -208,3 +203,27 @@ pub fn hashPasswordWithSalt(allocator: Allocator, password: String, salt: String
 
     return try std.fmt.allocPrint(allocator, "{s}", .{std.fmt.fmtSliceHexLower(&key)});
 }
+
+fn deriveKeyInto(allocator: Allocator, password: String, salt: String, key_out: []u8, iterations: u32, memory_kib: u32) !void {
+    const params = Argon2.Params{
+        .t = iterations,
+        .m = memory_kib,
+        .p = KDF_THREADS,
+    };
+
+    try Argon2.kdf(
+        allocator,
+        key_out,
+        password,
+        salt,
+        params,
+        .argon2id, // hybrid of argon2i and argon2d - best of both
+    );
+}
+
+// For archives that recorded their own KDF cost, so old backups still open if the defaults change.
+pub fn deriveKeyWithParams(allocator: Allocator, password: String, salt: [32]u8, iterations: u32, memory_kib: u32) ![KEY_LEN]u8 {
+    var key: [KEY_LEN]u8 = undefined;
+    try deriveKeyInto(allocator, password, &salt, &key, iterations, memory_kib);
+    return key;
+}
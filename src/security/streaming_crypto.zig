@@ -4,6 +4,8 @@ const crypto = @import("crypto.zig");
 const types = @import("../utils/types.zig");
 const String = types.String;
 const Allocator = std.mem.Allocator;
+const ChaCha20Poly1305 = std.crypto.aead.chacha_poly.ChaCha20Poly1305;
+const HmacSha256 = std.crypto.auth.hmac.sha2.HmacSha256;
 
 pub const StreamEncryptor = struct {
     allocator: Allocator,
@@ -12,7 +14,7 @@ pub const StreamEncryptor = struct {
     chunk_size: usize,
 
     const Self = @This();
-    const CHUNK_SIZE: usize = 1024 * 1024; // 1MB chunks - sweet spot for performance
+    pub const CHUNK_SIZE: usize = 1024 * 1024; // 1MB chunks - sweet spot for performance
     // tried 4MB first but it was slower on my laptop
     // 256KB was too small, lots of overhead
 
@@ -111,6 +113,424 @@ pub const StreamEncryptor = struct {
     }
 };
 
+// ---- chunked AEAD for v2 archives ----
+//
+// Same 1MB chunking as StreamEncryptor but laid out for archives: every chunk
+// but the last holds exactly CHUNK_SIZE plaintext bytes, stored as
+// ciphertext || tag with no length prefix, so chunk i always starts at
+// i * SEALED_CHUNK_SIZE and readers can seek. The last chunk (possibly empty)
+// is sealed with a "final" flag in its nonce, which is what catches an archive
+// cut short at a chunk boundary. Nonces are the archive's random base nonce
+// XORed with the chunk index, a stream id (payload vs index) and the final flag.
+
+pub const CHUNK_SIZE: usize = StreamEncryptor.CHUNK_SIZE;
+pub const TAG_LEN: usize = crypto.TAG_LEN;
+pub const SEALED_CHUNK_SIZE: usize = CHUNK_SIZE + TAG_LEN;
+
+pub const StreamId = enum(u8) {
+    payload = 0,
+    index = 1,
+};
+
+pub const StreamCryptoError = error{
+    TruncatedStream,
+    AuthenticationFailed,
+};
+
+pub const ChunkCipher = struct {
+    key: [crypto.KEY_LEN]u8,
+    base_nonce: [crypto.NONCE_LEN]u8,
+
+    const Self = @This();
+
+    pub fn derive(allocator: Allocator, password: String, salt: [32]u8, base_nonce: [crypto.NONCE_LEN]u8, iterations: u32, memory_kib: u32) !Self {
+        return Self{
+            .key = try crypto.deriveKeyWithParams(allocator, password, salt, iterations, memory_kib),
+            .base_nonce = base_nonce,
+        };
+    }
+
+    pub fn wipe(self: *Self) void {
+        std.crypto.utils.secureZero(u8, &self.key);
+    }
+
+    // A digest of the plaintext that gets stored in the clear (the archive
+    // checksum), keyed so that without the password it can't be used to
+    // check a guess at the contents.
+    pub fn keyedDigest(self: *const Self, digest: [32]u8) [32]u8 {
+        var out: [HmacSha256.mac_length]u8 = undefined;
+        var mac = HmacSha256.init(&self.key);
+        mac.update("khrowno checksum");
+        mac.update(&digest);
+        mac.final(&out);
+        return out;
+    }
+
+    fn nonce(self: *const Self, stream: StreamId, index: u64, final: bool) [crypto.NONCE_LEN]u8 {
+        var n = self.base_nonce;
+        var counter: [8]u8 = undefined;
+        std.mem.writeInt(u64, &counter, index, .little);
+        for (n[0..8], counter) |*b, c| b.* ^= c;
+        n[10] ^= @intFromEnum(stream);
+        if (final) n[11] ^= 1;
+        return n;
+    }
+
+    // Encrypts buf[0..len] in place and appends the tag, so buf needs len + TAG_LEN bytes.
+    fn seal(self: *const Self, stream: StreamId, index: u64, final: bool, buf: []u8, len: usize) void {
+        ChaCha20Poly1305.encrypt(buf[0..len], buf[len..][0..TAG_LEN], buf[0..len], &[_]u8{}, self.nonce(stream, index, final), self.key);
+    }
+
+    // Inverse of seal: sealed is ciphertext || tag, plaintext lands in sealed[0 .. sealed.len - TAG_LEN].
+    fn open(self: *const Self, stream: StreamId, index: u64, final: bool, sealed: []u8) !void {
+        const len = sealed.len - TAG_LEN;
+        ChaCha20Poly1305.decrypt(sealed[0..len], sealed[0..len], sealed[len..][0..TAG_LEN].*, &[_]u8{}, self.nonce(stream, index, final), self.key) catch {
+            return StreamCryptoError.AuthenticationFailed;
+        };
+    }
+};
+
+// Stored size of a stream holding plain_len plaintext bytes.
+pub fn sealedLen(plain_len: u64) u64 {
+    return plain_len + (plain_len / CHUNK_SIZE + 1) * TAG_LEN;
+}
+
+// Plaintext size of a stored stream, or TruncatedStream when the length can't be right.
+pub fn plainLen(sealed_len: u64) !u64 {
+    const full = sealed_len / SEALED_CHUNK_SIZE;
+    const rest = sealed_len % SEALED_CHUNK_SIZE;
+    if (rest < TAG_LEN) return StreamCryptoError.TruncatedStream;
+    return full * CHUNK_SIZE + (rest - TAG_LEN);
+}
+
+// Seals everything written to it into chunks on sink. finish() must be called
+// to emit the final chunk, without it the stream won't open.
+pub const EncryptingWriter = struct {
+    allocator: Allocator,
+    cipher: *const ChunkCipher,
+    stream: StreamId,
+    sink: std.io.AnyWriter,
+    buf: []u8,
+    len: usize = 0,
+    index: u64 = 0,
+
+    const Self = @This();
+
+    pub fn init(allocator: Allocator, cipher: *const ChunkCipher, stream: StreamId, sink: std.io.AnyWriter) !Self {
+        return Self{
+            .allocator = allocator,
+            .cipher = cipher,
+            .stream = stream,
+            .sink = sink,
+            .buf = try allocator.alloc(u8, SEALED_CHUNK_SIZE),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        std.crypto.utils.secureZero(u8, self.buf);
+        self.allocator.free(self.buf);
+    }
+
+    pub fn write(self: *Self, bytes: []const u8) anyerror!usize {
+        const n = @min(bytes.len, CHUNK_SIZE - self.len);
+        @memcpy(self.buf[self.len..][0..n], bytes[0..n]);
+        self.len += n;
+        if (self.len == CHUNK_SIZE) try self.flushChunk(false);
+        return n;
+    }
+
+    pub fn any(self: *Self) std.io.AnyWriter {
+        return .{ .context = self, .writeFn = typeErasedWrite };
+    }
+
+    fn typeErasedWrite(context: *const anyopaque, bytes: []const u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.write(bytes);
+    }
+
+    pub fn finish(self: *Self) !void {
+        try self.flushChunk(true);
+    }
+
+    fn flushChunk(self: *Self, final: bool) !void {
+        self.cipher.seal(self.stream, self.index, final, self.buf, self.len);
+        try self.sink.writeAll(self.buf[0 .. self.len + TAG_LEN]);
+        self.index += 1;
+        self.len = 0;
+    }
+};
+
+// Random-access reader over a sealed stream stored at [start, start + sealed_len) in file.
+// Uses positional reads, so it doesn't care where the file cursor is.
+pub const DecryptingReader = struct {
+    allocator: Allocator,
+    cipher: *const ChunkCipher,
+    stream: StreamId,
+    file: std.fs.File,
+    start: u64,
+    sealed_len: u64,
+    plain_len: u64,
+    buf: []u8,
+    chunk: ?u64 = null, // index of the chunk currently decrypted in buf
+    chunk_len: usize = 0,
+    pos: u64 = 0, // plaintext position
+    end_verified: bool = false,
+
+    const Self = @This();
+
+    pub fn init(allocator: Allocator, cipher: *const ChunkCipher, stream: StreamId, file: std.fs.File, start: u64, sealed_len: u64) !Self {
+        return Self{
+            .allocator = allocator,
+            .cipher = cipher,
+            .stream = stream,
+            .file = file,
+            .start = start,
+            .sealed_len = sealed_len,
+            .plain_len = try plainLen(sealed_len),
+            .buf = try allocator.alloc(u8, SEALED_CHUNK_SIZE),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        std.crypto.utils.secureZero(u8, self.buf);
+        self.allocator.free(self.buf);
+    }
+
+    pub fn seekTo(self: *Self, plain_offset: u64) !void {
+        if (plain_offset > self.plain_len) return StreamCryptoError.TruncatedStream;
+        self.pos = plain_offset;
+    }
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        if (dest.len == 0) return 0;
+        if (self.pos == self.plain_len) {
+            // EOF only counts once the final-flagged chunk has authenticated,
+            // otherwise a stream cut at a chunk boundary would read as complete
+            if (!self.end_verified) try self.loadChunk((self.sealed_len - 1) / SEALED_CHUNK_SIZE);
+            return 0;
+        }
+        const want = self.pos / CHUNK_SIZE;
+        if (self.chunk != want) try self.loadChunk(want);
+        const in_chunk: usize = @intCast(self.pos % CHUNK_SIZE);
+        const n = @min(dest.len, self.chunk_len - in_chunk);
+        @memcpy(dest[0..n], self.buf[in_chunk..][0..n]);
+        self.pos += n;
+        return n;
+    }
+
+    pub fn any(self: *Self) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
+
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+
+    fn loadChunk(self: *Self, index: u64) !void {
+        const last = (self.sealed_len - 1) / SEALED_CHUNK_SIZE;
+        const offset = index * SEALED_CHUNK_SIZE;
+        const stored: usize = @intCast(@min(SEALED_CHUNK_SIZE, self.sealed_len - offset));
+        self.chunk = null;
+        if (try self.file.preadAll(self.buf[0..stored], self.start + offset) != stored) return StreamCryptoError.TruncatedStream;
+        try self.cipher.open(self.stream, index, index == last, self.buf[0..stored]);
+        self.chunk = index;
+        self.chunk_len = stored - TAG_LEN;
+        if (index == last) self.end_verified = true;
+    }
+};
+
+// Front-to-back reader over a sealed stream whose length isn't known up
+// front (one coming down a pipe). Every chunk but the last is a full
+// SEALED_CHUNK_SIZE and the writer always ends with a final chunk, empty if
+// need be, so the first short chunk is the final one and source must end there.
+pub const SequentialDecryptor = struct {
+    allocator: Allocator,
+    cipher: *const ChunkCipher,
+    stream: StreamId,
+    source: std.io.AnyReader,
+    buf: []u8,
+    index: u64 = 0, // next chunk to load
+    pos: usize = 0,
+    len: usize = 0, // plaintext in buf
+    end_verified: bool = false,
+
+    const Self = @This();
+
+    pub fn init(allocator: Allocator, cipher: *const ChunkCipher, stream: StreamId, source: std.io.AnyReader) !Self {
+        return Self{
+            .allocator = allocator,
+            .cipher = cipher,
+            .stream = stream,
+            .source = source,
+            .buf = try allocator.alloc(u8, SEALED_CHUNK_SIZE),
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        std.crypto.utils.secureZero(u8, self.buf);
+        self.allocator.free(self.buf);
+    }
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        if (dest.len == 0) return 0;
+        while (self.pos == self.len) {
+            if (self.end_verified) return 0;
+            try self.loadChunk();
+        }
+        const n = @min(dest.len, self.len - self.pos);
+        @memcpy(dest[0..n], self.buf[self.pos..][0..n]);
+        self.pos += n;
+        return n;
+    }
+
+    pub fn any(self: *Self) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
+
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+
+    fn loadChunk(self: *Self) !void {
+        const stored = try self.source.readAll(self.buf);
+        // a stream cut at a chunk boundary ends up here with nothing
+        if (stored < TAG_LEN) return StreamCryptoError.TruncatedStream;
+        const final = stored < self.buf.len;
+        self.len = 0;
+        self.pos = 0;
+        try self.cipher.open(self.stream, self.index, final, self.buf[0..stored]);
+        self.index += 1;
+        self.len = stored - TAG_LEN;
+        self.end_verified = final;
+    }
+};
+
+// ---- v1 archives ----
+//
+// v1 sealed the whole compressed payload as one ChaCha20-Poly1305 message
+// (crypto.CryptoContext.serializeEncrypted: magic, salt, nonce, tag, u64
+// length, ciphertext). That still opens in bounded memory. Poly1305 only
+// covers the ciphertext, so the tag is checked in one pass over the file
+// before anything is handed out; reads then run the ChaCha20 keystream from
+// block 1 over the ciphertext a buffer at a time.
+
+const LEGACY_MAGIC = "KHROWNO_ENC_V1\n";
+const LEGACY_PREFIX_LEN: usize = LEGACY_MAGIC.len + 32 + crypto.NONCE_LEN + TAG_LEN + 8;
+const ChaCha20 = std.crypto.stream.chacha.ChaCha20IETF;
+const Poly1305 = std.crypto.onetimeauth.Poly1305;
+
+// Sequential reader over a v1 sealed payload stored at [start, start + stored_len) in file.
+pub const LegacyReader = struct {
+    allocator: Allocator,
+    file: std.fs.File,
+    start: u64, // first ciphertext byte
+    len: u64, // ciphertext bytes
+    key: [crypto.KEY_LEN]u8,
+    nonce: [crypto.NONCE_LEN]u8,
+    tag: [TAG_LEN]u8,
+    buf: []u8,
+    buf_pos: usize = 0,
+    buf_len: usize = 0,
+    pos: u64 = 0, // ciphertext bytes decrypted so far
+    verified: bool = false,
+
+    const Self = @This();
+    // a whole number of 64-byte ChaCha20 blocks, so every refill starts on a block
+    const BUFFER_SIZE: usize = 256 * 1024;
+
+    pub fn init(allocator: Allocator, password: String, file: std.fs.File, start: u64, stored_len: u64) !Self {
+        if (stored_len < LEGACY_PREFIX_LEN) return StreamCryptoError.TruncatedStream;
+        var prefix: [LEGACY_PREFIX_LEN]u8 = undefined;
+        if (try file.preadAll(&prefix, start) != prefix.len) return StreamCryptoError.TruncatedStream;
+        if (!std.mem.eql(u8, prefix[0..LEGACY_MAGIC.len], LEGACY_MAGIC)) return crypto.CryptoError.InvalidKey;
+
+        var pos: usize = LEGACY_MAGIC.len;
+        const salt = prefix[pos..][0..32].*;
+        pos += 32;
+        const nonce = prefix[pos..][0..crypto.NONCE_LEN].*;
+        pos += crypto.NONCE_LEN;
+        const tag = prefix[pos..][0..TAG_LEN].*;
+        pos += TAG_LEN;
+        // written with std.mem.toBytes, so native byte order
+        const len = std.mem.bytesToValue(u64, prefix[pos..][0..8]);
+        if (len != stored_len - LEGACY_PREFIX_LEN) return StreamCryptoError.TruncatedStream;
+
+        const buf = try allocator.alloc(u8, BUFFER_SIZE);
+        errdefer allocator.free(buf);
+        return Self{
+            .allocator = allocator,
+            .file = file,
+            .start = start + LEGACY_PREFIX_LEN,
+            .len = len,
+            // v1 didn't record its KDF cost; it was always the defaults of the day
+            .key = try crypto.deriveKeyWithParams(allocator, password, salt, crypto.KDF_ITERATIONS, crypto.KDF_MEMORY_KIB),
+            .nonce = nonce,
+            .tag = tag,
+            .buf = buf,
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        std.crypto.utils.secureZero(u8, &self.key);
+        std.crypto.utils.secureZero(u8, self.buf);
+        self.allocator.free(self.buf);
+    }
+
+    // Check the tag over all the ciphertext; read() does this first if nobody has.
+    pub fn verify(self: *Self) !void {
+        var poly_key = [_]u8{0} ** 32;
+        ChaCha20.xor(&poly_key, &poly_key, 0, self.key, self.nonce);
+        defer std.crypto.utils.secureZero(u8, &poly_key);
+        var mac = Poly1305.init(&poly_key);
+        var done: u64 = 0;
+        while (done < self.len) {
+            const want: usize = @intCast(@min(self.buf.len, self.len - done));
+            if (try self.file.preadAll(self.buf[0..want], self.start + done) != want) return StreamCryptoError.TruncatedStream;
+            mac.update(self.buf[0..want]);
+            done += want;
+        }
+        // RFC 8439 layout: no associated data, ciphertext padded to 16, then both lengths
+        const zeros = [_]u8{0} ** 16;
+        if (self.len % 16 != 0) mac.update(zeros[0..@intCast(16 - self.len % 16)]);
+        var lens: [16]u8 = undefined;
+        std.mem.writeInt(u64, lens[0..8], 0, .little);
+        std.mem.writeInt(u64, lens[8..16], self.len, .little);
+        mac.update(&lens);
+        var computed: [TAG_LEN]u8 = undefined;
+        mac.final(&computed);
+        if (!std.crypto.utils.timingSafeEql([TAG_LEN]u8, computed, self.tag)) return StreamCryptoError.AuthenticationFailed;
+        self.verified = true;
+    }
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        if (!self.verified) try self.verify();
+        if (self.buf_pos == self.buf_len) {
+            if (self.pos == self.len) return 0;
+            const want: usize = @intCast(@min(self.buf.len, self.len - self.pos));
+            if (try self.file.preadAll(self.buf[0..want], self.start + self.pos) != want) return StreamCryptoError.TruncatedStream;
+            ChaCha20.xor(self.buf[0..want], self.buf[0..want], @intCast(1 + self.pos / 64), self.key, self.nonce);
+            self.pos += want;
+            self.buf_pos = 0;
+            self.buf_len = want;
+        }
+        const n = @min(dest.len, self.buf_len - self.buf_pos);
+        @memcpy(dest[0..n], self.buf[self.buf_pos..][0..n]);
+        self.buf_pos += n;
+        return n;
+    }
+
+    pub fn any(self: *Self) std.io.AnyReader {
+        return .{ .context = self, .readFn = typeErasedRead };
+    }
+
+    fn typeErasedRead(context: *const anyopaque, dest: []u8) anyerror!usize {
+        const self: *Self = @ptrCast(@alignCast(@constCast(context)));
+        return self.read(dest);
+    }
+};
+
 pub fn encryptFile(
     allocator: Allocator,
     input_path: String,
@@ -828,8 +828,8 @@ export fn on_activate(app: *c.GtkApplication, user_data: ?*anyopaque) void {
     c.gtk_entry_set_input_purpose(@ptrCast(g_confirm_password_entry), c.GTK_INPUT_PURPOSE_PASSWORD);
     c.gtk_box_append(@ptrCast(encrypt_box), @ptrCast(g_confirm_password_entry));
 
-    // Info label about current encryption behavior - streaming module exists but not integrated yet
-    const enc_note = c.gtk_label_new("Note: Large encrypted backups load fully into memory. Streaming encryption module exists but needs integration.");
+    // Info label about current encryption behavior
+    const enc_note = c.gtk_label_new("Note: Encrypted backups are sealed in 1MB chunks while they're written, so backup size doesn't matter.");
     c.gtk_widget_add_css_class(enc_note, "dim-label");
     c.gtk_label_set_wrap(@ptrCast(enc_note), 1); // wrap text for better visibility on some themes
     c.gtk_box_append(@ptrCast(encrypt_box), enc_note);
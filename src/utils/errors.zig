@@ -116,7 +116,7 @@ pub fn getErrorMessage(err: anyerror) String {
         error.CompressionFailed => "Failed to compress data. Check available memory.",
         error.DecompressionFailed => "Failed to decompress data. The backup may be corrupted.",
         error.InvalidCompressedData => "Invalid compressed data format.",
-        error.UnsupportedCompressionFormat => "Unsupported compression format. Only gzip is supported.",
+        error.UnsupportedCompressionFormat => "Unsupported compression format. Supported: none, lz4, gzip, zstd.",
 
         error.NetworkUnavailable => "Network is unavailable. Check your internet connection.",
         error.ConnectionFailed => "Failed to connect to server. Check your network settings.",
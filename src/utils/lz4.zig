@@ -0,0 +1,177 @@
+// lz4 frame bindings - the "fast" codec. Each parallel block is compressed into
+// its own independent frame (see core/parallel_blocks.zig); the decoder walks
+// any number of concatenated frames, which is also what the lz4 CLI produces.
+
+const std = @import("std");
+const ArrayList = std.ArrayList;
+const Allocator = std.mem.Allocator;
+const types = @import("types.zig");
+const String = types.String;
+
+const c = @cImport({
+    @cInclude("lz4frame.h");
+});
+
+pub const Lz4Error = error{
+    CompressionFailed,
+    DecompressionFailed,
+    OutOfMemory,
+};
+
+// 0 = plain lz4 (the fast one); 3 and up switch to lz4hc, which trades most of the speed for ratio
+pub const DEFAULT_LEVEL: i32 = 0;
+
+fn isError(code: usize) bool {
+    return c.LZ4F_isError(code) != 0;
+}
+
+fn preferences(level: i32, content_size: usize) c.LZ4F_preferences_t {
+    var prefs = std.mem.zeroes(c.LZ4F_preferences_t);
+    prefs.frameInfo.blockSizeID = c.LZ4F_max1MB;
+    prefs.frameInfo.blockMode = c.LZ4F_blockIndependent;
+    // content checksum lets the decoder catch a bad frame on its own
+    prefs.frameInfo.contentChecksumFlag = c.LZ4F_contentChecksumEnabled;
+    prefs.frameInfo.contentSize = content_size;
+    prefs.compressionLevel = level;
+    return prefs;
+}
+
+// Block codec for parallel_blocks.BlockWriter: one complete lz4 frame per block.
+pub const FrameCodec = struct {
+    pub const Options = struct {
+        level: i32 = DEFAULT_LEVEL,
+    };
+
+    pub fn encode(out: *ArrayList(u8), data: []const u8, options: Options) !void {
+        const prefs = preferences(options.level, data.len);
+        try out.resize(c.LZ4F_compressFrameBound(data.len, &prefs));
+        const n = c.LZ4F_compressFrame(out.items.ptr, out.items.len, data.ptr, data.len, &prefs);
+        if (isError(n)) return Lz4Error.CompressionFailed;
+        out.shrinkRetainingCapacity(n);
+    }
+
+    // An lz4 frame made only of uncompressed blocks, for data that won't
+    // shrink. Built by hand since liblz4 always tries to compress; same
+    // descriptor as encode() (independent 1MB blocks, content checksum).
+    pub fn store(out: *ArrayList(u8), data: []const u8) !void {
+        const MAX_BLOCK: usize = 1024 * 1024;
+        const UNCOMPRESSED_BIT: u32 = 0x8000_0000;
+        out.clearRetainingCapacity();
+
+        var head: [7]u8 = undefined;
+        std.mem.writeInt(u32, head[0..4], 0x184D2204, .little);
+        head[4] = 0x64; // version 01, block independence, content checksum
+        head[5] = 0x60; // max block size 1MB
+        head[6] = @truncate(std.hash.XxHash32.hash(0, head[4..6]) >> 8);
+        try out.appendSlice(&head);
+
+        var rest = data;
+        while (rest.len > 0) {
+            const n = @min(rest.len, MAX_BLOCK);
+            var size: [4]u8 = undefined;
+            std.mem.writeInt(u32, &size, @as(u32, @intCast(n)) | UNCOMPRESSED_BIT, .little);
+            try out.appendSlice(&size);
+            try out.appendSlice(rest[0..n]);
+            rest = rest[n..];
+        }
+
+        var tail: [8]u8 = undefined;
+        std.mem.writeInt(u32, tail[0..4], 0, .little); // end mark
+        std.mem.writeInt(u32, tail[4..8], std.hash.XxHash32.hash(0, data), .little);
+        try out.appendSlice(&tail);
+    }
+};
+
+// Streaming decoder over any reader; handles any number of concatenated frames.
+pub const StreamDecompressor = struct {
+    allocator: Allocator,
+    dctx: *c.LZ4F_dctx,
+    source: std.io.AnyReader,
+    in_buf: []u8,
+    in_pos: usize = 0,
+    in_len: usize = 0,
+    source_done: bool = false,
+    frame_open: bool = false,
+
+    const Self = @This();
+    pub const Reader = std.io.GenericReader(*Self, anyerror, read);
+
+    const IN_BUFFER_SIZE: usize = 256 * 1024;
+
+    pub fn init(allocator: Allocator, source: std.io.AnyReader) !Self {
+        var dctx: ?*c.LZ4F_dctx = null;
+        if (isError(c.LZ4F_createDecompressionContext(&dctx, c.LZ4F_VERSION))) return Lz4Error.OutOfMemory;
+        errdefer _ = c.LZ4F_freeDecompressionContext(dctx);
+        const in_buf = try allocator.alloc(u8, IN_BUFFER_SIZE);
+        return Self{
+            .allocator = allocator,
+            .dctx = dctx.?,
+            .source = source,
+            .in_buf = in_buf,
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        _ = c.LZ4F_freeDecompressionContext(self.dctx);
+        self.allocator.free(self.in_buf);
+    }
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        if (dest.len == 0) return 0;
+        while (true) {
+            if (self.in_pos == self.in_len and !self.source_done) {
+                self.in_len = try self.source.read(self.in_buf);
+                self.in_pos = 0;
+                if (self.in_len == 0) self.source_done = true;
+            }
+
+            var src_size: usize = self.in_len - self.in_pos;
+            var dst_size: usize = dest.len;
+            const hint = c.LZ4F_decompress(self.dctx, dest.ptr, &dst_size, self.in_buf[self.in_pos..].ptr, &src_size, null);
+            if (isError(hint)) return Lz4Error.DecompressionFailed;
+            self.in_pos += src_size;
+            // an empty call says nothing about frame state; hint is 0 only right after a frame ends
+            if (src_size > 0 or dst_size > 0) self.frame_open = hint != 0;
+
+            if (dst_size > 0) return dst_size;
+            if (self.source_done and self.in_pos == self.in_len) {
+                // input ran out in the middle of a frame: truncated, not a clean end
+                if (self.frame_open) return Lz4Error.DecompressionFailed;
+                return 0;
+            }
+        }
+    }
+
+    pub fn reader(self: *Self) Reader {
+        return .{ .context = self };
+    }
+
+    // Forget buffered input and any half-decoded frame; the source has been
+    // repositioned at a frame boundary.
+    pub fn reset(self: *Self) void {
+        c.LZ4F_resetDecompressionContext(self.dctx);
+        self.in_pos = 0;
+        self.in_len = 0;
+        self.source_done = false;
+        self.frame_open = false;
+    }
+};
+
+pub fn compress(allocator: Allocator, data: String, level: i32) ![]u8 {
+    var out = ArrayList(u8).init(allocator);
+    errdefer out.deinit();
+    try FrameCodec.encode(&out, data, .{ .level = level });
+    return out.toOwnedSlice();
+}
+
+pub fn decompress(allocator: Allocator, data: String) ![]u8 {
+    var stream = std.io.fixedBufferStream(data);
+    const stream_reader = stream.reader();
+    var dec = try StreamDecompressor.init(allocator, stream_reader.any());
+    defer dec.deinit();
+
+    var out = ArrayList(u8).init(allocator);
+    errdefer out.deinit();
+    try dec.reader().readAllArrayList(&out, std.math.maxInt(usize));
+    return out.toOwnedSlice();
+}
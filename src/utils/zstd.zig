@@ -0,0 +1,285 @@
+// zstd bindings - std only ships a decoder, so this goes straight to libzstd
+// like http_client does for curl. Compression is parallelised one level up by
+// compressing fixed blocks into independent frames (see core/parallel_blocks.zig).
+// Dictionaries are trained with zdict (same library) and travel in a
+// skippable frame ahead of the frames that use them.
+
+const std = @import("std");
+const ArrayList = std.ArrayList;
+const Allocator = std.mem.Allocator;
+const types = @import("types.zig");
+const String = types.String;
+
+const c = @cImport({
+    @cInclude("zstd.h");
+    @cInclude("zdict.h");
+});
+
+pub const ZstdError = error{
+    CompressionFailed,
+    DecompressionFailed,
+    OutOfMemory,
+};
+
+// level 3 is zstd's own default: roughly gzip -6 ratio at several times the speed
+pub const DEFAULT_LEVEL: i32 = 3;
+
+pub fn maxLevel() i32 {
+    return c.ZSTD_maxCLevel();
+}
+
+fn isError(code: usize) bool {
+    return c.ZSTD_isError(code) != 0;
+}
+
+// Skippable frame (zstd reserves 0x184D2A50-5F) holding a dictionary:
+// magic, u32 length, the dictionary. Decoders that don't look for it step over it.
+pub const DICTIONARY_FRAME_MAGIC: u32 = 0x184D2A5B;
+// Anything bigger in a dictionary frame is corruption; trained ones are far smaller.
+pub const MAX_DICTIONARY_SIZE: usize = 1024 * 1024;
+
+// A trained dictionary plus the digested form frames are compressed with.
+// The CDict is read-only once built, so every block slot can share it.
+pub const Dictionary = struct {
+    allocator: Allocator,
+    bytes: []u8,
+    cdict: *c.ZSTD_CDict,
+
+    // null when zdict can't make a dictionary out of the samples (too few,
+    // too small, or nothing in common), which just means compressing without one.
+    pub fn train(allocator: Allocator, samples: []const u8, sample_sizes: []const usize, capacity: usize, level: i32) !?Dictionary {
+        var buf = try allocator.alloc(u8, capacity);
+        errdefer allocator.free(buf);
+        const n = c.ZDICT_trainFromBuffer(buf.ptr, buf.len, samples.ptr, sample_sizes.ptr, @intCast(sample_sizes.len));
+        if (c.ZDICT_isError(n) != 0) {
+            allocator.free(buf);
+            return null;
+        }
+        buf = try allocator.realloc(buf, n);
+        return try fromOwned(allocator, buf, level);
+    }
+
+    // A dictionary read back from an archive, e.g. to append frames that use it.
+    pub fn init(allocator: Allocator, bytes: []const u8, level: i32) !Dictionary {
+        const owned = try allocator.dupe(u8, bytes);
+        errdefer allocator.free(owned);
+        return fromOwned(allocator, owned, level);
+    }
+
+    fn fromOwned(allocator: Allocator, bytes: []u8, level: i32) !Dictionary {
+        const cdict = c.ZSTD_createCDict(bytes.ptr, bytes.len, level) orelse return ZstdError.OutOfMemory;
+        return .{ .allocator = allocator, .bytes = bytes, .cdict = cdict };
+    }
+
+    pub fn deinit(self: *Dictionary) void {
+        _ = c.ZSTD_freeCDict(self.cdict);
+        self.allocator.free(self.bytes);
+    }
+
+    // What goes in front of bytes to make the dictionary frame.
+    pub fn frameHeader(self: *const Dictionary) [8]u8 {
+        var head: [8]u8 = undefined;
+        std.mem.writeInt(u32, head[0..4], DICTIONARY_FRAME_MAGIC, .little);
+        std.mem.writeInt(u32, head[4..8], @intCast(self.bytes.len), .little);
+        return head;
+    }
+};
+
+// Block codec for core/parallel_blocks.BlockWriter: one complete zstd frame per
+// block. Each block slot keeps its own CCtx so we aren't rebuilding match
+// tables for every megabyte.
+pub const FrameCodec = struct {
+    pub const Options = struct {
+        level: i32 = DEFAULT_LEVEL,
+        // frames are compressed against it; the reader has to load the same one
+        dictionary: ?*const Dictionary = null,
+    };
+
+    pub const Context = struct {
+        cctx: *c.ZSTD_CCtx,
+
+        pub fn init() !Context {
+            const cctx = c.ZSTD_createCCtx() orelse return ZstdError.OutOfMemory;
+            return .{ .cctx = cctx };
+        }
+
+        pub fn deinit(self: *Context) void {
+            _ = c.ZSTD_freeCCtx(self.cctx);
+        }
+    };
+
+    pub fn encode(ctx: *Context, out: *ArrayList(u8), data: []const u8, options: Options) !void {
+        _ = c.ZSTD_CCtx_reset(ctx.cctx, c.ZSTD_reset_session_only);
+        const cdict: ?*const c.ZSTD_CDict = if (options.dictionary) |d| d.cdict else null;
+        if (isError(c.ZSTD_CCtx_refCDict(ctx.cctx, cdict))) return ZstdError.CompressionFailed;
+        if (isError(c.ZSTD_CCtx_setParameter(ctx.cctx, c.ZSTD_c_compressionLevel, options.level))) return ZstdError.CompressionFailed;
+        // per-frame content checksum so a bad frame is caught by the decoder itself
+        if (isError(c.ZSTD_CCtx_setParameter(ctx.cctx, c.ZSTD_c_checksumFlag, 1))) return ZstdError.CompressionFailed;
+
+        try out.resize(c.ZSTD_compressBound(data.len));
+        const n = c.ZSTD_compress2(ctx.cctx, out.items.ptr, out.items.len, data.ptr, data.len);
+        if (isError(n)) return ZstdError.CompressionFailed;
+        out.shrinkRetainingCapacity(n);
+    }
+
+    // A zstd frame of raw (uncompressed) blocks, for data that won't shrink.
+    // libzstd would get there too, but only after running the match finder
+    // over every byte. Single-segment with the content size in the header, and
+    // the same content checksum encode() asks for.
+    pub fn store(out: *ArrayList(u8), data: []const u8) !void {
+        const MAX_BLOCK: usize = 128 * 1024; // zstd's block size cap
+        out.clearRetainingCapacity();
+
+        var head: [13]u8 = undefined;
+        std.mem.writeInt(u32, head[0..4], 0xFD2FB528, .little);
+        head[4] = 0xE4; // 8-byte content size, single segment, content checksum
+        std.mem.writeInt(u64, head[5..13], data.len, .little);
+        try out.appendSlice(&head);
+
+        var rest = data;
+        while (true) {
+            const n = @min(rest.len, MAX_BLOCK);
+            const last: u24 = if (n == rest.len) 1 else 0;
+            var block: [3]u8 = undefined;
+            // bit 0 last block, bits 1-2 type (0 = raw), then the size
+            std.mem.writeInt(u24, &block, (@as(u24, @intCast(n)) << 3) | last, .little);
+            try out.appendSlice(&block);
+            try out.appendSlice(rest[0..n]);
+            rest = rest[n..];
+            if (last == 1) break;
+        }
+
+        var checksum: [4]u8 = undefined;
+        std.mem.writeInt(u32, &checksum, @truncate(std.hash.XxHash64.hash(0, data)), .little);
+        try out.appendSlice(&checksum);
+    }
+};
+
+// Streaming decoder over any reader; handles any number of concatenated frames.
+pub const StreamDecompressor = struct {
+    allocator: Allocator,
+    dctx: *c.ZSTD_DCtx,
+    source: std.io.AnyReader,
+    in_buf: []u8,
+    in_pos: usize = 0,
+    in_len: usize = 0,
+    source_done: bool = false,
+    frame_open: bool = false,
+    dictionary: ?[]u8 = null, // from readDictionaryFrame; loaded into dctx too
+
+    const Self = @This();
+    pub const Reader = std.io.GenericReader(*Self, anyerror, read);
+
+    pub fn init(allocator: Allocator, source: std.io.AnyReader) !Self {
+        const dctx = c.ZSTD_createDCtx() orelse return ZstdError.OutOfMemory;
+        errdefer _ = c.ZSTD_freeDCtx(dctx);
+        const in_buf = try allocator.alloc(u8, c.ZSTD_DStreamInSize());
+        return Self{
+            .allocator = allocator,
+            .dctx = dctx,
+            .source = source,
+            .in_buf = in_buf,
+        };
+    }
+
+    pub fn deinit(self: *Self) void {
+        _ = c.ZSTD_freeDCtx(self.dctx);
+        self.allocator.free(self.in_buf);
+        if (self.dictionary) |d| self.allocator.free(d);
+    }
+
+    // Before the first read: if the stream opens with a dictionary frame,
+    // load it for every frame after it. Otherwise the bytes looked at stay
+    // buffered for read().
+    pub fn readDictionaryFrame(self: *Self) !void {
+        while (self.in_len < 8 and !self.source_done) {
+            const n = try self.source.read(self.in_buf[self.in_len..]);
+            if (n == 0) self.source_done = true;
+            self.in_len += n;
+        }
+        if (self.in_len < 8) return;
+        const head = self.in_buf[0..8];
+        if (std.mem.readInt(u32, head[0..4], .little) != DICTIONARY_FRAME_MAGIC) return;
+        const size = std.mem.readInt(u32, head[4..8], .little);
+        if (size > MAX_DICTIONARY_SIZE) return ZstdError.DecompressionFailed;
+        self.in_pos = 8;
+
+        const dict = try self.allocator.alloc(u8, size);
+        errdefer self.allocator.free(dict);
+        var got: usize = 0;
+        while (got < size) {
+            if (self.in_pos == self.in_len) {
+                self.in_len = try self.source.read(self.in_buf);
+                self.in_pos = 0;
+                if (self.in_len == 0) return ZstdError.DecompressionFailed;
+            }
+            const n = @min(size - got, self.in_len - self.in_pos);
+            @memcpy(dict[got..][0..n], self.in_buf[self.in_pos..][0..n]);
+            got += n;
+            self.in_pos += n;
+        }
+        // reset(session_only) keeps it, so seeking between frames doesn't lose it
+        if (isError(c.ZSTD_DCtx_loadDictionary(self.dctx, dict.ptr, dict.len))) return ZstdError.DecompressionFailed;
+        self.dictionary = dict;
+    }
+
+    pub fn read(self: *Self, dest: []u8) anyerror!usize {
+        if (dest.len == 0) return 0;
+        while (true) {
+            if (self.in_pos == self.in_len and !self.source_done) {
+                self.in_len = try self.source.read(self.in_buf);
+                self.in_pos = 0;
+                if (self.in_len == 0) self.source_done = true;
+            }
+
+            var input = c.ZSTD_inBuffer{ .src = self.in_buf.ptr, .size = self.in_len, .pos = self.in_pos };
+            var output = c.ZSTD_outBuffer{ .dst = dest.ptr, .size = dest.len, .pos = 0 };
+            const rc = c.ZSTD_decompressStream(self.dctx, &output, &input);
+            if (isError(rc)) return ZstdError.DecompressionFailed;
+            self.in_pos = input.pos;
+            self.frame_open = rc != 0;
+
+            if (output.pos > 0) return output.pos;
+            if (self.source_done and self.in_pos == self.in_len) {
+                // input ran out in the middle of a frame: truncated, not a clean end
+                if (self.frame_open) return ZstdError.DecompressionFailed;
+                return 0;
+            }
+        }
+    }
+
+    pub fn reader(self: *Self) Reader {
+        return .{ .context = self };
+    }
+
+    // Forget buffered input and any half-decoded frame; the source has been
+    // repositioned at a frame boundary.
+    pub fn reset(self: *Self) void {
+        _ = c.ZSTD_DCtx_reset(self.dctx, c.ZSTD_reset_session_only);
+        self.in_pos = 0;
+        self.in_len = 0;
+        self.source_done = false;
+        self.frame_open = false;
+    }
+};
+
+pub fn compress(allocator: Allocator, data: String, level: i32) ![]u8 {
+    const bound = c.ZSTD_compressBound(data.len);
+    const out = try allocator.alloc(u8, bound);
+    errdefer allocator.free(out);
+    const n = c.ZSTD_compress(out.ptr, out.len, data.ptr, data.len, level);
+    if (isError(n)) return ZstdError.CompressionFailed;
+    return allocator.realloc(out, n);
+}
+
+pub fn decompress(allocator: Allocator, data: String) ![]u8 {
+    var stream = std.io.fixedBufferStream(data);
+    const stream_reader = stream.reader();
+    var dec = try StreamDecompressor.init(allocator, stream_reader.any());
+    defer dec.deinit();
+
+    var out = ArrayList(u8).init(allocator);
+    errdefer out.deinit();
+    try dec.reader().readAllArrayList(&out, std.math.maxInt(usize));
+    return out.toOwnedSlice();
+}
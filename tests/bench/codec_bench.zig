@@ -0,0 +1,99 @@
+//! zig build bench [-- <total MB>]
+//! Writes a synthetic tree (half text-like, half random bytes), then times
+//! create + extract of a v2 archive with every codec and prints ratio and MB/s.
+
+const std = @import("std");
+const khr_format = @import("../../src/core/khr_format.zig");
+
+const SRC_DIR = "/tmp/khrowno_bench_src";
+const OUT_DIR = "/tmp/khrowno_bench_out";
+const ARCHIVE = "/tmp/khrowno_bench.khr";
+const FILE_SIZE: usize = 4 * 1024 * 1024;
+
+fn noProgress(_: []const u8, _: usize, _: usize) void {}
+
+fn generateTree(allocator: std.mem.Allocator, total_mb: usize, paths: *std.ArrayList([]const u8)) !u64 {
+    std.fs.cwd().deleteTree(SRC_DIR) catch {};
+    try std.fs.cwd().makePath(SRC_DIR);
+
+    const buf = try allocator.alloc(u8, FILE_SIZE);
+    defer allocator.free(buf);
+    var prng = std.Random.DefaultPrng.init(0x6b68726f);
+    const random = prng.random();
+
+    const words = [_][]const u8{ "backup ", "restore ", "config ", "home/", ".local ", "share ", "0123 ", "\n" };
+    const file_count = @max(1, total_mb * 1024 * 1024 / FILE_SIZE);
+    var total: u64 = 0;
+    for (0..file_count) |i| {
+        if (i % 2 == 0) {
+            var pos: usize = 0;
+            while (pos < buf.len) {
+                const w = words[random.uintLessThan(usize, words.len)];
+                const n = @min(w.len, buf.len - pos);
+                @memcpy(buf[pos..][0..n], w[0..n]);
+                pos += n;
+            }
+        } else {
+            random.bytes(buf);
+        }
+        const path = try std.fmt.allocPrint(allocator, "{s}/file_{d}.bin", .{ SRC_DIR, i });
+        try std.fs.cwd().writeFile(.{ .sub_path = path, .data = buf });
+        try paths.append(path);
+        total += buf.len;
+    }
+    return total;
+}
+
+fn mbPerSec(bytes: u64, ns: u64) f64 {
+    const secs = @as(f64, @floatFromInt(@max(ns, 1))) / std.time.ns_per_s;
+    return @as(f64, @floatFromInt(bytes)) / (1024.0 * 1024.0) / secs;
+}
+
+pub fn main() !void {
+    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+    defer _ = gpa.deinit();
+    const allocator = gpa.allocator();
+
+    const args = try std.process.argsAlloc(allocator);
+    defer std.process.argsFree(allocator, args);
+    const total_mb = if (args.len > 1) try std.fmt.parseInt(usize, args[1], 10) else 256;
+
+    var paths = std.ArrayList([]const u8).init(allocator);
+    defer {
+        for (paths.items) |p| allocator.free(p);
+        paths.deinit();
+    }
+    const input_bytes = try generateTree(allocator, total_mb, &paths);
+    defer std.fs.cwd().deleteTree(SRC_DIR) catch {};
+    defer std.fs.cwd().deleteFile(ARCHIVE) catch {};
+
+    const codecs = [_]khr_format.CompressionType{ .none, .lz4, .gzip, .zstd };
+    var results: [codecs.len]struct { size: u64, create_ns: u64, extract_ns: u64 } = undefined;
+
+    for (codecs, 0..) |codec, i| {
+        var timer = try std.time.Timer.start();
+        try khr_format.createKhrBackupWithOptions(allocator, paths.items, ARCHIVE, null, .{ .compression = codec }, &noProgress);
+        results[i].create_ns = timer.read();
+        results[i].size = (try std.fs.cwd().statFile(ARCHIVE)).size;
+
+        std.fs.cwd().deleteTree(OUT_DIR) catch {};
+        timer.reset();
+        try khr_format.extractKhrBackup(allocator, ARCHIVE, null, OUT_DIR);
+        results[i].extract_ns = timer.read();
+        std.fs.cwd().deleteTree(OUT_DIR) catch {};
+    }
+
+    const out = std.io.getStdOut().writer();
+    try out.print("\n{d} MB input, {d} files\n", .{ input_bytes / (1024 * 1024), paths.items.len });
+    try out.print("{s:<6} {s:>12} {s:>7} {s:>12} {s:>12}\n", .{ "codec", "size", "ratio", "create MB/s", "extract MB/s" });
+    for (codecs, results) |codec, r| {
+        const ratio = @as(f64, @floatFromInt(r.size)) / @as(f64, @floatFromInt(input_bytes));
+        try out.print("{s:<6} {d:>12} {d:>7.3} {d:>12.1} {d:>12.1}\n", .{
+            @tagName(codec),
+            r.size,
+            ratio,
+            mbPerSec(input_bytes, r.create_ns),
+            mbPerSec(input_bytes, r.extract_ns),
+        });
+    }
+}
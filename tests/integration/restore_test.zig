@@ -2,6 +2,13 @@ const std = @import("std");
 const testing = std.testing;
 const khr_format = @import("../../src/core/khr_format.zig");
 const backup = @import("../../src/core/backup.zig");
+const crypto = @import("../../src/security/crypto.zig");
+const compress = @import("../../src/utils/compress.zig");
+const zstd = @import("../../src/utils/zstd.zig");
+const khr_codec = @import("../../src/core/khr_codec.zig");
+const parallel_gzip = @import("../../src/core/parallel_gzip.zig");
+const khr_index = @import("../../src/core/khr_index.zig");
+const parallel_extract = @import("../../src/core/parallel_extract.zig");
 
 // Integration test: create a tiny KHR backup from a specific file and restore to a target dir
 test "restore backup to destination directory" {
@@ -49,3 +56,1565 @@ test "restore backup to destination directory" {
     try testing.expect(n > 0);
     try testing.expect(std.mem.startsWith(u8, buf[0..n], "hello-restore"));
 }
+
+test "v2 archives round-trip with every codec" {
+    const allocator = testing.allocator;
+
+    const src_dir = "/tmp/khrowno_codec_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // bigger than one 1MB block so the parallel codecs emit several members/frames
+    const big = try allocator.alloc(u8, 3 * 1024 * 1024 + 17);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 31 + i / 4096);
+
+    // incompressible, so the compressing codecs store it in raw frames instead
+    const noise = try allocator.alloc(u8, 512 * 1024);
+    defer allocator.free(noise);
+    var prng = std.Random.DefaultPrng.init(0x6b6872);
+    prng.random().bytes(noise);
+
+    const big_path = src_dir ++ "/big.bin";
+    const small_path = src_dir ++ "/small.txt";
+    const noise_path = src_dir ++ "/noise.jpg";
+    try std.fs.cwd().writeFile(.{ .sub_path = big_path, .data = big });
+    try std.fs.cwd().writeFile(.{ .sub_path = small_path, .data = "hello-codec" });
+    try std.fs.cwd().writeFile(.{ .sub_path = noise_path, .data = noise });
+    const paths = [_][]const u8{ big_path, noise_path, small_path };
+
+    const khr_path = "/tmp/khrowno_codec_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_codec_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    for ([_]khr_format.CompressionType{ .none, .lz4, .gzip, .zstd }) |codec| {
+        try khr_format.createKhrBackup(allocator, &paths, khr_path, null, codec, null);
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+
+        const restored = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ big_path, big.len + 1);
+        defer allocator.free(restored);
+        try testing.expectEqualSlices(u8, big, restored);
+        const restored_noise = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ noise_path, noise.len + 1);
+        defer allocator.free(restored_noise);
+        try testing.expectEqualSlices(u8, noise, restored_noise);
+
+        var entries = try khr_format.indexKhrBackup(allocator, khr_path);
+        defer {
+            for (entries.items) |*e| e.deinit(allocator);
+            entries.deinit();
+        }
+        try testing.expectEqual(@as(usize, 3), entries.items.len);
+        // listing comes from the TOC footer, which also carries per-entry crcs
+        try testing.expectEqualStrings(big_path, entries.items[0].path);
+        try testing.expectEqual(@as(u64, big.len), entries.items[0].size);
+        try testing.expectEqual(std.hash.Crc32.hash(big), entries.items[0].crc32);
+
+        // the codec byte in front of each body says how it went in: noise is
+        // stored, what compresses goes through the archive's codec
+        for (entries.items) |e| {
+            if (e.size < 1024) continue; // small.txt is in a solid block, which has no codec byte
+            const want = if (std.mem.eql(u8, e.path, noise_path)) khr_format.CompressionType.none else codec;
+            try testing.expectEqual(@as(u8, @intFromEnum(want)), try bodyCodec(allocator, khr_path, e.offset));
+        }
+
+        // selective restore seeks straight to the entry via the frame table
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        const wanted = [_][]const u8{ small_path, noise_path };
+        try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &wanted);
+        const small = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ small_path, 64);
+        defer allocator.free(small);
+        try testing.expectEqualStrings("hello-codec", small);
+        // big enough for the copy_file_range path on raw payloads, crc checked against the TOC
+        const selected_noise = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ noise_path, noise.len + 1);
+        defer allocator.free(selected_noise);
+        try testing.expectEqualSlices(u8, noise, selected_noise);
+    }
+}
+
+// The per-entry codec byte, which sits just before the body's u64 size.
+fn bodyCodec(allocator: std.mem.Allocator, khr_path: []const u8, body_offset: u64) !u8 {
+    const f = try std.fs.cwd().openFile(khr_path, .{});
+    defer f.close();
+    const header = try khr_format.KhrHeader.read(f.reader());
+    const payload = try khr_codec.PayloadReader.open(allocator, f, try f.getPos(), header.tar_size, header.compression, null);
+    defer payload.close();
+    const decoded = try allocator.alloc(u8, @intCast(body_offset));
+    defer allocator.free(decoded);
+    var filled: usize = 0;
+    while (filled < decoded.len) {
+        const n = try payload.read(decoded[filled..]);
+        if (n == 0) return error.EndOfStream;
+        filled += n;
+    }
+    return decoded[decoded.len - 9];
+}
+
+fn gunzipMembers(allocator: std.mem.Allocator, encoded: []const u8, max: usize) ![]u8 {
+    var stream = std.io.fixedBufferStream(encoded);
+    const stream_reader = stream.reader();
+    var members = parallel_gzip.MemberReader.init(allocator, stream_reader.any());
+    defer members.deinit();
+    return members.reader().readAllAlloc(allocator, max);
+}
+
+test "parallel gzip members read back in order and bad sizes are refused" {
+    const allocator = testing.allocator;
+
+    // several blocks and a short last one, compressed on more threads than there are blocks in flight
+    const data = try allocator.alloc(u8, 3 * parallel_gzip.BLOCK_SIZE + 12345);
+    defer allocator.free(data);
+    for (data, 0..) |*b, i| b.* = @truncate(i *% 7 + i / 1000);
+
+    var encoded = std.ArrayList(u8).init(allocator);
+    defer encoded.deinit();
+    const encoded_writer = encoded.writer();
+    {
+        const gz = try parallel_gzip.ParallelGzipWriter.init(allocator, encoded_writer.any(), .{ .threads = 4 });
+        defer gz.deinit();
+        try gz.writer().writeAll(data);
+        try gz.finish();
+        try testing.expectEqual(@as(usize, 4), gz.frames.items.len);
+    }
+
+    const decoded = try gunzipMembers(allocator, encoded.items, data.len + 1);
+    defer allocator.free(decoded);
+    try testing.expectEqualSlices(u8, data, decoded);
+
+    // the first member's KM size: too small to be a member, over the cap, one byte short
+    const first_size = std.mem.readInt(u32, encoded.items[16..20], .little);
+    const cases = [_]struct { size: u32, err: anyerror }{
+        .{ .size = 4, .err = parallel_gzip.GzipError.BadMemberHeader },
+        .{ .size = parallel_gzip.MAX_MEMBER_SIZE + 1, .err = parallel_gzip.GzipError.MemberTooLarge },
+        .{ .size = first_size - 1, .err = parallel_gzip.GzipError.CorruptMember },
+    };
+    const bad = try allocator.dupe(u8, encoded.items);
+    defer allocator.free(bad);
+    for (cases) |case| {
+        std.mem.writeInt(u32, bad[16..20], case.size, .little);
+        try testing.expectError(case.err, gunzipMembers(allocator, bad, data.len + 1));
+    }
+}
+
+test "encrypted v2 archives round-trip, list and seek" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_enc_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // spans several 1MB cipher chunks
+    const big = try allocator.alloc(u8, 2 * 1024 * 1024 + 5);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 131 + i / 977);
+
+    const big_path = src_dir ++ "/big.bin";
+    const small_path = src_dir ++ "/small.txt";
+    try std.fs.cwd().writeFile(.{ .sub_path = big_path, .data = big });
+    try std.fs.cwd().writeFile(.{ .sub_path = small_path, .data = "hello-sealed" });
+    const paths = [_][]const u8{ big_path, small_path };
+
+    const khr_path = "/tmp/khrowno_enc_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_enc_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+    const password = "correct horse battery";
+
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, password, .zstd, null);
+    const info = try khr_format.getKhrInfo(allocator, khr_path);
+    try testing.expect(info.encrypted);
+    try testing.expectEqual(@as(u32, 2), info.version);
+
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, khr_path, password, dest_dir);
+    const restored = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ big_path, big.len + 1);
+    defer allocator.free(restored);
+    try testing.expectEqualSlices(u8, big, restored);
+
+    try testing.expectError(error.DecryptionFailed, khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir));
+    try testing.expectError(error.AuthenticationFailed, khr_format.extractKhrBackup(allocator, khr_path, "wrong", dest_dir));
+
+    // the index is sealed as well, so listing needs the password
+    try testing.expectError(error.DecryptionFailed, khr_format.indexKhrBackup(allocator, khr_path));
+    var entries = try khr_format.indexKhrBackupWithPassword(allocator, khr_path, password);
+    defer {
+        for (entries.items) |*e| e.deinit(allocator);
+        entries.deinit();
+    }
+    try testing.expectEqual(@as(usize, 2), entries.items.len);
+    try testing.expectEqual(std.hash.Crc32.hash(big), entries.items[0].crc32);
+
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    const wanted = [_][]const u8{small_path};
+    try khr_format.extractSelectedKhrBackup(allocator, khr_path, password, dest_dir, &wanted);
+    const small = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ small_path, 64);
+    defer allocator.free(small);
+    try testing.expectEqualStrings("hello-sealed", small);
+
+    // a flipped ciphertext byte has to fail authentication, not restore garbage
+    {
+        const f = try std.fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+        defer f.close();
+        var b: [1]u8 = undefined;
+        _ = try f.preadAll(&b, 200);
+        b[0] ^= 0x40;
+        try f.pwriteAll(&b, 200);
+    }
+    try testing.expectError(error.AuthenticationFailed, khr_format.extractKhrBackup(allocator, khr_path, password, dest_dir));
+}
+
+test "sealed archives keep their checksum and TOC crc to the password" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_keyed_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+    const file_path = src_dir ++ "/notes.txt";
+    try std.fs.cwd().writeFile(.{ .sub_path = file_path, .data = "guessable contents" });
+    const paths = [_][]const u8{file_path};
+
+    const plain_path = "/tmp/khrowno_keyed_plain.khr";
+    const sealed_path = "/tmp/khrowno_keyed_sealed.khr";
+    const other_path = "/tmp/khrowno_keyed_other.khr";
+    const archives = [_][]const u8{ plain_path, sealed_path, other_path };
+    defer for (archives) |p| std.fs.cwd().deleteFile(p) catch {};
+    try khr_format.createKhrBackup(allocator, &paths, plain_path, null, .zstd, null);
+    try khr_format.createKhrBackup(allocator, &paths, sealed_path, "first", .zstd, null);
+    try khr_format.createKhrBackup(allocator, &paths, other_path, "second", .zstd, null);
+
+    var checksums: [archives.len][32]u8 = undefined;
+    for (archives, 0..) |p, i| {
+        const f = try std.fs.cwd().openFile(p, .{});
+        defer f.close();
+        const header = try khr_format.KhrHeader.read(f.reader());
+        try testing.expectEqual(i != 0, header.checksum_keyed);
+        checksums[i] = header.checksum;
+    }
+    // the same bytes went in, so a plain root would match across all three
+    try testing.expect(!std.mem.eql(u8, &checksums[0], &checksums[1]));
+    try testing.expect(!std.mem.eql(u8, &checksums[1], &checksums[2]));
+    try khr_format.verifyKhrBackup(allocator, sealed_path, "first");
+    try testing.expectError(error.DecryptionFailed, khr_format.verifyKhrBackup(allocator, sealed_path, null));
+
+    // the trailer crc is of the sealed TOC as stored, not of what it decrypts to
+    const f = try std.fs.cwd().openFile(sealed_path, .{ .mode = .read_write });
+    defer f.close();
+    const size = try f.getEndPos();
+    var trailer: [khr_index.TRAILER_LEN]u8 = undefined;
+    _ = try f.preadAll(&trailer, size - trailer.len);
+    const index_offset = std.mem.readInt(u64, trailer[0..8], .little);
+    const index_len = std.mem.readInt(u64, trailer[8..16], .little);
+    const flags = std.mem.readInt(u32, trailer[20..24], .little);
+    try testing.expect(flags & khr_index.FLAG_STORED_CRC != 0);
+    const stored = try allocator.alloc(u8, @intCast(index_len));
+    defer allocator.free(stored);
+    _ = try f.preadAll(stored, index_offset);
+    try testing.expectEqual(std.hash.Crc32.hash(stored), std.mem.readInt(u32, trailer[16..20], .little));
+
+    // so damage to it shows up before anything is decrypted
+    stored[stored.len / 2] ^= 0x01;
+    try f.pwriteAll(stored, index_offset);
+    try testing.expectError(error.CorruptIndex, khr_format.verifyKhrBackup(allocator, sealed_path, "first"));
+}
+
+test "merkle leaves verify in parallel and per selected entry" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_merkle_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // several 1MB blocks, so there's a block the small file doesn't share
+    const big = try allocator.alloc(u8, 3 * 1024 * 1024 + 9);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 71 + i / 1021);
+
+    const big_path = src_dir ++ "/big.bin";
+    const small_path = src_dir ++ "/small.txt";
+    try std.fs.cwd().writeFile(.{ .sub_path = big_path, .data = big });
+    try std.fs.cwd().writeFile(.{ .sub_path = small_path, .data = "hello-merkle" });
+    const paths = [_][]const u8{ big_path, small_path };
+
+    const khr_path = "/tmp/khrowno_merkle_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_merkle_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .zstd, null);
+    try khr_format.verifyKhrBackup(allocator, khr_path, null);
+
+    // BLAKE3 archives carry the algorithm in the header
+    try khr_format.createKhrBackupWithOptions(allocator, &paths, khr_path, null, .{ .compression = .lz4, .hash = .blake3 }, null);
+    const info = try khr_format.getKhrInfo(allocator, khr_path);
+    try testing.expectEqual(khr_format.HashAlgo.blake3, info.hash);
+    try khr_format.verifyKhrBackup(allocator, khr_path, null);
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+    {
+        const restored = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ big_path, big.len + 1);
+        defer allocator.free(restored);
+        try testing.expectEqualSlices(u8, big, restored);
+    }
+
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .none, null);
+    try khr_format.verifyKhrBackup(allocator, khr_path, null);
+
+    // flip a byte in the middle of big.bin's second block
+    var entries = try khr_format.indexKhrBackup(allocator, khr_path);
+    defer {
+        for (entries.items) |*e| e.deinit(allocator);
+        entries.deinit();
+    }
+    {
+        const f = try std.fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+        defer f.close();
+        _ = try khr_format.KhrHeader.read(f.reader());
+        const at = (try f.getPos()) + entries.items[0].offset + 1536 * 1024;
+        var b: [1]u8 = undefined;
+        _ = try f.preadAll(&b, at);
+        b[0] ^= 0x01;
+        try f.pwriteAll(&b, at);
+    }
+    try testing.expectError(error.ChecksumMismatch, khr_format.verifyKhrBackup(allocator, khr_path, null));
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try testing.expectError(error.ChecksumMismatch, khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir));
+
+    // a selective restore only checks the blocks it reads
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    const untouched = [_][]const u8{small_path};
+    try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &untouched);
+    const small = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ small_path, 64);
+    defer allocator.free(small);
+    try testing.expectEqualStrings("hello-merkle", small);
+    const damaged = [_][]const u8{big_path};
+    try testing.expectError(error.ChecksumMismatch, khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &damaged));
+}
+
+// Drop an archive's TOC and trailer, leaving header and payload.
+fn cutFooter(path: []const u8) !void {
+    const f = try std.fs.cwd().openFile(path, .{ .mode = .read_write });
+    defer f.close();
+    const header = try khr_format.KhrHeader.read(f.reader());
+    try f.setEndPos((try f.getPos()) + header.tar_size);
+}
+
+test "archives without their TOC still restore and verify" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_notoc_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // more than one Merkle block, so the root isn't just a leaf
+    const big = try allocator.alloc(u8, 2 * 1024 * 1024 + 99);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 13 + i / 777);
+    const files = [_][2][]const u8{
+        .{ src_dir ++ "/big.bin", big },
+        .{ src_dir ++ "/small.txt", "no toc here\n" },
+    };
+    for (files) |f| try std.fs.cwd().writeFile(.{ .sub_path = f[0], .data = f[1] });
+    const sources = [_][]const u8{ files[0][0], files[1][0] };
+
+    const khr_path = "/tmp/khrowno_notoc.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_notoc_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    const cases = [_]struct { compression: khr_format.CompressionType, password: ?[]const u8, hash: khr_format.HashAlgo }{
+        .{ .compression = .gzip, .password = null, .hash = .sha256 },
+        .{ .compression = .zstd, .password = "no toc", .hash = .blake3 },
+    };
+    for (cases) |case| {
+        try khr_format.createKhrBackupWithOptions(allocator, &sources, khr_path, case.password, .{ .compression = case.compression, .hash = case.hash }, null);
+        try cutFooter(khr_path);
+
+        try khr_format.verifyKhrBackup(allocator, khr_path, case.password);
+        var entries = try khr_format.indexKhrBackupWithPassword(allocator, khr_path, case.password);
+        defer {
+            for (entries.items) |*e| e.deinit(allocator);
+            entries.deinit();
+        }
+        try testing.expectEqual(@as(usize, 2), entries.items.len);
+
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackup(allocator, khr_path, case.password, dest_dir);
+        for (files) |f| {
+            const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, f[0] });
+            defer allocator.free(got_path);
+            const got = try std.fs.cwd().readFileAlloc(allocator, got_path, f[1].len + 1);
+            defer allocator.free(got);
+            try testing.expectEqualSlices(u8, f[1], got);
+        }
+
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        const wanted = [_][]const u8{files[1][0]};
+        try khr_format.extractSelectedKhrBackup(allocator, khr_path, case.password, dest_dir, &wanted);
+        const small = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ src_dir ++ "/small.txt", 64);
+        defer allocator.free(small);
+        try testing.expectEqualStrings(files[1][1], small);
+    }
+
+    // an appended archive's segments are only listed in the TOC
+    try khr_format.createKhrBackup(allocator, &[_][]const u8{files[0][0]}, khr_path, null, .none, null);
+    try khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{files[1][0]}, .{}, null);
+    try cutFooter(khr_path);
+    try testing.expectError(error.ArchiveFormatFailed, khr_format.verifyKhrBackup(allocator, khr_path, null));
+}
+
+test "chunked v3 archives reference their parent's chunks" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_cdc_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // random so nothing compresses and every saved byte comes from dedup
+    const big = try allocator.alloc(u8, 2 * 1024 * 1024);
+    defer allocator.free(big);
+    var prng = std.Random.DefaultPrng.init(0x636463);
+    prng.random().bytes(big);
+
+    const big_path = src_dir ++ "/big.bin";
+    const dup_path = src_dir ++ "/dup.bin";
+    const small_path = src_dir ++ "/small.txt";
+    try std.fs.cwd().writeFile(.{ .sub_path = big_path, .data = big });
+    try std.fs.cwd().writeFile(.{ .sub_path = dup_path, .data = big });
+    try std.fs.cwd().writeFile(.{ .sub_path = small_path, .data = "hello-chunks" });
+    const paths = [_][]const u8{ big_path, dup_path, small_path };
+
+    const parent_path = "/tmp/khrowno_cdc_parent.khr";
+    const child_path = "/tmp/khrowno_cdc_child.khr";
+    defer std.fs.cwd().deleteFile(parent_path) catch {};
+    defer std.fs.cwd().deleteFile(child_path) catch {};
+    const dest_dir = "/tmp/khrowno_cdc_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    try khr_format.createKhrBackupWithOptions(allocator, &paths, parent_path, null, .{ .compression = .zstd, .chunked = true }, null);
+    const parent_info = try khr_format.getKhrInfo(allocator, parent_path);
+    try testing.expectEqual(@as(u32, 3), parent_info.version);
+    // dup.bin is all references to big.bin's chunks
+    try testing.expect(parent_info.file_size < big.len + big.len / 4);
+
+    // an insert in the middle only disturbs the chunks around it
+    const edited = try allocator.alloc(u8, big.len + 100);
+    defer allocator.free(edited);
+    @memcpy(edited[0..1000000], big[0..1000000]);
+    @memset(edited[1000000..1000100], 'x');
+    @memcpy(edited[1000100..], big[1000000..]);
+    try std.fs.cwd().writeFile(.{ .sub_path = big_path, .data = edited });
+
+    try khr_format.createKhrBackupWithOptions(allocator, &paths, child_path, null, .{ .compression = .zstd, .parent = parent_path }, null);
+    const child_info = try khr_format.getKhrInfo(allocator, child_path);
+    try testing.expect(child_info.file_size < big.len / 4);
+
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, child_path, null, dest_dir);
+    const restored = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ big_path, edited.len + 1);
+    defer allocator.free(restored);
+    try testing.expectEqualSlices(u8, edited, restored);
+    const restored_dup = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ dup_path, big.len + 1);
+    defer allocator.free(restored_dup);
+    try testing.expectEqualSlices(u8, big, restored_dup);
+
+    var entries = try khr_format.indexKhrBackup(allocator, child_path);
+    defer {
+        for (entries.items) |*e| e.deinit(allocator);
+        entries.deinit();
+    }
+    try testing.expectEqual(@as(usize, 3), entries.items.len);
+    try testing.expectEqual(std.hash.Crc32.hash(edited), entries.items[0].crc32);
+
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    const wanted = [_][]const u8{dup_path};
+    try khr_format.extractSelectedKhrBackup(allocator, child_path, null, dest_dir, &wanted);
+    try testing.expectError(error.FileNotFound, std.fs.cwd().access(dest_dir ++ big_path, .{}));
+
+    // the child is useless without its parent, and must say so rather than restore holes
+    try std.fs.cwd().deleteFile(parent_path);
+    try testing.expectError(error.ParentArchiveMissing, khr_format.extractKhrBackup(allocator, child_path, null, dest_dir));
+}
+
+test "many small files round-trip across read batches" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_small_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // enough entries for several batches, with a symlink and an empty file mixed in
+    var paths = std.ArrayList([]const u8).init(allocator);
+    defer {
+        for (paths.items) |p| allocator.free(p);
+        paths.deinit();
+    }
+    for (0..150) |i| {
+        const p = try std.fmt.allocPrint(allocator, src_dir ++ "/f{d}.conf", .{i});
+        try paths.append(p);
+        const body = try std.fmt.allocPrint(allocator, "key{d}=value{d}\n", .{ i, i * 7 });
+        defer allocator.free(body);
+        try std.fs.cwd().writeFile(.{ .sub_path = p, .data = if (i == 70) "" else body });
+    }
+    const link_path = try allocator.dupe(u8, src_dir ++ "/link.conf");
+    try paths.append(link_path);
+    try std.fs.cwd().symLink("f1.conf", link_path, .{});
+
+    const khr_path = "/tmp/khrowno_small_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_small_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    try khr_format.createKhrBackup(allocator, paths.items, khr_path, null, .zstd, null);
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+
+    for (paths.items[0..150], 0..) |p, i| {
+        const out_path = try std.fmt.allocPrint(allocator, dest_dir ++ "{s}", .{p});
+        defer allocator.free(out_path);
+        const got = try std.fs.cwd().readFileAlloc(allocator, out_path, 256);
+        defer allocator.free(got);
+        const want = try std.fs.cwd().readFileAlloc(allocator, p, 256);
+        defer allocator.free(want);
+        try testing.expectEqualStrings(want, got);
+        if (i == 70) try testing.expectEqual(@as(usize, 0), got.len);
+    }
+    var target_buf: [64]u8 = undefined;
+    const target = try std.fs.cwd().readLink(dest_dir ++ src_dir ++ "/link.conf", &target_buf);
+    try testing.expectEqualStrings("f1.conf", target);
+
+    // the small files went out in solid blocks, but each still has a TOC entry to seek to
+    var entries = try khr_format.indexKhrBackup(allocator, khr_path);
+    defer {
+        for (entries.items) |*e| e.deinit(allocator);
+        entries.deinit();
+    }
+    try testing.expectEqual(paths.items.len, entries.items.len);
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    const wanted = [_][]const u8{paths.items[42]};
+    try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &wanted);
+    const one = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ src_dir ++ "/f42.conf", 256);
+    defer allocator.free(one);
+    try testing.expectEqualStrings("key42=value294\n", one);
+}
+
+test "sparse files keep their holes" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_sparse_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // 8MB logical, two small runs of data, the rest holes
+    const size: u64 = 8 * 1024 * 1024;
+    const sparse_path = src_dir ++ "/disk.img";
+    {
+        const f = try std.fs.cwd().createFile(sparse_path, .{});
+        defer f.close();
+        try f.setEndPos(size);
+        try f.pwriteAll("boot sector", 0);
+        try f.pwriteAll("superblock", 5 * 1024 * 1024);
+    }
+    const paths = [_][]const u8{sparse_path};
+
+    const khr_path = "/tmp/khrowno_sparse_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_sparse_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .none, null);
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+
+    const want = try std.fs.cwd().readFileAlloc(allocator, sparse_path, size + 1);
+    defer allocator.free(want);
+    const got = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ sparse_path, size + 1);
+    defer allocator.free(got);
+    try testing.expectEqualSlices(u8, want, got);
+
+    // only meaningful where the source filesystem kept the holes in the first place
+    const src_stat = try std.posix.fstatat(std.fs.cwd().fd, sparse_path, 0);
+    if (@as(u64, @intCast(src_stat.blocks)) * 512 < size) {
+        const archive = try std.fs.cwd().statFile(khr_path);
+        try testing.expect(archive.size < size / 2);
+        const out_stat = try std.posix.fstatat(std.fs.cwd().fd, dest_dir ++ sparse_path, 0);
+        try testing.expect(@as(u64, @intCast(out_stat.blocks)) * 512 < size / 2);
+    }
+
+    // selective restore finds the record through the TOC
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &paths);
+    const selected = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ sparse_path, size + 1);
+    defer allocator.free(selected);
+    try testing.expectEqualSlices(u8, want, selected);
+}
+
+test "hard links are stored once and restored as links" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_hardlink_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir ++ "/bin");
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    const first = src_dir ++ "/bin/tool";
+    const second = src_dir ++ "/bin/tool-alias";
+    const body = "#!/bin/sh\n" ** 20000; // big enough that a second copy would show in the archive size
+    try std.fs.cwd().writeFile(.{ .sub_path = first, .data = body });
+    try std.posix.linkat(std.posix.AT.FDCWD, first, std.posix.AT.FDCWD, second, 0);
+    const paths = [_][]const u8{ first, second };
+
+    const khr_path = "/tmp/khrowno_hardlink_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_hardlink_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .none, null);
+    const archive = try std.fs.cwd().statFile(khr_path);
+    try testing.expect(archive.size < 2 * body.len);
+
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+    const a = try std.fs.cwd().statFile(dest_dir ++ first);
+    const b = try std.fs.cwd().statFile(dest_dir ++ second);
+    try testing.expectEqual(a.inode, b.inode);
+    const got = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ second, body.len + 1);
+    defer allocator.free(got);
+    try testing.expectEqualStrings(body, got);
+
+    // asking for just the second name still gets the contents
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    const wanted = [_][]const u8{second};
+    try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &wanted);
+    const alone = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ second, body.len + 1);
+    defer allocator.free(alone);
+    try testing.expectEqualStrings(body, alone);
+    try testing.expectError(error.FileNotFound, std.fs.cwd().statFile(dest_dir ++ first));
+}
+
+test "hard links can't reach through a restored symlink" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_linkesc_src";
+    const outside = "/tmp/khrowno_linkesc_outside";
+    const dest_dir = "/tmp/khrowno_linkesc_out";
+    const khr_path = "/tmp/khrowno_linkesc_test.khr";
+    for ([_][]const u8{ src_dir, outside, dest_dir }) |d| std.fs.cwd().deleteTree(d) catch {};
+    defer for ([_][]const u8{ src_dir, outside, dest_dir }) |d| std.fs.cwd().deleteTree(d) catch {};
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    try std.fs.cwd().makePath(src_dir ++ "/b");
+    try std.fs.cwd().makePath(outside);
+    try std.fs.cwd().writeFile(.{ .sub_path = outside ++ "/secret", .data = "not yours" });
+
+    // an honest archive: a link out of the tree, a file and a second name for it
+    try std.fs.cwd().symLink(outside, src_dir ++ "/a", .{ .is_directory = true });
+    try std.fs.cwd().writeFile(.{ .sub_path = src_dir ++ "/b/secret", .data = "ours" });
+    try std.posix.linkat(std.posix.AT.FDCWD, src_dir ++ "/b/secret", std.posix.AT.FDCWD, src_dir ++ "/h", 0);
+    const paths = [_][]const u8{ src_dir ++ "/a", src_dir ++ "/b/secret", src_dir ++ "/h" };
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .none, null);
+
+    // then point the hard link at a/secret; without the TOC nothing is
+    // checked until the restore is over, so only the restore can refuse it
+    try cutFooter(khr_path);
+    {
+        const f = try std.fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+        defer f.close();
+        const bytes = try f.readToEndAlloc(allocator, 1 << 20);
+        defer allocator.free(bytes);
+        const at = std.mem.lastIndexOf(u8, bytes, "/b/secret").?;
+        try f.pwriteAll("a", at + 1);
+    }
+
+    try testing.expectError(error.SymlinkInPath, khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir));
+    try testing.expectEqual(@as(u64, 1), (try std.posix.fstatat(std.posix.AT.FDCWD, outside ++ "/secret", 0)).nlink);
+    try testing.expectError(error.FileNotFound, std.fs.cwd().statFile(dest_dir ++ src_dir ++ "/h"));
+
+    // a link to a name that was never restored leaves what's already at its own name alone
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .none, null);
+    try cutFooter(khr_path);
+    {
+        const f = try std.fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+        defer f.close();
+        const bytes = try f.readToEndAlloc(allocator, 1 << 20);
+        defer allocator.free(bytes);
+        const at = std.mem.lastIndexOf(u8, bytes, "/b/secret").?;
+        try f.pwriteAll("X", at + 8);
+    }
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try std.fs.cwd().makePath(dest_dir ++ src_dir);
+    try std.fs.cwd().writeFile(.{ .sub_path = dest_dir ++ src_dir ++ "/h", .data = "already here" });
+    // the edit only shows as a checksum mismatch once the restore is over
+    if (khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir)) |_| {
+        return error.TestUnexpectedResult;
+    } else |_| {}
+    const kept = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ src_dir ++ "/h", 64);
+    defer allocator.free(kept);
+    try testing.expectEqualStrings("already here", kept);
+}
+
+test "appended files restore and verify as their own segments" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_append_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // a first body over one Merkle block, so the second segment starts mid-block
+    const big = try allocator.alloc(u8, 1536 * 1024);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 31);
+    const files = [_][2][]const u8{
+        .{ src_dir ++ "/base.bin", big },
+        .{ src_dir ++ "/later.txt", "added the next day\n" },
+        .{ src_dir ++ "/latest.txt", "and again\n" },
+    };
+    for (files) |f| try std.fs.cwd().writeFile(.{ .sub_path = f[0], .data = f[1] });
+
+    const khr_path = "/tmp/khrowno_append_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_append_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    for ([_]khr_format.CompressionType{ .none, .zstd }) |codec| {
+        try khr_format.createKhrBackup(allocator, &[_][]const u8{files[0][0]}, khr_path, null, codec, null);
+        const before = (try std.fs.cwd().statFile(khr_path)).size;
+        try khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{files[1][0]}, .{}, null);
+        try khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{files[2][0]}, .{}, null);
+        // the first segment wasn't rewritten, so the archive only grew by a little
+        try testing.expect((try std.fs.cwd().statFile(khr_path)).size < before + 4096);
+
+        try khr_format.verifyKhrBackup(allocator, khr_path, null);
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+        for (files) |f| {
+            const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, f[0] });
+            defer allocator.free(got_path);
+            const got = try std.fs.cwd().readFileAlloc(allocator, got_path, f[1].len + 1);
+            defer allocator.free(got);
+            try testing.expectEqualSlices(u8, f[1], got);
+        }
+
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        const wanted = [_][]const u8{files[1][0]};
+        try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &wanted);
+        const alone = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ src_dir ++ "/later.txt", 64);
+        defer allocator.free(alone);
+        try testing.expectEqualStrings(files[1][1], alone);
+    }
+
+    // sealed archives are refused rather than half-appended
+    try khr_format.createKhrBackup(allocator, &[_][]const u8{files[1][0]}, khr_path, "hunter2", .none, null);
+    try testing.expectError(error.ArchiveFormatFailed, khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{files[2][0]}, .{}, null));
+}
+
+test "an append that fails leaves the archive restorable" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_append_fail_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+    const kept_path = src_dir ++ "/kept.txt";
+    const big_path = src_dir ++ "/big.bin";
+    try std.fs.cwd().writeFile(.{ .sub_path = kept_path, .data = "in the archive already\n" });
+    const big = try allocator.alloc(u8, 1024 * 1024);
+    defer allocator.free(big);
+    var prng = std.Random.DefaultPrng.init(19);
+    prng.random().bytes(big);
+    try std.fs.cwd().writeFile(.{ .sub_path = big_path, .data = big });
+
+    const khr_path = "/tmp/khrowno_append_fail.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_append_fail_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.createKhrBackup(allocator, &[_][]const u8{kept_path}, khr_path, null, .none, null);
+    const before = try std.fs.cwd().readFileAlloc(allocator, khr_path, 1 << 20);
+    defer allocator.free(before);
+
+    // a file size limit the new body runs into half way: the write fails with
+    // EFBIG (SIGXFSZ ignored so it isn't fatal) after the old TOC's place is taken
+    {
+        var ignore = std.posix.Sigaction{ .handler = .{ .handler = std.posix.SIG.IGN }, .mask = std.posix.empty_sigset, .flags = 0 };
+        var previous: std.posix.Sigaction = undefined;
+        std.posix.sigaction(std.posix.SIG.XFSZ, &ignore, &previous);
+        defer std.posix.sigaction(std.posix.SIG.XFSZ, &previous, null);
+        const limit = try std.posix.getrlimit(.FSIZE);
+        try std.posix.setrlimit(.FSIZE, .{ .cur = @min(before.len + big.len / 2, limit.max), .max = limit.max });
+        defer std.posix.setrlimit(.FSIZE, limit) catch {};
+        if (khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{big_path}, .{}, null)) |_| {
+            return error.TestUnexpectedResult;
+        } else |_| {}
+    }
+
+    const after = try std.fs.cwd().readFileAlloc(allocator, khr_path, 1 << 20);
+    defer allocator.free(after);
+    try testing.expectEqualSlices(u8, before, after);
+    try testing.expectError(error.FileNotFound, std.fs.cwd().statFile(khr_path ++ ".append"));
+    try khr_format.verifyKhrBackup(allocator, khr_path, null);
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+    const got = try std.fs.cwd().readFileAlloc(allocator, dest_dir ++ kept_path, 64);
+    defer allocator.free(got);
+    try testing.expectEqualStrings("in the archive already\n", got);
+}
+
+test "an append cut off by a crash is rolled back from its undo record" {
+    const allocator = testing.allocator;
+    const src_path = "/tmp/khrowno_append_crash.txt";
+    try std.fs.cwd().writeFile(.{ .sub_path = src_path, .data = "in the archive already\n" });
+    defer std.fs.cwd().deleteFile(src_path) catch {};
+    const khr_path = "/tmp/khrowno_append_crash.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    try khr_format.createKhrBackup(allocator, &[_][]const u8{src_path}, khr_path, null, .none, null);
+    const before = try std.fs.cwd().readFileAlloc(allocator, khr_path, 1 << 20);
+    defer allocator.free(before);
+
+    // what a crash before the header rewrite leaves: the old header, part of
+    // a segment where the footer was, and the undo record
+    {
+        const f = try std.fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+        defer f.close();
+        const header = try khr_format.KhrHeader.read(f.reader());
+        const header_len = try f.getPos();
+        const payload_end = header_len + header.tar_size;
+        const undo = try std.fs.cwd().createFile(khr_path ++ ".append", .{});
+        defer undo.close();
+        const w = undo.writer();
+        try w.writeAll("KHRUNDO1");
+        try w.writeInt(u64, payload_end, .little);
+        try w.writeAll(before[0..header_len]);
+        try w.writeAll(before[payload_end..]);
+        try f.setEndPos(payload_end);
+        try f.pwriteAll("half a segment", payload_end);
+    }
+
+    try khr_format.recoverAppend(allocator, khr_path);
+    const after = try std.fs.cwd().readFileAlloc(allocator, khr_path, 1 << 20);
+    defer allocator.free(after);
+    try testing.expectEqualSlices(u8, before, after);
+    try testing.expectError(error.FileNotFound, std.fs.cwd().statFile(khr_path ++ ".append"));
+    try khr_format.verifyKhrBackup(allocator, khr_path, null);
+}
+
+test "a name appended again restores with its newest body" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_dup_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+    const khr_path = "/tmp/khrowno_dup_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_dup_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    // enough pool jobs that an older body overtaking a newer one would show
+    const count = 200;
+    var names = std.ArrayList([]const u8).init(allocator);
+    defer {
+        for (names.items) |n| allocator.free(n);
+        names.deinit();
+    }
+    for (0..count) |i| try names.append(try std.fmt.allocPrint(allocator, "{s}/f{d}.txt", .{ src_dir, i }));
+
+    // the old bodies are the big ones, so they take longest to write
+    const old = try allocator.alloc(u8, 256 * 1024);
+    defer allocator.free(old);
+    @memset(old, 'o');
+    for (names.items) |n| try std.fs.cwd().writeFile(.{ .sub_path = n, .data = old });
+    try khr_format.createKhrBackup(allocator, names.items, khr_path, null, .zstd, null);
+    for (names.items) |n| try std.fs.cwd().writeFile(.{ .sub_path = n, .data = "new" });
+    try khr_format.appendKhrBackup(allocator, khr_path, names.items, .{}, null);
+
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+    for (names.items) |n| {
+        const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, n });
+        defer allocator.free(got_path);
+        const got = try std.fs.cwd().readFileAlloc(allocator, got_path, old.len + 1);
+        defer allocator.free(got);
+        try testing.expectEqualStrings("new", got);
+    }
+}
+
+test "a file restored over a symlink of the same name replaces the link" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_relink_src";
+    const outside = "/tmp/khrowno_relink_outside";
+    const dest_dir = "/tmp/khrowno_relink_out";
+    const khr_path = "/tmp/khrowno_relink_test.khr";
+    for ([_][]const u8{ src_dir, outside, dest_dir }) |d| std.fs.cwd().deleteTree(d) catch {};
+    defer for ([_][]const u8{ src_dir, outside, dest_dir }) |d| std.fs.cwd().deleteTree(d) catch {};
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    try std.fs.cwd().makePath(outside);
+
+    // small goes through the pool; big is copied on the reader's thread (raw payload)
+    const big = try allocator.alloc(u8, 128 * 1024);
+    defer allocator.free(big);
+    @memset(big, 'b');
+    const names = [_][]const u8{ src_dir ++ "/small", src_dir ++ "/big" };
+    const bodies = [_][]const u8{ "small body", big };
+    for (names, 0..) |n, i| {
+        const target = try std.fmt.allocPrint(allocator, "{s}/x{d}", .{ outside, i });
+        defer allocator.free(target);
+        try std.fs.cwd().writeFile(.{ .sub_path = target, .data = "outside" });
+        try std.fs.cwd().symLink(target, n, .{});
+    }
+    try khr_format.createKhrBackup(allocator, &names, khr_path, null, .none, null);
+    // the same names again, now files: the archive has each as a link, then a file
+    for (names, bodies) |n, b| {
+        try std.fs.cwd().deleteFile(n);
+        try std.fs.cwd().writeFile(.{ .sub_path = n, .data = b });
+    }
+    try khr_format.appendKhrBackup(allocator, khr_path, &names, .{}, null);
+
+    try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+    for (names, bodies, 0..) |n, b, i| {
+        const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, n });
+        defer allocator.free(got_path);
+        const st = try std.posix.fstatat(std.posix.AT.FDCWD, got_path, std.posix.AT.SYMLINK_NOFOLLOW);
+        try testing.expect(std.posix.S.ISREG(st.mode));
+        const got = try std.fs.cwd().readFileAlloc(allocator, got_path, big.len + 1);
+        defer allocator.free(got);
+        try testing.expectEqualSlices(u8, b, got);
+
+        const target = try std.fmt.allocPrint(allocator, "{s}/x{d}", .{ outside, i });
+        defer allocator.free(target);
+        const kept = try std.fs.cwd().readFileAlloc(allocator, target, 64);
+        defer allocator.free(kept);
+        try testing.expectEqualStrings("outside", kept);
+    }
+}
+
+test "the writer pool reports a failed write from finish" {
+    const allocator = testing.allocator;
+    const pool = try parallel_extract.WriterPool.init(allocator, 2);
+    defer pool.deinit();
+
+    // a directory that is gone by the time the job creates its file
+    const gone = "/tmp/khrowno_pool_gone";
+    try std.fs.cwd().makePath(gone);
+    var dir = try std.fs.cwd().openDir(gone, .{});
+    defer dir.close();
+    try std.fs.cwd().deleteTree(gone);
+
+    const buf = try pool.acquire("lost".len + "lost.txt".len);
+    @memcpy(buf, "lost" ++ "lost.txt");
+    try pool.submit(dir, buf, "lost.txt".len, 0o644);
+    try testing.expectError(error.FileNotFound, pool.finish());
+    // and nothing more is taken once a write has failed
+    try testing.expectError(error.FileNotFound, pool.acquire(4));
+}
+
+test "multi-volume sets split big files and restore from any volume" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_volume_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // bigger than any one volume, so it has to be cut into parts
+    const big = try allocator.alloc(u8, 3 * 1024 * 1024 + 12345);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 131 +% i / 4096);
+    const files = [_][2][]const u8{
+        .{ src_dir ++ "/big.bin", big },
+        .{ src_dir ++ "/a.conf", "alpha=1\n" },
+        .{ src_dir ++ "/b.conf", "beta=2\n" },
+    };
+    for (files) |f| try std.fs.cwd().writeFile(.{ .sub_path = f[0], .data = f[1] });
+
+    const dirs = [_][]const u8{ "/tmp/khrowno_volume_d0", "/tmp/khrowno_volume_d1" };
+    for (dirs) |d| {
+        std.fs.cwd().deleteTree(d) catch {};
+        try std.fs.cwd().makePath(d);
+    }
+    defer for (dirs) |d| std.fs.cwd().deleteTree(d) catch {};
+    const set_path = "/tmp/khrowno_volume_set.khr";
+    const dest_dir = "/tmp/khrowno_volume_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    const sources = [_][]const u8{ files[0][0], files[1][0], files[2][0] };
+    try khr_format.createKhrBackupWithOptions(allocator, &sources, set_path, null, .{
+        .compression = .none,
+        .volume_size = khr_format.MIN_VOLUME_SIZE,
+        .volume_dirs = &dirs,
+    }, null);
+
+    // every volume is within the limit and alternates between the directories
+    var volumes: usize = 0;
+    while (true) : (volumes += 1) {
+        const p = try std.fmt.allocPrint(allocator, "{s}/khrowno_volume_set.khr.{d:0>3}", .{ dirs[volumes % dirs.len], volumes + 1 });
+        defer allocator.free(p);
+        const st = std.fs.cwd().statFile(p) catch break;
+        try testing.expect(st.size <= khr_format.MIN_VOLUME_SIZE);
+        try khr_format.verifyKhrBackup(allocator, p, null);
+    }
+    try testing.expect(volumes >= 4);
+
+    // by the name it was created with, or by any one of its volumes
+    const third = dirs[0] ++ "/khrowno_volume_set.khr.003";
+    for ([_][]const u8{ set_path, third }) |start| {
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackupWithVolumeDirs(allocator, start, &dirs, null, dest_dir);
+        for (files) |f| {
+            const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, f[0] });
+            defer allocator.free(got_path);
+            const got = try std.fs.cwd().readFileAlloc(allocator, got_path, f[1].len + 1);
+            defer allocator.free(got);
+            try testing.expectEqualSlices(u8, f[1], got);
+        }
+    }
+
+    // a missing volume is reported rather than leaving a silently short restore
+    try std.fs.cwd().deleteFile(dirs[1] ++ "/khrowno_volume_set.khr.002");
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    try testing.expectError(error.VolumeMissing, khr_format.extractKhrBackupWithVolumeDirs(allocator, set_path, &dirs, null, dest_dir));
+}
+
+test "hard links stay together in one volume" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_vollink_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // m.bin sits between the two names in the writer's order and doesn't fit next to a.bin
+    const body = try allocator.alloc(u8, 700 * 1024);
+    defer allocator.free(body);
+    for (body, 0..) |*b, i| b.* = @truncate(i *% 7 +% i / 1000);
+    const first = src_dir ++ "/a.bin";
+    const middle = src_dir ++ "/m.bin";
+    const second = src_dir ++ "/z.bin";
+    try std.fs.cwd().writeFile(.{ .sub_path = first, .data = body });
+    try std.fs.cwd().writeFile(.{ .sub_path = middle, .data = body });
+    try std.posix.linkat(std.posix.AT.FDCWD, first, std.posix.AT.FDCWD, second, 0);
+
+    const set_path = "/tmp/khrowno_vollink_set.khr";
+    const dest_dir = "/tmp/khrowno_vollink_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+    const sources = [_][]const u8{ first, middle, second };
+    try khr_format.createKhrBackupWithOptions(allocator, &sources, set_path, null, .{
+        .compression = .none,
+        .volume_size = khr_format.MIN_VOLUME_SIZE,
+    }, null);
+
+    var total: u64 = 0;
+    var volumes: usize = 0;
+    while (true) : (volumes += 1) {
+        const p = try std.fmt.allocPrint(allocator, "{s}.{d:0>3}", .{ set_path, volumes + 1 });
+        defer allocator.free(p);
+        const st = std.fs.cwd().statFile(p) catch break;
+        total += st.size;
+    }
+    defer for (0..volumes) |i| {
+        const p = std.fmt.allocPrint(allocator, "{s}.{d:0>3}", .{ set_path, i + 1 }) catch continue;
+        defer allocator.free(p);
+        std.fs.cwd().deleteFile(p) catch {};
+    };
+    try testing.expectEqual(@as(usize, 2), volumes);
+    // two bodies, not three
+    try testing.expect(total < 3 * body.len);
+
+    try khr_format.extractKhrBackupWithVolumeDirs(allocator, set_path, &[_][]const u8{}, null, dest_dir);
+    const a = try std.fs.cwd().statFile(dest_dir ++ first);
+    const z = try std.fs.cwd().statFile(dest_dir ++ second);
+    try testing.expectEqual(a.inode, z.inode);
+}
+
+test "zstd dictionaries are trained on small configs and kept by appends" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_dict_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // enough small config files to span several codec frames
+    var paths = std.ArrayList([]u8).init(allocator);
+    defer {
+        for (paths.items) |p| allocator.free(p);
+        paths.deinit();
+    }
+    var body = std.ArrayList(u8).init(allocator);
+    defer body.deinit();
+    for (0..1200) |i| {
+        const dir = try std.fmt.allocPrint(allocator, "{s}/app{d}", .{ src_dir, i % 16 });
+        defer allocator.free(dir);
+        try std.fs.cwd().makePath(dir);
+        body.clearRetainingCapacity();
+        for (0..64) |k| {
+            try body.writer().print("[section{d}]\nkey_{d} = {d}\npath = /home/user/.config/app{d}/item{d}.toml\n", .{ k % 7, k, (i * 31 + k * 17) % 1009, i % 16, k });
+        }
+        const path = try std.fmt.allocPrint(allocator, "{s}/settings{d}.conf", .{ dir, i });
+        try paths.append(path);
+        try std.fs.cwd().writeFile(.{ .sub_path = path, .data = body.items });
+    }
+    const sources: []const []const u8 = paths.items;
+
+    const khr_path = "/tmp/khrowno_dict_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_dict_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    for ([_]bool{ true, false }) |use_dictionary| {
+        try khr_format.createKhrBackupWithOptions(allocator, sources[1..], khr_path, null, .{ .compression = .zstd, .dictionary = use_dictionary }, null);
+
+        // the dictionary frame sits right at the start of the payload
+        {
+            const f = try std.fs.cwd().openFile(khr_path, .{});
+            defer f.close();
+            _ = try khr_format.KhrHeader.read(f.reader());
+            const magic = try f.reader().readInt(u32, .little);
+            try testing.expectEqual(use_dictionary, magic == zstd.DICTIONARY_FRAME_MAGIC);
+        }
+
+        // appended frames are compressed against the same dictionary
+        try khr_format.appendKhrBackup(allocator, khr_path, sources[0..1], .{}, null);
+        try khr_format.verifyKhrBackup(allocator, khr_path, null);
+
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+        for (sources) |src| {
+            const want = try std.fs.cwd().readFileAlloc(allocator, src, 1 << 20);
+            defer allocator.free(want);
+            const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, src });
+            defer allocator.free(got_path);
+            const got = try std.fs.cwd().readFileAlloc(allocator, got_path, 1 << 20);
+            defer allocator.free(got);
+            try testing.expectEqualSlices(u8, want, got);
+        }
+
+        // seeking into a frame in the middle still decodes with the dictionary
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        const wanted = [_][]const u8{sources[700]};
+        try khr_format.extractSelectedKhrBackup(allocator, khr_path, null, dest_dir, &wanted);
+        const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, sources[700] });
+        defer allocator.free(got_path);
+        const got = try std.fs.cwd().readFileAlloc(allocator, got_path, 1 << 20);
+        defer allocator.free(got);
+        const want = try std.fs.cwd().readFileAlloc(allocator, sources[700], 1 << 20);
+        defer allocator.free(want);
+        try testing.expectEqualSlices(u8, want, got);
+    }
+}
+
+fn tocLevel(allocator: std.mem.Allocator, path: []const u8) !?i32 {
+    const f = try std.fs.cwd().openFile(path, .{});
+    defer f.close();
+    const header = try khr_format.KhrHeader.read(f.reader());
+    var toc = (try khr_index.readIndex(allocator, f, (try f.getPos()) + header.tar_size, null)).?;
+    defer toc.deinit();
+    return toc.level;
+}
+
+test "appends compress at the level the archive was written at" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_level_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+    const first = src_dir ++ "/first.txt";
+    const second = src_dir ++ "/second.txt";
+    const third = src_dir ++ "/third.txt";
+    for ([_][]const u8{ first, second, third }) |p| try std.fs.cwd().writeFile(.{ .sub_path = p, .data = "level " ** 500 });
+
+    const khr_path = "/tmp/khrowno_level_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+
+    try khr_format.createKhrBackupWithOptions(allocator, &[_][]const u8{first}, khr_path, null, .{ .compression = .zstd, .level = 19 }, null);
+    try testing.expectEqual(@as(?i32, 19), try tocLevel(allocator, khr_path));
+    try khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{second}, .{}, null);
+    try testing.expectEqual(@as(?i32, 19), try tocLevel(allocator, khr_path));
+    // asking for another level on the append is what's kept from then on
+    try khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{third}, .{ .level = 5, .threads = 1 }, null);
+    try testing.expectEqual(@as(?i32, 5), try tocLevel(allocator, khr_path));
+    try khr_format.verifyKhrBackup(allocator, khr_path, null);
+
+    // no level asked for: none recorded, and appends stay at the codec default
+    try khr_format.createKhrBackupWithOptions(allocator, &[_][]const u8{first}, khr_path, null, .{ .compression = .zstd }, null);
+    try khr_format.appendKhrBackup(allocator, khr_path, &[_][]const u8{second}, .{}, null);
+    try testing.expectEqual(@as(?i32, null), try tocLevel(allocator, khr_path));
+}
+
+test "restores revisit more directories than the handle cache holds" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_dirs_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // the writer orders by extension first, so every directory is entered
+    // once for the .conf files and again for the .txt ones, long after its
+    // handle has been evicted
+    var paths = std.ArrayList([]const u8).init(allocator);
+    defer {
+        for (paths.items) |p| allocator.free(p);
+        paths.deinit();
+    }
+    for (0..150) |i| {
+        const dir = try std.fmt.allocPrint(allocator, src_dir ++ "/d{d}/sub{d}/leaf", .{ i % 50, i });
+        defer allocator.free(dir);
+        try std.fs.cwd().makePath(dir);
+        for ([_][]const u8{ "a.conf", "b.txt" }) |name| {
+            const path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ dir, name });
+            try paths.append(path);
+            try std.fs.cwd().writeFile(.{ .sub_path = path, .data = path });
+        }
+    }
+    const link = src_dir ++ "/d7/sub7/leaf/link";
+    const link_path = try allocator.dupe(u8, link);
+    try paths.append(link_path);
+    try std.fs.cwd().symLink("a.conf", link_path, .{});
+
+    const khr_path = "/tmp/khrowno_dirs_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_dirs_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    for ([_]khr_format.CompressionType{ .none, .gzip }) |codec| {
+        try khr_format.createKhrBackup(allocator, paths.items, khr_path, null, codec, null);
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir);
+        for (paths.items[0 .. paths.items.len - 1]) |src| {
+            const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, src });
+            defer allocator.free(got_path);
+            const got = try std.fs.cwd().readFileAlloc(allocator, got_path, 4096);
+            defer allocator.free(got);
+            try testing.expectEqualStrings(src, got);
+        }
+        var target_buf: [64]u8 = undefined;
+        try testing.expectEqualStrings("a.conf", try std.fs.cwd().readLink(dest_dir ++ link, &target_buf));
+    }
+}
+
+test "restores don't write through a symlink with a directory's name" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_dirlink_src";
+    const outside = "/tmp/khrowno_dirlink_outside";
+    const dest_dir = "/tmp/khrowno_dirlink_out";
+    const khr_path = "/tmp/khrowno_dirlink_test.khr";
+    for ([_][]const u8{ src_dir, outside, dest_dir }) |d| std.fs.cwd().deleteTree(d) catch {};
+    defer for ([_][]const u8{ src_dir, outside, dest_dir }) |d| std.fs.cwd().deleteTree(d) catch {};
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    try std.fs.cwd().makePath(outside);
+
+    // the archive holds d as a link out of the tree, then a file under d
+    try std.fs.cwd().writeFile(.{ .sub_path = outside ++ "/x", .data = "archived" });
+    try std.fs.cwd().symLink(outside, src_dir ++ "/d", .{ .is_directory = true });
+    const paths = [_][]const u8{ src_dir ++ "/d", src_dir ++ "/d/x" };
+    try khr_format.createKhrBackup(allocator, &paths, khr_path, null, .zstd, null);
+    try std.fs.cwd().writeFile(.{ .sub_path = outside ++ "/x", .data = "untouched" });
+
+    try testing.expectError(error.SymlinkInPath, khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir));
+    const kept = try std.fs.cwd().readFileAlloc(allocator, outside ++ "/x", 64);
+    defer allocator.free(kept);
+    try testing.expectEqualStrings("untouched", kept);
+}
+
+test "copies written in the same pass are identical and restore" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_tee_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // several tee pieces' worth, so the destinations really run behind one another
+    const big = try allocator.alloc(u8, 5 * 1024 * 1024 + 777);
+    defer allocator.free(big);
+    var prng = std.Random.DefaultPrng.init(0x746565);
+    prng.random().bytes(big);
+    const files = [_][2][]const u8{
+        .{ src_dir ++ "/big.bin", big },
+        .{ src_dir ++ "/a.conf", "alpha=1\n" },
+        .{ src_dir ++ "/b.conf", "beta=2\n" },
+    };
+    for (files) |f| try std.fs.cwd().writeFile(.{ .sub_path = f[0], .data = f[1] });
+
+    const khr_path = "/tmp/khrowno_tee.khr";
+    const copies = [_][]const u8{ "/tmp/khrowno_tee_copy1.khr", "/tmp/khrowno_tee_copy2.khr" };
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    defer for (copies) |c| std.fs.cwd().deleteFile(c) catch {};
+    const dest_dir = "/tmp/khrowno_tee_out";
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    const sources = [_][]const u8{ files[0][0], files[1][0], files[2][0] };
+    try khr_format.createKhrBackupWithOptions(allocator, &sources, khr_path, null, .{ .copies = &copies }, null);
+
+    const original = try std.fs.cwd().readFileAlloc(allocator, khr_path, 64 * 1024 * 1024);
+    defer allocator.free(original);
+    for (copies) |c| {
+        const copy = try std.fs.cwd().readFileAlloc(allocator, c, 64 * 1024 * 1024);
+        defer allocator.free(copy);
+        try testing.expectEqualSlices(u8, original, copy);
+    }
+
+    try khr_format.verifyKhrBackup(allocator, copies[1], null);
+    try khr_format.extractKhrBackup(allocator, copies[1], null, dest_dir);
+    for (files) |f| {
+        const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, f[0] });
+        defer allocator.free(got_path);
+        const got = try std.fs.cwd().readFileAlloc(allocator, got_path, f[1].len + 1);
+        defer allocator.free(got);
+        try testing.expectEqualSlices(u8, f[1], got);
+    }
+}
+
+test "piped archives are written and restored front to back" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_pipe_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+
+    // more than one frame and more than one sealed chunk
+    const big = try allocator.alloc(u8, 3 * 1024 * 1024 + 4321);
+    defer allocator.free(big);
+    var prng = std.Random.DefaultPrng.init(0x706970);
+    prng.random().bytes(big);
+    const files = [_][2][]const u8{
+        .{ src_dir ++ "/big.bin", big },
+        .{ src_dir ++ "/a.conf", "alpha=1\n" },
+        .{ src_dir ++ "/b.conf", "beta=2\n" },
+    };
+    for (files) |f| try std.fs.cwd().writeFile(.{ .sub_path = f[0], .data = f[1] });
+    const sources = [_][]const u8{ files[0][0], files[1][0], files[2][0] };
+
+    const khr_path = "/tmp/khrowno_pipe.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_pipe_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    const cases = [_]struct { compression: khr_format.CompressionType, password: ?[]const u8 }{
+        .{ .compression = .gzip, .password = null },
+        .{ .compression = .zstd, .password = "pipe password" },
+    };
+    for (cases) |case| {
+        {
+            const out = try std.fs.cwd().createFile(khr_path, .{});
+            defer out.close();
+            try khr_format.createKhrBackupPiped(allocator, &sources, out, case.password, .{ .compression = case.compression }, null);
+        }
+
+        // from a stream, and from the file it was saved to
+        for (0..2) |round| {
+            std.fs.cwd().deleteTree(dest_dir) catch {};
+            if (round == 0) {
+                const in = try std.fs.cwd().openFile(khr_path, .{});
+                defer in.close();
+                try khr_format.extractKhrBackupPiped(allocator, in, case.password, dest_dir);
+            } else {
+                try khr_format.extractKhrBackup(allocator, khr_path, case.password, dest_dir);
+            }
+            for (files) |f| {
+                const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, f[0] });
+                defer allocator.free(got_path);
+                const got = try std.fs.cwd().readFileAlloc(allocator, got_path, f[1].len + 1);
+                defer allocator.free(got);
+                try testing.expectEqualSlices(u8, f[1], got);
+            }
+        }
+
+        // saved to a file it lists and verifies too, read front to back
+        var entries = try khr_format.indexKhrBackupWithPassword(allocator, khr_path, case.password);
+        defer {
+            for (entries.items) |*e| e.deinit(allocator);
+            entries.deinit();
+        }
+        try testing.expectEqual(@as(usize, files.len), entries.items.len);
+        try khr_format.verifyKhrBackup(allocator, khr_path, case.password);
+        try testing.expect(try backup.validateBackup(allocator, khr_path, case.password));
+    }
+
+    // a stream cut short loses its trailer and doesn't pass for complete
+    {
+        const f = try std.fs.cwd().openFile(khr_path, .{ .mode = .read_write });
+        defer f.close();
+        try f.setEndPos(try f.getEndPos() - 20);
+    }
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    const in = try std.fs.cwd().openFile(khr_path, .{});
+    defer in.close();
+    try testing.expectError(error.ArchiveFormatFailed, khr_format.extractKhrBackupPiped(allocator, in, "pipe password", dest_dir));
+    try testing.expect(!try backup.validateBackup(allocator, khr_path, "pipe password"));
+}
+
+const RESUME_KHR = "/tmp/khrowno_resume.khr";
+var midway_cut_at: usize = 201;
+var midway_copy_taken = false;
+
+// Stands in for a backup killed partway through: the archive, its checkpoint
+// and the undo record of a resumed run's append as they were on disk at the
+// first progress report from midway_cut_at on.
+fn copyMidway(operation: []const u8, current: usize, total: usize) void {
+    _ = operation;
+    _ = total;
+    if (current < midway_cut_at or midway_copy_taken) return;
+    std.fs.cwd().copyFile(RESUME_KHR, std.fs.cwd(), RESUME_KHR ++ ".cut", .{}) catch return;
+    std.fs.cwd().copyFile(RESUME_KHR ++ ".ckpt", std.fs.cwd(), RESUME_KHR ++ ".ckpt.cut", .{}) catch return;
+    std.fs.cwd().copyFile(RESUME_KHR ++ ".append", std.fs.cwd(), RESUME_KHR ++ ".append.cut", .{}) catch |err| {
+        if (err != error.FileNotFound) return;
+    };
+    midway_copy_taken = true;
+}
+
+fn restoreMidway() !void {
+    try std.fs.cwd().rename(RESUME_KHR ++ ".cut", RESUME_KHR);
+    try std.fs.cwd().rename(RESUME_KHR ++ ".ckpt.cut", RESUME_KHR ++ ".ckpt");
+    std.fs.cwd().rename(RESUME_KHR ++ ".append.cut", RESUME_KHR ++ ".append") catch |err| {
+        if (err != error.FileNotFound) return err;
+    };
+}
+
+test "interrupted backups resume from their last checkpoint" {
+    const allocator = testing.allocator;
+    const src_dir = "/tmp/khrowno_resume_src";
+    std.fs.cwd().deleteTree(src_dir) catch {};
+    try std.fs.cwd().makePath(src_dir);
+    defer std.fs.cwd().deleteTree(src_dir) catch {};
+    const dest_dir = "/tmp/khrowno_resume_out";
+    std.fs.cwd().deleteTree(dest_dir) catch {};
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+    defer for ([_][]const u8{ RESUME_KHR, RESUME_KHR ++ ".ckpt", RESUME_KHR ++ ".append", RESUME_KHR ++ ".cut", RESUME_KHR ++ ".ckpt.cut", RESUME_KHR ++ ".append.cut" }) |p| std.fs.cwd().deleteFile(p) catch {};
+
+    // solid blocks of these fill up a few times over, so there are several checkpoints
+    const count = 300;
+    const size = 8 * 1024;
+    const data = try allocator.alloc(u8, count * size);
+    defer allocator.free(data);
+    var prng = std.Random.DefaultPrng.init(0x636b7074);
+    prng.random().bytes(data);
+    var sources = std.ArrayList([]const u8).init(allocator);
+    defer {
+        for (sources.items) |p| allocator.free(p);
+        sources.deinit();
+    }
+    for (0..count) |i| {
+        const path = try std.fmt.allocPrint(allocator, "{s}/f{d:0>3}.bin", .{ src_dir, i });
+        sources.append(path) catch |err| {
+            allocator.free(path);
+            return err;
+        };
+        try std.fs.cwd().writeFile(.{ .sub_path = path, .data = data[i * size ..][0..size] });
+    }
+
+    const options = khr_format.CreateOptions{ .checkpoint_every = 256 * 1024 };
+    midway_cut_at = 201;
+    midway_copy_taken = false;
+    try khr_format.createKhrBackupWithOptions(allocator, sources.items, RESUME_KHR, null, options, &copyMidway);
+    try testing.expect(midway_copy_taken);
+    // a run that finishes takes its checkpoint with it
+    try testing.expectError(error.FileNotFound, std.fs.cwd().access(RESUME_KHR ++ ".ckpt", .{}));
+
+    var resumed = options;
+    resumed.resume_interrupted = true;
+    // a checkpoint of another source list isn't carried on
+    {
+        try std.fs.cwd().copyFile(RESUME_KHR ++ ".cut", std.fs.cwd(), RESUME_KHR, .{});
+        try std.fs.cwd().copyFile(RESUME_KHR ++ ".ckpt.cut", std.fs.cwd(), RESUME_KHR ++ ".ckpt", .{});
+        try khr_format.createKhrBackupWithOptions(allocator, sources.items[0..10], RESUME_KHR, null, resumed, null);
+        var entries = try khr_format.indexKhrBackup(allocator, RESUME_KHR);
+        defer {
+            for (entries.items) |*e| e.deinit(allocator);
+            entries.deinit();
+        }
+        try testing.expectEqual(@as(usize, 10), entries.items.len);
+    }
+
+    // back to where the run was cut off; the first file changes afterwards,
+    // but it's before the checkpoint, so what the archive has of it stays
+    try restoreMidway();
+    try std.fs.cwd().writeFile(.{ .sub_path = sources.items[0], .data = "changed after the checkpoint\n" });
+    const first_ckpt = try std.fs.cwd().readFileAlloc(allocator, RESUME_KHR ++ ".ckpt", 1 << 20);
+    defer allocator.free(first_ckpt);
+
+    // the resumed run is cut off too, after checkpoints of its own
+    midway_cut_at = 2;
+    midway_copy_taken = false;
+    try khr_format.createKhrBackupWithOptions(allocator, sources.items, RESUME_KHR, null, resumed, &copyMidway);
+    try testing.expect(midway_copy_taken);
+    const second_ckpt = try std.fs.cwd().readFileAlloc(allocator, RESUME_KHR ++ ".ckpt.cut", 1 << 20);
+    defer allocator.free(second_ckpt);
+    try testing.expect(!std.mem.eql(u8, first_ckpt, second_ckpt));
+
+    try restoreMidway();
+    try khr_format.createKhrBackupWithOptions(allocator, sources.items, RESUME_KHR, null, resumed, null);
+    try testing.expectError(error.FileNotFound, std.fs.cwd().access(RESUME_KHR ++ ".ckpt", .{}));
+    try testing.expectError(error.FileNotFound, std.fs.cwd().access(RESUME_KHR ++ ".append", .{}));
+
+    try khr_format.verifyKhrBackup(allocator, RESUME_KHR, null);
+    var entries = try khr_format.indexKhrBackup(allocator, RESUME_KHR);
+    defer {
+        for (entries.items) |*e| e.deinit(allocator);
+        entries.deinit();
+    }
+    try testing.expectEqual(@as(usize, count), entries.items.len);
+
+    try khr_format.extractKhrBackup(allocator, RESUME_KHR, null, dest_dir);
+    for (sources.items, 0..) |path, i| {
+        const got_path = try std.fmt.allocPrint(allocator, "{s}{s}", .{ dest_dir, path });
+        defer allocator.free(got_path);
+        const got = try std.fs.cwd().readFileAlloc(allocator, got_path, size + 1);
+        defer allocator.free(got);
+        try testing.expectEqualSlices(u8, data[i * size ..][0..size], got);
+    }
+}
+
+// What the old whole-buffer writer produced: the text stream, gzipped, then
+// sealed as one message when there's a password.
+fn writeV1Archive(allocator: std.mem.Allocator, path: []const u8, files: []const [2][]const u8, password: ?[]const u8) !void {
+    var text = std.ArrayList(u8).init(allocator);
+    defer text.deinit();
+    try text.appendSlice("KROWNO_BACKUP_V1\n");
+    for (files) |f| try text.writer().print("FILE: {s}\nLEN: {d}\nMTIME: 0\n{s}", .{ f[0], f[1].len, f[1] });
+
+    var stored = try compress.compressGzip(allocator, text.items);
+    var info = khr_format.EncryptionInfo{ .salt = [_]u8{0} ** 32, .nonce = [_]u8{0} ** 12 };
+    if (password) |pw| {
+        var ctx = crypto.CryptoContext.init(allocator);
+        defer ctx.deinit();
+        var sealed = try ctx.encrypt(stored, pw);
+        defer sealed.deinit(allocator);
+        allocator.free(stored);
+        stored = try ctx.serializeEncrypted(sealed);
+        info.opslimit = crypto.KDF_ITERATIONS;
+        info.memlimit = crypto.KDF_MEMORY_KIB * 1024;
+    }
+    defer allocator.free(stored);
+
+    var header = khr_format.KhrHeader{ .compression = .gzip, .encryption = info, .tar_size = stored.len };
+    std.crypto.hash.sha2.Sha256.hash(stored, &header.checksum, .{});
+    const f = try std.fs.cwd().createFile(path, .{});
+    defer f.close();
+    try header.write(f.writer());
+    try f.writeAll(stored);
+}
+
+test "v1 archives still restore, sealed or not" {
+    const allocator = testing.allocator;
+    const big = try allocator.alloc(u8, 3 * 1024 * 1024 + 17);
+    defer allocator.free(big);
+    for (big, 0..) |*b, i| b.* = @truncate(i *% 31 +% i / 4096);
+    const files = [_][2][]const u8{
+        .{ "home/user/.bashrc", "alias ll='ls -l'\n" },
+        .{ "home/user/data.bin", big },
+        .{ "home/user/empty", "" },
+    };
+
+    const khr_path = "/tmp/khrowno_v1_test.khr";
+    defer std.fs.cwd().deleteFile(khr_path) catch {};
+    const dest_dir = "/tmp/khrowno_v1_out";
+    defer std.fs.cwd().deleteTree(dest_dir) catch {};
+
+    for ([_]?[]const u8{ null, "v1-secret" }) |password| {
+        try writeV1Archive(allocator, khr_path, &files, password);
+        std.fs.cwd().deleteTree(dest_dir) catch {};
+        try khr_format.extractKhrBackup(allocator, khr_path, password, dest_dir);
+        for (files) |f| {
+            const out_path = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ dest_dir, f[0] });
+            defer allocator.free(out_path);
+            const got = try std.fs.cwd().readFileAlloc(allocator, out_path, big.len + 1);
+            defer allocator.free(got);
+            try testing.expectEqualSlices(u8, f[1], got);
+        }
+    }
+    // the archive on disk is the sealed one now
+    try testing.expectError(error.AuthenticationFailed, khr_format.extractKhrBackup(allocator, khr_path, "wrong", dest_dir));
+    try testing.expectError(error.DecryptionFailed, khr_format.extractKhrBackup(allocator, khr_path, null, dest_dir));
+}